@@ -0,0 +1,529 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_CACHE)
+
+#define MDNS_CACHE
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <strings.h> // strncasecmp()
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "DNS.hpp"
+#include "RRTypes.hpp"
+#include "TxtRecord.hpp"
+
+namespace mDNS
+{
+
+//
+// Record cache for many concurrent readers and a (logically) single writer.
+//
+// Records are sharded by a hash of their name. Each shard is an immutable
+// table published through an atomic pointer: the writer copies the shards a
+// message touches, modifies the copies and publishes them, so a lookup is
+// one atomic load plus a binary search of a vector sorted by name hash, with
+// no locks and no writes to memory shared with other readers or the writer.
+//
+// Entries past their expiry are ignored by lookups, but stay in the tables
+// until a record with the same name hash arrives or Expire() is called;
+// call it periodically (e.g. once a second) to keep tables from growing.
+//
+// Old tables are reclaimed with a simple epoch scheme: each reader announces
+// the global epoch in its own slot (a cache line of its own) for the duration
+// of a lookup, and a retired table is freed once no reader slot shows an
+// epoch at or before the one at which it was retired.
+//
+// Readers need a Reader handle (one per thread; it owns a slot). Lookups
+// pass each matching entry to a callback, which must not keep references to
+// it after returning. Writers may be called from several threads, but are
+// serialised internally; this is expected to be the receive loop(s).
+//
+// Times are milliseconds from any monotonic clock (see Now()), passed in
+// explicitly so that tests and replays can supply their own. Cached names
+// have no trailing dot, and names in RDATA (PTR, SRV, NSEC etc.) are stored
+// decompressed so entries don't depend on the message they came from.
+//
+struct Cache
+{
+	struct Entry {
+		std::string name;     // as received, no trailing dot
+		uint64_t hash;        // name hash (case-insensitive)
+		uint16_t type;
+		uint16_t clss;        // without cache-flush bit
+		uint32_t TTL;         // as received
+		int64_t received_ms;
+		int64_t expires_ms;
+		std::vector<char> rdata;
+		DNS::TxtIndex txt;    // TXT only
+
+		DNS::TxtView txt_view() const { return DNS::TxtView(rdata.data(), rdata.size(), txt); }
+	};
+
+	using EntryPtr = std::shared_ptr<const Entry>;
+	using Table = std::vector<EntryPtr>; // sorted by name hash; cheap to copy
+
+	struct Stats {
+		uint64_t messages = 0;  // messages passed to Update()
+		uint64_t records = 0;   // records added or refreshed
+		uint64_t flushed = 0;   // removed by cache-flush bit
+		uint64_t expired = 0;   // removed on expiry
+		uint64_t published = 0; // shard tables published
+		uint64_t reclaimed = 0; // ... and freed
+	};
+
+	static constexpr size_t NShards = 256;
+	static constexpr size_t MaxReaders = 128;
+
+	static constexpr int64_t FlushGrace_ms = 1000;   // RFC6762:10.2
+	static constexpr int64_t GoodbyeDelay_ms = 1000; // RFC6762:10.1
+
+	struct alignas(64) Shard {
+		std::atomic<const Table*> table{nullptr};
+	};
+
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> epoch{0}; // 0 => not in a lookup
+		std::atomic<bool> in_use{false};
+	};
+
+	Shard shards[NShards];
+	Slot slots[MaxReaders];
+	std::atomic<uint64_t> epoch{1};
+
+	// Writer state
+	std::mutex write_mutex;
+	std::vector< std::pair<uint64_t,const Table*> > retired; // retire epoch, table
+	Stats stats;
+
+	Cache()
+	{
+		for (auto& s : shards) s.table = new Table;
+	}
+
+	~Cache()
+	{
+		for (auto& s : shards) delete s.table.load();
+		for (auto& r : retired) delete r.second;
+	}
+
+	Cache(const Cache&) = delete;
+	Cache& operator=(const Cache&) = delete;
+
+	static int64_t Now()
+	{
+		using namespace std::chrono;
+		return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	static std::string_view trim_(std::string_view name)
+	{
+		if (!name.empty() && name.back() == '.') name.remove_suffix(1);
+		return name;
+	}
+
+	static uint64_t hash_(std::string_view name)
+	{
+		name = trim_(name);
+		return Hash::fnv1a_nocase(name.data(), name.size());
+	}
+
+	static size_t shard_(uint64_t hash)
+	{
+		return (hash >> 56) % NShards; // top bits; unordered_map uses the bottom
+	}
+
+	// First entry with hash h (or end); entries with that hash follow.
+	static Table::const_iterator find_(const Table& t, uint64_t h)
+	{
+		return std::lower_bound(t.begin(), t.end(), h,
+			[](const EntryPtr& e, uint64_t h) { return e->hash < h; });
+	}
+
+	// Is type in the bitmap of (decompressed) NSEC RDATA? RFC4034:4.1.2
+	static bool nsec_lists_(const std::vector<char>& rdata, uint16_t type)
+	{
+		size_t i = 0, n = rdata.size();
+
+		while ((i < n) && (rdata[i] != 0)) i += 1 + (uint8_t)rdata[i];
+		i++;
+
+		while (i+2 <= n) {
+			uint8_t window = rdata[i], len = rdata[i+1];
+			i += 2;
+			if (i+len > n) return false;
+
+			if (window == (type >> 8)) {
+				uint8_t k = type & 0xff;
+				return (k/8 < len) && (rdata[i+k/8] & (0x80 >> (k%8)));
+			}
+			i += len;
+		}
+
+		return false;
+	}
+
+	static bool same_name_(const Entry& e, std::string_view name)
+	{
+		return (e.name.size() == name.size()) && (strncasecmp(e.name.data(), name.data(), name.size()) == 0);
+	}
+
+	//
+	// Read side
+	//
+
+	struct Reader
+	{
+		Cache& cache;
+		Slot* slot = nullptr;
+
+		Reader(Cache& c) : cache(c)
+		{
+			for (auto& s : cache.slots) {
+				bool expected = false;
+				if (s.in_use.compare_exchange_strong(expected, true)) {
+					slot = &s;
+					break;
+				}
+			}
+			if (!slot) ERROR("No free cache reader slots (max %d)", (int)MaxReaders);
+		}
+
+		~Reader()
+		{
+			slot->epoch = 0;
+			slot->in_use = false;
+		}
+
+		Reader(const Reader&) = delete;
+		Reader& operator=(const Reader&) = delete;
+
+		// Calls fn(const Entry&) for each unexpired entry with the given name
+		// and type (ANY => all types). Returns number of entries visited.
+		template <typename F>
+		size_t Lookup(std::string_view name, uint16_t type, int64_t now_ms, F fn)
+		{
+			name = trim_(name);
+			auto h = Hash::fnv1a_nocase(name.data(), name.size());
+			size_t n = 0;
+
+			slot->epoch = cache.epoch.load();
+			const Table* t = cache.shards[shard_(h)].table.load();
+
+			for (auto it = find_(*t, h); (it != t->end()) && ((*it)->hash == h); ++it) {
+				const auto& e = **it;
+				if (e.expires_ms <= now_ms) continue;
+				if ((type != DNS::Defs::ANY) && (type != e.type)) continue;
+				if (!same_name_(e, name)) continue;
+				fn(e);
+				n++;
+			}
+
+			slot->epoch.store(0, std::memory_order_release);
+			return n;
+		}
+
+		// As above, but copies the entries out.
+		size_t Find(std::string_view name, uint16_t type, int64_t now_ms, std::vector<Entry>& out)
+		{
+			out.clear();
+			return Lookup(name, type, now_ms, [&out](const Entry& e) { out.push_back(e); });
+		}
+
+		// True if a cached NSEC record for name (RFC6762:6.1) says it has no
+		// records of the given type, and none are cached: the question can be
+		// answered "no" locally instead of being sent again.
+		bool Absent(std::string_view name, uint16_t type, int64_t now_ms)
+		{
+			bool nsec = false, listed = false;
+
+			Lookup(name, DNS::Defs::ANY, now_ms, [&](const Entry& e) {
+				if (e.type == type) listed = true;
+				else if (e.type == DNS::Defs::NSEC) {
+					nsec = true;
+					if (nsec_lists_(e.rdata, type)) listed = true;
+				}
+			});
+
+			return nsec && !listed;
+		}
+
+		// Visit every unexpired entry, one shard at a time.
+		template <typename F>
+		size_t ForEach(int64_t now_ms, F fn)
+		{
+			size_t n = 0;
+
+			for (auto& shard : cache.shards) {
+				slot->epoch = cache.epoch.load();
+				for (const auto& e : *shard.table.load()) {
+					if (e->expires_ms <= now_ms) continue;
+					fn(*e);
+					n++;
+				}
+				slot->epoch.store(0, std::memory_order_release);
+			}
+
+			return n;
+		}
+	};
+
+	//
+	// Write side
+	//
+
+	// Per-call set of shard copies; shards are copied at most once each.
+	struct Pending
+	{
+		Table* tables[NShards] = {};
+
+		Table& get(Cache& c, size_t s)
+		{
+			if (!tables[s]) tables[s] = new Table(*c.shards[s].table.load());
+			return *tables[s];
+		}
+	};
+
+	// RDATA of rr, with any embedded names decompressed.
+	static bool rdata_(const char* bytes, size_t len, const DNS::ResourceRecord& rr, std::vector<char>& out)
+	{
+		const auto& info = DNS::RRTypes::info(rr.type);
+
+		if (!info.has_name()) {
+			out.assign(&bytes[rr.rd_ofs], &bytes[rr.rd_ofs]+rr.rd_len);
+			return true;
+		}
+
+		return info.decode(bytes, len, rr.rd_ofs, rr.rd_len, out);
+	}
+
+	// Same RDATA, comparing any names in it case-insensitively (RFC6762:16),
+	// so e.g. an SRV re-announced with its target in other case refreshes the
+	// record rather than adding a second one.
+	static bool same_rdata_(const Entry& a, const Entry& b)
+	{
+		if (a.rdata == b.rdata) return true;
+
+		const auto& info = DNS::RRTypes::info(a.type);
+		if (!info.has_name() || (a.rdata.size() != b.rdata.size())) return false;
+
+		return info.compare(a.rdata.data(), a.rdata.size(), b.rdata.data(), b.rdata.size()) == 0;
+	}
+
+	// Add/refresh/remove a single entry in the pending tables.
+	void apply_(Pending& p, Entry&& e, bool flush, int64_t now_ms)
+	{
+		auto& entries = p.get(*this, shard_(e.hash));
+		auto it = entries.begin() + (find_(entries, e.hash) - entries.begin());
+
+		while ((it != entries.end()) && ((*it)->hash == e.hash)) {
+			const auto& x = **it;
+
+			bool same_rrset = (x.type == e.type) && (x.clss == e.clss) && same_name_(x, e.name);
+			bool same_rdata = same_rrset && same_rdata_(x, e);
+
+			if (x.expires_ms <= now_ms) {
+				stats.expired++;
+			}
+			else if (same_rdata) {
+				// Goodbye: keep for another second (RFC6762:10.1); else refresh.
+				if (e.TTL == 0) {
+					if (x.expires_ms > now_ms + GoodbyeDelay_ms) {
+						auto g = std::make_shared<Entry>(x);
+						g->expires_ms = now_ms + GoodbyeDelay_ms;
+						*it = g;
+					}
+					return;
+				}
+			}
+			else if (!(flush && same_rrset && (x.received_ms < now_ms - FlushGrace_ms))) {
+				++it;
+				continue;
+			}
+			else {
+				stats.flushed++;
+			}
+
+			it = entries.erase(it);
+		}
+
+		if (e.TTL == 0) return; // goodbye for something we don't have
+
+		entries.insert(it, std::make_shared<const Entry>(std::move(e)));
+		stats.records++;
+	}
+
+	void publish_(Pending& p)
+	{
+		for (size_t s=0; s<NShards; s++) {
+			if (!p.tables[s]) continue;
+
+			auto old = shards[s].table.exchange(p.tables[s]);
+			retired.push_back( {epoch.fetch_add(1), old} );
+			stats.published++;
+		}
+
+		reclaim_();
+	}
+
+	// Free retired tables that no reader can still be using.
+	void reclaim_()
+	{
+		uint64_t oldest = UINT64_MAX;
+		for (const auto& s : slots) {
+			auto e = s.epoch.load();
+			if ((e != 0) && (e < oldest)) oldest = e;
+		}
+
+		size_t n = 0;
+		for (const auto& r : retired) {
+			if (r.first < oldest) {
+				delete r.second;
+				stats.reclaimed++;
+			}
+			else {
+				retired[n++] = r;
+			}
+		}
+		retired.resize(n);
+	}
+
+	// Cache the records of a response message. Questions are skipped, as
+	// are queries (including known answers). Returns number of records
+	// added or refreshed.
+	int Update(const char* bytes, size_t len, int64_t now_ms)
+	{
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+		Pending p;
+
+		size_t i = msg.read_header(bytes, 0, len);
+		if ((i == 0) || !(msg.flags & DNS::Defs::QRMask)) return 0;
+
+		std::lock_guard<std::mutex> lock(write_mutex);
+
+		auto n0 = stats.records;
+		stats.messages++;
+
+		for (int j=0; j<msg.n_question; j++) {
+			i = rr.read_header(bytes, i, len);
+			if (i == 0) return 0;
+		}
+
+		int n_rr = msg.n_answer + msg.n_authority + msg.n_additional;
+
+		for (int j=0; j<n_rr; j++) {
+			i = rr.read_header_and_body(bytes, i, len, tmp);
+			if (i == 0) break;
+			if (rr.type == DNS::Defs::OPT) continue; // describes the message, not a name
+
+			Entry e;
+			e.name = std::string(trim_(rr.name));
+			e.hash = Hash::fnv1a_nocase(e.name.data(), e.name.size());
+			e.type = rr.type;
+			e.clss = rr.clss & ~DNS::Defs::CACHE_FLUSH_BIT;
+			e.TTL = rr.TTL;
+			e.received_ms = now_ms;
+			e.expires_ms = now_ms + 1000*(int64_t)rr.TTL;
+
+			if (!rdata_(bytes, len, rr, e.rdata)) continue;
+			if (e.type == DNS::Defs::TXT) e.txt.build(e.rdata.data(), e.rdata.size());
+
+			apply_(p, std::move(e), rr.clss & DNS::Defs::CACHE_FLUSH_BIT, now_ms);
+		}
+
+		publish_(p);
+
+		return (int)(stats.records - n0);
+	}
+
+	// Direct insertion of a single record (name, type, class and rdata as
+	// for the wire format, but with rdata names uncompressed).
+	void Insert(const std::string& name, uint16_t type, uint16_t clss, uint32_t TTL,
+		const std::vector<char>& rdata, int64_t now_ms)
+	{
+		Entry e;
+		e.name = std::string(trim_(name));
+		e.hash = Hash::fnv1a_nocase(e.name.data(), e.name.size());
+		e.type = type;
+		e.clss = clss & ~DNS::Defs::CACHE_FLUSH_BIT;
+		e.TTL = TTL;
+		e.received_ms = now_ms;
+		e.expires_ms = now_ms + 1000*(int64_t)TTL;
+		e.rdata = rdata;
+		if (type == DNS::Defs::TXT) e.txt.build(rdata.data(), rdata.size());
+
+		std::lock_guard<std::mutex> lock(write_mutex);
+		Pending p;
+		apply_(p, std::move(e), clss & DNS::Defs::CACHE_FLUSH_BIT, now_ms);
+		publish_(p);
+	}
+
+	// Bulk insertion (e.g. from a snapshot), published in one step. Entries
+	// need name, type, clss, TTL, received_ms, expires_ms and rdata; the rest
+	// is filled in here. Returns number of entries added.
+	size_t Insert(std::vector<Entry>&& entries, int64_t now_ms)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		Pending p;
+
+		auto n0 = stats.records;
+
+		for (auto& e : entries) {
+			if (e.expires_ms <= now_ms) continue;
+
+			e.name = std::string(trim_(e.name));
+			e.hash = Hash::fnv1a_nocase(e.name.data(), e.name.size());
+			e.clss &= ~DNS::Defs::CACHE_FLUSH_BIT;
+			if (e.type == DNS::Defs::TXT) e.txt.build(e.rdata.data(), e.rdata.size());
+
+			apply_(p, std::move(e), false, now_ms);
+		}
+
+		publish_(p);
+
+		return (size_t)(stats.records - n0);
+	}
+
+	// Drop expired entries; only shards containing any are copied.
+	void Expire(int64_t now_ms)
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		Pending p;
+
+		for (size_t s=0; s<NShards; s++) {
+			const Table* t = shards[s].table.load();
+
+			auto expired = [now_ms](const EntryPtr& e) { return e->expires_ms <= now_ms; };
+			if (std::none_of(t->begin(), t->end(), expired)) continue;
+
+			auto& copy = p.get(*this, s);
+			auto end = std::remove_if(copy.begin(), copy.end(), expired);
+			stats.expired += copy.end() - end;
+			copy.erase(end, copy.end());
+		}
+
+		publish_(p);
+	}
+
+	Stats GetStats()
+	{
+		std::lock_guard<std::mutex> lock(write_mutex);
+		return stats;
+	}
+};
+
+}
+
+#endif
@@ -9,9 +9,12 @@
 #include "defs.hpp" // should come before any inet headers etc
 
 #include <string.h> // strtok_r()
+#include <strings.h> // strncasecmp()
 
+#include <deque>
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace mDNS
@@ -66,7 +69,8 @@ struct Defs
 	static constexpr uint16_t BADTRUNC  = 22;
 	static constexpr uint16_t BADCOOKIE = 23;
 
-	// RR types, no obsolete/experimental; RFC1035:3.2.2, 3596:2.1, 2782:1.1
+	// RR types, no obsolete/experimental; RFC1035:3.2.2, 3596:2.1, 2782:1.1,
+	// 6891:6.1.1, 4034:4. Names, layouts etc. are in RRTypes.hpp.
 	static constexpr uint16_t A = 1;
 	static constexpr uint16_t NS    = 2;
 	static constexpr uint16_t CNAME = 5;
@@ -80,6 +84,8 @@ struct Defs
 	static constexpr uint16_t TXT   = 16;
 	static constexpr uint16_t AAAA  = 28;
 	static constexpr uint16_t SRV   = 33;
+	static constexpr uint16_t OPT   = 41;
+	static constexpr uint16_t NSEC  = 47;
 	static constexpr uint16_t ANY   = 255;
 
 	// Classes, "no obsolete" ;) RFC1035:3.2.4
@@ -129,22 +135,6 @@ struct Defs
 			_(BADTRUNC ),
 			_(BADCOOKIE),
 		};
-		inline static const NameMap<uint16_t> RRTypes = {
-			_(A    ),
-			_(NS   ),
-			_(CNAME),
-			_(SOA  ),
-			_(NUL  ),
-			_(WKS  ),
-			_(PTR  ),
-			_(HINFO),
-			_(MINFO),
-			_(MX   ),
-			_(TXT  ),
-			_(AAAA ),
-			_(SRV  ),
-			_(ANY  ),
-		};
 		inline static const NameMap<uint16_t> Classes = {
 			_(IN),
 		};
@@ -160,7 +150,6 @@ struct Defs
 	static const char* HeaderFlag(uint16_t k) { return get(HeaderFlags,k); }
 	static const char* ReturnCode(uint16_t k) { return get(ReturnCodes,k); }
 	static const char* OpCode(uint16_t k) { return get(OpCodes,k); }
-	static const char* RRType(uint16_t k) { return get(RRTypes,k); }
 	static const char* Class(uint16_t k) { return get(Classes,k); }
 };
 
@@ -320,6 +309,83 @@ struct Parse
 			}
 		}
 	}
+
+	// Skip over a name in place; a compression pointer ends the name. Returns
+	// the index after the name (as for labels()), or 0 on error.
+	static size_t skip_labels(const char* bytes, size_t i, size_t max_i)
+	{
+		if (!bytes) {
+			WARN("Null bytes pointer!");
+			return 0;
+		}
+
+		while (i < max_i) {
+			uint8_t c = bytes[i];
+			if (c == 0) return i+1;
+			if ((c & 0xc0) == 0xc0) return (i+2 <= max_i) ? i+2 : 0;
+			if (c & 0xc0) return 0;
+			i += c + 1;
+		}
+
+		WARN("Attempt to read past buffer (%d,%d)", (int)i, (int)max_i);
+		return 0;
+	}
+
+	// Location of a single label in the source buffer.
+	struct Span {
+		uint16_t ofs;
+		uint8_t len;
+	};
+
+	// As labels(), but records label locations without copying; at most
+	// max_spans labels. Returns the index after the name, or 0 on error.
+	static size_t spans(
+		const char* bytes,
+		size_t i, size_t max_i,
+		Span* spans, size_t max_spans, size_t& n_spans)
+	{
+		const size_t max_jumps = 64;
+		size_t end = 0, jumps = 0;
+
+		n_spans = 0;
+
+		if (!bytes) {
+			WARN("Null bytes pointer!");
+			return 0;
+		}
+
+		while (i < max_i) {
+			uint8_t c = bytes[i];
+
+			if (c == 0) {
+				return (end == 0) ? i+1 : end;
+			}
+
+			if ((c & 0xc0) == 0xc0) {
+				if (i+2 > max_i) break;
+				if (end == 0) end = i+2;
+				if (++jumps > max_jumps) {
+					WARN("Too many compression jumps - stopping");
+					return 0;
+				}
+				i = ((uint16_t)(c & 0x3f) << 8) | (uint8_t)bytes[i+1];
+				continue;
+			}
+
+			if (c & 0xc0) {
+				WARN("Compression format (%d) not supported.", c & 0xc0);
+				return 0;
+			}
+
+			if ((i+1+c > max_i) || (n_spans >= max_spans)) break;
+
+			spans[n_spans++] = { (uint16_t)(i+1), c };
+			i += c + 1;
+		}
+
+		WARN("Bad name at %d (%d)", (int)i, (int)max_i);
+		return 0;
+	}
 };
 
 //
@@ -339,7 +405,10 @@ struct ResourceRecord
 	uint16_t rd_ofs = 0; // offset into original buffer for payload (in bytes)
 	uint16_t rd_len = 0; // length of payload (in bytes)
 
-	// Header and body deserialization invoked explicitly!
+	uint16_t name_ofs = 0; // offset into original buffer for name (in bytes)
+
+	// Header and body deserialization invoked explicitly! Versions without the
+	// tmp parameter don't decode the name into a string; use name_ofs instead.
 
 	size_t read_header(const char* bytes, size_t i, size_t max_i, std::vector<std::string>& tmp)
 	{
@@ -348,6 +417,8 @@ struct ResourceRecord
 			return 0;
 		}
 
+		name_ofs = i;
+
 		// Name: allow compression, require terminal zero-string
 		tmp.clear();
 		i = Parse::labels(bytes, i, max_i, true, true, tmp);
@@ -360,6 +431,29 @@ struct ResourceRecord
 			name += tmp[ti] + ".";
 		}
 
+		return read_type_class_(bytes, i, max_i);
+	}
+
+	size_t read_header(const char* bytes, size_t i, size_t max_i)
+	{
+		if (!bytes) {
+			WARN("Null bytes pointer!");
+			return 0;
+		}
+
+		name_ofs = i;
+		name.clear();
+
+		i = Parse::skip_labels(bytes, i, max_i);
+		if (i==0) {
+			return 0;
+		}
+
+		return read_type_class_(bytes, i, max_i);
+	}
+
+	size_t read_type_class_(const char* bytes, size_t i, size_t max_i)
+	{
 		i = Parse::read(bytes, i, max_i, type);
 		if (i==0) {
 			return 0;
@@ -380,6 +474,21 @@ struct ResourceRecord
 			return 0;
 		}
 
+		return read_body_(bytes, i, max_i);
+	}
+
+	size_t read_header_and_body(const char* bytes, size_t i, size_t max_i)
+	{
+		i = read_header(bytes, i, max_i);
+		if (i == 0) {
+			return 0;
+		}
+
+		return read_body_(bytes, i, max_i);
+	}
+
+	size_t read_body_(const char* bytes, size_t i, size_t max_i)
+	{
 		i = Parse::read(bytes, i, max_i, TTL);
 		if (i==0) {
 			return 0;
@@ -521,6 +630,548 @@ struct Message
 	}
 };
 
+//
+// EDNS(0) parameters from an OPT pseudo-record (RFC6891:6.1). OPT lives in the
+// additional section with the root name; its class is the sender's maximum
+// UDP payload, and its TTL holds the extended RCODE, version and flags. It
+// describes the message rather than any name, so is never cached.
+//
+struct EDNS
+{
+	static constexpr uint16_t DOMask = 1 << 15;   // DNSSEC OK
+	static constexpr uint16_t MinPayload = 512;   // RFC6891:6.2.5
+	static constexpr uint16_t MaxPayload = 8972;  // 9000-byte jumbo frame, less IPv4+UDP headers
+	static constexpr size_t RecordSize = 11;      // OPT with no options
+
+	uint16_t udp_size = 0;
+	uint8_t ext_rcode = 0;
+	uint8_t version = 0;
+	uint16_t flags = 0;
+
+	uint16_t rd_ofs = 0; // options, in source buffer
+	uint16_t rd_len = 0;
+
+	bool from_record(const ResourceRecord& rr)
+	{
+		if (rr.type != Defs::OPT) return false;
+
+		udp_size = (rr.clss < MinPayload) ? MinPayload : rr.clss;
+		ext_rcode = rr.TTL >> 24;
+		version = (rr.TTL >> 16) & 0xff;
+		flags = rr.TTL & 0xffff;
+		rd_ofs = rr.rd_ofs;
+		rd_len = rr.rd_len;
+
+		return true;
+	}
+
+	static uint32_t ttl(uint8_t ext_rcode, uint8_t version, uint16_t flags)
+	{
+		return ((uint32_t)ext_rcode << 24) | ((uint32_t)version << 16) | flags;
+	}
+
+	// Scan a message for its OPT record; returns false if there isn't one
+	// (or the message is malformed).
+	bool read(const char* bytes, size_t len)
+	{
+		Message msg;
+		ResourceRecord rr;
+
+		size_t i = msg.read_header(bytes, 0, len);
+		if (i == 0 || msg.n_additional == 0) return false;
+
+		for (int j=0; j<msg.n_question; j++) {
+			i = rr.read_header(bytes, i, len);
+			if (i == 0) return false;
+		}
+
+		int n_rr = msg.n_answer + msg.n_authority + msg.n_additional;
+		for (int j=0; j<n_rr; j++) {
+			i = rr.read_header_and_body(bytes, i, len);
+			if (i == 0) return false;
+			if (from_record(rr)) return true;
+		}
+
+		return false;
+	}
+};
+
+//
+// DNS message builder - serializes header and records into a network buffer,
+// keeping the header section counts up to date. Records must be added in
+// section order (questions, answers, authority, additional).
+//
+// If max_size is set, question() and record() refuse (returning false, with
+// the buffer unchanged) anything that would take the message past it, so
+// callers can fill a packet to the link's payload limit and start another.
+// opt() is exempt; leave EDNS::RecordSize spare if it is to be added.
+//
+// If compress is set, names are compressed (RFC1035:4.1.4): owner names, and
+// names in the RDATA of the types RFC6762:18.14 allows (PTR, CNAME, NS, SRV,
+// MX), which must be given uncompressed. Suffixes already written are found
+// by hash and checked against the message before a pointer is used.
+//
+struct Builder
+{
+	enum Section { Question = 0, Answer, Authority, Additional };
+
+	static constexpr size_t HeaderSize = 12;
+	static constexpr size_t MaxPointer = 0x3fff;
+
+	struct Label {
+		const char *p;
+		uint8_t len;
+	};
+
+	std::vector<char>& buf;
+	Section section = Question;
+	size_t max_size = 0; // 0 => no limit
+	bool compress = false;
+
+	std::unordered_map<uint64_t, uint16_t> suffixes; // name suffix hash => offset
+	std::vector<uint64_t> added_;                    // ... added by the current write
+	std::vector<Label> lbls_;
+
+	Builder(std::vector<char>& buf_, uint16_t id = 0, uint16_t flags = 0, size_t max_size_ = 0) :
+		buf(buf_), max_size(max_size_)
+	{
+		buf.clear();
+		Parse::append(buf, id);
+		Parse::append(buf, flags);
+		for (int i=0; i<4; i++) Parse::append(buf, (uint16_t)0);
+	}
+
+	// Write dotted name as uncompressed labels; trailing '.' optional.
+	static bool name(std::vector<char>& bytes, const std::string& name)
+	{
+		size_t start = 0, total = 0;
+
+		while (start < name.size()) {
+			auto end = name.find('.', start);
+			if (end == std::string::npos) end = name.size();
+
+			auto len = end - start;
+			if (len > 63) {
+				WARN("Label too long (%d) in '%s'", (int)len, name.c_str());
+				return false;
+			}
+
+			if (len > 0) {
+				Parse::append(bytes, (uint8_t)len);
+				bytes.insert(bytes.end(), &name[start], &name[start]+len);
+				total += len + 1;
+			}
+
+			start = end + 1;
+		}
+		Parse::append(bytes, (uint8_t)0);
+
+		if (total+1 > 255) {
+			WARN("Name too long (%d) : '%s'", (int)total+1, name.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	void set_flags(uint16_t flags)
+	{
+		Parse::write(buf.data(), 2, buf.size(), flags);
+	}
+
+	//
+	// Name compression
+	//
+
+	// Labels of a dotted name; false (with a warning) if too long.
+	static bool labels_(const std::string& name, std::vector<Label>& out)
+	{
+		size_t start = 0, total = 1;
+
+		out.clear();
+		while (start < name.size()) {
+			auto end = name.find('.', start);
+			if (end == std::string::npos) end = name.size();
+
+			auto len = end - start;
+			if (len > 63) {
+				WARN("Label too long (%d) in '%s'", (int)len, name.c_str());
+				return false;
+			}
+			if (len > 0) {
+				out.push_back( {&name[start], (uint8_t)len} );
+				total += len + 1;
+			}
+
+			start = end + 1;
+		}
+
+		if (total > 255) {
+			WARN("Name too long (%d) : '%s'", (int)total, name.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	// Labels of an uncompressed name in wire format at bytes[i], which must
+	// end exactly at len; false otherwise (e.g. it has compression pointers).
+	static bool wire_labels_(const char *bytes, size_t i, size_t len, std::vector<Label>& out)
+	{
+		size_t start = i;
+
+		out.clear();
+		while (i < len) {
+			uint8_t n = bytes[i];
+			if (n == 0) return (i+1 == len);
+			if ((n > 63) || (i+1+n > len) || (i+1+n - start > 255)) return false;
+			out.push_back( {&bytes[i+1], n} );
+			i += 1 + n;
+		}
+		return false;
+	}
+
+	// Offset in RDATA of a name we may compress, or -1.
+	static int rdata_name_ofs_(uint16_t type)
+	{
+		switch (type) {
+			case Defs::PTR: case Defs::CNAME: case Defs::NS: return 0;
+			case Defs::MX: return 2;
+			case Defs::SRV: return 6;
+		}
+		return -1;
+	}
+
+	// Does the name at buf[i] equal lbls[k...]?
+	bool same_suffix_(size_t i, const std::vector<Label>& lbls, size_t k) const
+	{
+		for (int hops = 0; i < buf.size(); ) {
+			uint8_t n = buf[i];
+			if ((n & 0xc0) == 0xc0) {
+				if ((i+1 >= buf.size()) || (++hops > 16)) return false;
+				i = ((n & 0x3f) << 8) | (uint8_t)buf[i+1];
+				continue;
+			}
+			if (n == 0) return (k == lbls.size());
+			if ((k == lbls.size()) || (n != lbls[k].len) || (i+1+n > buf.size())) return false;
+			if (strncasecmp(&buf[i+1], lbls[k].p, n) != 0) return false;
+			i += 1 + n;
+			k++;
+		}
+		return false;
+	}
+
+	// Write labels, ending in a pointer to the longest suffix already in the
+	// message (if any); record offsets of the new suffixes.
+	void put_labels_(const std::vector<Label>& lbls)
+	{
+		size_t n = lbls.size(), k = 0;
+		uint64_t h[128];
+		uint16_t ptr = 0;
+
+		h[n] = Hash::Basis;
+		for (size_t j=n; j-- > 0; ) {
+			h[j] = Hash::fnv1a_nocase(lbls[j].p, lbls[j].len, Hash::fnv1a(&lbls[j].len, 1, h[j+1]));
+		}
+
+		for (; k<n; k++) {
+			auto it = suffixes.find(h[k]);
+			if ((it != suffixes.end()) && same_suffix_(it->second, lbls, k)) {
+				ptr = it->second;
+				break;
+			}
+		}
+
+		for (size_t j=0; j<k; j++) {
+			if ((buf.size() <= MaxPointer) && suffixes.emplace(h[j], (uint16_t)buf.size()).second) {
+				added_.push_back(h[j]);
+			}
+			Parse::append(buf, lbls[j].len);
+			buf.insert(buf.end(), lbls[j].p, lbls[j].p + lbls[j].len);
+		}
+
+		if (k < n) Parse::append(buf, (uint16_t)(0xc000 | ptr));
+		else Parse::append(buf, (uint8_t)0);
+	}
+
+	bool put_name_(const std::string& dotted)
+	{
+		if (!compress) return name(buf, dotted);
+		if (!labels_(dotted, lbls_)) return false;
+		put_labels_(lbls_);
+		return true;
+	}
+
+	void put_rdata_(uint16_t type, const char *rdata, uint16_t rd_len)
+	{
+		int ofs = compress ? rdata_name_ofs_(type) : -1;
+
+		if ((ofs < 0) || (rd_len <= ofs) || !wire_labels_(rdata, ofs, rd_len, lbls_)) {
+			Parse::append(buf, rd_len);
+			if (rd_len > 0) buf.insert(buf.end(), rdata, rdata+rd_len);
+			return;
+		}
+
+		auto at = buf.size();
+		Parse::append(buf, rd_len);
+		buf.insert(buf.end(), rdata, rdata+ofs);
+		put_labels_(lbls_);
+
+		uint16_t n = (uint16_t)(buf.size() - at - 2);
+		Parse::write(buf.data(), at, buf.size(), n);
+	}
+
+	void increment_(Section s)
+	{
+		uint16_t n = 0;
+		size_t i = 4 + 2*(size_t)s;
+
+		if (s < section) {
+			WARN("Record added out of section order (%d < %d)", (int)s, (int)section);
+		}
+		section = s;
+
+		Parse::read(buf.data(), i, buf.size(), n);
+		n++;
+		Parse::write(buf.data(), i, buf.size(), n);
+	}
+
+	// Undo a partial write if it failed or overflowed max_size.
+	bool fits_(bool ok, size_t mark)
+	{
+		if (ok && ((max_size == 0) || (buf.size() <= max_size))) return true;
+		buf.resize(mark);
+		for (auto h : added_) suffixes.erase(h);
+		return false;
+	}
+
+	bool question(const std::string& qname, uint16_t type, uint16_t clss = Defs::IN)
+	{
+		auto mark = buf.size();
+		added_.clear();
+		bool ok = put_name_(qname);
+		Parse::append(buf, type);
+		Parse::append(buf, clss);
+		if (!fits_(ok, mark)) return false;
+		increment_(Question);
+		return true;
+	}
+
+	bool record(Section s, const std::string& rname, uint16_t type, uint16_t clss, uint32_t TTL,
+		const char *rdata, uint16_t rd_len)
+	{
+		auto mark = buf.size();
+		added_.clear();
+		bool ok = put_name_(rname);
+		Parse::append(buf, type);
+		Parse::append(buf, clss);
+		Parse::append(buf, TTL);
+		put_rdata_(type, rdata, rd_len);
+		if (!fits_(ok, mark)) return false;
+		increment_(s);
+		return true;
+	}
+
+	bool record(Section s, const std::string& rname, uint16_t type, uint16_t clss, uint32_t TTL,
+		const std::vector<char>& rdata)
+	{
+		return record(s, rname, type, clss, TTL, rdata.data(), (uint16_t)rdata.size());
+	}
+
+	// OPT pseudo-record advertising our UDP payload size (RFC6891:6.1.2);
+	// must be the last record added.
+	bool opt(uint16_t udp_size, uint16_t flags = 0, uint8_t version = 0, uint8_t ext_rcode = 0)
+	{
+		auto limit = max_size;
+		max_size = 0;
+		bool ok = record(Additional, "", Defs::OPT, udp_size, EDNS::ttl(ext_rcode, version, flags), nullptr, 0);
+		max_size = limit;
+		return ok;
+	}
+
+	// Bytes left before max_size (or SIZE_MAX if unlimited)
+	size_t remaining() const
+	{
+		if (max_size == 0) return SIZE_MAX;
+		return (buf.size() < max_size) ? max_size - buf.size() : 0;
+	}
+
+	//
+	// RDATA helpers for common record types
+	//
+
+	static std::vector<char> rdata_name(const std::string& target)
+	{
+		std::vector<char> rd;
+		name(rd, target);
+		return rd;
+	}
+
+	static std::vector<char> rdata_srv(uint16_t priority, uint16_t weight, uint16_t port,
+		const std::string& target)
+	{
+		std::vector<char> rd;
+		Parse::append(rd, priority);
+		Parse::append(rd, weight);
+		Parse::append(rd, port);
+		name(rd, target);
+		return rd;
+	}
+
+	static std::vector<char> rdata_txt(const std::vector<std::string>& entries)
+	{
+		std::vector<char> rd;
+		for (const auto& e : entries) {
+			auto len = (e.size() > 255) ? 255 : e.size();
+			Parse::append(rd, (uint8_t)len);
+			rd.insert(rd.end(), e.data(), e.data()+len);
+		}
+		if (rd.empty()) Parse::append(rd, (uint8_t)0); // RFC6763:6.1
+		return rd;
+	}
+
+	// Restricted form of NSEC (RFC6762:6.1): next domain is the record's own
+	// name, and only window 0 of the bitmap is used, so types >= 256 are
+	// dropped.
+	static std::vector<char> rdata_nsec(const std::string& next, const std::vector<uint16_t>& types)
+	{
+		std::vector<char> rd;
+		uint8_t bits[32] = {};
+		int n = 0;
+
+		name(rd, next);
+		for (auto t : types) {
+			if (t > 255) continue;
+			bits[t/8] |= 0x80 >> (t%8);
+			if (t/8 + 1 > n) n = t/8 + 1;
+		}
+		if (n > 0) {
+			Parse::append(rd, (uint8_t)0);
+			Parse::append(rd, (uint8_t)n);
+			rd.insert(rd.end(), (char*)bits, (char*)bits+n);
+		}
+		return rd;
+	}
+};
+
+//
+// Response assembly across several packets, when the records don't all fit
+// in one (RFC6762:6, 18.5): answers go first, in order, each into the
+// current packet or, when that's full, a new one; additionals then go into
+// the first packet with room for them, again starting a new one if none has.
+// So answers are never displaced by additionals, and additionals tend to
+// fill the space left after the answers.
+//
+// Records are never split or truncated. One that can't fit even in an empty
+// packet is left out (and counted). Names are compressed within each packet.
+//
+struct Packer
+{
+	static constexpr size_t MinRecordSize = 2 + 10; // pointer name, fixed fields, no RDATA
+
+	struct Record {
+		const std::string *name;
+		uint16_t type, clss;
+		uint32_t TTL;
+		const char *rdata;
+		uint16_t rd_len;
+	};
+
+	struct Result {
+		size_t packets = 0;
+		size_t answers = 0;     // records placed
+		size_t additionals = 0; // ...
+		size_t skipped = 0;     // too big for any packet
+		size_t bytes = 0;       // total of all packets
+	};
+
+	// Packets (headers with id and flags, no questions) into out, each no
+	// larger than max_size (0 => one packet, no limit).
+	static Result Pack(std::vector< std::vector<char> >& out, uint16_t id, uint16_t flags, size_t max_size,
+		const std::vector<Record>& answers, const std::vector<Record>& additionals, bool compress = true)
+	{
+		std::deque< std::vector<char> > bufs; // deque: Builders keep references
+		std::deque<Builder> builders;
+		Result res;
+
+		auto open = [&]() -> Builder& {
+			bufs.emplace_back();
+			builders.emplace_back(bufs.back(), id, flags, max_size);
+			builders.back().compress = compress;
+			return builders.back();
+		};
+
+		auto put = [](Builder& b, Builder::Section s, const Record& r) {
+			return b.record(s, *r.name, r.type, r.clss, r.TTL, r.rdata, r.rd_len);
+		};
+
+		for (const auto& r : answers) {
+			if (!builders.empty() && put(builders.back(), Builder::Answer, r)) {
+				res.answers++;
+				continue;
+			}
+			if (put(open(), Builder::Answer, r)) {
+				res.answers++;
+				continue;
+			}
+			res.skipped++;
+			builders.pop_back();
+			bufs.pop_back();
+		}
+
+		// (Nearly) first fit. Packets before first_open are full for the
+		// smallest record possible; a packet isn't tried for a record that
+		// would take at least (with best case compression) what it has
+		// room for, or what some record that didn't fit there would have.
+		size_t first_open = 0;
+		std::vector<size_t> failed(builders.size(), SIZE_MAX); // least size known not to fit
+
+		for (const auto& r : additionals) {
+			bool placed = false;
+
+			int ofs = Builder::rdata_name_ofs_(r.type);
+			size_t least = MinRecordSize + (((ofs >= 0) && (r.rd_len > ofs)) ? ofs+2 : r.rd_len);
+
+			for (size_t k=first_open; k<builders.size() && !placed; k++) {
+				auto room = builders[k].remaining();
+				if (room < MinRecordSize) {
+					if (k == first_open) first_open++;
+					continue;
+				}
+				if ((room < least) || (least >= failed[k])) continue;
+
+				placed = put(builders[k], Builder::Additional, r);
+				if (!placed) failed[k] = least;
+			}
+
+			if (!placed) {
+				placed = put(open(), Builder::Additional, r);
+				if (placed) {
+					failed.push_back(SIZE_MAX);
+				}
+				else {
+					builders.pop_back();
+					bufs.pop_back();
+				}
+			}
+
+			if (placed) res.additionals++;
+			else res.skipped++;
+		}
+
+		builders.clear();
+
+		out.clear();
+		for (auto& b : bufs) {
+			res.bytes += b.size();
+			out.push_back(std::move(b));
+		}
+		res.packets = out.size();
+
+		return res;
+	}
+};
+
 }
 
 }
@@ -36,6 +36,7 @@ struct DatagramSocket
 		char tmp[1024]; // temporary buffer for metadata
 		sockaddr_storage src, dst;
 		int ifc_idx;
+		struct timespec rx_time; // kernel receive time if enabled, else zero
 	};
 
 	static const char * check_(int family)
@@ -46,10 +47,44 @@ struct DatagramSocket
 		return nullptr; // stop compiler warning
 	}
 
+	// Restrict socket to traffic arriving on the named interface, so the kernel
+	// discards everything else before it reaches us. Must be called before
+	// bind(). Linux requires CAP_NET_RAW for SO_BINDTODEVICE before 5.7; on
+	// failure we return false and the caller should instead filter received
+	// datagrams on Meta::ifc_idx.
+	static bool BindToDevice(int sd, int family, const char *device)
+	{
+		if (!device) return false;
+
+		#if __linux__
+			(void)family;
+			if (setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, device, strlen(device)+1) < 0) {
+				WARN("setsockopt(SO_BINDTODEVICE,%s); falling back to userspace filter", device);
+				errno = 0;
+				return false;
+			}
+		#else
+			unsigned int idx = if_nametoindex(device);
+			int proto = (family == AF_INET6) ? IPPROTO_IPV6 : IPPROTO_IP;
+			int option = (family == AF_INET6) ? IPV6_BOUND_IF : IP_BOUND_IF;
+			if ((idx == 0) || (setsockopt(sd, proto, option, &idx, sizeof(idx)) < 0)) {
+				WARN("setsockopt(BOUND_IF,%s); falling back to userspace filter", device);
+				errno = 0;
+				return false;
+			}
+		#endif
+
+		return true;
+	}
+
 	// Attempt to create a socket bound to the specified port on all available
 	// interfaces (ifc_addr == null) or only the specified interface (via
 	// ifc_addr != null). You almost certainly want ifa == null!
-	static int CreateAndBind(int family, int port, const struct sockaddr* ifc_addr = nullptr)
+	//
+	// If device != null, also try to restrict the socket to that interface via
+	// BindToDevice(); the result of that is written to device_bound, if given.
+	static int CreateAndBind(int family, int port, const struct sockaddr* ifc_addr = nullptr,
+		const char *device = nullptr, bool *device_bound = nullptr)
 	{
 		const int on = 1;
 
@@ -135,6 +170,13 @@ struct DatagramSocket
 			break;
 		}
 
+		// Optionally restrict to a single interface
+
+		if (device) {
+			bool bound = BindToDevice(s, family, device);
+			if (device_bound) *device_bound = bound;
+		}
+
 		// Bind socket
 
 		if (bind(s, (struct sockaddr *)&ss, bind_len) != 0) {
@@ -163,6 +205,22 @@ struct DatagramSocket
 	// interface (Bonjour, Avahi etc), we may already be receiving multicasts
 	// without needing to call this - but call it in case we're the first!
 	static void JoinMulticastGroup(int sd, const char *mcast_ip, const ifaddrs *ifa = nullptr)
+	{
+		if (ifa == nullptr) {
+			join_(sd, mcast_ip, 0, nullptr);
+		}
+		else {
+			join_(sd, mcast_ip, if_nametoindex(ifa->ifa_name), ifa->ifa_addr);
+		}
+	}
+
+	// As above, by interface index alone; 0 => any/default interface.
+	static void JoinMulticastIndex(int sd, const char *mcast_ip, unsigned int ifc_idx)
+	{
+		join_(sd, mcast_ip, ifc_idx, nullptr);
+	}
+
+	static void join_(int sd, const char *mcast_ip, unsigned int ifc_idx, const struct sockaddr *ifc_addr)
 	{
 		struct sockaddr sa;
 		socklen_t len = sizeof(sa);
@@ -189,15 +247,12 @@ struct DatagramSocket
 					ERROR("inet_pton(%s)", mcast_ip);
 				}
 
-				// No ifaddrs specified? Receive on any interface/address,
-				// otherwise us specified interface.
-				if (ifa == nullptr) {
-					g.imr_address.s_addr = htonl(INADDR_ANY);
-					g.imr_ifindex = 0;
-				}
-				else {
-					g.imr_address = *SockUtil::inet4(ifa->ifa_addr);
-					g.imr_ifindex = if_nametoindex(ifa->ifa_name);
+				// No interface specified? Receive on any interface/address,
+				// otherwise use specified interface (and address, if given).
+				g.imr_address.s_addr = htonl(INADDR_ANY);
+				g.imr_ifindex = ifc_idx;
+				if (ifc_addr && (ifc_addr->sa_family == AF_INET)) {
+					g.imr_address = *SockUtil::inet4(ifc_addr);
 				}
 
 				if (setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &g, sizeof(g)) < 0) {
@@ -214,14 +269,10 @@ struct DatagramSocket
 					ERROR("inet_pton(%s)", mcast_ip);
 				}
 
-				// No ifaddrs specified? Use default multicast interface,
+				// No interface specified? Use default multicast interface,
 				// otherwise use specified interface.
-				if (ifa == nullptr) {
-					g.ipv6mr_interface = 0; // https://github.com/sccn/liblsl/issues/36
-				}
-				else {
-					g.ipv6mr_interface = if_nametoindex(ifa->ifa_name);
-				}
+				// https://github.com/sccn/liblsl/issues/36
+				g.ipv6mr_interface = ifc_idx;
 
 				if (setsockopt(sd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &g, sizeof(g)) < 0) {
 					ERROR("setsockopt(%s,JOIN_MULTI)", check_(domain));
@@ -231,17 +282,106 @@ struct DatagramSocket
 		}
 	}
 
+	// Enable/disable local delivery of multicasts sent on this socket. Note
+	// that disabling loopback also hides our packets from any other process
+	// on this host that listens for them (e.g. a local responder).
+	static void SetMulticastLoop(int sd, int family, bool enable)
+	{
+		auto fstr = check_(family);
+
+		if (family == AF_INET) {
+			unsigned char on = enable ? 1 : 0;
+			if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_LOOP, &on, sizeof(on)) < 0) {
+				WARN("setsockopt(%s,IP_MULTICAST_LOOP)", fstr);
+			}
+		}
+		else {
+			unsigned int on = enable ? 1 : 0;
+			if (setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &on, sizeof(on)) < 0) {
+				WARN("setsockopt(%s,IPV6_MULTICAST_LOOP)", fstr);
+			}
+		}
+	}
+
+	// Ask kernel to timestamp received datagrams (see Meta::rx_time). Time is
+	// CLOCK_REALTIME.
+	static bool EnableTimestamps(int sd)
+	{
+		const int on = 1;
+
+		#if __linux__
+			if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+				WARN("setsockopt(SO_TIMESTAMPNS)");
+				return false;
+			}
+		#else
+			if (setsockopt(sd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) < 0) {
+				WARN("setsockopt(SO_TIMESTAMP)");
+				return false;
+			}
+		#endif
+
+		return true;
+	}
+
+	// Extract destination address, interface index and timestamp (where
+	// present) from ancillary data of a received message.
+	static void ParseControl(struct msghdr& mh, Meta& meta)
+	{
+		memset(&meta.dst, 0, sizeof(meta.dst));
+		meta.ifc_idx = 0;
+		meta.rx_time = { 0, 0 };
+
+		for (struct cmsghdr* c = CMSG_FIRSTHDR(&mh); c!=NULL; c = CMSG_NXTHDR(&mh,c))
+		{
+			auto lvl = c->cmsg_level;
+			auto typ = c->cmsg_type;
+
+			if ((lvl==IPPROTO_IP) && (typ==IP_PKTINFO)) {
+				auto pi = (in_pktinfo *) CMSG_DATA(c);
+				auto index = pi->ipi_ifindex;
+				auto addr_ptr = &pi->ipi_addr;
+
+				meta.dst.ss_family = AF_INET;
+				memcpy(SockUtil::inet4(&meta.dst), addr_ptr, sizeof(*addr_ptr));
+				meta.ifc_idx = index;
+			}
+
+			if ((lvl==IPPROTO_IPV6) && (typ==IPV6_PKTINFO)) {
+				auto pi = (in6_pktinfo *) CMSG_DATA(c);
+				auto index = pi->ipi6_ifindex;
+				auto addr_ptr = &pi->ipi6_addr;
+
+				meta.dst.ss_family = AF_INET6;
+				memcpy(SockUtil::inet6(&meta.dst), addr_ptr, sizeof(*addr_ptr));
+				meta.ifc_idx = index;
+			}
+
+			#if __linux__
+				if ((lvl==SOL_SOCKET) && (typ==SCM_TIMESTAMPNS)) {
+					memcpy(&meta.rx_time, CMSG_DATA(c), sizeof(meta.rx_time));
+				}
+			#else
+				if ((lvl==SOL_SOCKET) && (typ==SCM_TIMESTAMP)) {
+					struct timeval tv;
+					memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+					meta.rx_time.tv_sec = tv.tv_sec;
+					meta.rx_time.tv_nsec = tv.tv_usec * 1000;
+				}
+			#endif
+		}
+	}
+
 	//
 	// Read from socket, acquiring information about the data source and local interface/IP.
 	// Only family and address regions of metadata dst are valid after call!
+	// With flags MSG_DONTWAIT, returns -1 quietly if nothing is waiting.
 	//
-	static int Read(int sd, void *buf, size_t len, Meta& meta)
+	static int Read(int sd, void *buf, size_t len, Meta& meta, int flags = 0)
 	{
 		if (!buf || (len<1)) return -1;
 
 		memset(&meta.src, 0, sizeof(meta.src));
-		memset(&meta.dst, 0, sizeof(meta.dst));
-		meta.ifc_idx = 0;
 
 		struct iovec iov;
 		{
@@ -261,8 +401,12 @@ struct DatagramSocket
 			mh.msg_controllen = sizeof(meta.tmp);
 		}
 
-		auto result = recvmsg(sd, &mh, 0);
+		auto result = recvmsg(sd, &mh, flags);
 		if (result<0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				errno = 0;
+				return -1;
+			}
 			WARN("recvmsg() returned %d", result);
 			return result;
 		}
@@ -271,36 +415,63 @@ struct DatagramSocket
 			WARN("metadata is potentially truncated");
 		}
 
-		for (struct cmsghdr* c = CMSG_FIRSTHDR(&mh); c!=NULL; c = CMSG_NXTHDR(&mh,c))
-		{
-			auto lvl = c->cmsg_level;
-			auto typ = c->cmsg_type;
+		ParseControl(mh, meta);
 
-			if ((lvl==IPPROTO_IP) && (typ==IP_PKTINFO)) {
-				auto pi = (in_pktinfo *) CMSG_DATA(c);
-				auto index = pi->ipi_ifindex;
-				auto addr_ptr = &pi->ipi_addr;
+		return result;
+	}
 
-				meta.dst.ss_family = AF_INET;
-				memcpy(SockUtil::inet4(&meta.dst), addr_ptr, sizeof(*addr_ptr));
-				meta.ifc_idx = index;
+	//
+	// Send to dst out of interface ifc_idx only (e.g. Meta::ifc_idx of the
+	// query being answered), whatever the socket's multicast interface or
+	// the routing table would otherwise pick; 0 leaves that to the kernel.
+	// The source address is chosen for that interface. Returns as sendmsg().
+	//
+	static int Send(int sd, const void *buf, size_t len, const sockaddr_storage& dst, int ifc_idx)
+	{
+		char control[CMSG_SPACE(sizeof(in6_pktinfo))] = {};
+		bool v6 = (dst.ss_family == AF_INET6);
 
-				break;
-			}
+		struct iovec iov;
+		{
+			iov.iov_base = (void *)buf;
+			iov.iov_len = len;
+		}
 
-			if ((lvl==IPPROTO_IPV6) && (typ==IPV6_PKTINFO)) {
-				auto pi = (in6_pktinfo *) CMSG_DATA(c);
-				auto index = pi->ipi6_ifindex;
-				auto addr_ptr = &pi->ipi6_addr;
+		struct msghdr mh;
+		{
+			memset(&mh, 0, sizeof(mh));
 
-				meta.dst.ss_family = AF_INET6;
-				memcpy(SockUtil::inet6(&meta.dst), addr_ptr, sizeof(*addr_ptr));
-				meta.ifc_idx = index;
+			mh.msg_name = (void *)&dst;
+			mh.msg_namelen = v6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+
+			mh.msg_iov = &iov;
+			mh.msg_iovlen = 1;
+		}
 
-				break;
+		if (ifc_idx > 0) {
+			mh.msg_control = control;
+			mh.msg_controllen = v6 ? CMSG_SPACE(sizeof(in6_pktinfo)) : CMSG_SPACE(sizeof(in_pktinfo));
+
+			auto c = CMSG_FIRSTHDR(&mh);
+			if (v6) {
+				c->cmsg_level = IPPROTO_IPV6;
+				c->cmsg_type = IPV6_PKTINFO;
+				c->cmsg_len = CMSG_LEN(sizeof(in6_pktinfo));
+				((in6_pktinfo *) CMSG_DATA(c))->ipi6_ifindex = ifc_idx;
+			}
+			else {
+				c->cmsg_level = IPPROTO_IP;
+				c->cmsg_type = IP_PKTINFO;
+				c->cmsg_len = CMSG_LEN(sizeof(in_pktinfo));
+				((in_pktinfo *) CMSG_DATA(c))->ipi_ifindex = ifc_idx;
 			}
 		}
 
+		auto result = sendmsg(sd, &mh, 0);
+		if (result<0) {
+			WARN("sendmsg() returned %d", (int)result);
+		}
+
 		return result;
 	}
 };
@@ -0,0 +1,249 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_DEDUPE)
+
+#define MDNS_DEDUPE
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <strings.h> // strcasecmp()
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "SockUtil.hpp"
+#include "DatagramSocket.hpp"
+#include "DNS.hpp"
+
+namespace mDNS
+{
+
+//
+// Short-lived duplicate detection for datagrams. Responders typically send the
+// same answer over IPv4 and IPv6, and multi-homed hosts deliver it once more
+// per interface; we only want to decode one of those copies.
+//
+// Datagrams are keyed on a hash of the payload (plus length), and an entry is
+// a duplicate of an earlier one seen within the window if:
+//
+//  - it arrived via the other address family on the same interface, from
+//    an IPv4/IPv6 source pair known to be the same host, or
+//  - it arrived from the same source address on a different interface.
+//
+// Source addresses can't be compared across families, so pairs are learned
+// from responses (Learn()): a host announcing an A record for the address
+// it sent from, and AAAA records under the same name, owns those too (and
+// vice versa). Until a host's pair is learned its copies are all decoded;
+// and a host that doesn't list its IPv6 source (e.g. link-local) address in
+// its AAAA records never is. The remaining false positive: two hosts sending
+// identical datagrams from addresses one of them has announced as its own.
+//
+// Anything else, e.g. the same standard query from two hosts, is NOT
+// considered a duplicate. One instance can be shared by the IPv4 and IPv6
+// listener threads.
+//
+struct Dedupe
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Stats {
+		uint64_t seen = 0;            // datagrams checked
+		uint64_t duplicates = 0;      // total duplicates detected
+		uint64_t cross_family = 0;    // ... of which arrived via other family
+		uint64_t cross_interface = 0; // ... of which arrived on other interface
+		uint64_t pairs = 0;           // IPv4/IPv6 source pairs learned
+	};
+
+	// Addresses of one host, one per family
+	struct Pair {
+		unsigned char v4[4];
+		unsigned char v6[16];
+	};
+
+	struct Entry {
+		uint64_t hash;
+		size_t len;
+		int family, ifc_idx;
+		unsigned char addr[16]; // IPv4 uses first 4 bytes
+		Clock::time_point t;
+	};
+
+	static constexpr size_t MaxEntries = 64; // ring size; plenty for a few ms
+	static constexpr size_t MaxPairs = 256;  // ring; oldest forgotten first
+
+	std::chrono::microseconds window;
+
+	Entry entries[MaxEntries];
+	size_t n_entries = 0, next = 0;
+
+	Pair pairs[MaxPairs];
+	size_t n_pairs = 0, next_pair = 0;
+
+	Stats stats;
+	std::mutex mutex;
+
+	Dedupe(int window_ms = 5) : window(window_ms*1000) {}
+
+	static void addr_(const sockaddr_storage& ss, unsigned char *addr)
+	{
+		memset(addr, 0, 16);
+		if (ss.ss_family == AF_INET) memcpy(addr, SockUtil::inet4(&ss), 4);
+		if (ss.ss_family == AF_INET6) memcpy(addr, SockUtil::inet6(&ss), 16);
+	}
+
+	// Same host? a, b from different families, as stored in Entry::addr.
+	bool paired_(const Entry& a, const Entry& b) const
+	{
+		const auto& x = (a.family == AF_INET) ? a : b;
+		const auto& y = (a.family == AF_INET) ? b : a;
+
+		for (size_t k=0; k<n_pairs; k++) {
+			if ((memcmp(pairs[k].v4, x.addr, 4) == 0) && (memcmp(pairs[k].v6, y.addr, 16) == 0)) return true;
+		}
+		return false;
+	}
+
+	void add_pair_(const unsigned char *v4, const unsigned char *v6)
+	{
+		for (size_t k=0; k<n_pairs; k++) {
+			if ((memcmp(pairs[k].v4, v4, 4) == 0) && (memcmp(pairs[k].v6, v6, 16) == 0)) return;
+		}
+
+		memcpy(pairs[next_pair].v4, v4, 4);
+		memcpy(pairs[next_pair].v6, v6, 16);
+		next_pair = (next_pair+1) % MaxPairs;
+		if (n_pairs < MaxPairs) n_pairs++;
+		stats.pairs++;
+	}
+
+	// Learn which IPv4 and IPv6 addresses belong to the sender of a response:
+	// those of the name with an A/AAAA record for the source address. Names
+	// are only decoded if there is such a record.
+	void Learn(const char *buf, size_t len, const DatagramSocket::Meta& meta)
+	{
+		struct Addr {
+			size_t name_ofs;
+			std::string name;
+			int family;
+			unsigned char addr[16];
+		};
+
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+		std::vector<Addr> addrs;
+		unsigned char src[16];
+		int family = meta.src.ss_family;
+		bool from_own = false;
+
+		if (window.count() <= 0) return;
+		if ((family != AF_INET) && (family != AF_INET6)) return;
+
+		size_t i = msg.read_header(buf, 0, len);
+		if ((i == 0) || !(msg.flags & DNS::Defs::QRMask)) return;
+
+		addr_(meta.src, src);
+
+		for (int j=0; j<msg.n_question; j++) {
+			i = rr.read_header(buf, i, len);
+			if (i == 0) return;
+		}
+
+		int n_rr = msg.n_answer + msg.n_authority + msg.n_additional;
+		for (int j=0; j<n_rr; j++) {
+			i = rr.read_header_and_body(buf, i, len);
+			if (i == 0) break;
+
+			Addr a;
+			if ((rr.type == DNS::Defs::A) && (rr.rd_len == 4)) a.family = AF_INET;
+			else if ((rr.type == DNS::Defs::AAAA) && (rr.rd_len == 16)) a.family = AF_INET6;
+			else continue;
+
+			a.name_ofs = rr.name_ofs;
+			memset(a.addr, 0, sizeof(a.addr));
+			memcpy(a.addr, &buf[rr.rd_ofs], rr.rd_len);
+			if ((a.family == family) && (memcmp(a.addr, src, 16) == 0)) from_own = true;
+			addrs.push_back(a);
+		}
+		if (!from_own) return;
+
+		for (auto& a : addrs) {
+			if (rr.read_header(buf, a.name_ofs, len, tmp) == 0) return;
+			a.name = rr.name;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (const auto& s : addrs) {
+			if ((s.family != family) || (memcmp(s.addr, src, 16) != 0)) continue;
+
+			for (const auto& o : addrs) {
+				if ((o.family == family) || (strcasecmp(o.name.c_str(), s.name.c_str()) != 0)) continue;
+				if (family == AF_INET) add_pair_(s.addr, o.addr);
+				else add_pair_(o.addr, s.addr);
+			}
+		}
+	}
+
+	// Returns true if datagram should be skipped. Non-duplicates are remembered.
+	bool IsDuplicate(const void *buf, size_t len, const DatagramSocket::Meta& meta,
+		Clock::time_point now = Clock::now())
+	{
+		if (window.count() <= 0) return false;
+
+		Entry e;
+		e.hash = Hash::fnv1a(buf, len);
+		e.len = len;
+		e.family = meta.src.ss_family;
+		e.ifc_idx = meta.ifc_idx;
+		addr_(meta.src, e.addr);
+		e.t = now;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		stats.seen++;
+
+		// Newest to oldest; stop as soon as we leave the window.
+		for (size_t n=0; n<n_entries; n++) {
+			const auto& x = entries[(next+MaxEntries-1-n) % MaxEntries];
+
+			if (now - x.t > window) break;
+			if ((x.hash != e.hash) || (x.len != e.len)) continue;
+
+			if (x.family != e.family) {
+				if ((x.ifc_idx != e.ifc_idx) || !paired_(x, e)) continue;
+				stats.duplicates++;
+				stats.cross_family++;
+				return true;
+			}
+
+			if (memcmp(x.addr, e.addr, sizeof(e.addr)) != 0) continue;
+
+			if (x.ifc_idx != e.ifc_idx) {
+				stats.duplicates++;
+				stats.cross_interface++;
+				return true;
+			}
+		}
+
+		entries[next] = e;
+		next = (next+1) % MaxEntries;
+		if (n_entries < MaxEntries) n_entries++;
+
+		return false;
+	}
+
+	Stats GetStats()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return stats;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,436 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_EVENTFEED)
+
+#define MDNS_EVENTFEED
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <arpa/inet.h> // inet_ntop()
+#include <strings.h> // strncasecmp()
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Cache.hpp"
+
+namespace mDNS
+{
+
+//
+// Service-level change events, derived from the cache, for consumers that
+// want to know what changed on the link rather than see every packet.
+//
+// Poll() builds a view of the cache in DNS-SD terms (RFC6763): instances,
+// found through PTR records of "_service._tcp|_udp.<domain>" names, with
+// the SRV and TXT records of each, and hosts with their A/AAAA records. This
+// is compared with the view from the previous call, as ShmExport does for
+// records, and the differences go to every subscriber as one batch:
+//
+//   added    : an instance appeared (first PTR to it)
+//   removed  : an instance went away (goodbye or expiry of its last PTR)
+//   updated  : an instance's SRV changed (host, port, priority or weight)
+//   txt      : an instance's TXT changed
+//   address  : a host's set of addresses changed (empty => host gone)
+//
+// Anything that comes and goes between two calls is never seen, and refreshes
+// of unchanged records produce nothing; the poll interval is the batching
+// interval. If no shard has been published since the last call and nothing
+// has expired, the cache isn't walked at all.
+//
+// Events can be encoded as JSON lines or as a compact binary format (see
+// Binary()). Call Poll() from one thread only.
+//
+struct EventFeed
+{
+	enum Kind { Added = 0, Removed, Updated, Txt, Address, NKinds };
+
+	inline static const char* KindNames[NKinds] = {
+		"added", "removed", "updated", "txt", "address"
+	};
+
+	struct Event {
+		Kind kind;
+		int64_t time_ms;               // wall clock (Unix epoch)
+		std::string name;              // instance, or host for Address
+		std::string service;           // e.g. "_ipp._tcp.local"; empty for Address
+		std::string host;              // from SRV, if known
+		uint16_t port = 0;             // ...
+		std::vector<char> txt;         // TXT RDATA, as on the wire
+		std::vector< std::vector<char> > addresses; // A/AAAA RDATA (4 or 16 bytes)
+	};
+
+	using Batch = std::vector<Event>;
+	using Callback = std::function<void(const Batch&)>;
+
+	struct Stats {
+		uint64_t polls = 0;
+		uint64_t skipped = 0; // polls with nothing to look at
+		uint64_t batches = 0; // non-empty batches delivered
+		uint64_t events = 0;
+		uint64_t kinds[NKinds] = {};
+	};
+
+	struct Instance {
+		std::string name, service;
+		bool has_srv = false;
+		std::vector<char> srv, txt; // lowest RDATA if several
+	};
+
+	struct Host {
+		std::string name;
+		std::vector< std::vector<char> > addresses; // sorted
+	};
+
+	struct View {
+		std::unordered_map<std::string, Instance> instances; // lower case name =>
+		std::unordered_map<std::string, Host> hosts;         // ...
+	};
+
+	View view;
+	uint64_t published = UINT64_MAX; // cache shard publishes at last walk
+	int64_t next_expiry_ms = 0;      // earliest expiry seen at last walk
+
+	std::mutex mutex;
+	std::vector< std::pair<int,Callback> > subscribers;
+	int next_id = 1;
+
+	Stats stats;
+
+	static int64_t UnixMillis()
+	{
+		using namespace std::chrono;
+		return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+	}
+
+	static std::string lower_(std::string s)
+	{
+		for (auto& c : s) c = tolower((unsigned char)c);
+		return s;
+	}
+
+	// Uncompressed name (from cached RDATA) as dotted text, no trailing dot.
+	static std::string name_(const char *bytes, size_t i, size_t len)
+	{
+		std::vector<std::string> labels;
+		std::string out;
+
+		if (DNS::Parse::labels(bytes, i, len, false, true, labels) == 0) return out;
+
+		for (const auto& l : labels) {
+			if (!out.empty()) out += '.';
+			out += l;
+		}
+		return out;
+	}
+
+	// Is this the name of a service type, i.e. "_service._tcp|_udp.<domain>"?
+	// Excludes "_services._dns-sd._udp.<domain>" and subtypes ("x._sub.y").
+	static bool service_type_(const std::string& name)
+	{
+		if ((name.size() < 2) || (name[0] != '_')) return false;
+
+		auto dot = name.find('.');
+		if (dot == std::string::npos) return false;
+
+		auto proto = name.c_str() + dot + 1;
+		return ((strncasecmp(proto, "_tcp.", 5) == 0) || (strncasecmp(proto, "_udp.", 5) == 0));
+	}
+
+	// DNS-SD view of what's in the cache now.
+	View build_(Cache::Reader& reader, int64_t now_ms)
+	{
+		View v;
+		std::unordered_map< std::string, std::vector<char> > srvs, txts; // lower case name => RDATA
+
+		next_expiry_ms = INT64_MAX;
+
+		reader.ForEach(now_ms, [&](const Cache::Entry& e) {
+			next_expiry_ms = std::min(next_expiry_ms, e.expires_ms);
+
+			switch (e.type) {
+				case DNS::Defs::PTR:
+				{
+					if (!service_type_(e.name)) return;
+
+					auto target = name_(e.rdata.data(), 0, e.rdata.size());
+					if (target.empty()) return;
+
+					auto& x = v.instances[lower_(target)];
+					if (x.name.empty()) {
+						x.name = target;
+						x.service = e.name;
+					}
+				}
+				break;
+
+				case DNS::Defs::SRV:
+				case DNS::Defs::TXT:
+				{
+					auto& m = (e.type == DNS::Defs::SRV) ? srvs : txts;
+					auto key = lower_(e.name);
+					auto it = m.find(key);
+					if (it == m.end()) m.emplace(key, e.rdata);
+					else if (e.rdata < it->second) it->second = e.rdata;
+				}
+				break;
+
+				case DNS::Defs::A:
+				case DNS::Defs::AAAA:
+				{
+					auto& h = v.hosts[lower_(e.name)];
+					if (h.name.empty()) h.name = e.name;
+					h.addresses.push_back(e.rdata);
+				}
+				break;
+			}
+		});
+
+		for (auto& x : v.instances) {
+			auto s = srvs.find(x.first);
+			if ((s != srvs.end()) && (s->second.size() > 6)) {
+				x.second.has_srv = true;
+				x.second.srv = s->second;
+			}
+
+			auto t = txts.find(x.first);
+			if (t != txts.end()) x.second.txt = t->second;
+		}
+
+		for (auto& h : v.hosts) {
+			auto& a = h.second.addresses;
+			std::sort(a.begin(), a.end());
+			a.erase(std::unique(a.begin(), a.end()), a.end());
+		}
+
+		return v;
+	}
+
+	static Event event_(Kind kind, int64_t time_ms, const Instance& x)
+	{
+		Event ev;
+		ev.kind = kind;
+		ev.time_ms = time_ms;
+		ev.name = x.name;
+		ev.service = x.service;
+
+		if ((kind != Removed) && x.has_srv) {
+			uint16_t port;
+			DNS::Parse::read(x.srv.data(), 4, x.srv.size(), port);
+			ev.port = port;
+			ev.host = name_(x.srv.data(), 6, x.srv.size());
+		}
+		if (kind != Removed) ev.txt = x.txt;
+
+		return ev;
+	}
+
+	// Compare cache with last view, deliver differences; returns number of
+	// events delivered.
+	size_t Poll(Cache& cache, int64_t now_ms)
+	{
+		stats.polls++;
+
+		auto p = cache.GetStats().published;
+		if ((p == published) && (now_ms < next_expiry_ms)) {
+			stats.skipped++;
+			return 0;
+		}
+		published = p;
+
+		Cache::Reader reader(cache);
+		auto v = build_(reader, now_ms);
+		auto t = UnixMillis();
+
+		Batch batch;
+
+		for (const auto& x : v.instances) {
+			auto it = view.instances.find(x.first);
+			if (it == view.instances.end()) {
+				batch.push_back( event_(Added, t, x.second) );
+				continue;
+			}
+
+			const auto& old = it->second;
+			if ((old.has_srv != x.second.has_srv) || (old.srv != x.second.srv)) {
+				batch.push_back( event_(Updated, t, x.second) );
+			}
+			if (old.txt != x.second.txt) {
+				batch.push_back( event_(Txt, t, x.second) );
+			}
+		}
+
+		for (const auto& x : view.instances) {
+			if (v.instances.count(x.first) == 0) batch.push_back( event_(Removed, t, x.second) );
+		}
+
+		auto address = [&batch, t](const Host& h, bool gone) {
+			Event ev;
+			ev.kind = Address;
+			ev.time_ms = t;
+			ev.name = h.name;
+			if (!gone) ev.addresses = h.addresses;
+			batch.push_back(std::move(ev));
+		};
+
+		for (const auto& h : v.hosts) {
+			auto it = view.hosts.find(h.first);
+			if ((it == view.hosts.end()) || (it->second.addresses != h.second.addresses)) address(h.second, false);
+		}
+
+		for (const auto& h : view.hosts) {
+			if (v.hosts.count(h.first) == 0) address(h.second, true);
+		}
+
+		view = std::move(v);
+
+		if (batch.empty()) return 0;
+
+		stats.batches++;
+		stats.events += batch.size();
+		for (const auto& ev : batch) stats.kinds[ev.kind]++;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& s : subscribers) s.second(batch);
+
+		return batch.size();
+	}
+
+	// Returns subscription id, for Unsubscribe().
+	int Subscribe(Callback fn)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		subscribers.push_back( {next_id, fn} );
+		return next_id++;
+	}
+
+	bool Unsubscribe(int id)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto it = std::find_if(subscribers.begin(), subscribers.end(),
+			[id](const std::pair<int,Callback>& s) { return s.first == id; });
+		if (it == subscribers.end()) return false;
+		subscribers.erase(it);
+		return true;
+	}
+
+	//
+	// Encodings
+	//
+
+	static void json_string_(std::string& out, const char *s, size_t len)
+	{
+		out += '"';
+		for (size_t i=0; i<len; i++) {
+			unsigned char c = s[i];
+			if ((c == '"') || (c == '\\')) {
+				out += '\\';
+				out += c;
+			}
+			else if (c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", c);
+				out += buf;
+			}
+			else {
+				out += c; // names and TXT are UTF-8 (RFC6763:4.1.3, 6.5)
+			}
+		}
+		out += '"';
+	}
+
+	// One JSON object per line, e.g.
+	// {"time":1700000000000,"event":"added","name":"X._ipp._tcp.local","service":"_ipp._tcp.local",
+	//  "host":"x.local","port":631,"txt":["rp=ipp/print"]}
+	// {"time":1700000000000,"event":"address","name":"x.local","addresses":["10.0.0.1"]}
+	static void Json(const Event& ev, std::string& out)
+	{
+		out += "{\"time\":" + std::to_string(ev.time_ms) + ",\"event\":\"" + KindNames[ev.kind] + "\",\"name\":";
+		json_string_(out, ev.name.data(), ev.name.size());
+
+		if (ev.kind == Address) {
+			out += ",\"addresses\":[";
+			for (size_t i=0; i<ev.addresses.size(); i++) {
+				const auto& a = ev.addresses[i];
+				char buf[INET6_ADDRSTRLEN] = "";
+				inet_ntop((a.size() == 4) ? AF_INET : AF_INET6, a.data(), buf, sizeof(buf));
+				out += (i > 0) ? ",\"" : "\"";
+				out += buf;
+				out += '"';
+			}
+			out += "]}\n";
+			return;
+		}
+
+		out += ",\"service\":";
+		json_string_(out, ev.service.data(), ev.service.size());
+
+		if (!ev.host.empty()) {
+			out += ",\"host\":";
+			json_string_(out, ev.host.data(), ev.host.size());
+			out += ",\"port\":" + std::to_string(ev.port);
+		}
+
+		if (ev.kind != Removed) {
+			out += ",\"txt\":[";
+			for (size_t i=0, n=0; i<ev.txt.size(); ) {
+				size_t len = (uint8_t)ev.txt[i++];
+				if (i+len > ev.txt.size()) break;
+				if (len == 0) continue; // empty string, e.g. a TXT with no keys
+				if (n++ > 0) out += ',';
+				json_string_(out, &ev.txt[i], len);
+				i += len;
+			}
+			out += ']';
+		}
+
+		out += "}\n";
+	}
+
+	// Compact binary, integers in network order:
+	//
+	//   u16 length of the rest of the event
+	//   u8 kind, i64 time_ms
+	//   u8 length + name, u8 length + service, u8 length + host, u16 port
+	//   u16 length + TXT RDATA
+	//   u8 count, then count x (u8 length (4 or 16) + address)
+	static void Binary(const Event& ev, std::vector<char>& out)
+	{
+		auto start = out.size();
+		DNS::Parse::append(out, (uint16_t)0);
+		DNS::Parse::append(out, (uint8_t)ev.kind);
+		DNS::Parse::append(out, (uint64_t)ev.time_ms);
+
+		auto str = [&out](const char *s, size_t len, bool wide) {
+			if (wide) DNS::Parse::append(out, (uint16_t)len);
+			else DNS::Parse::append(out, (uint8_t)len);
+			out.insert(out.end(), s, s+len);
+		};
+
+		str(ev.name.data(), std::min(ev.name.size(), (size_t)255), false);
+		str(ev.service.data(), std::min(ev.service.size(), (size_t)255), false);
+		str(ev.host.data(), std::min(ev.host.size(), (size_t)255), false);
+		DNS::Parse::append(out, ev.port);
+		str(ev.txt.data(), std::min(ev.txt.size(), (size_t)65535), true);
+
+		auto n = std::min(ev.addresses.size(), (size_t)255);
+		DNS::Parse::append(out, (uint8_t)n);
+		for (size_t i=0; i<n; i++) str(ev.addresses[i].data(), ev.addresses[i].size(), false);
+
+		uint16_t len = (uint16_t)std::min(out.size() - start - 2, (size_t)65535);
+		DNS::Parse::write(out.data(), start, out.size(), len);
+	}
+
+	Stats GetStats() const { return stats; }
+};
+
+}
+
+#endif
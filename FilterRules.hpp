@@ -0,0 +1,88 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_FILTERRULES)
+
+#define MDNS_FILTERRULES
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <stdint.h>
+#include <stdlib.h> // atoi()
+
+#include <string>
+#include <vector>
+
+#include "DNS.hpp"
+#include "RRTypes.hpp"
+
+namespace mDNS
+{
+
+//
+// What SocketFilter and Prefilter have in common: rule strings of
+// ':'-separated fields, starting with "q" (queries), "r" (responses) or
+// "*"/empty (either), with record types by name or number; and finding the
+// type of a datagram's first record without decoding it.
+//
+struct FilterRules
+{
+	// Split str at every sep; always at least one field.
+	static std::vector<std::string> Split(const std::string& str, char sep = ':')
+	{
+		std::vector<std::string> fields;
+		size_t start = 0;
+
+		while (true) {
+			auto end = str.find(sep, start);
+			fields.push_back(str.substr(start, end-start));
+			if (end == std::string::npos) break;
+			start = end + 1;
+		}
+
+		return fields;
+	}
+
+	// "q" => 0, "r" => 1, "*" or "" => -1 (either); false if none of those.
+	static bool ParseQR(const std::string& s, int& qr)
+	{
+		if (s == "q") qr = 0;
+		else if (s == "r") qr = 1;
+		else if (s.empty() || s == "*") qr = -1;
+		else return false;
+
+		return true;
+	}
+
+	// Name (e.g. "PTR", "TYPE65") or number => type; 0 if not recognised.
+	static uint16_t ParseType(const std::string& s)
+	{
+		uint16_t type = DNS::RRTypes::lookup(s.c_str());
+		if (type == 0) type = (uint16_t)atoi(s.c_str());
+		return type;
+	}
+
+	// Offset of the type of the first record: walks the name that follows the
+	// header, as a BPF program can. A label byte with either of the top bits
+	// set is taken as a compression pointer, ending the name. Returns 0 if the
+	// name or type runs out of datagram, or if the name isn't ended by one of
+	// its first max_labels label bytes.
+	static size_t FirstTypeOfs(const char* buf, size_t len, size_t max_labels = SIZE_MAX)
+	{
+		size_t i = DNS::Builder::HeaderSize;
+
+		for (size_t n=0; (n < max_labels) && (i < len); n++) {
+			uint8_t c = buf[i];
+			if (c == 0) return (i+1+2 <= len) ? i+1 : 0;
+			if (c & 0xC0) return (i+2+2 <= len) ? i+2 : 0;
+			i += c + 1;
+		}
+
+		return 0;
+	}
+};
+
+}
+
+#endif
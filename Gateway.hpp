@@ -0,0 +1,561 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_GATEWAY)
+
+#define MDNS_GATEWAY
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <csignal>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "SockUtil.hpp"
+#include "DNS.hpp"
+#include "DatagramSocket.hpp"
+#include "Cache.hpp"
+
+namespace mDNS
+{
+
+//
+// Unicast DNS front end for the record cache, in the spirit of an RFC8766
+// discovery proxy: tools that only speak ordinary DNS can resolve names under
+// the mDNS domain by asking us, over UDP or TCP, on a local address and port.
+//
+// Questions are answered from the cache when it has the records (or knows,
+// from a cached NSEC, that they don't exist). Otherwise we ask the link: a
+// one-shot multicast query goes out from our own ephemeral port, so responders
+// reply to us directly (RFC6762:6.7), and the replies are added to the cache.
+// The client gets its answer as soon as one arrives, or whatever the cache
+// has when the deadline passes.
+//
+// Answers are authoritative and carry the remaining TTL of the cached
+// records. Names outside the domain are REFUSED; a name with no records at
+// all after the deadline is NXDOMAIN. UDP responses are limited to 512 bytes,
+// or the client's EDNS payload size, and set TC if records were dropped;
+// clients then retry over TCP (RFC7766), which has no such limit.
+//
+// The multicast fallback is IPv4 only. Run() (or Poll(), from an existing
+// loop) handles everything in the calling thread.
+//
+struct Gateway
+{
+	struct Stats {
+		uint64_t queries = 0;   // client queries (UDP and TCP)
+		uint64_t tcp = 0;       // ... of which over TCP
+		uint64_t cached = 0;    // answered straight from the cache
+		uint64_t forwarded = 0; // sent to the link as multicast queries
+		uint64_t replies = 0;   // multicast replies received
+		uint64_t timeouts = 0;  // answered at the deadline
+		uint64_t refused = 0;   // outside our domain, or malformed (any error rcode)
+	};
+
+	struct Question {
+		std::string name;
+		uint16_t type;
+	};
+
+	// Client query waiting on the link
+	struct Pending {
+		uint16_t id = 0, flags = 0;
+		std::vector<Question> questions;
+		sockaddr_storage client = {};
+		int tcp_sd = -1;   // -1 => UDP
+		size_t max_size = DNS::EDNS::MinPayload;
+		bool edns = false;
+		int64_t deadline_ms = 0;
+	};
+
+	// TCP client; messages are prefixed by their 2-byte length (RFC1035:4.2.2),
+	// and may arrive or leave a piece at a time.
+	struct Client {
+		std::vector<char> in;  // received, not yet a complete message
+		std::vector<char> out; // responses not yet sent
+		int64_t active_ms = 0; // last progress either way
+	};
+
+	static constexpr size_t MaxTcpClients = 64;
+	static constexpr size_t MaxTcpOut = 1 << 16; // unsent bytes before we stop reading a client
+	static constexpr int TcpTimeout_ms = 2000;   // without progress, once a message has started
+
+	Cache& cache;
+	std::string domain = "local";
+	int64_t deadline_ms = 250;
+
+	int udp_sd = -1, tcp_sd = -1, mcast_sd = -1;
+	std::map<int, Client> clients; // by socket
+
+	sockaddr_storage mcast_dst;
+	std::map<uint16_t, Pending> pending; // multicast query ID => client query
+	uint16_t next_id = 1;
+
+	Stats stats;
+
+	Gateway(Cache& c) : cache(c) {}
+	~Gateway() { Close(); }
+
+	Gateway(const Gateway&) = delete;
+	Gateway& operator=(const Gateway&) = delete;
+
+	//
+	// Setup
+	//
+
+	// Listen on IP:port (UDP and TCP); multicast queries go out via the
+	// interface with address mcast_ifc_IP (IPv4), or the default if null.
+	bool Open(const char *IP, int port, const char *mcast_ifc_IP = nullptr)
+	{
+		const int on = 1;
+		sockaddr_storage ss;
+
+		Close();
+
+		int family = strchr(IP, ':') ? AF_INET6 : AF_INET;
+		socklen_t ss_len = (family == AF_INET6) ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+
+		if (!SockUtil::pack(&ss, family, IP, port)) {
+			WARN("Bad gateway address %s", IP);
+			return false;
+		}
+
+		udp_sd = socket(family, SOCK_DGRAM, 0);
+		tcp_sd = socket(family, SOCK_STREAM, 0);
+		if ((udp_sd < 0) || (tcp_sd < 0)) {
+			WARN("socket() failed");
+			Close();
+			return false;
+		}
+
+		setsockopt(tcp_sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+		if ((bind(udp_sd, (sockaddr *)&ss, ss_len) != 0) || (bind(tcp_sd, (sockaddr *)&ss, ss_len) != 0)) {
+			WARN("bind(%s,%d) failed", IP, port);
+			Close();
+			return false;
+		}
+
+		if (listen(tcp_sd, 16) != 0) {
+			WARN("listen(%s,%d) failed", IP, port);
+			Close();
+			return false;
+		}
+
+		// Multicast querier: ephemeral port => replies come straight back
+		mcast_sd = socket(PF_INET, SOCK_DGRAM, 0);
+		if (mcast_sd < 0) {
+			WARN("socket() failed");
+			Close();
+			return false;
+		}
+
+		if (mcast_ifc_IP) {
+			struct in_addr a;
+			if (inet_pton(AF_INET, mcast_ifc_IP, &a) == 1) {
+				setsockopt(mcast_sd, IPPROTO_IP, IP_MULTICAST_IF, &a, sizeof(a));
+			}
+		}
+		DatagramSocket::SetMulticastLoop(mcast_sd, AF_INET, true);
+
+		SockUtil::pack(&mcast_dst, AF_INET, "224.0.0.251", 5353);
+
+		return true;
+	}
+
+	void Close()
+	{
+		for (const auto& it : clients) close(it.first);
+		for (auto sd : { udp_sd, tcp_sd, mcast_sd }) if (sd >= 0) close(sd);
+
+		clients.clear();
+		pending.clear();
+		udp_sd = tcp_sd = mcast_sd = -1;
+	}
+
+	//
+	// Answering
+	//
+
+	bool in_domain_(const std::string& name) const
+	{
+		auto n = Cache::trim_(name);
+		if (n.size() < domain.size()) return false;
+		if (strncasecmp(n.data() + n.size() - domain.size(), domain.c_str(), domain.size()) != 0) return false;
+		return (n.size() == domain.size()) || (n[n.size()-domain.size()-1] == '.');
+	}
+
+	// Build the response to p into out. If miss_ok is set and the cache can't
+	// answer every question, returns false instead (and out is unused).
+	bool answer_(const Pending& p, int64_t now_ms, std::vector<char>& out, bool miss_ok)
+	{
+		Cache::Reader reader(cache);
+
+		uint16_t flags = DNS::Defs::QRMask | DNS::Defs::AAMask | (p.flags & DNS::Defs::RDMask);
+		bool unknown = false, any_known = false;
+
+		// Resolve first; the response is only built if we're answering now
+		std::vector< std::vector<Cache::Entry> > found(p.questions.size());
+
+		for (size_t k=0; k<p.questions.size(); k++) {
+			const auto& q = p.questions[k];
+
+			reader.Find(q.name, q.type, now_ms, found[k]);
+			if (!found[k].empty() || reader.Absent(q.name, q.type, now_ms)) {
+				any_known = true;
+				continue;
+			}
+
+			// Other types of record for the name don't rule this one out, as
+			// names may be shared; but they do mean it isn't NXDOMAIN.
+			unknown = true;
+			if (reader.Lookup(q.name, DNS::Defs::ANY, now_ms, [](const Cache::Entry&) {}) > 0) {
+				any_known = true;
+			}
+		}
+
+		if (unknown && miss_ok) return false;
+
+		uint16_t rcode = any_known ? DNS::Defs::NOERROR : DNS::Defs::NXDOMAIN;
+		size_t limit = p.max_size - (p.edns ? DNS::EDNS::RecordSize : 0);
+		DNS::Builder b(out, p.id, flags | rcode, limit);
+
+		for (const auto& q : p.questions) b.question(q.name, q.type);
+
+		bool full = false;
+		for (const auto& entries : found) {
+			for (const auto& e : entries) {
+				auto TTL = (uint32_t)((e.expires_ms - now_ms + 999) / 1000);
+				full = !b.record(b.Answer, e.name, e.type, e.clss, TTL, e.rdata);
+				if (full) break;
+			}
+			if (full) break;
+		}
+		if (full) b.set_flags(flags | rcode | DNS::Defs::TCMask);
+
+		if (p.edns) b.opt(DNS::EDNS::MaxPayload);
+
+		return true;
+	}
+
+	// Parse client query in q[0..len) into p; returns rcode (NOERROR => ok).
+	static uint16_t parse_(const char *q, size_t len, Pending& p)
+	{
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+
+		size_t i = msg.read_header(q, 0, len);
+		if (i == 0) return DNS::Defs::FORMERR;
+
+		p.id = msg.id;
+		p.flags = msg.flags;
+
+		if (msg.flags & DNS::Defs::QRMask) return DNS::Defs::FORMERR;
+		if (((msg.flags & DNS::Defs::OpMask) >> 11) != DNS::Defs::QUERY) return DNS::Defs::NOTIMP;
+		if (msg.n_question == 0) return DNS::Defs::FORMERR;
+
+		for (int n=0; n<msg.n_question; n++) {
+			i = rr.read_header(q, i, len, tmp);
+			if (i == 0) return DNS::Defs::FORMERR;
+			p.questions.push_back( {rr.name, rr.type} );
+		}
+
+		DNS::EDNS edns;
+		p.edns = edns.read(q, len);
+		if (p.edns && (p.max_size < 0xffff)) p.max_size = edns.udp_size;
+
+		return DNS::Defs::NOERROR;
+	}
+
+	void send_(const Pending& p, const std::vector<char>& out)
+	{
+		if (p.tcp_sd < 0) {
+			socklen_t len = (p.client.ss_family == AF_INET6) ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+			sendto(udp_sd, out.data(), out.size(), 0, (sockaddr *)&p.client, len);
+			return;
+		}
+
+		// Whatever the socket doesn't take now goes when it's writable; if the
+		// client has gone, Poll() finds out and drops it.
+		auto it = clients.find(p.tcp_sd);
+		if (it == clients.end()) return;
+
+		auto& c = it->second;
+		DNS::Parse::append(c.out, (uint16_t)out.size());
+		c.out.insert(c.out.end(), out.begin(), out.end());
+		flush_(p.tcp_sd, c);
+	}
+
+	// Header-only error response
+	void error_(const Pending& p, uint16_t rcode)
+	{
+		std::vector<char> out;
+		DNS::Builder b(out, p.id, DNS::Defs::QRMask | (p.flags & DNS::Defs::RDMask) | rcode);
+		send_(p, out);
+		stats.refused++;
+	}
+
+	void query_(const char *q, size_t len, Pending& p, int64_t now_ms)
+	{
+		std::vector<char> out;
+
+		stats.queries++;
+
+		auto rcode = parse_(q, len, p);
+		for (const auto& x : p.questions) {
+			if (!in_domain_(x.name)) rcode = DNS::Defs::REFUSED;
+		}
+		if (rcode != DNS::Defs::NOERROR) {
+			error_(p, rcode);
+			return;
+		}
+
+		if (answer_(p, now_ms, out, true)) {
+			stats.cached++;
+			send_(p, out);
+			return;
+		}
+
+		// Ask the link, under our own ID
+		uint16_t id = next_id++;
+		if (next_id == 0) next_id = 1;
+
+		DNS::Builder b(out, id, 0, DNS::EDNS::MaxPayload);
+		for (const auto& x : p.questions) b.question(x.name, x.type);
+
+		sendto(mcast_sd, out.data(), out.size(), 0, (sockaddr *)&mcast_dst, sizeof(sockaddr_in));
+		stats.forwarded++;
+
+		p.deadline_ms = now_ms + deadline_ms;
+		pending[id] = std::move(p);
+	}
+
+	//
+	// Socket handling
+	//
+
+	void read_udp_(int64_t now_ms)
+	{
+		char buf[4096];
+		Pending p;
+		socklen_t len = sizeof(p.client);
+
+		auto N = recvfrom(udp_sd, buf, sizeof(buf), 0, (sockaddr *)&p.client, &len);
+		if (N <= 0) return;
+
+		query_(buf, N, p, now_ms);
+	}
+
+	void read_mcast_(int64_t now_ms)
+	{
+		std::vector<char> buf(DNS::EDNS::MaxPayload + 1024), out;
+
+		auto N = recv(mcast_sd, buf.data(), buf.size(), 0);
+		if (N < 12) return;
+
+		stats.replies++;
+		cache.Update(buf.data(), N, now_ms);
+
+		uint16_t id = 0;
+		DNS::Parse::read(buf.data(), 0, N, id);
+
+		auto it = pending.find(id);
+		if (it == pending.end()) return;
+
+		// Several responders may answer; the first one that leaves the
+		// cache able to answer everything completes the query.
+		if (answer_(it->second, now_ms, out, true)) {
+			send_(it->second, out);
+			pending.erase(it);
+		}
+	}
+
+	// Non-blocking socket call failed only for want of data or space?
+	static bool again_()
+	{
+		return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+	}
+
+	// Send as much of c.out as the socket takes now; false on error.
+	static bool flush_(int sd, Client& c)
+	{
+		size_t done = 0;
+
+		while (done < c.out.size()) {
+			auto k = send(sd, c.out.data()+done, c.out.size()-done, MSG_NOSIGNAL);
+			if (k < 0) {
+				if (again_()) break;
+				return false;
+			}
+			done += k;
+		}
+
+		c.out.erase(c.out.begin(), c.out.begin()+done);
+		return true;
+	}
+
+	// Append what the client has sent, and handle every message now complete;
+	// never blocks. Returns false if the connection should be closed.
+	bool read_tcp_(int sd, Client& c, int64_t now_ms)
+	{
+		char buf[4096];
+
+		auto k = recv(sd, buf, sizeof(buf), 0);
+		if (k == 0) return false;
+		if (k < 0) return again_();
+
+		c.in.insert(c.in.end(), buf, buf+k);
+		c.active_ms = now_ms;
+
+		size_t i = 0;
+		while (c.in.size() - i >= 2) {
+			size_t len = ((uint8_t)c.in[i] << 8) | (uint8_t)c.in[i+1];
+			if (c.in.size() - i < 2 + len) break;
+
+			Pending p;
+			p.tcp_sd = sd;
+			p.max_size = 0xffff;
+
+			stats.tcp++;
+			query_(&c.in[i+2], len, p, now_ms);
+			i += 2 + len;
+		}
+		c.in.erase(c.in.begin(), c.in.begin()+i);
+
+		return true;
+	}
+
+	void accept_()
+	{
+		int sd = accept(tcp_sd, nullptr, nullptr);
+		if (sd < 0) return;
+
+		if (clients.size() >= MaxTcpClients) {
+			close(sd);
+			return;
+		}
+
+		// Non-blocking, so a slow client can't stall the loop
+		const int on = 1;
+		fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		clients[sd].active_ms = Cache::Now();
+	}
+
+	void drop_client_(int sd)
+	{
+		for (auto it = pending.begin(); it != pending.end(); ) {
+			if (it->second.tcp_sd == sd) it = pending.erase(it);
+			else ++it;
+		}
+		clients.erase(sd);
+		close(sd);
+	}
+
+	// Has c stalled part-way through a message, either way?
+	static bool stalled_(const Client& c, int64_t now_ms)
+	{
+		return (!c.in.empty() || !c.out.empty()) && (now_ms - c.active_ms > TcpTimeout_ms);
+	}
+
+	// Answer anything past its deadline with what the cache has.
+	void expire_(int64_t now_ms)
+	{
+		std::vector<char> out;
+
+		for (auto it = pending.begin(); it != pending.end(); ) {
+			if (it->second.deadline_ms > now_ms) {
+				++it;
+				continue;
+			}
+			answer_(it->second, now_ms, out, false);
+			send_(it->second, out);
+			stats.timeouts++;
+			it = pending.erase(it);
+		}
+	}
+
+	// Wait up to timeout_ms for activity, and handle it.
+	void Poll(int timeout_ms)
+	{
+		if (udp_sd < 0) return;
+
+		fd_set fds, wfds;
+		int max_sd = std::max({ udp_sd, tcp_sd, mcast_sd });
+
+		FD_ZERO(&fds);
+		FD_ZERO(&wfds);
+		FD_SET(udp_sd, &fds);
+		FD_SET(tcp_sd, &fds);
+		FD_SET(mcast_sd, &fds);
+
+		// Clients we're still sending to wait until they've read some of it
+		for (const auto& it : clients) {
+			if (it.second.out.size() < MaxTcpOut) FD_SET(it.first, &fds);
+			if (!it.second.out.empty()) FD_SET(it.first, &wfds);
+			max_sd = std::max(max_sd, it.first);
+		}
+
+		// Don't sleep past the earliest deadline, or a stalled client's timeout
+		auto now_ms = Cache::Now();
+		for (const auto& it : pending) {
+			auto dt = it.second.deadline_ms - now_ms;
+			if (dt < timeout_ms) timeout_ms = (dt > 0) ? (int)dt : 0;
+		}
+		for (const auto& it : clients) {
+			if (it.second.in.empty() && it.second.out.empty()) continue;
+			auto dt = it.second.active_ms + TcpTimeout_ms + 1 - now_ms;
+			if (dt < timeout_ms) timeout_ms = (dt > 0) ? (int)dt : 0;
+		}
+
+		struct timeval tv = { timeout_ms/1000, (timeout_ms%1000)*1000 };
+		int n = select(max_sd+1, &fds, &wfds, nullptr, &tv);
+
+		now_ms = Cache::Now();
+
+		if (n > 0) {
+			if (FD_ISSET(udp_sd, &fds)) read_udp_(now_ms);
+			if (FD_ISSET(mcast_sd, &fds)) read_mcast_(now_ms);
+			if (FD_ISSET(tcp_sd, &fds)) accept_();
+		}
+
+		std::vector<int> dropped;
+		for (auto& it : clients) {
+			int sd = it.first;
+			auto& c = it.second;
+			bool ok = true;
+
+			if ((n > 0) && FD_ISSET(sd, &wfds)) {
+				auto before = c.out.size();
+				ok = flush_(sd, c);
+				if (c.out.size() < before) c.active_ms = now_ms;
+			}
+			if (ok && (n > 0) && FD_ISSET(sd, &fds)) ok = read_tcp_(sd, c, now_ms);
+			if (!ok || stalled_(c, now_ms)) dropped.push_back(sd);
+		}
+		for (auto sd : dropped) drop_client_(sd);
+
+		expire_(Cache::Now());
+	}
+
+	void Run(volatile std::sig_atomic_t& status, int timeout_ms = 100)
+	{
+		while (status == 0) Poll(timeout_ms);
+	}
+
+	Stats GetStats() const { return stats; }
+};
+
+}
+
+#endif
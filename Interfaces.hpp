@@ -10,6 +10,8 @@
 
 #include <ifaddrs.h> // getifaddrs(), freeifaddrs()
 #include <net/if.h>  // IFF_<x>, if_nametoindex(), if_indextoname()
+#include <sys/ioctl.h> // SIOCGIFMTU
+#include <unistd.h>    // close()
 
 #include <vector>
 
@@ -62,6 +64,39 @@ struct Interfaces
 		return if_nametoindex(name);
 	}
 
+	static constexpr int DefaultMTU = 1500;
+	static constexpr int JumboMTU = 9000; // largest mDNS packet; RFC6762:17
+
+	// Link MTU, or 0 if it can't be determined.
+	static int GetMTU(const char *name)
+	{
+		struct ifreq ifr;
+
+		if (!name || (strlen(name) >= sizeof(ifr.ifr_name))) return 0;
+
+		int sd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sd < 0) return 0;
+
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, name);
+		int result = ioctl(sd, SIOCGIFMTU, &ifr);
+		close(sd);
+
+		return (result == 0) ? ifr.ifr_mtu : 0;
+	}
+
+	// Largest DNS message that leaves the interface in one unfragmented
+	// packet: the link MTU (at most a jumbo frame) less IP and UDP headers.
+	static size_t MaxPayload(const char *name, int family)
+	{
+		int mtu = GetMTU(name);
+		if (mtu <= 0) mtu = DefaultMTU;
+		if (mtu > JumboMTU) mtu = JumboMTU;
+
+		size_t headers = ((family == AF_INET6) ? 40 : 20) + 8;
+		return ((size_t)mtu > headers+512) ? mtu - headers : 512;
+	}
+
 	static bool IsLoopback(const ifaddrs * ifa)
 	{
 		if (ifa == nullptr) return false;
@@ -158,7 +193,7 @@ struct Interfaces
 		char buf[INET6_ADDRSTRLEN];
 		auto len = sizeof(buf);
 
-		printf("%s [%d]\n", ifc.name.c_str(), ifc.index);
+		printf("%s [%d] mtu %d\n", ifc.name.c_str(), ifc.index, GetMTU(ifc.name.c_str()));
 
 		for (const auto ifa : ifc.addresses) {
 
@@ -0,0 +1,429 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_PACKETCAPTURE)
+
+#define MDNS_PACKETCAPTURE
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <net/if.h>  // if_nametoindex()
+#include <net/if_arp.h> // ARPHRD_LOOPBACK
+#include <poll.h>
+#include <sys/mman.h>
+
+#if __linux__
+	#include <linux/if_ether.h>
+	#include <linux/if_packet.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "DatagramSocket.hpp"
+#include "SocketFilter.hpp"
+
+namespace mDNS
+{
+
+//
+// Passive capture of mDNS traffic from the link layer: an AF_PACKET socket
+// with a TPACKET_V3 receive ring, which the kernel fills with whole frames
+// in blocks that are handed to us (and back) by a status word in each block
+// header. Unlike a UDP socket, this sees every UDP/5353 frame the interface
+// does, whether or not it's for a group we joined or an address we have,
+// e.g. on a switch mirror port (use promisc, so frames for other MACs aren't
+// dropped by the NIC).
+//
+// A classic BPF program drops everything but UDP to or from port 5353 in the
+// kernel; frames are parsed again here (Ethernet, optional 802.1Q tags, IPv4
+// or IPv6 with extension headers, UDP), in case the filter couldn't be
+// attached. IP fragments can't be reassembled and are counted and skipped.
+//
+// Next() returns the UDP payload where it lies in the ring (valid until the
+// next call), with Meta filled in as DatagramSocket::Read() would: source
+// address and port, destination address, interface index, and the kernel's
+// receive time (CLOCK_REALTIME). Read() copies it out instead, and Wait()
+// stands in for select(). One thread per capture. Linux only.
+//
+// To try it on a veth pair in a network namespace:
+//
+//   ip netns add mdns-test
+//   ip link add veth0 type veth peer name veth1
+//   ip link set veth1 netns mdns-test
+//   ip addr add 10.9.0.1/24 dev veth0 && ip link set veth0 up
+//   ip -n mdns-test addr add 10.9.0.2/24 dev veth1
+//   ip -n mdns-test link set veth1 up
+//   ip -n mdns-test route add 224.0.0.0/4 dev veth1
+//   ./a.out --capture=veth0 --quiet &
+//   ip netns exec mdns-test ./loadgen veth1
+//
+struct PacketCapture
+{
+	using Meta = DatagramSocket::Meta;
+
+	struct Stats {
+		uint64_t frames = 0;    // handed to us by the kernel
+		uint64_t datagrams = 0; // mDNS payloads returned
+		uint64_t skipped = 0;   // not UDP/5353, or malformed
+		uint64_t fragments = 0; // IP fragments (not reassembled)
+		uint64_t drops = 0;     // kernel: ring full
+	};
+
+	static constexpr uint16_t Port = 5353;
+
+	int sd = -1;
+	int ifc_idx = 0;
+
+	char *ring = nullptr;
+	size_t block_size = 0, n_blocks = 0;
+
+	size_t block_idx = 0;      // current block
+	uint32_t frames_left = 0;  // ... frames still to read in it
+	char *frame = nullptr;     // ... next of them
+	bool held = false;         // current block is ours (not yet returned)
+
+	Stats stats;
+	std::atomic<uint64_t> drops{0};
+
+	PacketCapture() {}
+	~PacketCapture() { Close(); }
+
+	PacketCapture(const PacketCapture&) = delete;
+	PacketCapture& operator=(const PacketCapture&) = delete;
+
+	// Equivalent to "udp port 5353" in tcpdump, for Ethernet frames
+	static std::vector<sock_filter> Filter(uint16_t port = Port)
+	{
+		return {
+			{ BPF_LD  | BPF_H   | BPF_ABS, 0,  0, 12 },            // ethertype
+			{ BPF_JMP | BPF_JEQ | BPF_K,   0,  6, 0x86dd },
+			{ BPF_LD  | BPF_B   | BPF_ABS, 0,  0, 20 },            // IPv6 next header
+			{ BPF_JMP | BPF_JEQ | BPF_K,   0, 15, 17 },
+			{ BPF_LD  | BPF_H   | BPF_ABS, 0,  0, 54 },            // UDP source port
+			{ BPF_JMP | BPF_JEQ | BPF_K,  12,  0, port },
+			{ BPF_LD  | BPF_H   | BPF_ABS, 0,  0, 56 },            // UDP dest port
+			{ BPF_JMP | BPF_JEQ | BPF_K,  10, 11, port },
+			{ BPF_JMP | BPF_JEQ | BPF_K,   0, 10, 0x0800 },
+			{ BPF_LD  | BPF_B   | BPF_ABS, 0,  0, 23 },            // IPv4 protocol
+			{ BPF_JMP | BPF_JEQ | BPF_K,   0,  8, 17 },
+			{ BPF_LD  | BPF_H   | BPF_ABS, 0,  0, 20 },            // fragment offset
+			{ BPF_JMP | BPF_JSET | BPF_K,  6,  0, 0x1fff },
+			{ BPF_LDX | BPF_B   | BPF_MSH, 0,  0, 14 },            // IP header length
+			{ BPF_LD  | BPF_H   | BPF_IND, 0,  0, 14 },            // UDP source port
+			{ BPF_JMP | BPF_JEQ | BPF_K,   2,  0, port },
+			{ BPF_LD  | BPF_H   | BPF_IND, 0,  0, 16 },            // UDP dest port
+			{ BPF_JMP | BPF_JEQ | BPF_K,   0,  1, port },
+			{ BPF_RET | BPF_K,             0,  0, 0x40000 },       // accept
+			{ BPF_RET | BPF_K,             0,  0, 0 },             // drop
+		};
+	}
+
+	// Capture on the named interface; block_size must be a multiple of the
+	// page size, and a block is handed over when full or after block_ms.
+	bool Open(const char *device, bool promisc = false,
+		size_t block_size_ = 1<<20, size_t n_blocks_ = 8, int block_ms = 10)
+	{
+		#if __linux__
+			Close();
+
+			ifc_idx = if_nametoindex(device);
+			if (ifc_idx == 0) {
+				WARN("Unknown interface '%s'", device);
+				return false;
+			}
+
+			sd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+			if (sd < 0) {
+				WARN("socket(AF_PACKET); needs CAP_NET_RAW");
+				return false;
+			}
+
+			// Filter first, so nothing else gets into the ring
+			if (!SocketFilter::Attach(sd, Filter())) {
+				WARN("Unable to attach capture filter; filtering in userspace");
+			}
+
+			int version = TPACKET_V3;
+			if (setsockopt(sd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+				WARN("setsockopt(PACKET_VERSION,TPACKET_V3)");
+				Close();
+				return false;
+			}
+
+			block_size = block_size_;
+			n_blocks = n_blocks_;
+
+			struct tpacket_req3 req;
+			memset(&req, 0, sizeof(req));
+			req.tp_block_size = block_size;
+			req.tp_block_nr = n_blocks;
+			req.tp_frame_size = TPACKET_ALIGNMENT << 7; // only a hint for V3
+			req.tp_frame_nr = (block_size * n_blocks) / req.tp_frame_size;
+			req.tp_retire_blk_tov = block_ms;
+			req.tp_feature_req_word = 0;
+
+			if (setsockopt(sd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+				WARN("setsockopt(PACKET_RX_RING)");
+				Close();
+				return false;
+			}
+
+			ring = (char *)mmap(nullptr, block_size*n_blocks, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, sd, 0);
+			if (ring == MAP_FAILED) {
+				ring = (char *)mmap(nullptr, block_size*n_blocks, PROT_READ|PROT_WRITE, MAP_SHARED, sd, 0);
+			}
+			if (ring == MAP_FAILED) {
+				ring = nullptr;
+				WARN("mmap(PACKET_RX_RING)");
+				Close();
+				return false;
+			}
+
+			struct sockaddr_ll ll;
+			memset(&ll, 0, sizeof(ll));
+			ll.sll_family = AF_PACKET;
+			ll.sll_protocol = htons(ETH_P_ALL);
+			ll.sll_ifindex = ifc_idx;
+			if (bind(sd, (struct sockaddr *)&ll, sizeof(ll)) < 0) {
+				WARN("bind(AF_PACKET,%s)", device);
+				Close();
+				return false;
+			}
+
+			if (promisc) {
+				struct packet_mreq mr;
+				memset(&mr, 0, sizeof(mr));
+				mr.mr_ifindex = ifc_idx;
+				mr.mr_type = PACKET_MR_PROMISC;
+				if (setsockopt(sd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr, sizeof(mr)) < 0) {
+					WARN("setsockopt(PACKET_MR_PROMISC,%s)", device);
+				}
+			}
+
+			block_idx = 0;
+			frames_left = 0;
+			held = false;
+
+			return true;
+		#else
+			(void)device; (void)promisc; (void)block_size_; (void)n_blocks_; (void)block_ms;
+			WARN("Link layer capture is only supported on Linux");
+			return false;
+		#endif
+	}
+
+	void Close()
+	{
+		if (ring) munmap(ring, block_size*n_blocks);
+		if (sd >= 0) close(sd);
+		ring = nullptr;
+		sd = -1;
+	}
+
+	#if __linux__
+
+	tpacket_block_desc* block_(size_t i) { return (tpacket_block_desc *)(ring + i*block_size); }
+
+	bool user_owns_(size_t i)
+	{
+		return __atomic_load_n(&block_(i)->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER;
+	}
+
+	// Hand current block back to the kernel, and move on
+	void release_()
+	{
+		__atomic_store_n(&block_(block_idx)->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+		block_idx = (block_idx + 1) % n_blocks;
+		held = false;
+	}
+
+	#endif
+
+	// Wait up to timeout_ms for a frame; as select().
+	int Wait(int timeout_ms)
+	{
+		#if __linux__
+			if (sd < 0) return -1;
+			if ((held && (frames_left > 0)) || (!held && user_owns_(block_idx))) return 1;
+			if (held) release_(); // finished with it
+			if (user_owns_(block_idx)) return 1;
+		#endif
+
+		struct pollfd pfd = { sd, POLLIN|POLLERR, 0 };
+		int r = poll(&pfd, 1, timeout_ms);
+		if ((r < 0) && (errno == EINTR)) {
+			errno = 0;
+			return 0;
+		}
+		return r;
+	}
+
+	// Next mDNS payload, if any: data points into the ring, valid until the
+	// next call to Next(), Wait() or Read(). Returns its length, or -1 if
+	// nothing is waiting.
+	int Next(const char*& data, Meta& meta)
+	{
+		#if __linux__
+			if (sd < 0) return -1;
+
+			while (true) {
+				if (held && (frames_left == 0)) release_();
+
+				if (!held) {
+					if (!user_owns_(block_idx)) return -1;
+					auto b = block_(block_idx);
+					held = true;
+					frames_left = b->hdr.bh1.num_pkts;
+					frame = (char *)b + b->hdr.bh1.offset_to_first_pkt;
+					continue;
+				}
+
+				auto h = (tpacket3_hdr *)frame;
+				frame += h->tp_next_offset;
+				frames_left--;
+				stats.frames++;
+
+				auto ll = (sockaddr_ll *)((char *)h + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+
+				// Loopback shows each frame twice: going out, and coming in
+				if ((ll->sll_pkttype == PACKET_OUTGOING) && (ll->sll_hatype == ARPHRD_LOOPBACK)) {
+					stats.skipped++;
+					continue;
+				}
+
+				int n = parse_((char *)h + h->tp_mac, h->tp_snaplen, ll->sll_ifindex, data, meta);
+				if (n < 0) {
+					stats.skipped++;
+					continue;
+				}
+
+				meta.rx_time.tv_sec = h->tp_sec;
+				meta.rx_time.tv_nsec = h->tp_nsec;
+
+				stats.datagrams++;
+				return n;
+			}
+		#else
+			(void)data; (void)meta;
+			return -1;
+		#endif
+	}
+
+	// As DatagramSocket::Read(): blocks until a payload arrives, and copies
+	// it (truncated to len) into buf.
+	int Read(void *buf, size_t len, Meta& meta)
+	{
+		if (!buf || (len<1) || (sd < 0)) return -1;
+
+		const char *data;
+		while (true) {
+			int n = Next(data, meta);
+			if (n >= 0) {
+				size_t N = std::min((size_t)n, len);
+				memcpy(buf, data, N);
+				return (int)N;
+			}
+			if (Wait(-1) < 0) return -1;
+		}
+	}
+
+	// Ethernet / IP / UDP headers => payload & Meta; returns payload length,
+	// or -1 if not a UDP/Port datagram.
+	int parse_(const char *p, size_t len, int ifindex, const char*& data, Meta& meta)
+	{
+		auto u8 = [p](size_t i) { return (uint8_t)p[i]; };
+		auto u16 = [p](size_t i) { return (uint16_t)(((uint8_t)p[i] << 8) | (uint8_t)p[i+1]); };
+
+		memset(&meta.src, 0, sizeof(meta.src));
+		memset(&meta.dst, 0, sizeof(meta.dst));
+		meta.ifc_idx = ifindex;
+
+		// Ethernet, skipping any VLAN tags
+		size_t i = 12;
+		if (len < i+2) return -1;
+		uint16_t ethertype = u16(i);
+		while ((ethertype == 0x8100) || (ethertype == 0x88a8)) {
+			i += 4;
+			if (len < i+2) return -1;
+			ethertype = u16(i);
+		}
+		i += 2;
+
+		size_t udp = 0, end = len;
+
+		if (ethertype == 0x0800) {
+			if (len < i+20) return -1;
+			size_t ihl = 4 * (u8(i) & 0xf);
+			if (((u8(i) >> 4) != 4) || (ihl < 20) || (len < i+ihl)) return -1;
+			if (u8(i+9) != 17) return -1;
+			if (u16(i+6) & 0x3fff) { stats.fragments++; return -1; } // MF set, or offset
+			end = std::min(len, i + u16(i+2));
+
+			auto src = (sockaddr_in *)&meta.src, dst = (sockaddr_in *)&meta.dst;
+			src->sin_family = dst->sin_family = AF_INET;
+			memcpy(&src->sin_addr, p+i+12, 4);
+			memcpy(&dst->sin_addr, p+i+16, 4);
+			udp = i + ihl;
+		}
+		else if (ethertype == 0x86dd) {
+			if (len < i+40) return -1;
+			if ((u8(i) >> 4) != 6) return -1;
+			end = std::min(len, i + 40 + u16(i+4));
+
+			auto src = (sockaddr_in6 *)&meta.src, dst = (sockaddr_in6 *)&meta.dst;
+			src->sin6_family = dst->sin6_family = AF_INET6;
+			memcpy(&src->sin6_addr, p+i+8, 16);
+			memcpy(&dst->sin6_addr, p+i+24, 16);
+			if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr)) src->sin6_scope_id = ifindex;
+
+			// Extension headers: hop-by-hop, routing, destination options
+			uint8_t next = u8(i+6);
+			udp = i + 40;
+			while ((next == 0) || (next == 43) || (next == 60)) {
+				if (end < udp+2) return -1;
+				next = u8(udp);
+				udp += 8 * (1 + u8(udp+1));
+			}
+			if (next == 44) { stats.fragments++; return -1; }
+			if (next != 17) return -1;
+		}
+		else {
+			return -1;
+		}
+
+		if (end < udp+8) return -1;
+
+		uint16_t sport = u16(udp), dport = u16(udp+2), ulen = u16(udp+4);
+		if ((sport != Port) && (dport != Port)) return -1;
+		if ((ulen < 8) || (udp + ulen > end)) return -1;
+
+		if (meta.src.ss_family == AF_INET) ((sockaddr_in *)&meta.src)->sin_port = htons(sport);
+		else ((sockaddr_in6 *)&meta.src)->sin6_port = htons(sport);
+
+		data = p + udp + 8;
+		return ulen - 8;
+	}
+
+	// Kernel drop count is read (and reset) here, so call from one thread.
+	Stats GetStats()
+	{
+		#if __linux__
+			if (sd >= 0) {
+				struct tpacket_stats_v3 st;
+				socklen_t n = sizeof(st);
+				if (getsockopt(sd, SOL_PACKET, PACKET_STATISTICS, &st, &n) == 0) drops += st.tp_drops;
+			}
+		#endif
+
+		Stats st = stats;
+		st.drops = drops;
+		return st;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,259 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_PCAP)
+
+#define MDNS_PCAP
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "DatagramSocket.hpp"
+
+namespace mDNS
+{
+
+//
+// Classic pcap files (not pcapng), Ethernet link type, so recordings can be
+// looked at with the usual tools and captures from them fed back in.
+//
+// Datagrams received through a socket have no link or IP headers, so the
+// writer makes them up from Meta: destination MAC derived from a multicast
+// destination address (else zero), source MAC zero, TTL / hop limit 255,
+// and checksums filled in (UDP over IPv4 left at zero, which means "none").
+// Timestamps have nanosecond resolution.
+//
+// The reader handles either resolution and byte order, and calls back with
+// each frame; PacketCapture::parse_() turns those into payload and Meta.
+//
+struct Pcap
+{
+	struct FileHeader {
+		uint32_t magic;
+		uint16_t version_major, version_minor;
+		int32_t thiszone;
+		uint32_t sigfigs, snaplen, linktype;
+	};
+
+	struct RecordHeader {
+		uint32_t sec, frac, caplen, len;
+	};
+
+	static constexpr uint32_t MagicMicros = 0xa1b2c3d4;
+	static constexpr uint32_t MagicNanos = 0xa1b23c4d;
+	static constexpr uint32_t LinkEthernet = 1;
+	static constexpr uint32_t SnapLen = 65535;
+	static constexpr uint16_t Port = 5353;
+
+	FILE *f = nullptr;
+	std::vector<char> frame;
+
+	Pcap() {}
+	~Pcap() { Close(); }
+
+	Pcap(const Pcap&) = delete;
+	Pcap& operator=(const Pcap&) = delete;
+
+	bool Open(const std::string& path)
+	{
+		Close();
+
+		f = fopen(path.c_str(), "wb");
+		if (!f) {
+			WARN("Unable to create '%s'", path.c_str());
+			return false;
+		}
+
+		FileHeader h = { MagicNanos, 2, 4, 0, 0, SnapLen, LinkEthernet };
+		return fwrite(&h, sizeof(h), 1, f) == 1;
+	}
+
+	void Close()
+	{
+		if (f) fclose(f);
+		f = nullptr;
+	}
+
+	bool Write(int64_t time_ns, const DatagramSocket::Meta& meta, const char *payload, size_t len)
+	{
+		if (!f) return false;
+
+		Build(frame, meta, payload, len);
+
+		RecordHeader r;
+		r.sec = (uint32_t)(time_ns / 1000000000LL);
+		r.frac = (uint32_t)(time_ns % 1000000000LL);
+		r.caplen = r.len = (uint32_t)frame.size();
+
+		return (fwrite(&r, sizeof(r), 1, f) == 1) && (fwrite(frame.data(), frame.size(), 1, f) == 1);
+	}
+
+	static uint32_t sum_(const uint8_t *p, size_t n, uint32_t sum = 0)
+	{
+		for (size_t i=0; i+1<n; i+=2) sum += (p[i] << 8) | p[i+1];
+		if (n & 1) sum += p[n-1] << 8;
+		return sum;
+	}
+
+	static uint16_t fold_(uint32_t sum)
+	{
+		while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+		return (uint16_t)~sum;
+	}
+
+	// Ethernet / IP / UDP frame around payload, from Meta
+	static void Build(std::vector<char>& out, const DatagramSocket::Meta& meta, const char *payload, size_t len)
+	{
+		bool v6 = (meta.src.ss_family == AF_INET6);
+		size_t ip_len = v6 ? 40 : 20;
+
+		out.assign(14 + ip_len + 8 + len, 0);
+		auto p = (uint8_t *)out.data();
+
+		auto put16 = [p](size_t i, uint16_t x) { p[i] = x >> 8; p[i+1] = x & 0xff; };
+
+		uint16_t sport, dport;
+		const uint8_t *src, *dst;
+
+		if (v6) {
+			auto s = (const sockaddr_in6 *)&meta.src, d = (const sockaddr_in6 *)&meta.dst;
+			sport = ntohs(s->sin6_port);
+			dport = ntohs(d->sin6_port);
+			src = (const uint8_t *)&s->sin6_addr;
+			dst = (const uint8_t *)&d->sin6_addr;
+		}
+		else {
+			auto s = (const sockaddr_in *)&meta.src, d = (const sockaddr_in *)&meta.dst;
+			sport = ntohs(s->sin_port);
+			dport = ntohs(d->sin_port);
+			src = (const uint8_t *)&s->sin_addr;
+			dst = (const uint8_t *)&d->sin_addr;
+		}
+		if (dport == 0) dport = Port;
+
+		// Ethernet
+		if (v6 && (dst[0] == 0xff)) {
+			p[0] = p[1] = 0x33;
+			memcpy(p+2, dst+12, 4);
+		}
+		else if (!v6 && ((dst[0] & 0xf0) == 0xe0)) {
+			p[0] = 0x01; p[1] = 0x00; p[2] = 0x5e;
+			p[3] = dst[1] & 0x7f; p[4] = dst[2]; p[5] = dst[3];
+		}
+		put16(12, v6 ? 0x86dd : 0x0800);
+
+		// IP
+		size_t i = 14, u = i + ip_len;
+		uint16_t udp_len = (uint16_t)(8 + len);
+
+		if (v6) {
+			p[i] = 0x60;
+			put16(i+4, udp_len);
+			p[i+6] = 17;
+			p[i+7] = 255;
+			memcpy(p+i+8, src, 16);
+			memcpy(p+i+24, dst, 16);
+		}
+		else {
+			p[i] = 0x45;
+			put16(i+2, (uint16_t)(ip_len + udp_len));
+			p[i+8] = 255;
+			p[i+9] = 17;
+			memcpy(p+i+12, src, 4);
+			memcpy(p+i+16, dst, 4);
+			put16(i+10, fold_(sum_(p+i, 20)));
+		}
+
+		// UDP
+		put16(u, sport);
+		put16(u+2, dport);
+		put16(u+4, udp_len);
+		memcpy(p+u+8, payload, len);
+
+		if (v6) {
+			uint32_t sum = sum_(src, 16) + sum_(dst, 16) + udp_len + 17;
+			uint16_t c = fold_(sum_(p+u, udp_len, sum));
+			put16(u+6, c ? c : 0xffff);
+		}
+	}
+
+	// Calls fn(int64_t time_ns, const char *frame, size_t len) for each frame
+	// in the file; returns number of frames, or -1 if unreadable.
+	template <typename F>
+	static long ReadFile(const std::string& path, F fn)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			WARN("Unable to open '%s'", path.c_str());
+			return -1;
+		}
+
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(FileHeader))) {
+			close(fd);
+			return -1;
+		}
+
+		size_t size = st.st_size;
+		void *m = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (m == MAP_FAILED) return -1;
+
+		auto base = (const char *)m;
+
+		FileHeader h;
+		memcpy(&h, base, sizeof(h));
+
+		bool swap = false, nanos = false;
+		if ((h.magic == MagicMicros) || (h.magic == MagicNanos)) nanos = (h.magic == MagicNanos);
+		else if ((h.magic == __builtin_bswap32(MagicMicros)) || (h.magic == __builtin_bswap32(MagicNanos))) {
+			swap = true;
+			nanos = (h.magic == __builtin_bswap32(MagicNanos));
+		}
+		else {
+			WARN("'%s' is not a pcap file", path.c_str());
+			munmap(m, size);
+			return -1;
+		}
+
+		auto u32 = [swap](uint32_t x) { return swap ? __builtin_bswap32(x) : x; };
+
+		if (u32(h.linktype) != LinkEthernet) {
+			WARN("'%s' has link type %u; only Ethernet supported", path.c_str(), u32(h.linktype));
+			munmap(m, size);
+			return -1;
+		}
+
+		long n = 0;
+		size_t ofs = sizeof(FileHeader);
+		while (ofs + sizeof(RecordHeader) <= size) {
+			RecordHeader r;
+			memcpy(&r, base + ofs, sizeof(r));
+			ofs += sizeof(r);
+
+			size_t caplen = u32(r.caplen);
+			if (ofs + caplen > size) break;
+
+			int64_t t = (int64_t)u32(r.sec)*1000000000LL + (int64_t)u32(r.frac)*(nanos ? 1 : 1000);
+			fn(t, base + ofs, caplen);
+
+			ofs += caplen;
+			n++;
+		}
+
+		munmap(m, size);
+		return n;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_PREFILTER)
+
+#define MDNS_PREFILTER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "DNS.hpp"
+#include "FilterRules.hpp"
+
+namespace mDNS
+{
+
+//
+// Cheap accept/reject decision from the 12-byte header and (optionally) the
+// type of the first record, made before any record is decoded. Under a flood
+// most datagrams are of no interest, and rejecting them here costs a few
+// loads and compares instead of a walk through every section.
+//
+// Checks, in order; the first failure is counted as the reason:
+//
+//   Short  : fewer than 12 bytes
+//   QR     : query or response, if the policy wants only one of them
+//   Opcode : non-zero opcode (RFC6762:18.3 says ignore these)
+//   Rcode  : non-zero rcode (RFC6762:18.11 likewise)
+//   Counts : no records at all, or more than could fit in the datagram (each
+//            question takes at least 5 bytes, each other record 11)
+//   Type   : type of the first question (or first answer, if no questions)
+//            not in the policy's list; only checked if the list is non-empty
+//
+// Unlike SocketFilter this runs in userspace on every listener thread, and
+// keeps per-reason counts; Accept() is safe to call from several threads.
+//
+struct Prefilter
+{
+	enum Reason { Short = 0, QR, Opcode, Rcode, Counts, Type, NReasons };
+
+	inline static const char* ReasonNames[NReasons] = {
+		"short", "qr", "opcode", "rcode", "counts", "type"
+	};
+
+	struct Policy {
+		int qr = -1;                 // -1 = either, 0 = queries only, 1 = responses only
+		bool any_opcode = false;     // accept non-zero opcodes
+		bool any_rcode = false;      // accept non-zero rcodes
+		std::vector<uint16_t> types; // first record types to accept; empty = any
+	};
+
+	struct Stats {
+		uint64_t seen = 0;
+		uint64_t skipped = 0;
+		uint64_t reasons[NReasons] = {};
+	};
+
+	Policy policy;
+
+	std::atomic<uint64_t> seen{0};
+	std::atomic<uint64_t> reasons[NReasons] = {};
+
+	static constexpr size_t MinQuestion = 5; // root name, type, class
+	static constexpr size_t MinRecord = 11;  // ... plus TTL, rdata length
+
+	// Returns the reason to reject, or -1 to accept.
+	static int Check(const Policy& policy, const char* buf, size_t len)
+	{
+		auto u16 = [buf](size_t i) { return (uint16_t)(((uint8_t)buf[i] << 8) | (uint8_t)buf[i+1]); };
+
+		if (len < DNS::Builder::HeaderSize) return Short;
+
+		uint16_t flags = u16(2);
+
+		if (policy.qr >= 0) {
+			int qr = (flags & DNS::Defs::QRMask) ? 1 : 0;
+			if (qr != policy.qr) return QR;
+		}
+		if (!policy.any_opcode && (flags & DNS::Defs::OpMask)) return Opcode;
+		if (!policy.any_rcode && (flags & DNS::Defs::RcMask)) return Rcode;
+
+		size_t n_q = u16(4), n_rr = (size_t)u16(6) + u16(8) + u16(10);
+		if ((n_q + n_rr == 0) || (DNS::Builder::HeaderSize + MinQuestion*n_q + MinRecord*n_rr > len)) {
+			return Counts;
+		}
+
+		if (policy.types.empty()) return -1;
+
+		// Type follows the first name; not Parse::skip_labels(), as that
+		// complains about malformed names, and floods may be full of them.
+		size_t i = FilterRules::FirstTypeOfs(buf, len);
+		if (i == 0) return Counts;
+
+		uint16_t type = u16(i);
+		for (auto t : policy.types) {
+			if (t == type) return -1;
+		}
+		return Type;
+	}
+
+	bool Accept(const char* buf, size_t len)
+	{
+		seen.fetch_add(1, std::memory_order_relaxed);
+
+		int r = Check(policy, buf, len);
+		if (r < 0) return true;
+
+		reasons[r].fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	Stats GetStats() const
+	{
+		Stats st;
+		st.seen = seen;
+		for (int r=0; r<NReasons; r++) {
+			st.reasons[r] = reasons[r];
+			st.skipped += st.reasons[r];
+		}
+		return st;
+	}
+
+	// Parse policy from string: [q|r|*][:TYPE[,TYPE...]][:any-opcode][:any-rcode],
+	// e.g. "r:PTR,SRV". Returns false on error.
+	static bool ParsePolicy(const char *str, Policy& p)
+	{
+		auto fields = FilterRules::Split(str);
+
+		p = Policy();
+
+		if (!FilterRules::ParseQR(fields[0], p.qr)) return false;
+
+		for (size_t f=1; f<fields.size(); f++) {
+			const auto& x = fields[f];
+
+			if (x == "any-opcode") p.any_opcode = true;
+			else if (x == "any-rcode") p.any_rcode = true;
+			else if (x.empty() || x == "*") continue;
+			else {
+				for (const auto& name : FilterRules::Split(x, ',')) {
+					uint16_t type = FilterRules::ParseType(name);
+					if (type == 0) return false;
+					p.types.push_back(type);
+				}
+			}
+		}
+
+		return true;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,630 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_RRTYPES)
+
+#define MDNS_RRTYPES
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <arpa/inet.h> // inet_ntop(), inet_pton()
+#include <strings.h>   // strcasecmp()
+
+#include <array>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "DNS.hpp"
+
+namespace mDNS
+{
+
+namespace DNS
+{
+
+//
+// Resource record type registry.
+//
+// Each type declares its name and RDATA layout as a sequence of fields in
+// RRTraits<type>; the codec functions for that type (decode, format, encode,
+// compare) are generated from the layout by RR<type>, and RRTypes::info()
+// finds them via a dense table built at compile time. Types not registered
+// are handled as opaque bytes (RFC3597).
+//
+// Forms of RDATA:
+//
+//   wire      : as received; names may be compressed, so the whole message
+//               is needed to read them.
+//   canonical : names uncompressed, so independent of any message. This is
+//               what decode() produces, and what encode() and compare() use.
+//   text      : presentation format, as for zone files (RFC1035:5.1), e.g.
+//               "0 0 631 host.local." for SRV; "\# <len> <hex>" is accepted
+//               for any type (RFC3597:5).
+//
+
+enum class Field : uint8_t {
+	U8, U16, U32,
+	Name,       // domain name
+	IPv4, IPv6,
+	String,     // <character-string>: length byte, then bytes
+	Strings,    // <character-string>s, to end of RDATA
+	TypeBitmap, // NSEC type bit maps, to end of RDATA; RFC4034:4.1.2
+	Options,    // EDNS0 {code,length,data} options, to end of RDATA; RFC6891:6.1.2
+	Bytes,      // opaque, to end of RDATA
+};
+
+template <uint16_t Type> struct RRTraits {
+	static constexpr const char* name = nullptr; // unregistered
+	static constexpr Field fields[] = { Field::Bytes };
+};
+
+#define RR_(T, ...) \
+	template <> struct RRTraits<Defs::T> { \
+		static constexpr const char* name = #T; \
+		static constexpr Field fields[] = { __VA_ARGS__ }; \
+	};
+
+	RR_(A,     Field::IPv4)
+	RR_(NS,    Field::Name)
+	RR_(CNAME, Field::Name)
+	RR_(SOA,   Field::Name, Field::Name, Field::U32, Field::U32, Field::U32, Field::U32, Field::U32)
+	RR_(NUL,   Field::Bytes)
+	RR_(WKS,   Field::IPv4, Field::U8, Field::Bytes)
+	RR_(PTR,   Field::Name)
+	RR_(HINFO, Field::String, Field::String)
+	RR_(MINFO, Field::Name, Field::Name)
+	RR_(MX,    Field::U16, Field::Name)
+	RR_(TXT,   Field::Strings)
+	RR_(AAAA,  Field::IPv6)
+	RR_(SRV,   Field::U16, Field::U16, Field::U16, Field::Name)
+	RR_(OPT,   Field::Options)
+	RR_(NSEC,  Field::Name, Field::TypeBitmap)
+
+#undef RR_
+
+//
+// Layout-driven implementations, shared by all types.
+//
+struct RRCodec
+{
+	// Wire (at msg[ofs..ofs+len)) => canonical. False if malformed.
+	static bool decode(const Field* fields, size_t n_fields,
+		const char* msg, size_t msg_len, size_t ofs, size_t len, std::vector<char>& out)
+	{
+		size_t i = ofs, end = ofs + len;
+
+		out.clear();
+
+		if (end > msg_len) return false;
+
+		for (size_t f=0; f<n_fields; f++) {
+			size_t n = 0;
+
+			switch (fields[f]) {
+				case Field::U8:   n = 1; break;
+				case Field::U16:  n = 2; break;
+				case Field::U32:  n = 4; break;
+				case Field::IPv4: n = 4; break;
+				case Field::IPv6: n = 16; break;
+
+				case Field::String:
+					if (i >= end) return false;
+					n = 1 + (uint8_t)msg[i];
+				break;
+
+				case Field::Name:
+				{
+					Parse::Span spans[128];
+					size_t n_spans;
+
+					auto next = Parse::spans(msg, i, msg_len, spans, 128, n_spans);
+					if ((next == 0) || (next > end)) return false;
+
+					for (size_t k=0; k<n_spans; k++) {
+						out.push_back((char)spans[k].len);
+						out.insert(out.end(), &msg[spans[k].ofs], &msg[spans[k].ofs]+spans[k].len);
+					}
+					out.push_back(0);
+
+					i = next;
+					continue;
+				}
+
+				case Field::Strings:
+				case Field::TypeBitmap:
+				case Field::Options:
+				case Field::Bytes:
+					if (!valid_rest_(fields[f], &msg[i], end-i)) return false;
+					n = end - i;
+				break;
+			}
+
+			if (i+n > end) return false;
+			out.insert(out.end(), &msg[i], &msg[i]+n);
+			i += n;
+		}
+
+		return (i == end);
+	}
+
+	// Wire => text.
+	static bool format(const Field* fields, size_t n_fields,
+		const char* msg, size_t msg_len, size_t ofs, size_t len, std::string& out)
+	{
+		size_t i = ofs, end = ofs + len;
+		char b[INET6_ADDRSTRLEN];
+
+		out.clear();
+
+		if (end > msg_len) return false;
+
+		for (size_t f=0; f<n_fields; f++) {
+			if (!out.empty()) out += ' ';
+
+			switch (fields[f]) {
+				case Field::U8:
+				case Field::U16:
+				case Field::U32:
+				{
+					size_t n = (fields[f] == Field::U8) ? 1 : (fields[f] == Field::U16) ? 2 : 4;
+					uint32_t v = 0;
+					if (i+n > end) return false;
+					for (size_t k=0; k<n; k++) v = (v << 8) | (uint8_t)msg[i+k];
+					out += std::to_string(v);
+					i += n;
+				}
+				break;
+
+				case Field::IPv4:
+				case Field::IPv6:
+				{
+					bool v4 = (fields[f] == Field::IPv4);
+					if (i + (v4 ? 4 : 16) > end) return false;
+					out += inet_ntop(v4 ? AF_INET : AF_INET6, &msg[i], b, sizeof(b));
+					i += v4 ? 4 : 16;
+				}
+				break;
+
+				case Field::Name:
+				{
+					Parse::Span spans[128];
+					size_t n_spans;
+
+					auto next = Parse::spans(msg, i, msg_len, spans, 128, n_spans);
+					if ((next == 0) || (next > end)) return false;
+
+					for (size_t k=0; k<n_spans; k++) {
+						out.append(&msg[spans[k].ofs], spans[k].len);
+						out += '.';
+					}
+					if (n_spans == 0) out += '.';
+
+					i = next;
+				}
+				break;
+
+				case Field::String:
+				case Field::Strings:
+					for (size_t k=0; (fields[f] == Field::String) ? (k == 0) : (i < end); k++) {
+						if (i >= end) return false;
+						uint8_t n = msg[i];
+						if (i+1+n > end) return false;
+						if (k > 0) out += ' ';
+						quote_(&msg[i+1], n, out);
+						i += 1+n;
+					}
+				break;
+
+				case Field::TypeBitmap:
+					if (!valid_rest_(Field::TypeBitmap, &msg[i], end-i)) return false;
+					while (i < end) {
+						uint8_t window = msg[i], n = msg[i+1];
+						for (size_t k=0; k<8u*n; k++) {
+							if (!(msg[i+2+k/8] & (0x80 >> (k%8)))) continue;
+							if (out.size() && out.back() != ' ') out += ' ';
+							out += type_text_((uint16_t)(window*256 + k));
+						}
+						i += 2+n;
+					}
+				break;
+
+				case Field::Options:
+					if (!valid_rest_(Field::Options, &msg[i], end-i)) return false;
+					while (i < end) {
+						uint16_t code = ((uint8_t)msg[i] << 8) | (uint8_t)msg[i+1];
+						uint16_t n = ((uint8_t)msg[i+2] << 8) | (uint8_t)msg[i+3];
+						if (out.size() && out.back() != ' ') out += ' ';
+						out += "option" + std::to_string(code) + ":";
+						hex_(&msg[i+4], n, out);
+						i += 4+n;
+					}
+				break;
+
+				case Field::Bytes:
+					out += "\\# " + std::to_string(end-i) + (end > i ? " " : "");
+					hex_(&msg[i], end-i, out);
+					i = end;
+				break;
+			}
+		}
+
+		if (!out.empty() && out.back() == ' ') out.pop_back();
+
+		return (i == end);
+	}
+
+	// Text => canonical. False if the text doesn't fit the layout.
+	static bool encode(const Field* fields, size_t n_fields, const std::string& text, std::vector<char>& out)
+	{
+		std::vector<std::string> tok;
+		size_t t = 0;
+
+		out.clear();
+
+		if (!tokenize_(text, tok)) return false;
+
+		// Generic form, for any type
+		if ((tok.size() >= 2) && (tok[0] == "\\#")) {
+			size_t n = atoi(tok[1].c_str());
+			std::string hex;
+			for (size_t k=2; k<tok.size(); k++) hex += tok[k];
+			if (hex.size() != 2*n) return false;
+			for (size_t k=0; k<n; k++) {
+				out.push_back((char)strtol(hex.substr(2*k,2).c_str(), nullptr, 16));
+			}
+			return true;
+		}
+
+		for (size_t f=0; f<n_fields; f++) {
+			switch (fields[f]) {
+				case Field::U8:
+				case Field::U16:
+				case Field::U32:
+				{
+					if (t >= tok.size()) return false;
+					size_t n = (fields[f] == Field::U8) ? 1 : (fields[f] == Field::U16) ? 2 : 4;
+					uint32_t v = (uint32_t)strtoul(tok[t++].c_str(), nullptr, 10);
+					for (size_t k=n; k-- > 0; ) out.push_back((char)(v >> (8*k)));
+				}
+				break;
+
+				case Field::IPv4:
+				case Field::IPv6:
+				{
+					if (t >= tok.size()) return false;
+					bool v4 = (fields[f] == Field::IPv4);
+					unsigned char b[16];
+					if (inet_pton(v4 ? AF_INET : AF_INET6, tok[t++].c_str(), b) != 1) return false;
+					out.insert(out.end(), b, b + (v4 ? 4 : 16));
+				}
+				break;
+
+				case Field::Name:
+					if (t >= tok.size()) return false;
+					if (!Builder::name(out, tok[t++])) return false;
+				break;
+
+				case Field::String:
+				case Field::Strings:
+					do {
+						if (t >= tok.size()) return (fields[f] == Field::Strings);
+						if (tok[t].size() > 255) return false;
+						out.push_back((char)tok[t].size());
+						out.insert(out.end(), tok[t].begin(), tok[t].end());
+						t++;
+					} while ((fields[f] == Field::Strings) && (t < tok.size()));
+				break;
+
+				case Field::TypeBitmap:
+				{
+					uint8_t bits[256][32] = {};
+					int max_byte[256];
+					for (auto& m : max_byte) m = -1;
+
+					for (; t < tok.size(); t++) {
+						uint16_t type = type_from_text_(tok[t].c_str());
+						if (type == 0) return false;
+						uint8_t w = type >> 8, k = type & 0xff;
+						bits[w][k/8] |= 0x80 >> (k%8);
+						if (k/8 > max_byte[w]) max_byte[w] = k/8;
+					}
+					for (int w=0; w<256; w++) {
+						if (max_byte[w] < 0) continue;
+						out.push_back((char)w);
+						out.push_back((char)(max_byte[w]+1));
+						out.insert(out.end(), (char*)bits[w], (char*)bits[w] + max_byte[w]+1);
+					}
+				}
+				break;
+
+				case Field::Options:
+				case Field::Bytes:
+					return false; // generic form only
+			}
+		}
+
+		return (t == tok.size());
+	}
+
+	// Order of canonical RDATA: as unsigned byte strings, with names in
+	// lower case (RFC4034:6.2-6.3; RFC6762:8.2 uses the same order).
+	static int compare(const Field* fields, size_t n_fields,
+		const char* a, size_t a_len, const char* b, size_t b_len)
+	{
+		std::string x, y;
+
+		if (!lower_names_(fields, n_fields, a, a_len, x)) x.assign(a, a_len);
+		if (!lower_names_(fields, n_fields, b, b_len, y)) y.assign(b, b_len);
+
+		auto n = std::min(x.size(), y.size());
+		int c = memcmp(x.data(), y.data(), n);
+		if (c != 0) return (c < 0) ? -1 : 1;
+		return (x.size() < y.size()) ? -1 : (x.size() > y.size()) ? 1 : 0;
+	}
+
+	//
+	// Helpers
+	//
+
+	static bool valid_rest_(Field f, const char* p, size_t n)
+	{
+		size_t i = 0;
+
+		switch (f) {
+			case Field::Strings:
+				while (i < n) i += 1 + (uint8_t)p[i];
+			break;
+
+			case Field::TypeBitmap:
+				while (i < n) {
+					if (i+2 > n) return false;
+					uint8_t len = p[i+1];
+					if ((len < 1) || (len > 32)) return false;
+					i += 2 + len;
+				}
+			break;
+
+			case Field::Options:
+				while (i < n) {
+					if (i+4 > n) return false;
+					i += 4 + (((uint8_t)p[i+2] << 8) | (uint8_t)p[i+3]);
+				}
+			break;
+
+			default:
+				i = n;
+			break;
+		}
+
+		return (i == n);
+	}
+
+	static void quote_(const char* p, size_t n, std::string& out)
+	{
+		char b[8];
+		out += '"';
+		for (size_t k=0; k<n; k++) {
+			unsigned char c = p[k];
+			if ((c == '"') || (c == '\\')) {
+				out += '\\';
+				out += (char)c;
+			}
+			else if ((c < 0x20) || (c > 0x7e)) {
+				snprintf(b, sizeof(b), "\\%03d", c);
+				out += b;
+			}
+			else {
+				out += (char)c;
+			}
+		}
+		out += '"';
+	}
+
+	static void hex_(const char* p, size_t n, std::string& out)
+	{
+		const char* digits = "0123456789abcdef";
+		for (size_t k=0; k<n; k++) {
+			out += digits[((uint8_t)p[k]) >> 4];
+			out += digits[((uint8_t)p[k]) & 15];
+		}
+	}
+
+	// Whitespace-separated tokens; "..." may contain spaces, \" and \DDD.
+	static bool tokenize_(const std::string& s, std::vector<std::string>& tok)
+	{
+		size_t i = 0, n = s.size();
+
+		while (i < n) {
+			if (isspace((unsigned char)s[i])) {
+				i++;
+				continue;
+			}
+
+			std::string t;
+			if (s[i] == '"') {
+				for (i++; (i < n) && (s[i] != '"'); i++) {
+					if ((s[i] == '\\') && (i+1 < n)) {
+						if (isdigit((unsigned char)s[i+1]) && (i+3 < n)) {
+							t += (char)atoi(s.substr(i+1,3).c_str());
+							i += 3;
+						}
+						else {
+							t += s[++i];
+						}
+					}
+					else {
+						t += s[i];
+					}
+				}
+				if (i >= n) return false; // unterminated
+				i++;
+			}
+			else {
+				while ((i < n) && !isspace((unsigned char)s[i])) t += s[i++];
+			}
+			tok.push_back(t);
+		}
+
+		return true;
+	}
+
+	// Canonical RDATA with name labels in lower case.
+	static bool lower_names_(const Field* fields, size_t n_fields, const char* p, size_t len, std::string& out)
+	{
+		size_t i = 0;
+
+		out.assign(p, len);
+
+		for (size_t f=0; f<n_fields; f++) {
+			switch (fields[f]) {
+				case Field::U8:   i += 1; break;
+				case Field::U16:  i += 2; break;
+				case Field::U32:  i += 4; break;
+				case Field::IPv4: i += 4; break;
+				case Field::IPv6: i += 16; break;
+
+				case Field::String:
+					if (i >= len) return false;
+					i += 1 + (uint8_t)p[i];
+				break;
+
+				case Field::Name:
+					while ((i < len) && (p[i] != 0)) {
+						uint8_t n = p[i];
+						if (n & 0xc0) return false; // not canonical
+						for (size_t k=i+1; (k <= i+n) && (k < len); k++) out[k] = tolower((unsigned char)out[k]);
+						i += 1 + n;
+					}
+					i++;
+				break;
+
+				default:
+					i = len;
+				break;
+			}
+		}
+
+		return (i == len);
+	}
+
+	static std::string type_text_(uint16_t type);
+	static uint16_t type_from_text_(const char* s);
+};
+
+// Per-type codec, generated from the type's layout.
+template <uint16_t Type>
+struct RR
+{
+	using Traits = RRTraits<Type>;
+	static constexpr size_t n_fields = std::size(Traits::fields);
+
+	static bool decode(const char* msg, size_t msg_len, size_t ofs, size_t len, std::vector<char>& out)
+	{
+		return RRCodec::decode(Traits::fields, n_fields, msg, msg_len, ofs, len, out);
+	}
+
+	static bool format(const char* msg, size_t msg_len, size_t ofs, size_t len, std::string& out)
+	{
+		return RRCodec::format(Traits::fields, n_fields, msg, msg_len, ofs, len, out);
+	}
+
+	static bool encode(const std::string& text, std::vector<char>& out)
+	{
+		return RRCodec::encode(Traits::fields, n_fields, text, out);
+	}
+
+	static int compare(const char* a, size_t a_len, const char* b, size_t b_len)
+	{
+		return RRCodec::compare(Traits::fields, n_fields, a, a_len, b, b_len);
+	}
+};
+
+struct RRTypeInfo
+{
+	uint16_t type;
+	const char* name; // nullptr => unregistered
+	const Field* fields;
+	size_t n_fields;
+
+	bool (*decode)(const char* msg, size_t msg_len, size_t ofs, size_t len, std::vector<char>& out);
+	bool (*format)(const char* msg, size_t msg_len, size_t ofs, size_t len, std::string& out);
+	bool (*encode)(const std::string& text, std::vector<char>& out);
+	int (*compare)(const char* a, size_t a_len, const char* b, size_t b_len);
+
+	// Does the layout include a name (i.e. can the wire form be compressed)?
+	constexpr bool has_name() const
+	{
+		for (size_t f=0; f<n_fields; f++) if (fields[f] == Field::Name) return true;
+		return false;
+	}
+};
+
+template <uint16_t Type>
+constexpr RRTypeInfo make_rr_type_info()
+{
+	using R = RR<Type>;
+	return { Type, RRTraits<Type>::name, RRTraits<Type>::fields, R::n_fields,
+		&R::decode, &R::format, &R::encode, &R::compare };
+}
+
+// Dense table of registered types (all < 256 at present); unused entries
+// are the opaque "unknown" type.
+template <uint16_t... Types>
+constexpr std::array<RRTypeInfo,256> make_rr_type_table()
+{
+	std::array<RRTypeInfo,256> t{};
+	for (size_t k=0; k<t.size(); k++) t[k] = make_rr_type_info<0>();
+	((t[Types] = make_rr_type_info<Types>()), ...);
+	return t;
+}
+
+struct RRTypes
+{
+	// Built at compile time; add new types here as well as in RRTraits.
+	static constexpr std::array<RRTypeInfo,256> table = make_rr_type_table<
+		Defs::A, Defs::NS, Defs::CNAME, Defs::SOA, Defs::NUL, Defs::WKS,
+		Defs::PTR, Defs::HINFO, Defs::MINFO, Defs::MX, Defs::TXT, Defs::AAAA,
+		Defs::SRV, Defs::OPT, Defs::NSEC>();
+
+	static constexpr RRTypeInfo unknown = make_rr_type_info<0>();
+
+	static constexpr const RRTypeInfo& info(uint16_t type)
+	{
+		return (type < table.size()) ? table[type] : unknown;
+	}
+
+	// nullptr if not registered. ANY is only ever a question type
+	// (RFC1035:3.2.3), so it has a name but no RDATA layout.
+	static constexpr const char* name(uint16_t type)
+	{
+		return (type == Defs::ANY) ? "ANY" : info(type).name;
+	}
+
+	// Registered name, else "TYPEnnn" (RFC3597:5)
+	static std::string text(uint16_t type)
+	{
+		auto n = name(type);
+		return n ? std::string(n) : "TYPE" + std::to_string(type);
+	}
+
+	// Case-insensitive name or "TYPEnnn" => type; 0 if not recognised.
+	static uint16_t lookup(const char* s)
+	{
+		for (uint16_t t=0; t<table.size(); t++) {
+			if (name(t) && (strcasecmp(name(t), s) == 0)) return t;
+		}
+		if (strncasecmp(s, "TYPE", 4) == 0) return (uint16_t)atoi(s+4);
+		return 0;
+	}
+};
+
+inline std::string RRCodec::type_text_(uint16_t type) { return RRTypes::text(type); }
+inline uint16_t RRCodec::type_from_text_(const char* s) { return RRTypes::lookup(s); }
+
+}
+
+}
+
+#endif
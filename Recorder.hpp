@@ -0,0 +1,498 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_RECORDER)
+
+#define MDNS_RECORDER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DatagramSocket.hpp"
+
+namespace mDNS
+{
+
+//
+// Flight recorder: every datagram received, with its metadata, appended to a
+// log of fixed-size memory-mapped segment files, for post-mortems. Files are
+// shared mappings, so what was written survives the process crashing.
+//
+// Record() is safe from any number of threads, and never waits on I/O: space
+// in the current segment is claimed with an atomic add, and the frame copied
+// straight into the mapping. A background thread keeps the next segment
+// created and mapped in advance; when the current one fills, it's swapped in
+// (a brief lock, once per segment) and the old one is trimmed to its used
+// length and closed once its last writer is done. If the spare isn't ready
+// in time, frames are dropped and counted rather than waited for. The oldest
+// segments are deleted beyond max_segments.
+//
+// Format, version 1, native byte order; files are <dir>/mdns-<seq>.rec:
+//
+//   SegmentHeader : magic "MDNSREC1", version, seq, created_ns (Unix)
+//   Frame *       : 56-byte header (below), then payload, padded to 8 bytes
+//
+// A frame's len is stored last, so a reader stops at the first zero len: the
+// end of the segment, or a frame whose writer never finished.
+//
+struct Recorder
+{
+	struct SegmentHeader {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t header_size;
+		uint64_t seq;
+		int64_t created_ns; // Unix epoch
+	};
+
+	struct Frame {
+		uint32_t len;          // whole frame incl. padding; 0 = end
+		uint16_t payload_len;
+		uint8_t family;        // 4 or 6
+		uint8_t reserved;
+		int64_t time_ns;       // Unix epoch; kernel receive time if known
+		uint32_t ifc_idx;
+		uint16_t src_port, dst_port; // host order; dst_port 0 if unknown
+		uint8_t src[16], dst[16];    // IPv4 in the first 4 bytes
+	};
+
+	struct Stats {
+		uint64_t frames = 0;
+		uint64_t bytes = 0;    // including framing
+		uint64_t dropped = 0;  // no space (spare segment not ready)
+		uint64_t segments = 0; // created
+	};
+
+	static constexpr uint64_t Magic = 0x3143455253444e4dULL; // "MDNSREC1"
+	static constexpr uint32_t Version = 1;
+	static constexpr size_t Align = 8;
+
+	struct Segment {
+		uint64_t seq = 0;
+		std::string path;
+		int fd = -1;
+		char *base = nullptr;
+		size_t size = 0;
+		std::atomic<size_t> next{0};  // offset of next frame to claim
+		std::atomic<int> writers{0};  // Record() calls in progress
+	};
+
+	std::string dir;
+	size_t segment_size = 0;
+	size_t max_segments = 0;
+
+	// Segments are never freed before Close(), so a writer that lost a race
+	// with a swap can still look at one safely (the mapping may be gone).
+	std::vector< std::unique_ptr<Segment> > segments;
+	std::vector<Segment*> retired; // swapped out, awaiting writers
+	std::atomic<Segment*> current{nullptr};
+	Segment *spare = nullptr;
+	uint64_t next_seq = 0;
+
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::thread maintainer;
+	bool stopping = false;
+
+	std::atomic<uint64_t> n_frames{0}, n_bytes{0}, n_dropped{0}, n_segments{0};
+
+	Recorder() {}
+	~Recorder() { Close(); }
+
+	Recorder(const Recorder&) = delete;
+	Recorder& operator=(const Recorder&) = delete;
+
+	static std::string segment_path_(const std::string& dir, uint64_t seq)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "mdns-%010llu.rec", (unsigned long long)seq);
+		return dir + "/" + name;
+	}
+
+	// Sequence numbers of the segments in dir, in order
+	static std::vector<uint64_t> Segments(const std::string& dir)
+	{
+		std::vector<uint64_t> seqs;
+
+		DIR *d = opendir(dir.c_str());
+		if (!d) return seqs;
+
+		while (auto e = readdir(d)) {
+			unsigned long long seq;
+			char tail[8];
+			if (sscanf(e->d_name, "mdns-%llu.%7s", &seq, tail) != 2) continue;
+			if (strcmp(tail, "rec") != 0) continue;
+			seqs.push_back(seq);
+		}
+		closedir(d);
+
+		std::sort(seqs.begin(), seqs.end());
+		return seqs;
+	}
+
+	static int64_t UnixNanos()
+	{
+		using namespace std::chrono;
+		return duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+	}
+
+	// Start recording into dir (which must exist), after any segments there.
+	bool Open(const std::string& dir_, size_t segment_size_ = 64<<20, size_t max_segments_ = 16)
+	{
+		Close();
+
+		dir = dir_;
+		segment_size = segment_size_;
+		max_segments = std::max(max_segments_, (size_t)2);
+
+		if (segment_size < 4096) {
+			WARN("Segment size %zu too small", segment_size);
+			return false;
+		}
+
+		auto seqs = Segments(dir);
+		next_seq = seqs.empty() ? 0 : seqs.back() + 1;
+
+		// Nothing recorded yet, so a segment made before a failure is removed
+		auto first = create_();
+		if (!first) return false;
+
+		spare = create_();
+		if (!spare) {
+			std::lock_guard<std::mutex> lock(mutex);
+			discard_(first);
+			segments.clear();
+			return false;
+		}
+		current = first;
+
+		stopping = false;
+		maintainer = std::thread( [this] { maintain_(); } );
+
+		return true;
+	}
+
+	void Close()
+	{
+		if (maintainer.joinable()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			cv.notify_all();
+			maintainer.join();
+		}
+
+		// No more writers: finish the current segment, and drop the unused spare
+		std::lock_guard<std::mutex> lock(mutex);
+		if (auto s = current.exchange(nullptr)) retired.push_back(s);
+		for (auto s : retired) finish_(s);
+		retired.clear();
+
+		if (spare) {
+			discard_(spare);
+			spare = nullptr;
+		}
+
+		segments.clear();
+	}
+
+	// Unmap, close and delete an unused segment; caller holds mutex.
+	void discard_(Segment *s)
+	{
+		munmap(s->base, s->size);
+		close(s->fd);
+		unlink(s->path.c_str());
+		n_segments--;
+	}
+
+	// New segment file, sized and mapped; nullptr on failure.
+	Segment* create_()
+	{
+		std::unique_ptr<Segment> s(new Segment);
+		s->seq = next_seq++;
+		s->path = segment_path_(dir, s->seq);
+		s->size = segment_size;
+
+		s->fd = open(s->path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+		if (s->fd < 0) {
+			WARN("Unable to create '%s'", s->path.c_str());
+			return nullptr;
+		}
+		if (ftruncate(s->fd, s->size) != 0) {
+			WARN("Unable to size '%s'", s->path.c_str());
+			close(s->fd);
+			unlink(s->path.c_str());
+			return nullptr;
+		}
+
+		void *p = mmap(nullptr, s->size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, s->fd, 0);
+		if (p == MAP_FAILED) {
+			WARN("Unable to map '%s'", s->path.c_str());
+			close(s->fd);
+			unlink(s->path.c_str());
+			return nullptr;
+		}
+		s->base = (char *)p;
+
+		SegmentHeader h;
+		memset(&h, 0, sizeof(h));
+		h.magic = Magic;
+		h.version = Version;
+		h.header_size = sizeof(SegmentHeader);
+		h.seq = s->seq;
+		h.created_ns = UnixNanos();
+		memcpy(s->base, &h, sizeof(h));
+		s->next = (sizeof(SegmentHeader) + Align-1) & ~(Align-1);
+
+		n_segments++;
+		std::lock_guard<std::mutex> lock(mutex);
+		segments.push_back(std::move(s));
+		return segments.back().get();
+	}
+
+	// Trim to what was used, and close; caller holds mutex, no writers left.
+	void finish_(Segment *s)
+	{
+		if (!s->base) return;
+
+		size_t used = std::min(s->next.load(), s->size);
+		munmap(s->base, s->size);
+		if (ftruncate(s->fd, used) != 0) WARN("Unable to trim '%s'", s->path.c_str());
+		close(s->fd);
+
+		s->base = nullptr;
+		s->fd = -1;
+
+		// Oldest files go first (including any from before this run); the
+		// spare isn't counted, as it holds nothing yet
+		auto seqs = Segments(dir);
+		size_t keep = max_segments + (spare ? 1 : 0);
+		for (size_t i=0; i+keep < seqs.size(); i++) unlink(segment_path_(dir, seqs[i]).c_str());
+	}
+
+	void maintain_()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (!stopping) {
+			cv.wait_for(lock, std::chrono::milliseconds(100));
+
+			// Retired segments with no writers left can be closed
+			for (size_t i=0; i<retired.size(); ) {
+				if (retired[i]->writers.load() == 0) {
+					finish_(retired[i]);
+					retired.erase(retired.begin() + i);
+				}
+				else i++;
+			}
+
+			// Next segment ready in advance
+			if (!spare && !stopping) {
+				lock.unlock();
+				auto s = create_();
+				lock.lock();
+				spare = s;
+			}
+		}
+	}
+
+	// Swap in the spare for a full segment (unless someone else already did)
+	void roll_(Segment *full)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if ((current.load() != full) || !spare) return;
+			current.store(spare);
+			spare = nullptr;
+			retired.push_back(full);
+		}
+		cv.notify_all();
+	}
+
+	// Append a datagram; false if dropped.
+	bool Record(const char *buf, size_t len, const DatagramSocket::Meta& meta)
+	{
+		size_t need = (sizeof(Frame) + len + Align-1) & ~(Align-1);
+		if ((len > 0xffff) || (need > segment_size - sizeof(SegmentHeader))) {
+			n_dropped++;
+			return false;
+		}
+
+		for (int attempt=0; attempt<2; attempt++) {
+			auto s = current.load(std::memory_order_acquire);
+			if (!s) break;
+
+			// Announce ourselves, then check the segment wasn't retired before
+			// we did (sequentially consistent, against roll_ and maintain_)
+			s->writers.fetch_add(1);
+			if (s != current.load()) {
+				s->writers.fetch_sub(1, std::memory_order_release);
+				continue;
+			}
+
+			size_t ofs = s->next.fetch_add(need, std::memory_order_relaxed);
+			if (ofs + need <= s->size) {
+				write_(s->base + ofs, need, buf, len, meta);
+				s->writers.fetch_sub(1, std::memory_order_release);
+				n_frames++;
+				n_bytes += need;
+				return true;
+			}
+
+			s->writers.fetch_sub(1, std::memory_order_release);
+			roll_(s);
+		}
+
+		n_dropped++;
+		return false;
+	}
+
+	static void write_(char *p, size_t need, const char *buf, size_t len, const DatagramSocket::Meta& meta)
+	{
+		Frame f;
+		memset(&f, 0, sizeof(f));
+		f.payload_len = (uint16_t)len;
+		f.ifc_idx = meta.ifc_idx;
+
+		if (meta.rx_time.tv_sec || meta.rx_time.tv_nsec) {
+			f.time_ns = (int64_t)meta.rx_time.tv_sec*1000000000LL + meta.rx_time.tv_nsec;
+		}
+		else f.time_ns = UnixNanos();
+
+		if (meta.src.ss_family == AF_INET6) {
+			auto src = (const sockaddr_in6 *)&meta.src, dst = (const sockaddr_in6 *)&meta.dst;
+			f.family = 6;
+			f.src_port = ntohs(src->sin6_port);
+			f.dst_port = ntohs(dst->sin6_port);
+			memcpy(f.src, &src->sin6_addr, 16);
+			memcpy(f.dst, &dst->sin6_addr, 16);
+		}
+		else {
+			auto src = (const sockaddr_in *)&meta.src, dst = (const sockaddr_in *)&meta.dst;
+			f.family = 4;
+			f.src_port = ntohs(src->sin_port);
+			f.dst_port = ntohs(dst->sin_port);
+			memcpy(f.src, &src->sin_addr, 4);
+			memcpy(f.dst, &dst->sin_addr, 4);
+		}
+
+		// Everything but len, then len to commit the frame
+		memcpy(p + sizeof(f.len), (char *)&f + sizeof(f.len), sizeof(f) - sizeof(f.len));
+		memcpy(p + sizeof(f), buf, len);
+		__atomic_store_n((uint32_t *)p, (uint32_t)need, __ATOMIC_RELEASE);
+	}
+
+	Stats GetStats() const
+	{
+		Stats st;
+		st.frames = n_frames;
+		st.bytes = n_bytes;
+		st.dropped = n_dropped;
+		st.segments = n_segments;
+		return st;
+	}
+
+	// Meta as it was when recorded
+	static void ToMeta(const Frame& f, DatagramSocket::Meta& meta)
+	{
+		memset(&meta.src, 0, sizeof(meta.src));
+		memset(&meta.dst, 0, sizeof(meta.dst));
+		meta.ifc_idx = f.ifc_idx;
+		meta.rx_time.tv_sec = f.time_ns / 1000000000LL;
+		meta.rx_time.tv_nsec = f.time_ns % 1000000000LL;
+
+		if (f.family == 6) {
+			auto src = (sockaddr_in6 *)&meta.src, dst = (sockaddr_in6 *)&meta.dst;
+			src->sin6_family = dst->sin6_family = AF_INET6;
+			src->sin6_port = htons(f.src_port);
+			dst->sin6_port = htons(f.dst_port);
+			memcpy(&src->sin6_addr, f.src, 16);
+			memcpy(&dst->sin6_addr, f.dst, 16);
+			if (IN6_IS_ADDR_LINKLOCAL(&src->sin6_addr)) src->sin6_scope_id = f.ifc_idx;
+		}
+		else {
+			auto src = (sockaddr_in *)&meta.src, dst = (sockaddr_in *)&meta.dst;
+			src->sin_family = dst->sin_family = AF_INET;
+			src->sin_port = htons(f.src_port);
+			dst->sin_port = htons(f.dst_port);
+			memcpy(&src->sin_addr, f.src, 4);
+			memcpy(&dst->sin_addr, f.dst, 4);
+		}
+	}
+
+	// Calls fn(const Frame&, const char *payload) for each frame in a segment
+	// file, in order; returns number of frames, or -1 if not a segment.
+	template <typename F>
+	static long ReadSegment(const std::string& path, F fn)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return -1;
+
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(SegmentHeader))) {
+			close(fd);
+			return -1;
+		}
+
+		size_t size = st.st_size;
+		void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return -1;
+
+		auto base = (const char *)p;
+		SegmentHeader h;
+		memcpy(&h, base, sizeof(h));
+		if ((h.magic != Magic) || (h.version != Version)) {
+			WARN("'%s' is not a recording segment", path.c_str());
+			munmap(p, size);
+			return -1;
+		}
+
+		long n = 0;
+		size_t ofs = (h.header_size + Align-1) & ~(Align-1);
+		while (ofs + sizeof(Frame) <= size) {
+			Frame f;
+			memcpy(&f, base + ofs, sizeof(f));
+			if ((f.len == 0) || (f.len < sizeof(Frame) + f.payload_len) || (ofs + f.len > size)) break;
+			fn(f, base + ofs + sizeof(Frame));
+			ofs += f.len;
+			n++;
+		}
+
+		munmap(p, size);
+		return n;
+	}
+
+	// As above, for every segment in dir, oldest first; returns frame count.
+	template <typename F>
+	static long ReadAll(const std::string& dir, F fn)
+	{
+		long n = 0;
+		for (auto seq : Segments(dir)) {
+			auto r = ReadSegment(segment_path_(dir, seq), fn);
+			if (r > 0) n += r;
+		}
+		return n;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,224 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_REFRESHER)
+
+#define MDNS_REFRESHER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DNS.hpp"
+#include "Cache.hpp"
+#include "TimerWheel.hpp"
+
+namespace mDNS
+{
+
+//
+// Keeps records we care about fresh in the cache, so nobody has to wait for
+// the network after they expire. Per RFC6762:5.2, a record still wanted is
+// queried for at 80%, 85%, 90% and 95% of its TTL, each time plus up to 2%
+// of the TTL at random; a response in between resets the sequence.
+//
+// Interest is per name and type (an RRset), and the schedule follows the
+// record in the set that expires first. Each watched RRset has at most one
+// timer at a time, on a TimerWheel, so between deadlines nothing is looked
+// at, however many are watched. Questions due in the same tick are packed
+// together into as few queries as the payload limit allows.
+//
+// Like Responder, this builds packets but doesn't send them: call Advance()
+// regularly with the cache's clock, and send what it returns. Not thread
+// safe; use from one thread.
+//
+struct Refresher
+{
+	struct Stats {
+		uint64_t fired = 0;     // timers handled
+		uint64_t questions = 0; // refresh questions asked
+		uint64_t packets = 0;   // ... in this many queries
+		uint64_t refreshed = 0; // record replaced (e.g. answered) since last look
+		uint64_t idle = 0;      // nothing cached to refresh
+	};
+
+	static constexpr int64_t Tick_ms = 10;
+	static constexpr int Steps = 4;              // 80, 85, 90, 95% of TTL
+	static constexpr int64_t IdleRecheck_ms = 5000; // nothing cached yet (or any more)
+
+	struct Interest {
+		std::string name;
+		uint16_t type;
+		int64_t received_ms = -1; // record the schedule follows
+		int step = 0;
+		uint32_t generation = 0;  // bumped by Unwatch(), to drop stale timers
+		bool active = false;
+	};
+
+	struct TimerRef {
+		uint32_t index, generation;
+	};
+
+	Cache& cache;
+	size_t max_size; // per query; e.g. Interfaces::MaxPayload()
+
+	std::vector<Interest> interests;
+	std::unordered_map<std::string, uint32_t> by_key; // lower case name, type => interests[]
+	TimerWheel<TimerRef> wheel;
+
+	std::mt19937 rng{std::random_device{}()};
+	Stats stats;
+
+	Refresher(Cache& c, int64_t now_ms, size_t max_size_ = DNS::EDNS::MaxPayload) :
+		cache(c), max_size(max_size_), wheel(now_ms/Tick_ms) {}
+
+	static std::string key_(const std::string& name, uint16_t type)
+	{
+		std::string k(Cache::trim_(name));
+		for (auto& c : k) c = tolower((unsigned char)c);
+		k.append((const char*)&type, sizeof(type));
+		return k;
+	}
+
+	void schedule_(uint32_t index, int64_t when_ms)
+	{
+		// Already passed (which may be before tick 0) => next tick
+		uint64_t tick = (when_ms > 0) ? (uint64_t)((when_ms + Tick_ms-1) / Tick_ms) : 0;
+		wheel.Add(tick, { index, interests[index].generation });
+	}
+
+	// Step k's deadline for a record received at received_ms with given TTL
+	int64_t point_(int64_t received_ms, uint32_t TTL, int k)
+	{
+		int64_t ttl_ms = 1000*(int64_t)TTL;
+		std::uniform_int_distribution<int64_t> jitter(0, ttl_ms/50);
+		return received_ms + ttl_ms*(80 + 5*k)/100 + jitter(rng);
+	}
+
+	// Start refreshing name/type; no effect if already watched.
+	void Watch(const std::string& name, uint16_t type, int64_t now_ms)
+	{
+		auto key = key_(name, type);
+		auto it = by_key.find(key);
+
+		uint32_t index;
+		if (it != by_key.end()) {
+			index = it->second;
+			if (interests[index].active) return;
+		}
+		else {
+			index = (uint32_t)interests.size();
+			interests.push_back( {} );
+			by_key[key] = index;
+		}
+
+		auto& x = interests[index];
+		x.name = std::string(Cache::trim_(name));
+		x.type = type;
+		x.received_ms = -1;
+		x.step = 0;
+		x.active = true;
+
+		schedule_(index, now_ms); // next tick works out the schedule
+	}
+
+	void Unwatch(const std::string& name, uint16_t type)
+	{
+		auto it = by_key.find(key_(name, type));
+		if (it == by_key.end()) return;
+
+		auto& x = interests[it->second];
+		x.active = false;
+		x.generation++;
+	}
+
+	// Handle a timer; adds to questions if a query is needed.
+	void fire_(Cache::Reader& reader, const TimerRef& ref, int64_t now_ms, std::vector<uint32_t>& questions)
+	{
+		auto& x = interests[ref.index];
+		if (!x.active || (x.generation != ref.generation)) return;
+
+		stats.fired++;
+
+		// The record in the set that expires first
+		int64_t expires_ms = -1, received_ms = -1;
+		uint32_t TTL = 0;
+
+		reader.Lookup(x.name, x.type, now_ms, [&](const Cache::Entry& e) {
+			if ((expires_ms < 0) || (e.expires_ms < expires_ms)) {
+				expires_ms = e.expires_ms;
+				received_ms = e.received_ms;
+				TTL = e.TTL;
+			}
+		});
+
+		if ((expires_ms < 0) || (TTL == 0)) {
+			stats.idle++;
+			x.received_ms = -1;
+			schedule_(ref.index, now_ms + IdleRecheck_ms);
+			return;
+		}
+
+		// New (or refreshed) since the schedule was made: start again
+		if (received_ms != x.received_ms) {
+			if (x.received_ms >= 0) stats.refreshed++;
+			x.received_ms = received_ms;
+			x.step = 0;
+			schedule_(ref.index, point_(received_ms, TTL, 0));
+			return;
+		}
+
+		questions.push_back(ref.index);
+		x.step++;
+
+		if (x.step < Steps) schedule_(ref.index, point_(received_ms, TTL, x.step));
+		else schedule_(ref.index, expires_ms); // last chance passed; see what's left
+	}
+
+	// Run timers up to now_ms; returns queries to send (possibly none).
+	std::vector< std::vector<char> > Advance(int64_t now_ms)
+	{
+		std::vector< std::vector<char> > packets;
+		std::vector<uint32_t> questions;
+
+		Cache::Reader reader(cache);
+		wheel.Advance(now_ms/Tick_ms, [&](TimerRef& ref) { fire_(reader, ref, now_ms, questions); });
+
+		size_t k = 0;
+		while (k < questions.size()) {
+			packets.emplace_back();
+			DNS::Builder b(packets.back(), 0, 0, max_size);
+
+			auto k0 = k;
+			while (k < questions.size()) {
+				const auto& x = interests[questions[k]];
+				if (!b.question(x.name, x.type)) break;
+				k++;
+			}
+			if (k == k0) {
+				packets.pop_back(); // can't ever fit
+				k++;
+			}
+		}
+
+		stats.questions += questions.size();
+		stats.packets += packets.size();
+
+		return packets;
+	}
+
+	size_t Watched() const
+	{
+		size_t n = 0;
+		for (const auto& x : interests) n += x.active ? 1 : 0;
+		return n;
+	}
+};
+
+}
+
+#endif
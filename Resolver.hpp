@@ -0,0 +1,410 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_RESOLVER)
+
+#define MDNS_RESOLVER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <strings.h> // strncasecmp()
+
+#include <algorithm>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "SockUtil.hpp"
+#include "DNS.hpp"
+#include "DatagramSocket.hpp"
+#include "Cache.hpp"
+#include "Transport.hpp"
+
+namespace mDNS
+{
+
+//
+// Bulk resolution of many names at once, e.g. every known host for an
+// inventory scan, without a query and a wait per name.
+//
+// Questions are packed into as few one-shot queries (RFC6762:5.1) as the
+// payload limit allows, sent from our own ephemeral port so responders reply
+// straight to us (RFC6762:6.7), and paced at a given rate so a scan of
+// thousands of names doesn't swamp the link. Queries carry an OPT record, so
+// responders aren't held to 512 bytes: legacy unicast responses repeat the
+// questions, so are always larger than the query.
+//
+// Each record in a reply (any section) is matched back to its question by a
+// hash of the name. A question is done when a record for it arrives, or
+// an NSEC record says the name has no such type (RFC6762:6.1). Others are
+// asked again after timeout_ms, then twice that, and so on (RFC6762:5.2), up
+// to retries times, and are then left unanswered.
+//
+// Resolve() blocks until every question is done or has run out of retries,
+// handling everything in the calling thread. Replies also go into the cache,
+// if one is given.
+//
+// Sockets, clock and waiting all go through a Transport: real sockets by
+// default, or e.g. a SimNetwork host, where waiting runs the simulation and
+// timeouts pass in virtual time.
+//
+struct Resolver
+{
+	struct Question {
+		std::string name;
+		uint16_t type;
+	};
+
+	struct Result {
+		std::string name;
+		uint16_t type;
+		std::vector< std::vector<char> > rdata; // answers; names in RDATA decompressed
+		uint32_t TTL = 0;       // lowest of the answers
+		bool absent = false;    // NSEC says there are none
+		int attempts = 0;       // queries it was in
+		int64_t sent_us = 0;    // first query (steady clock)
+		int64_t answered_us = 0; // first answer or NSEC; 0 => unanswered
+
+		bool Answered() const { return answered_us > 0; }
+		int64_t Latency_us() const { return Answered() ? (answered_us - sent_us) : -1; }
+	};
+
+	struct Stats {
+		uint64_t questions = 0; // questions sent (including retries)
+		uint64_t queries = 0;   // ... in this many packets
+		uint64_t retries = 0;   // questions asked again
+		uint64_t replies = 0;   // reply packets received
+		uint64_t matched = 0;   // records matched to a question
+		uint64_t negative = 0;  // questions answered by NSEC
+		uint64_t truncated = 0; // replies with TC set
+		uint64_t unanswered = 0; // questions that ran out of retries
+	};
+
+	size_t max_size = 1472;     // per query; e.g. Interfaces::MaxPayload()
+	size_t max_questions = 0;   // per query; 0 => as many as fit
+	int rate = 0;               // queries per second; 0 => no limit
+	int64_t timeout_ms = 1000;  // before first retry, then doubling
+	int retries = 2;
+	Cache* cache = nullptr;     // replies are added here too, if set; stamped by transport clock
+
+	Transport* transport = &SocketTransport::Default();
+	int sd = -1;
+	int ifc_idx = 0;            // queries go out of this interface; 0 => default
+	sockaddr_storage dst;
+	uint16_t next_id = 1;
+
+	Stats stats;
+
+	Resolver() {}
+	~Resolver() { Close(); }
+
+	Resolver(const Resolver&) = delete;
+	Resolver& operator=(const Resolver&) = delete;
+
+	// Queries go out via the interface with address ifc_IP (IPv4), or the
+	// default if null, to group:port.
+	bool Open(const char *ifc_IP = nullptr, const char *group = "224.0.0.251", int port = 5353)
+	{
+		Close();
+
+		transport = &SocketTransport::Default();
+		ifc_idx = 0;
+
+		if (!SockUtil::pack(&dst, AF_INET, group, port)) {
+			WARN("Bad multicast group %s", group);
+			return false;
+		}
+
+		sd = socket(PF_INET, SOCK_DGRAM, 0);
+		if (sd < 0) {
+			WARN("socket() failed");
+			return false;
+		}
+
+		if (ifc_IP) {
+			struct in_addr a;
+			if (inet_pton(AF_INET, ifc_IP, &a) == 1) {
+				setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &a, sizeof(a));
+			}
+		}
+		DatagramSocket::SetMulticastLoop(sd, AF_INET, true);
+
+		// A scan's worth of replies can arrive faster than we read them
+		int rcvbuf = 4 << 20;
+		setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+		return true;
+	}
+
+	// As above, but over transport t, from an ephemeral port, with queries
+	// going out of interface ifc (0 => default).
+	bool Open(Transport& t, int ifc = 0, const char *group = "224.0.0.251", int port = 5353)
+	{
+		Close();
+
+		if (!SockUtil::pack(&dst, AF_INET, group, port)) {
+			WARN("Bad multicast group %s", group);
+			return false;
+		}
+
+		transport = &t;
+		ifc_idx = ifc;
+		sd = t.Open(AF_INET, 0);
+
+		return sd >= 0;
+	}
+
+	void Close()
+	{
+		if (sd >= 0) transport->Close(sd);
+		sd = -1;
+	}
+
+	int64_t now_us_()
+	{
+		return transport->Now_us();
+	}
+
+	static bool same_(std::string_view a, std::string_view b)
+	{
+		a = Cache::trim_(a);
+		b = Cache::trim_(b);
+		return (a.size() == b.size()) && (strncasecmp(a.data(), b.data(), a.size()) == 0);
+	}
+
+	// Questions by name hash, so a record (or NSEC) finds every question
+	// about its name whatever the type.
+	struct Index {
+		std::unordered_multimap<uint64_t, uint32_t> by_name; // => results[]
+
+		template <typename F>
+		void find(const std::vector<Result>& results, std::string_view name, F fn) const
+		{
+			auto range = by_name.equal_range(Cache::hash_(name));
+			for (auto it = range.first; it != range.second; ++it) {
+				if (same_(results[it->second].name, name)) fn(it->second);
+			}
+		}
+	};
+
+	// Match the records of a reply to outstanding questions; returns number
+	// of questions done.
+	size_t reply_(const char *buf, size_t len, const Index& index, std::vector<Result>& results, int64_t now_us)
+	{
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+		std::vector<char> rdata;
+		size_t n_done = 0;
+
+		size_t i = msg.read_header(buf, 0, len);
+		if ((i == 0) || !(msg.flags & DNS::Defs::QRMask)) return 0;
+
+		stats.replies++;
+		if (msg.flags & DNS::Defs::TCMask) stats.truncated++;
+		if (cache) cache->Update(buf, len, now_us/1000);
+
+		for (int j=0; j<msg.n_question; j++) {
+			i = rr.read_header(buf, i, len);
+			if (i == 0) return 0;
+		}
+
+		int n_rr = msg.n_answer + msg.n_authority + msg.n_additional;
+
+		for (int j=0; j<n_rr; j++) {
+			i = rr.read_header_and_body(buf, i, len, tmp);
+			if (i == 0) break;
+			if (rr.type == DNS::Defs::OPT) continue;
+			if (!Cache::rdata_(buf, len, rr, rdata)) continue;
+
+			index.find(results, rr.name, [&](uint32_t k) {
+				auto& r = results[k];
+				bool nsec = (rr.type == DNS::Defs::NSEC) && (r.type != DNS::Defs::NSEC);
+
+				if (nsec) {
+					// "No such type", if not listed and nothing else says otherwise
+					if ((r.type == DNS::Defs::ANY) || !r.rdata.empty()) return;
+					if (Cache::nsec_lists_(rdata, r.type)) return;
+					if (!r.absent) stats.negative++;
+					r.absent = true;
+				}
+				else {
+					if ((r.type != DNS::Defs::ANY) && (r.type != rr.type)) return;
+					if (std::find(r.rdata.begin(), r.rdata.end(), rdata) != r.rdata.end()) return;
+
+					if (r.rdata.empty() || (rr.TTL < r.TTL)) r.TTL = rr.TTL;
+					r.rdata.push_back(rdata);
+					r.absent = false;
+					stats.matched++;
+				}
+
+				if (r.answered_us == 0) {
+					r.answered_us = now_us;
+					n_done++;
+				}
+			});
+		}
+
+		return n_done;
+	}
+
+	// Read whatever replies are waiting; returns number of questions done.
+	size_t drain_(std::vector<char>& buf, const Index& index, std::vector<Result>& results)
+	{
+		DatagramSocket::Meta meta;
+		size_t n_done = 0;
+
+		while (true) {
+			auto N = transport->Read(sd, buf.data(), buf.size(), meta);
+			if (N < 0) break;
+			if (N < 12) continue;
+			n_done += reply_(buf.data(), N, index, results, now_us_());
+		}
+
+		return n_done;
+	}
+
+	//
+	// Resolution
+	//
+
+	std::vector<Result> Resolve(const std::vector<Question>& questions)
+	{
+		std::vector<Result> results(questions.size());
+		std::vector<uint32_t> alias(questions.size()); // duplicates => first
+		Index index;
+
+		if (sd < 0) {
+			WARN("Resolver not open");
+			return results;
+		}
+
+		// Questions to (re)send, and deadlines of those in flight; a question
+		// has at most one deadline queued at a time.
+		std::vector<uint32_t> due;
+		using Deadline = std::pair<int64_t,uint32_t>; // time (us), results[]
+		std::priority_queue< Deadline, std::vector<Deadline>, std::greater<Deadline> > deadlines;
+
+		for (uint32_t k=0; k<questions.size(); k++) {
+			auto& r = results[k];
+			r.name = questions[k].name;
+			r.type = questions[k].type;
+			alias[k] = k;
+
+			index.find(results, r.name, [&](uint32_t j) {
+				if (results[j].type == r.type) alias[k] = j;
+			});
+			if (alias[k] != k) continue;
+
+			index.by_name.emplace(Cache::hash_(r.name), k);
+			due.push_back(k);
+		}
+
+		const int64_t Gaveup = -1; // answered_us of questions out of retries
+
+		size_t n_open = due.size(), n_done = 0, next = 0;
+		int64_t gap_us = (rate > 0) ? 1000000/rate : 0;
+		int64_t next_send_us = now_us_();
+
+		std::vector<char> pkt;
+		std::vector<char> buf(DNS::EDNS::MaxPayload + 1024);
+
+		while (n_done < n_open) {
+			auto now = now_us_();
+
+			// Anything past its deadline goes back in the queue, or gives up
+			while (!deadlines.empty() && (deadlines.top().first <= now)) {
+				auto k = deadlines.top().second;
+				deadlines.pop();
+
+				auto& r = results[k];
+				if (r.answered_us != 0) continue;
+				if (r.attempts > retries) {
+					r.answered_us = Gaveup;
+					stats.unanswered++;
+					n_done++;
+					continue;
+				}
+				due.push_back(k);
+				stats.retries++;
+			}
+
+			while ((next < due.size()) && (results[due[next]].answered_us != 0)) next++;
+			if (next == due.size()) {
+				due.clear();
+				next = 0;
+			}
+
+			// Next query, if one is due and the rate allows; then read any
+			// replies already waiting, so they don't pile up during a burst.
+			if ((next < due.size()) && (now >= next_send_us)) {
+				uint16_t id = next_id++;
+				if (next_id == 0) next_id = 1;
+
+				DNS::Builder b(pkt, id, 0, max_size - DNS::EDNS::RecordSize);
+				size_t n = 0;
+
+				for (; next < due.size(); next++) {
+					auto k = due[next];
+					auto& r = results[k];
+					if (r.answered_us != 0) continue;
+					if ((max_questions > 0) && (n == max_questions)) break;
+					if (!b.question(r.name, r.type)) {
+						if (n > 0) break;
+						WARN("Question for '%s' can't fit in a query", r.name.c_str());
+						r.attempts = retries + 1;
+						deadlines.push( {now, k} );
+						continue;
+					}
+
+					if (r.attempts++ == 0) r.sent_us = now;
+					deadlines.push( {now + 1000*timeout_ms*(1LL << (r.attempts-1)), k} );
+					n++;
+				}
+
+				if (n > 0) {
+					b.max_size = 0;
+					b.opt(DNS::EDNS::MaxPayload);
+					transport->Send(sd, pkt.data(), pkt.size(), dst, ifc_idx);
+					stats.queries++;
+					stats.questions += n;
+				}
+
+				next_send_us = now + gap_us;
+				n_done += drain_(buf, index, results);
+				continue;
+			}
+
+			// Wait for replies until something else needs doing
+			int64_t wake = INT64_MAX;
+			if (next < due.size()) wake = next_send_us;
+			if (!deadlines.empty()) wake = std::min(wake, deadlines.top().first);
+
+			int timeout = (wake == INT64_MAX) ? 100 : (int)std::max((int64_t)0, (wake - now + 999)/1000);
+
+			if (transport->Wait(sd, timeout) > 0) n_done += drain_(buf, index, results);
+		}
+
+		for (size_t k=0; k<results.size(); k++) {
+			if (results[k].answered_us == Gaveup) results[k].answered_us = 0;
+		}
+		for (size_t k=0; k<results.size(); k++) {
+			if (alias[k] != k) {
+				auto name = results[k].name;
+				results[k] = results[alias[k]];
+				results[k].name = name;
+			}
+		}
+
+		return results;
+	}
+
+	Stats GetStats() const { return stats; }
+};
+
+}
+
+#endif
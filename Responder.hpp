@@ -0,0 +1,448 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_RESPONDER)
+
+#define MDNS_RESPONDER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "DNS.hpp"
+#include "Interfaces.hpp"
+
+namespace mDNS
+{
+
+//
+// Authoritative record set, and construction of responses to queries for it.
+//
+// Respond() doesn't send anything; the caller decides where the response goes.
+// Per RFC6762:6.7, a query from a source port other than 5353 is a "legacy"
+// unicast query: the response must go straight back to the querier, echo the
+// query ID, and repeat the question(s). Otherwise the response has ID zero,
+// no questions, and should be multicast.
+//
+// Names with unique records (cache-flush bit set) are ours alone, so we can
+// also say what they *don't* have: a query for a missing type gets an NSEC
+// record listing the types that do exist (RFC6762:6.1), which the querier
+// can cache rather than asking again. The same NSEC goes in the Additional
+// section when we answer A but have no AAAA, or vice versa.
+//
+// A multi-homed host has different addresses on each link, and a querier
+// can only use those of the link it asked on. Records may therefore be tied
+// to one interface (see AddHost()), and a query received on interface
+// ifc_idx (DatagramSocket::Meta::ifc_idx) sees only that interface's view:
+// records tied to it, plus those for every interface. Answers, additionals
+// and NSEC type lists all come from that view, and the caller should send
+// the response out of the same interface only (DatagramSocket::Send()).
+//
+struct Responder
+{
+	struct Record {
+		std::string name; // as given; matched case-insensitively
+		uint16_t type;
+		uint16_t clss;
+		uint32_t TTL;
+		std::vector<char> rdata;
+		int ifc_idx;      // only visible on this interface; 0 => every interface
+	};
+
+	static constexpr uint32_t LegacyMaxTTL = 10; // RFC6762:6.7
+
+	bool negative = true; // NSEC for missing types of names we own
+
+	std::vector<Record> records;
+	std::unordered_multimap<std::string, size_t> by_name; // lower case name => records[]
+
+	static std::string key_(const std::string& name)
+	{
+		std::string k(name);
+		for (auto& c : k) c = tolower((unsigned char)c);
+		if (!k.empty() && k.back() == '.') k.pop_back();
+		return k;
+	}
+
+	void Add(const std::string& name, uint16_t type, uint16_t clss, uint32_t TTL, const std::vector<char>& rdata,
+		int ifc_idx = 0)
+	{
+		by_name.insert( {key_(name), records.size()} );
+		records.push_back( {name, type, clss, TTL, rdata, ifc_idx} );
+	}
+
+	// A and AAAA records for host, one per address assigned to each
+	// interface and visible only on that interface; unique, as the addresses
+	// are ours alone. Returns number of records added.
+	size_t AddHost(const std::string& host, uint32_t TTL, const Interfaces& ifcs)
+	{
+		size_t n = 0;
+
+		for (const auto& ifc : ifcs.interfaces) {
+			for (const auto ifa : ifc.addresses) {
+				auto sa = ifa->ifa_addr;
+				if (!SockUtil::is_inet(sa)) continue;
+
+				const char *p;
+				size_t len;
+				uint16_t type;
+
+				if (sa->sa_family == AF_INET) {
+					p = (const char *)SockUtil::inet4(sa);
+					len = sizeof(SockUtil::ia4);
+					type = DNS::Defs::A;
+				}
+				else {
+					p = (const char *)SockUtil::inet6(sa);
+					len = sizeof(SockUtil::ia6);
+					type = DNS::Defs::AAAA;
+				}
+
+				Add(host, type, DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT, TTL,
+					std::vector<char>(p, p+len), (int)ifc.index);
+				n++;
+			}
+		}
+
+		return n;
+	}
+
+	// Is r in the view of interface ifc_idx? Unknown interface (0) sees all.
+	static bool visible_(const Record& r, int ifc_idx)
+	{
+		return (r.ifc_idx == 0) || (ifc_idx == 0) || (r.ifc_idx == ifc_idx);
+	}
+
+	void Clear()
+	{
+		records.clear();
+		by_name.clear();
+	}
+
+	// Types held for a name we own, and the least of their TTLs; false if
+	// the name has no unique records.
+	bool owned_(const std::string& key, int ifc_idx, std::vector<uint16_t>& types, uint32_t& TTL) const
+	{
+		bool unique = false;
+
+		types.clear();
+		TTL = 0;
+
+		auto range = by_name.equal_range(key);
+		for (auto it = range.first; it != range.second; ++it) {
+			const auto& r = records[it->second];
+			if (!visible_(r, ifc_idx)) continue;
+			if (r.clss & DNS::Defs::CACHE_FLUSH_BIT) unique = true;
+			if (std::find(types.begin(), types.end(), r.type) == types.end()) types.push_back(r.type);
+			if (types.size() == 1 || r.TTL < TTL) TTL = r.TTL;
+		}
+
+		return unique;
+	}
+
+	bool has_type_(const std::string& key, int ifc_idx, uint16_t type) const
+	{
+		auto range = by_name.equal_range(key);
+		for (auto it = range.first; it != range.second; ++it) {
+			const auto& r = records[it->second];
+			if ((r.type == type) && visible_(r, ifc_idx)) return true;
+		}
+		return false;
+	}
+
+	// What to send in response to a query, as indices into records[]
+	struct Plan {
+		int ifc_idx = 0; // view the query was answered from
+		std::vector< std::pair<std::string,uint16_t> > questions;
+		std::vector<size_t> answers, additionals;
+		std::vector<std::string> nsec_answers, nsec_additional;
+		std::unordered_set<size_t> included; // answers and additionals
+	};
+
+	// Work out the answers to q[0..len), and what goes with them; false if
+	// we have nothing to say (including if q isn't a well-formed query).
+	bool plan_(const char *q, size_t len, Plan& plan) const
+	{
+		auto ifc_idx = plan.ifc_idx;
+
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+
+		size_t i = msg.read_header(q, 0, len);
+		if ((i == 0) || (msg.flags & DNS::Defs::QRMask)) return false;
+		if (((msg.flags & DNS::Defs::OpMask) >> 11) != DNS::Defs::QUERY) return false;
+
+		for (int n=0; n<msg.n_question; n++) {
+			i = rr.read_header(q, i, len, tmp);
+			if (i == 0) return false;
+
+			plan.questions.push_back( {rr.name, rr.type} );
+
+			auto key = key_(rr.name);
+			size_t n0 = plan.answers.size();
+
+			auto range = by_name.equal_range(key);
+			for (auto it = range.first; it != range.second; ++it) {
+				const auto& r = records[it->second];
+				if ((rr.type != DNS::Defs::ANY) && (rr.type != r.type)) continue;
+				if (!visible_(r, ifc_idx)) continue;
+				if (!plan.included.insert(it->second).second) continue;
+				plan.answers.push_back(it->second);
+			}
+
+			if (!negative) continue;
+
+			if (plan.answers.size() == n0) {
+				if (rr.type != DNS::Defs::ANY) plan.nsec_answers.push_back(rr.name);
+			}
+			else if ((rr.type == DNS::Defs::A) || (rr.type == DNS::Defs::AAAA)) {
+				auto other = (rr.type == DNS::Defs::A) ? DNS::Defs::AAAA : DNS::Defs::A;
+				if (!has_type_(key, ifc_idx, other)) plan.nsec_additional.push_back(rr.name);
+			}
+		}
+
+		if (plan.answers.empty() && plan.nsec_answers.empty()) return false;
+
+		additionals_(plan);
+
+		// NSEC additionals: first mention of each name, if not already an answer
+		std::vector<std::string> nsec;
+		for (const auto& name : plan.nsec_additional) {
+			auto key = key_(name);
+			auto same = [&key](const std::string& x) { return key_(x) == key; };
+			if (std::any_of(plan.nsec_answers.begin(), plan.nsec_answers.end(), same)) continue;
+			if (std::any_of(nsec.begin(), nsec.end(), same)) continue;
+			nsec.push_back(name);
+		}
+		plan.nsec_additional = std::move(nsec);
+
+		return true;
+	}
+
+	// DNS-SD additional records (RFC6763:12): SRV and TXT for the target of
+	// a PTR answer, and addresses for the target of any SRV we send; but not
+	// records that are already answers.
+	void additionals_(Plan& plan) const
+	{
+		std::vector<std::string> tmp;
+
+		auto add = [&](const std::string& key, uint16_t type) {
+			auto range = by_name.equal_range(key);
+			for (auto it = range.first; it != range.second; ++it) {
+				const auto& r = records[it->second];
+				if ((r.type != type) || !visible_(r, plan.ifc_idx)) continue;
+				if (!plan.included.insert(it->second).second) continue;
+				plan.additionals.push_back(it->second);
+			}
+		};
+
+		auto target = [&tmp](const Record& r, size_t ofs) {
+			std::string name;
+			tmp.clear();
+			if ((r.rdata.size() <= ofs) ||
+				(DNS::Parse::labels(r.rdata.data(), ofs, r.rdata.size(), false, true, tmp) == 0)) return name;
+			for (const auto& l : tmp) name += l + ".";
+			return key_(name);
+		};
+
+		for (auto a : plan.answers) {
+			if (records[a].type != DNS::Defs::PTR) continue;
+			auto key = target(records[a], 0);
+			add(key, DNS::Defs::SRV);
+			add(key, DNS::Defs::TXT);
+		}
+
+		// Answers, then any SRV added above (the vector may grow meanwhile)
+		for (size_t k=0; k<plan.answers.size()+plan.additionals.size(); k++) {
+			auto x = (k < plan.answers.size()) ? plan.answers[k] : plan.additionals[k-plan.answers.size()];
+			if (records[x].type != DNS::Defs::SRV) continue;
+			auto key = target(records[x], 6);
+			add(key, DNS::Defs::A);
+			add(key, DNS::Defs::AAAA);
+		}
+	}
+
+	// Class and TTL of record r as sent: no cache-flush bit, capped TTL for
+	// legacy resolvers.
+	static void send_as_(const Record& r, bool legacy_unicast, uint16_t& clss, uint32_t& TTL)
+	{
+		clss = r.clss;
+		TTL = r.TTL;
+		if (legacy_unicast) {
+			clss &= ~DNS::Defs::CACHE_FLUSH_BIT;
+			if (TTL > LegacyMaxTTL) TTL = LegacyMaxTTL;
+		}
+	}
+
+	// Build response to query in q[0..len) into out; returns false if we have
+	// nothing to say (including if q isn't a well-formed query).
+	//
+	// max_size is the payload limit of the link the response goes out on (see
+	// Interfaces::MaxPayload()), 0 if unlimited; records that don't fit are
+	// left out. Legacy unicast responses are also limited to what the querier
+	// can take: its EDNS payload size (and we echo OPT), else 512 bytes, with
+	// TC set if answers had to be dropped (RFC6762:6.7, RFC6891:7).
+	//
+	// ifc_idx is the interface the query arrived on; the response comes from
+	// its view only. 0 (unknown) answers from every record.
+	bool Respond(const char *q, size_t len, bool legacy_unicast, std::vector<char>& out,
+		size_t max_size = 0, int ifc_idx = 0) const
+	{
+		Plan plan;
+		plan.ifc_idx = ifc_idx;
+		if (!plan_(q, len, plan)) return false;
+
+		DNS::EDNS edns;
+		bool use_edns = legacy_unicast && edns.read(q, len);
+		size_t limit = max_size;
+
+		if (legacy_unicast) {
+			size_t peer = use_edns ? edns.udp_size : DNS::EDNS::MinPayload;
+			if ((limit == 0) || (peer < limit)) limit = peer;
+			if (use_edns) limit -= DNS::EDNS::RecordSize;
+		}
+
+		uint16_t flags = DNS::Defs::QRMask | DNS::Defs::AAMask;
+		uint16_t id = 0;
+		if (legacy_unicast) DNS::Parse::read(q, 0, len, id);
+
+		DNS::Builder b(out, id, flags, limit);
+		size_t n_answered = 0;
+
+		if (legacy_unicast) {
+			for (const auto& x : plan.questions) b.question(x.first, x.second);
+		}
+
+		for (auto a : plan.answers) {
+			const auto& r = records[a];
+			uint16_t clss;
+			uint32_t TTL;
+
+			send_as_(r, legacy_unicast, clss, TTL);
+			if (!b.record(b.Answer, r.name, r.type, clss, TTL, r.rdata)) {
+				if (legacy_unicast) b.set_flags(flags | DNS::Defs::TCMask);
+				break;
+			}
+			n_answered++;
+		}
+
+		size_t n_nsec = 0;
+		for (const auto& name : plan.nsec_answers) n_nsec += nsec_(b, b.Answer, name, ifc_idx, legacy_unicast);
+
+		// Additionals are optional; whatever fits
+		for (auto a : plan.additionals) {
+			const auto& r = records[a];
+			uint16_t clss;
+			uint32_t TTL;
+
+			send_as_(r, legacy_unicast, clss, TTL);
+			b.record(b.Additional, r.name, r.type, clss, TTL, r.rdata);
+		}
+		for (const auto& name : plan.nsec_additional) nsec_(b, b.Additional, name, ifc_idx, legacy_unicast);
+
+		if (use_edns) {
+			size_t ours = ((max_size > 0) && (max_size < DNS::EDNS::MaxPayload)) ? max_size : DNS::EDNS::MaxPayload;
+			b.opt((uint16_t)ours);
+		}
+
+		return (n_answered > 0) || (n_nsec > 0);
+	}
+
+	// As above, but a multicast response that doesn't fit in one packet of
+	// max_size is spread over as many as needed, with names compressed,
+	// answers first and then additionals (see DNS::Packer); nothing is left
+	// out unless it can't fit in a packet on its own. Legacy unicast responses
+	// are still one packet, as above. Returns number of packets.
+	size_t Respond(const char *q, size_t len, bool legacy_unicast, std::vector< std::vector<char> >& packets,
+		size_t max_size, int ifc_idx = 0) const
+	{
+		packets.clear();
+
+		if (legacy_unicast) {
+			packets.emplace_back();
+			if (!Respond(q, len, true, packets.back(), max_size, ifc_idx)) packets.clear();
+			return packets.size();
+		}
+
+		Plan plan;
+		plan.ifc_idx = ifc_idx;
+		if (!plan_(q, len, plan)) return 0;
+
+		std::vector<DNS::Packer::Record> answers, additionals;
+		std::deque< std::vector<char> > nsec_rdata; // deque: Packer records point into it
+		std::deque<std::string> nsec_names;         // ...
+
+		auto record = [](const Record& r) {
+			return DNS::Packer::Record{ &r.name, r.type, r.clss, r.TTL, r.rdata.data(), (uint16_t)r.rdata.size() };
+		};
+
+		auto nsec = [&](const std::string& name, std::vector<DNS::Packer::Record>& out) {
+			uint16_t clss;
+			uint32_t TTL;
+			nsec_rdata.emplace_back();
+			if (!nsec_rdata_(name, ifc_idx, false, clss, TTL, nsec_rdata.back())) return;
+			nsec_names.push_back(name);
+			auto& rd = nsec_rdata.back();
+			out.push_back( {&nsec_names.back(), DNS::Defs::NSEC, clss, TTL, rd.data(), (uint16_t)rd.size()} );
+		};
+
+		for (auto a : plan.answers) answers.push_back( record(records[a]) );
+		for (const auto& name : plan.nsec_answers) nsec(name, answers);
+		for (auto a : plan.additionals) additionals.push_back( record(records[a]) );
+		for (const auto& name : plan.nsec_additional) nsec(name, additionals);
+
+		if (answers.empty()) return 0;
+
+		uint16_t flags = DNS::Defs::QRMask | DNS::Defs::AAMask;
+		DNS::Packer::Pack(packets, 0, flags, max_size, answers, additionals);
+
+		return packets.size();
+	}
+
+	// NSEC for name if we own it, as seen from interface ifc_idx: class, TTL
+	// and RDATA. False if not ours.
+	bool nsec_rdata_(const std::string& name, int ifc_idx, bool legacy_unicast, uint16_t& clss, uint32_t& TTL,
+		std::vector<char>& rdata) const
+	{
+		std::vector<uint16_t> types;
+
+		if (!owned_(key_(name), ifc_idx, types, TTL)) return false;
+
+		types.push_back(DNS::Defs::NSEC);
+
+		clss = DNS::Defs::IN;
+		if (legacy_unicast) {
+			if (TTL > LegacyMaxTTL) TTL = LegacyMaxTTL;
+		}
+		else {
+			clss |= DNS::Defs::CACHE_FLUSH_BIT;
+		}
+
+		rdata = DNS::Builder::rdata_nsec(name, types);
+		return true;
+	}
+
+	// Append NSEC for name if we own it; returns number of records added.
+	size_t nsec_(DNS::Builder& b, DNS::Builder::Section s, const std::string& name, int ifc_idx,
+		bool legacy_unicast) const
+	{
+		uint16_t clss;
+		uint32_t TTL;
+		std::vector<char> rdata;
+
+		if (!nsec_rdata_(name, ifc_idx, legacy_unicast, clss, TTL, rdata)) return 0;
+
+		return b.record(s, name, DNS::Defs::NSEC, clss, TTL, rdata) ? 1 : 0;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,157 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SELFECHO)
+
+#define MDNS_SELFECHO
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "SockUtil.hpp"
+#include "Interfaces.hpp"
+#include "DatagramSocket.hpp"
+
+namespace mDNS
+{
+
+//
+// Recognise our own transmissions when the kernel loops them back to us.
+//
+// Disabling IP_MULTICAST_LOOP on the sending socket (see DatagramSocket::
+// SetMulticastLoop()) stops the echo at source, but also hides our queries
+// from any other responder on this host (Avahi, Bonjour etc). As that's not
+// always acceptable, we also remember a hash of each datagram we send, with
+// the port and interface it left from, and drop received datagrams that match
+// one of those AND come from one of our local addresses within lifetime. The
+// kernel loops a multicast back within a millisecond or so, so lifetime only
+// needs to cover our own receive latency; another local process (e.g. Avahi)
+// only collides if it sends the same bytes from the same port on the same
+// interface in that window, and a standard query repeated that quickly is
+// redundant anyway.
+//
+// Sent entries are not consumed on a match, as one send can be echoed on more
+// than one socket/interface; they simply age out.
+//
+struct SelfEcho
+{
+	using Clock = std::chrono::steady_clock;
+
+	struct Sent {
+		uint64_t hash;
+		size_t len;
+		int port; // 0: any
+		int ifc_idx; // 0: any
+		Clock::time_point t;
+	};
+
+	struct Address {
+		int family;
+		unsigned char addr[16]; // IPv4 uses first 4 bytes
+	};
+
+	static constexpr size_t MaxSent = 32;
+
+	std::chrono::milliseconds lifetime;
+
+	std::vector<Address> local_addresses;
+
+	Sent sent[MaxSent];
+	size_t n_sent = 0, next = 0;
+
+	uint64_t echoes = 0;
+	std::mutex mutex;
+
+	SelfEcho(const Interfaces& ifcs, int lifetime_ms = 50) : lifetime(lifetime_ms)
+	{
+		SetLocalAddresses(ifcs);
+	}
+
+	static bool address_(const void *sa, Address& a)
+	{
+		if (!SockUtil::is_inet(sa)) return false;
+
+		a.family = ((const sockaddr *)sa)->sa_family;
+		memset(a.addr, 0, sizeof(a.addr));
+
+		if (a.family == AF_INET) memcpy(a.addr, SockUtil::inet4(sa), 4);
+		else memcpy(a.addr, SockUtil::inet6(sa), 16);
+
+		return true;
+	}
+
+	void SetLocalAddresses(const Interfaces& ifcs)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		local_addresses.clear();
+		for (const auto& ifc : ifcs.interfaces) {
+			for (const auto ifa : ifc.addresses) {
+				Address a;
+				if (address_(ifa->ifa_addr, a)) local_addresses.push_back(a);
+			}
+		}
+	}
+
+	// Record a datagram we're about to transmit from port on interface ifc_idx.
+	void Record(const void *buf, size_t len, int port, int ifc_idx,
+		Clock::time_point now = Clock::now())
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		sent[next] = { Hash::fnv1a(buf, len), len, port, ifc_idx, now };
+		next = (next+1) % MaxSent;
+		if (n_sent < MaxSent) n_sent++;
+	}
+
+	// Returns true if datagram is one of ours, looped back.
+	bool IsEcho(const void *buf, size_t len, const DatagramSocket::Meta& meta,
+		Clock::time_point now = Clock::now())
+	{
+		Address src;
+		int port = 0;
+		if (!address_(&meta.src, src)) return false;
+		SockUtil::unpack(&meta.src, nullptr, 0, &port);
+
+		uint64_t hash = Hash::fnv1a(buf, len);
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		bool local = false;
+		for (const auto& a : local_addresses) {
+			if ((a.family == src.family) && (memcmp(a.addr,src.addr,sizeof(a.addr)) == 0)) {
+				local = true;
+				break;
+			}
+		}
+		if (!local) return false;
+
+		for (size_t n=0; n<n_sent; n++) {
+			const auto& x = sent[(next+MaxSent-1-n) % MaxSent];
+
+			if (now - x.t > lifetime) break;
+			if ((x.port != 0) && (x.port != port)) continue;
+			if ((x.ifc_idx != 0) && (x.ifc_idx != meta.ifc_idx)) continue;
+			if ((x.hash == hash) && (x.len == len)) {
+				echoes++;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	uint64_t GetEchoes()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return echoes;
+	}
+};
+
+}
+
+#endif
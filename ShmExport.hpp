@@ -0,0 +1,325 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SHMEXPORT)
+
+#define MDNS_SHMEXPORT
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Cache.hpp"
+#include "mdns_shm.h"
+
+namespace mDNS
+{
+
+//
+// Publishes the contents of a Cache into a POSIX shared memory object, for
+// lookups from other processes without IPC; see mdns_shm.h for the layout and
+// the (C) reader side.
+//
+// Publish() brings the shared table in step with the cache: slots are only
+// written for records that appeared, changed expiry or went away, each under
+// its own seqlock, so readers of other slots are never disturbed. If too many
+// slots are in use (including deleted ones, which lengthen probe sequences)
+// the whole table is rebuilt under the header seqlock instead.
+//
+// Call Publish() from one thread only. Cache times must be CLOCK_MONOTONIC
+// milliseconds (as from Cache::Now()), since readers compare against that.
+//
+struct ShmExport
+{
+	struct Stats {
+		uint64_t publishes = 0;
+		uint64_t written = 0;  // slots written (new or changed records)
+		uint64_t deleted = 0;  // slots marked deleted
+		uint64_t rebuilds = 0; // full rewrites of the table
+		uint64_t skipped = 0;  // records not exported (too large, or table full)
+	};
+
+	struct Shadow {
+		uint32_t slot;
+		int64_t expires_ms;
+		uint64_t generation; // last publish that saw this record
+	};
+
+	static constexpr double MaxLoad = 0.75; // used + deleted slots, as fraction
+
+	std::string name;
+	int fd = -1;
+	size_t size = 0;
+	mdns_shm_header* hdr = nullptr;
+	mdns_shm_slot* slots = nullptr;
+
+	std::unordered_map<std::string, Shadow> shadow; // record key => slot
+	uint32_t n_used = 0, n_deleted = 0;
+	uint64_t generation = 0;
+
+	Stats stats;
+
+	ShmExport() {}
+	~ShmExport() { Close(); }
+
+	ShmExport(const ShmExport&) = delete;
+	ShmExport& operator=(const ShmExport&) = delete;
+
+	// Create (or replace) shared memory object; n_slots is rounded up to a
+	// power of 2. Returns false on failure.
+	bool Open(const std::string& name_, uint32_t n_slots = 4096)
+	{
+		uint32_t n = 1;
+		while (n < n_slots) n <<= 1;
+
+		Close();
+
+		name = name_;
+		size = sizeof(mdns_shm_header) + (size_t)n*sizeof(mdns_shm_slot);
+
+		fd = shm_open(name.c_str(), O_CREAT|O_RDWR, 0644);
+		if (fd < 0) {
+			WARN("shm_open(%s) failed", name.c_str());
+			return false;
+		}
+
+		if (ftruncate(fd, size) != 0) {
+			WARN("ftruncate(%s, %d) failed", name.c_str(), (int)size);
+			Close();
+			return false;
+		}
+
+		void* p = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) {
+			WARN("mmap(%s) failed", name.c_str());
+			Close();
+			return false;
+		}
+
+		hdr = (mdns_shm_header*)p;
+		slots = (mdns_shm_slot*)((char*)p + sizeof(mdns_shm_header));
+
+		// Readers check magic before anything else, so it goes in last
+		__atomic_store_n(&hdr->magic, 0, __ATOMIC_RELAXED);
+		memset((char*)p + sizeof(hdr->magic), 0, size - sizeof(hdr->magic));
+
+		hdr->version = MDNS_SHM_VERSION;
+		hdr->header_size = sizeof(mdns_shm_header);
+		hdr->slot_size = sizeof(mdns_shm_slot);
+		hdr->n_slots = n;
+		hdr->writer_pid = getpid();
+
+		__atomic_store_n(&hdr->magic, MDNS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+		return true;
+	}
+
+	// The object is unlinked unless keep is set; readers that already have
+	// it mapped are unaffected.
+	void Close(bool keep = false)
+	{
+		if (hdr) munmap(hdr, size);
+		if (fd >= 0) {
+			close(fd);
+			if (!keep) shm_unlink(name.c_str());
+		}
+
+		fd = -1;
+		hdr = nullptr;
+		slots = nullptr;
+		shadow.clear();
+		n_used = n_deleted = 0;
+	}
+
+	static std::string key_(const Cache::Entry& e)
+	{
+		std::string k(e.name);
+		for (auto& c : k) c = tolower((unsigned char)c);
+		k.push_back(0);
+		k.append((const char*)&e.type, sizeof(e.type));
+		k.append((const char*)&e.clss, sizeof(e.clss));
+		k.append(e.rdata.data(), e.rdata.size());
+		return k;
+	}
+
+	static bool fits_(const Cache::Entry& e)
+	{
+		return (e.name.size() <= MDNS_SHM_MAX_NAME) && (e.rdata.size() <= MDNS_SHM_MAX_RDATA);
+	}
+
+	static void seq_begin_(uint32_t* seq)
+	{
+		__atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	static void seq_end_(uint32_t* seq)
+	{
+		__atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+	}
+
+	void write_slot_(uint32_t i, const Cache::Entry* e)
+	{
+		auto& s = slots[i];
+
+		seq_begin_(&s.seq);
+
+		if (e) {
+			s.state = MDNS_SHM_SLOT_USED;
+			s.name_len = (uint8_t)e->name.size();
+			s.rdata_len = (uint16_t)e->rdata.size();
+			s.hash = e->hash;
+			s.type = e->type;
+			s.clss = e->clss;
+			s.ttl = e->TTL;
+			s.expires_ms = e->expires_ms;
+			memcpy(s.name, e->name.c_str(), e->name.size()+1);
+			memcpy(s.rdata, e->rdata.data(), e->rdata.size());
+		}
+		else {
+			s.state = MDNS_SHM_SLOT_DELETED;
+		}
+
+		seq_end_(&s.seq);
+	}
+
+	// Place a new record; returns false if the table is full.
+	bool insert_(const std::string& key, const Cache::Entry& e)
+	{
+		uint32_t mask = hdr->n_slots - 1;
+
+		if (n_used+1 > MaxLoad*hdr->n_slots) return false;
+
+		for (uint32_t i = e.hash & mask; ; i = (i+1) & mask) {
+			auto state = slots[i].state;
+			if (state == MDNS_SHM_SLOT_USED) continue;
+
+			if (state == MDNS_SHM_SLOT_DELETED) n_deleted--;
+			n_used++;
+
+			write_slot_(i, &e);
+			shadow[key] = { i, e.expires_ms, generation };
+			stats.written++;
+			return true;
+		}
+	}
+
+	// Returns number of records that didn't fit.
+	uint32_t rebuild_(Cache::Reader& reader, int64_t now_ms)
+	{
+		uint32_t skipped = 0;
+
+		seq_begin_(&hdr->seq);
+
+		for (uint32_t i=0; i<hdr->n_slots; i++) {
+			if (slots[i].state != MDNS_SHM_SLOT_EMPTY) {
+				seq_begin_(&slots[i].seq);
+				slots[i].state = MDNS_SHM_SLOT_EMPTY;
+				seq_end_(&slots[i].seq);
+			}
+		}
+
+		shadow.clear();
+		n_used = n_deleted = 0;
+
+		reader.ForEach(now_ms, [this, &skipped](const Cache::Entry& e) {
+			if (!fits_(e) || !insert_(key_(e), e)) skipped++;
+		});
+
+		seq_end_(&hdr->seq);
+		stats.rebuilds++;
+
+		return skipped;
+	}
+
+	// Returns number of slots written or deleted.
+	size_t Publish(Cache& cache, int64_t now_ms)
+	{
+		if (!hdr) return 0;
+
+		auto n0 = stats.written + stats.deleted;
+		uint32_t skipped = 0;
+		size_t n_new = 0;
+
+		Cache::Reader reader(cache);
+
+		// Records new or changed since last time are copied out; the rest
+		// are just marked as still present.
+		std::vector< std::pair<std::string,Cache::EntryPtr> > changed;
+
+		generation++;
+
+		reader.ForEach(now_ms, [&](const Cache::Entry& e) {
+			if (!fits_(e)) {
+				skipped++;
+				return;
+			}
+
+			auto key = key_(e);
+			auto it = shadow.find(key);
+
+			if (it == shadow.end()) {
+				n_new++;
+			}
+			else {
+				it->second.generation = generation;
+				if (it->second.expires_ms == e.expires_ms) return;
+			}
+
+			changed.push_back( {std::move(key), std::make_shared<const Cache::Entry>(e)} );
+		});
+
+		// Deleted slots accumulate; rebuild from scratch if there are too many
+		if ((n_deleted > 0) && (n_used + n_deleted + n_new > MaxLoad*hdr->n_slots)) {
+			skipped = rebuild_(reader, now_ms);
+		}
+		else {
+			// Gone from the cache (or expired)
+			for (auto it = shadow.begin(); it != shadow.end(); ) {
+				if (it->second.generation == generation) {
+					++it;
+					continue;
+				}
+				write_slot_(it->second.slot, nullptr);
+				n_used--;
+				n_deleted++;
+				stats.deleted++;
+				it = shadow.erase(it);
+			}
+
+			// New, or changed expiry
+			for (const auto& c : changed) {
+				auto it = shadow.find(c.first);
+				if (it != shadow.end()) {
+					write_slot_(it->second.slot, c.second.get());
+					it->second.expires_ms = c.second->expires_ms;
+					stats.written++;
+				}
+				else if (!insert_(c.first, *c.second)) {
+					skipped++;
+				}
+			}
+		}
+
+		stats.skipped += skipped;
+		stats.publishes++;
+
+		hdr->n_used = n_used;
+		hdr->n_skipped = skipped;
+		hdr->published_ms = now_ms;
+		__atomic_store_n(&hdr->generation, generation, __ATOMIC_RELEASE);
+
+		return (size_t)(stats.written + stats.deleted - n0);
+	}
+};
+
+}
+
+#endif
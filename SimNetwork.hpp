@@ -0,0 +1,463 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SIMNETWORK)
+
+#define MDNS_SIMNETWORK
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "SockUtil.hpp"
+#include "DatagramSocket.hpp"
+#include "Transport.hpp"
+
+namespace mDNS
+{
+
+//
+// In-memory IPv4 multicast network, for running thousands of hosts' worth of
+// protocol logic in one process, deterministically, under a virtual clock.
+//
+// The network is a set of links (think VLANs). Each Host is a Transport with
+// one virtual interface per link it is attached to: interface index k is its
+// k'th link, named "eth<k-1>", with address 10.<link>.<n/256>.<n%256> for the
+// n'th host on that link. Multicasts reach every socket on the link that
+// has joined the group (including the sender's, like IP_MULTICAST_LOOP) and
+// is bound to the destination port; unicasts reach the socket bound to the
+// port at the destination address. Interface index 0 means a host's first
+// interface, as the default multicast interface would for real sockets.
+//
+// Every packet takes latency_us, plus up to jitter_us chosen per packet, to
+// arrive; each receiver independently misses it with probability loss.
+// Sockets hold up to rx_limit datagrams (like SO_RCVBUF); beyond that, they
+// are dropped. Payloads are shared, not copied per receiver, until Read().
+//
+// Nothing happens between events, so time jumps straight from one to the
+// next: deliveries, and timers set with At(). Ties run in the order they
+// were scheduled, and the only randomness comes from rng, so a run with the
+// same seed and inputs always produces the same result (see Stats::digest).
+// A socket can have a callback that runs on each delivery, for hosts that
+// only react to traffic (e.g. responders); anything blocking in Wait(), e.g.
+// Resolver::Resolve(), runs the network itself until its data arrives or the
+// timeout passes in virtual time. Not thread safe; everything runs in the
+// calling thread, and Wait() must not be called from a callback.
+//
+struct SimNetwork
+{
+	struct Stats {
+		uint64_t packets = 0;     // sent
+		uint64_t bytes = 0;       // ... payload only
+		uint64_t deliveries = 0;  // datagrams queued on a receiving socket
+		uint64_t lost = 0;        // missed by a receiver (loss)
+		uint64_t overflows = 0;   // receiving socket full
+		uint64_t unreachable = 0; // unicast to nobody
+		uint64_t events = 0;
+		uint64_t digest = 0;      // of every delivery: time, host, socket, length
+	};
+
+	struct Datagram {
+		std::shared_ptr< const std::vector<char> > data;
+		sockaddr_in src, dst;
+		int ifc_idx;
+		int64_t t_us;
+	};
+
+	struct Socket {
+		bool open = true;
+		int port = 0;
+		int device = 0; // only this interface; 0 => all
+		std::deque<Datagram> rx;
+		std::function<void(int sd)> on_readable;
+	};
+
+	// Socket joined to a group on a link; port and interface copied here so
+	// a delivery only touches the hosts that take it.
+	struct Member {
+		int host, sd;
+		in_addr_t group;
+		int port;
+		int ifc_idx;
+	};
+
+	struct Link {
+		std::vector<Member> members;
+		int n_hosts = 0;
+	};
+
+	struct Host;
+
+	int64_t latency_us = 500;
+	int64_t jitter_us = 0;
+	double loss = 0.0;
+	size_t rx_limit = 1024;
+
+	int64_t now_us = 0;
+	std::mt19937_64 rng;
+
+	std::vector<Link> links;
+	std::vector< std::unique_ptr<Host> > hosts;
+	std::unordered_map<in_addr_t, std::pair<int,int>> by_address; // => host, interface index
+
+	Stats stats;
+
+	struct Event {
+		int64_t t;
+		uint64_t seq;
+		std::function<void()> fn;
+
+		bool operator>(const Event& e) const { return (t > e.t) || ((t == e.t) && (seq > e.seq)); }
+	};
+
+	std::priority_queue< Event, std::vector<Event>, std::greater<Event> > events;
+	uint64_t next_seq = 0;
+
+	SimNetwork(uint64_t seed = 1) : rng(seed) {}
+
+	SimNetwork(const SimNetwork&) = delete;
+	SimNetwork& operator=(const SimNetwork&) = delete;
+
+	//
+	// Setup
+	//
+
+	int AddLink()
+	{
+		if (links.size() > 255) ERROR("SimNetwork: too many links");
+		links.emplace_back();
+		return (int)links.size() - 1;
+	}
+
+	// New host attached to the given links, in that order (interface 1, 2 ...)
+	Host& AddHost(const std::vector<int>& on_links)
+	{
+		int id = (int)hosts.size();
+		hosts.emplace_back(new Host(*this, id));
+		auto& h = *hosts.back();
+
+		for (auto l : on_links) {
+			if ((l < 0) || ((size_t)l >= links.size())) ERROR("SimNetwork: no link %d", l);
+
+			int n = ++links[l].n_hosts;
+			if (n > 0xfffe) ERROR("SimNetwork: too many hosts on link %d", l);
+
+			in_addr a;
+			a.s_addr = htonl((10u << 24) | ((uint32_t)l << 16) | (uint32_t)n);
+			h.ifcs.push_back( {l, a} );
+			by_address[a.s_addr] = { id, (int)h.ifcs.size() };
+		}
+
+		return h;
+	}
+
+	//
+	// Time
+	//
+
+	void At(int64_t t_us, std::function<void()> fn)
+	{
+		events.push( {std::max(t_us, now_us), next_seq++, std::move(fn)} );
+	}
+
+	void After(int64_t dt_us, std::function<void()> fn)
+	{
+		At(now_us + dt_us, std::move(fn));
+	}
+
+	// Run the next event; false if there are none.
+	bool Step()
+	{
+		if (events.empty()) return false;
+
+		// Moved out before running, as it may schedule more
+		auto fn = std::move(const_cast<Event&>(events.top()).fn);
+		now_us = events.top().t;
+		events.pop();
+
+		stats.events++;
+		fn();
+		return true;
+	}
+
+	// Run everything due up to t_us, then advance the clock to t_us.
+	void RunUntil(int64_t t_us)
+	{
+		while (!events.empty() && (events.top().t <= t_us)) Step();
+		if (now_us < t_us) now_us = t_us;
+	}
+
+	// Uniform in [lo, hi]
+	int64_t Uniform(int64_t lo, int64_t hi)
+	{
+		return (hi <= lo) ? lo : std::uniform_int_distribution<int64_t>(lo, hi)(rng);
+	}
+
+	//
+	// Traffic
+	//
+
+	static uint64_t mix_(uint64_t h, uint64_t x)
+	{
+		h ^= x + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+		return h;
+	}
+
+	bool lose_()
+	{
+		return (loss > 0) && (std::uniform_real_distribution<double>(0, 1)(rng) < loss);
+	}
+
+	void deliver_(int host, int sd, const Datagram& d)
+	{
+		auto& h = *hosts[host];
+		auto& s = h.sockets[sd];
+
+		if (!s.open) return;
+		if (lose_()) {
+			stats.lost++;
+			return;
+		}
+		if (s.rx.size() >= rx_limit) {
+			stats.overflows++;
+			return;
+		}
+
+		s.rx.push_back(d);
+		s.rx.back().t_us = now_us;
+
+		stats.deliveries++;
+		stats.digest = mix_(stats.digest, (uint64_t)now_us);
+		stats.digest = mix_(stats.digest, ((uint64_t)host << 32) | ((uint64_t)sd << 16) | d.data->size());
+
+		if (s.on_readable) s.on_readable(sd);
+	}
+
+	// Sent by host out of interface ifc_idx (1-based) of socket sd
+	int send_(Host& h, int sd, const void *buf, size_t len, const sockaddr_storage& dst, int ifc_idx)
+	{
+		if ((sd < 0) || ((size_t)sd >= h.sockets.size()) || !h.sockets[sd].open) return -1;
+		if (dst.ss_family != AF_INET) return -1;
+
+		const auto& s = h.sockets[sd];
+		if (ifc_idx == 0) ifc_idx = (s.device > 0) ? s.device : 1;
+		if ((ifc_idx < 1) || ((size_t)ifc_idx > h.ifcs.size())) return -1;
+
+		Datagram d;
+		memset(&d.src, 0, sizeof(d.src));
+		d.data = std::make_shared< const std::vector<char> >((const char *)buf, (const char *)buf + len);
+		d.src.sin_family = AF_INET;
+		d.src.sin_port = htons(s.port);
+		d.src.sin_addr = h.ifcs[ifc_idx-1].addr;
+		memcpy(&d.dst, &dst, sizeof(d.dst));
+		d.ifc_idx = 0;
+		d.t_us = 0;
+
+		stats.packets++;
+		stats.bytes += len;
+
+		auto t = now_us + latency_us + Uniform(0, jitter_us);
+		auto group = d.dst.sin_addr.s_addr;
+		auto port = ntohs(d.dst.sin_port);
+
+		// Multicast: everyone on the link who joined, as of arrival
+		if ((ntohl(group) >> 28) == 0xe) {
+			int link = h.ifcs[ifc_idx-1].link;
+
+			At(t, [this, link, group, port, d]() mutable {
+				// Callbacks may join or leave, changing members under us; so take
+				// who's in first (a socket closed meanwhile gets nothing).
+				std::vector<Member> to;
+				for (const auto& m : links[link].members) {
+					if ((m.group == group) && (m.port == port)) to.push_back(m);
+				}
+				for (const auto& m : to) {
+					d.ifc_idx = m.ifc_idx;
+					deliver_(m.host, m.sd, d);
+				}
+			});
+			return (int)len;
+		}
+
+		// Unicast: first socket on that port at that address
+		auto it = by_address.find(group);
+		if (it == by_address.end()) {
+			stats.unreachable++;
+			return (int)len;
+		}
+
+		int host = it->second.first;
+		d.ifc_idx = it->second.second;
+
+		At(t, [this, host, port, d]() {
+			const auto& sockets = hosts[host]->sockets;
+			for (size_t k=0; k<sockets.size(); k++) {
+				const auto& s = sockets[k];
+				if (!s.open || (s.port != port)) continue;
+				if ((s.device > 0) && (s.device != d.ifc_idx)) continue;
+				deliver_(host, (int)k, d);
+				return;
+			}
+			stats.unreachable++;
+		});
+
+		return (int)len;
+	}
+
+	Stats GetStats() const { return stats; }
+
+	//
+	// One simulated host: a Transport over the network.
+	//
+	struct Host : public Transport
+	{
+		struct Ifc {
+			int link;
+			in_addr addr;
+		};
+
+		SimNetwork& net;
+		int id;
+		std::vector<Ifc> ifcs; // interface index k => ifcs[k-1]
+		std::vector<Socket> sockets; // by descriptor
+		int next_port = 49152;
+
+		Host(SimNetwork& net_, int id_) : net(net_), id(id_) {}
+
+		// Address of interface ifc_idx (0 => first)
+		sockaddr_storage Address(int ifc_idx = 0, int port = 0) const
+		{
+			sockaddr_storage ss;
+			memset(&ss, 0, sizeof(ss));
+
+			auto sa = (sockaddr_in *)&ss;
+			sa->sin_family = AF_INET;
+			sa->sin_port = htons(port);
+			sa->sin_addr = ifcs[(ifc_idx > 0) ? ifc_idx-1 : 0].addr;
+
+			return ss;
+		}
+
+		// Call fn(sd) on each delivery to sd
+		void OnReadable(int sd, std::function<void(int sd)> fn)
+		{
+			if ((sd >= 0) && ((size_t)sd < sockets.size())) sockets[sd].on_readable = std::move(fn);
+		}
+
+		//
+		// Transport
+		//
+
+		int Open(int family, int port, const char *device = nullptr) override
+		{
+			if (family != AF_INET) {
+				WARN("SimNetwork is IPv4 only");
+				return -1;
+			}
+			if (ifcs.empty()) return -1;
+
+			Socket s;
+			s.port = (port > 0) ? port : next_port++;
+
+			if (device) {
+				int k = -1;
+				if ((sscanf(device, "eth%d", &k) != 1) || (k < 0) || ((size_t)k >= ifcs.size())) {
+					WARN("No interface '%s'", device);
+					return -1;
+				}
+				s.device = k + 1;
+			}
+
+			sockets.push_back( std::move(s) );
+			return (int)sockets.size() - 1;
+		}
+
+		bool Join(int sd, const char *group, int ifc_idx = 0) override
+		{
+			in_addr g;
+
+			if ((sd < 0) || ((size_t)sd >= sockets.size()) || !sockets[sd].open) return false;
+			if (inet_pton(AF_INET, group, &g) != 1) return false;
+
+			if (ifc_idx == 0) ifc_idx = 1;
+			if ((size_t)ifc_idx > ifcs.size()) return false;
+
+			net.links[ifcs[ifc_idx-1].link].members.push_back( {id, sd, g.s_addr, sockets[sd].port, ifc_idx} );
+			return true;
+		}
+
+		int Wait(int sd, int timeout_ms) override
+		{
+			if ((sd < 0) || ((size_t)sd >= sockets.size())) return -1;
+
+			int64_t deadline = net.now_us + 1000LL*std::max(timeout_ms, 0);
+			const auto& rx = sockets[sd].rx;
+
+			while (rx.empty() && !net.events.empty() && (net.events.top().t <= deadline)) net.Step();
+			if (rx.empty() && (net.now_us < deadline)) net.now_us = deadline;
+
+			return rx.empty() ? 0 : 1;
+		}
+
+		int Read(int sd, void *buf, size_t len, DatagramSocket::Meta& meta) override
+		{
+			if ((sd < 0) || ((size_t)sd >= sockets.size())) return -1;
+
+			auto& rx = sockets[sd].rx;
+			if (rx.empty()) return -1;
+
+			const auto& d = rx.front();
+			size_t n = std::min(len, d.data->size());
+
+			memcpy(buf, d.data->data(), n);
+			memset(&meta.src, 0, sizeof(meta.src));
+			memset(&meta.dst, 0, sizeof(meta.dst));
+			memcpy(&meta.src, &d.src, sizeof(d.src));
+			memcpy(&meta.dst, &d.dst, sizeof(d.dst));
+			meta.ifc_idx = d.ifc_idx;
+			meta.rx_time.tv_sec = d.t_us / 1000000;
+			meta.rx_time.tv_nsec = (d.t_us % 1000000) * 1000;
+
+			rx.pop_front();
+			return (int)n;
+		}
+
+		int Send(int sd, const void *buf, size_t len, const sockaddr_storage& dst, int ifc_idx = 0) override
+		{
+			return net.send_(*this, sd, buf, len, dst, ifc_idx);
+		}
+
+		void Close(int sd) override
+		{
+			if ((sd < 0) || ((size_t)sd >= sockets.size())) return;
+
+			sockets[sd].open = false;
+			sockets[sd].rx.clear();
+			sockets[sd].on_readable = nullptr;
+
+			for (const auto& ifc : ifcs) {
+				auto& m = net.links[ifc.link].members;
+				m.erase(std::remove_if(m.begin(), m.end(),
+					[this,sd](const Member& x) { return (x.host == id) && (x.sd == sd); }), m.end());
+			}
+		}
+
+		int64_t Now_us() override
+		{
+			return net.now_us;
+		}
+	};
+};
+
+}
+
+#endif
@@ -0,0 +1,238 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SNAPSHOT)
+
+#define MDNS_SNAPSHOT
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Cache.hpp"
+
+namespace mDNS
+{
+
+//
+// On-disk snapshot of a Cache, so a restarted listener has a warm view of the
+// link straight away instead of re-browsing it.
+//
+// Expiry times are stored as absolute (Unix epoch) milliseconds, since the
+// cache's monotonic clock doesn't survive a reboot, and converted back on
+// load. The file is written to a temporary name and renamed into place, so
+// readers see either the old snapshot or the new one, never a partial file;
+// it is mapped (not read) on load and checked before anything is used.
+//
+// Format, version 1, native byte order (snapshots are not meant to move
+// between hosts):
+//
+//   Header   : magic "MDNSSNP1", version, n_records, written_ms, checksum
+//   Record * : expires_ms (int64), TTL (uint32), type, clss, rdata_len
+//              (uint16), name_len (uint8), then name and rdata bytes
+//
+// checksum is FNV-1a over everything after the header.
+//
+struct Snapshot
+{
+	struct Header {
+		uint64_t magic;
+		uint32_t version;
+		uint32_t n_records;
+		int64_t written_ms; // Unix epoch
+		uint64_t checksum;
+	};
+
+	struct RecordHeader {
+		int64_t expires_ms; // Unix epoch
+		uint32_t TTL;
+		uint16_t type, clss, rdata_len;
+		uint8_t name_len;
+	} __attribute__((packed));
+
+	static constexpr uint64_t Magic = 0x31504e53534e444dULL; // "MDNSSNP1"
+	static constexpr uint32_t Version = 1;
+
+	// Records with less than this fraction of their TTL left are "stale",
+	// i.e. worth querying again; RFC6762:5.2 refreshes at 80% of TTL.
+	static constexpr double StaleFraction = 0.2;
+
+	struct Question {
+		std::string name;
+		uint16_t type;
+		bool operator<(const Question& q) const { return (type != q.type) ? (type < q.type) : (name < q.name); }
+	};
+
+	static int64_t UnixNow()
+	{
+		using namespace std::chrono;
+		return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+	}
+
+	// Write unexpired cache contents to path; now_ms is the cache's clock.
+	// Returns number of records written, or -1 on error.
+	static int Write(Cache& cache, const std::string& path, int64_t now_ms)
+	{
+		std::vector<char> buf(sizeof(Header));
+		int64_t unix_ms = UnixNow();
+		uint32_t n = 0;
+
+		{
+			Cache::Reader reader(cache);
+			reader.ForEach(now_ms, [&](const Cache::Entry& e) {
+				if ((e.name.size() > 255) || (e.rdata.size() > 0xffff)) return;
+
+				RecordHeader r;
+				r.expires_ms = unix_ms + (e.expires_ms - now_ms);
+				r.TTL = e.TTL;
+				r.type = e.type;
+				r.clss = e.clss;
+				r.rdata_len = (uint16_t)e.rdata.size();
+				r.name_len = (uint8_t)e.name.size();
+
+				buf.insert(buf.end(), (const char*)&r, (const char*)&r + sizeof(r));
+				buf.insert(buf.end(), e.name.begin(), e.name.end());
+				buf.insert(buf.end(), e.rdata.begin(), e.rdata.end());
+				n++;
+			});
+		}
+
+		Header h;
+		h.magic = Magic;
+		h.version = Version;
+		h.n_records = n;
+		h.written_ms = unix_ms;
+		h.checksum = Hash::fnv1a(&buf[sizeof(Header)], buf.size()-sizeof(Header));
+		memcpy(&buf[0], &h, sizeof(h));
+
+		// Write to temporary file alongside, then atomically replace
+		auto tmp = path + ".tmp." + std::to_string(getpid());
+
+		int fd = open(tmp.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0644);
+		if (fd < 0) {
+			WARN("open(%s) failed", tmp.c_str());
+			return -1;
+		}
+
+		size_t done = 0;
+		while (done < buf.size()) {
+			auto k = write(fd, &buf[done], buf.size()-done);
+			if (k <= 0) break;
+			done += k;
+		}
+
+		bool ok = (done == buf.size()) && (fsync(fd) == 0);
+		close(fd);
+
+		if (!ok || (rename(tmp.c_str(), path.c_str()) != 0)) {
+			WARN("Failed to write snapshot %s", path.c_str());
+			unlink(tmp.c_str());
+			return -1;
+		}
+
+		return (int)n;
+	}
+
+	// Load snapshot into cache. Unexpired records are inserted; names of any
+	// that have expired or are close to it are placed in stale (if given),
+	// one per name and type, for re-querying. Returns number of records
+	// inserted, or -1 if the file is missing or invalid.
+	static int Load(Cache& cache, const std::string& path, int64_t now_ms,
+		std::vector<Question>* stale = nullptr)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return -1;
+
+		struct stat st;
+		if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(Header))) {
+			WARN("Snapshot %s too small", path.c_str());
+			close(fd);
+			return -1;
+		}
+
+		size_t len = st.st_size;
+		void* p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+
+		if (p == MAP_FAILED) {
+			WARN("mmap(%s) failed", path.c_str());
+			return -1;
+		}
+
+		auto bytes = (const char*)p;
+		int result = load_(cache, bytes, len, now_ms, stale);
+
+		munmap(p, len);
+
+		if (result < 0) WARN("Snapshot %s is invalid; ignored", path.c_str());
+
+		return result;
+	}
+
+	static int load_(Cache& cache, const char* bytes, size_t len, int64_t now_ms,
+		std::vector<Question>* stale)
+	{
+		Header h;
+		memcpy(&h, bytes, sizeof(h));
+
+		if ((h.magic != Magic) || (h.version != Version)) return -1;
+		if (h.checksum != Hash::fnv1a(bytes+sizeof(h), len-sizeof(h))) return -1;
+
+		int64_t unix_ms = UnixNow();
+		std::vector<Cache::Entry> entries;
+		std::set<Question> questions;
+		size_t i = sizeof(h);
+
+		entries.reserve(h.n_records);
+
+		for (uint32_t k=0; k<h.n_records; k++) {
+			RecordHeader r;
+
+			if (i+sizeof(r) > len) return -1;
+			memcpy(&r, bytes+i, sizeof(r));
+			i += sizeof(r);
+
+			if (i+r.name_len+r.rdata_len > len) return -1;
+
+			std::string name(bytes+i, r.name_len);
+			i += r.name_len;
+
+			int64_t remaining = r.expires_ms - unix_ms;
+
+			if (remaining < StaleFraction*1000*r.TTL) {
+				questions.insert( {name, r.type} );
+			}
+
+			if (remaining > 0) {
+				Cache::Entry e;
+				e.name = std::move(name);
+				e.type = r.type;
+				e.clss = r.clss;
+				e.TTL = r.TTL;
+				e.expires_ms = now_ms + remaining;
+				e.received_ms = e.expires_ms - 1000*(int64_t)r.TTL;
+				e.rdata.assign(bytes+i, bytes+i+r.rdata_len);
+				entries.push_back(std::move(e));
+			}
+
+			i += r.rdata_len;
+		}
+
+		if (stale) stale->assign(questions.begin(), questions.end());
+
+		return (int)cache.Insert(std::move(entries), now_ms);
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,300 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SOCKETFILTER)
+
+#define MDNS_SOCKETFILTER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <ctype.h>
+
+#include <string>
+#include <vector>
+
+#if __linux__
+	#include <linux/filter.h> // sock_filter, sock_fprog, BPF_<x>
+#else
+	// Classic BPF socket filters are Linux-only, but the instruction set is
+	// the same; rules can still be compiled, and applied via Match().
+	#include <net/bpf.h> // bpf_insn, BPF_<x>
+	using sock_filter = struct bpf_insn;
+#endif
+
+#include "DNS.hpp"
+#include "FilterRules.hpp"
+
+namespace mDNS
+{
+
+//
+// Compile a small set of rules into a classic BPF program, and attach it to a
+// UDP socket (e.g. from DatagramSocket::CreateAndBind()) so that the kernel
+// drops uninteresting mDNS traffic before it is copied to userspace.
+//
+// A datagram is accepted if ANY rule matches; a rule matches if ALL of its
+// specified fields match:
+//
+//   qr     : -1 = don't care, 0 = queries only, 1 = responses only
+//   type   : RR type of the first record (first question if n_question > 0,
+//            else first answer); 0 = don't care
+//   prefix : case-insensitive prefix of the first label of the first record;
+//            empty = don't care. Max. MaxPrefix characters.
+//
+// No rules => accept everything. Match() applies identical logic in userspace
+// (e.g. on platforms without socket filters, or for comparison). Note that a
+// datagram too short for the fields a rule inspects does not match it.
+//
+// For UDP sockets, offset 0 in the filter's view of the packet is the start
+// of the UDP header; the DNS message follows at offset 8.
+//
+struct SocketFilter
+{
+	struct Rule {
+		int qr = -1;
+		uint16_t type = 0;
+		std::string prefix;
+	};
+
+	static constexpr uint32_t Payload = 8;     // UDP header size
+	static constexpr size_t MaxLabels = 8;     // name walk is unrolled
+	static constexpr size_t MaxPrefix = 32;    // keeps jumps within 8 bits
+
+	std::vector<Rule> rules;
+
+	SocketFilter() {}
+	SocketFilter(const std::vector<Rule>& rules_) : rules(rules_) {}
+
+	static bool needs_type_(const std::vector<Rule>& rules)
+	{
+		for (const auto& r : rules) if (r.type != 0) return true;
+		return false;
+	}
+
+	// Minimal assembler: jump targets are symbolic labels, resolved at the end.
+	struct Asm
+	{
+		std::vector<sock_filter> prog;
+		std::vector<int> jt_label, jf_label; // -1 => next instruction
+		std::vector<int> labels;             // label => instruction index
+
+		int label() { labels.push_back(-1); return (int)labels.size()-1; }
+		void here(int l) { labels[l] = (int)prog.size(); }
+
+		void op(uint16_t code, uint32_t k, int jt = -1, int jf = -1)
+		{
+			prog.push_back( {code, 0, 0, k} );
+			jt_label.push_back(jt);
+			jf_label.push_back(jf);
+		}
+
+		bool resolve()
+		{
+			for (size_t i=0; i<prog.size(); i++) {
+				int t[2] = { jt_label[i], jf_label[i] };
+				uint8_t *j[2] = { &prog[i].jt, &prog[i].jf };
+
+				for (int n=0; n<2; n++) {
+					if (t[n] < 0) continue;
+					int ofs = labels[t[n]] - (int)(i+1);
+					if ((ofs < 0) || (ofs > 255)) {
+						WARN("BPF jump out of range (%d)", ofs);
+						return false;
+					}
+					*j[n] = (uint8_t)ofs;
+				}
+
+				// Unconditional jumps use k
+				if (prog[i].code == (BPF_JMP|BPF_JA)) {
+					prog[i].k = labels[prog[i].k] - (int)(i+1);
+				}
+			}
+			return true;
+		}
+	};
+
+	// Returns empty program on failure
+	std::vector<sock_filter> Compile() const
+	{
+		Asm a;
+
+		const uint32_t hdr = Payload;
+		const uint32_t first = Payload + 12;
+		const uint32_t accept = 0xFFFFFFFF, reject = 0;
+
+		if (rules.empty()) {
+			a.op(BPF_RET|BPF_K, accept);
+			return a.prog;
+		}
+
+		for (const auto& r : rules) {
+			if (r.prefix.size() > MaxPrefix) {
+				WARN("Prefix '%s' too long (max %d)", r.prefix.c_str(), (int)MaxPrefix);
+				return {};
+			}
+		}
+
+		int l_reject = a.label();
+
+		// Walk first record's name to find its type; store type in M[0].
+		if (needs_type_(rules)) {
+			int l_end1 = a.label(), l_end2 = a.label(), l_type = a.label();
+
+			a.op(BPF_LDX|BPF_W|BPF_IMM, first);
+			for (size_t n=0; n<MaxLabels; n++) {
+				a.op(BPF_LD|BPF_B|BPF_IND, 0);                // A = bytes[X]
+				a.op(BPF_JMP|BPF_JEQ|BPF_K, 0, l_end1, -1);   // terminator
+				a.op(BPF_JMP|BPF_JSET|BPF_K, 0xC0, l_end2, -1); // pointer
+				a.op(BPF_ALU|BPF_ADD|BPF_K, 1);
+				a.op(BPF_ALU|BPF_ADD|BPF_X, 0);
+				a.op(BPF_MISC|BPF_TAX, 0);
+			}
+			a.op(BPF_JMP|BPF_JA, l_reject);
+
+			a.here(l_end1);
+			a.op(BPF_MISC|BPF_TXA, 0);
+			a.op(BPF_ALU|BPF_ADD|BPF_K, 1);
+			a.op(BPF_MISC|BPF_TAX, 0);
+			a.op(BPF_JMP|BPF_JA, l_type);
+
+			a.here(l_end2);
+			a.op(BPF_MISC|BPF_TXA, 0);
+			a.op(BPF_ALU|BPF_ADD|BPF_K, 2);
+			a.op(BPF_MISC|BPF_TAX, 0);
+
+			a.here(l_type);
+			a.op(BPF_LD|BPF_H|BPF_IND, 0);
+			a.op(BPF_ST, 0);
+		}
+
+		for (const auto& r : rules) {
+			int l_next = a.label();
+
+			if (r.qr >= 0) {
+				a.op(BPF_LD|BPF_H|BPF_ABS, hdr+2);
+				if (r.qr) a.op(BPF_JMP|BPF_JSET|BPF_K, DNS::Defs::QRMask, -1, l_next);
+				else      a.op(BPF_JMP|BPF_JSET|BPF_K, DNS::Defs::QRMask, l_next, -1);
+			}
+
+			if (r.type != 0) {
+				a.op(BPF_LD|BPF_MEM, 0);
+				a.op(BPF_JMP|BPF_JEQ|BPF_K, r.type, -1, l_next);
+			}
+
+			if (!r.prefix.empty()) {
+				a.op(BPF_LD|BPF_B|BPF_ABS, first);
+				a.op(BPF_JMP|BPF_JSET|BPF_K, 0xC0, l_next, -1);
+				a.op(BPF_JMP|BPF_JGE|BPF_K, (uint32_t)r.prefix.size(), -1, l_next);
+
+				for (size_t n=0; n<r.prefix.size(); n++) {
+					unsigned char c = r.prefix[n];
+					a.op(BPF_LD|BPF_B|BPF_ABS, first+1+(uint32_t)n);
+					if (isalpha(c)) a.op(BPF_ALU|BPF_OR|BPF_K, 0x20); // lower case
+					a.op(BPF_JMP|BPF_JEQ|BPF_K, (uint32_t)tolower(c), -1, l_next);
+				}
+			}
+
+			a.op(BPF_RET|BPF_K, accept);
+			a.here(l_next);
+		}
+
+		a.here(l_reject);
+		a.op(BPF_RET|BPF_K, reject);
+
+		if (!a.resolve()) return {};
+		return a.prog;
+	}
+
+	// Userspace equivalent of the compiled program; buf is the DNS message.
+	bool Match(const char *buf, size_t len) const
+	{
+		if (rules.empty()) return true;
+
+		size_t first = 12;
+		uint16_t flags = 0, type = 0;
+
+		if (len < 12) return false;
+		DNS::Parse::read(buf, 2, len, flags);
+
+		if (needs_type_(rules)) {
+			size_t i = FilterRules::FirstTypeOfs(buf, len, MaxLabels);
+			if (i == 0) return false;
+			DNS::Parse::read(buf, i, len, type);
+		}
+
+		for (const auto& r : rules) {
+			if ((r.qr == 0) && (flags & DNS::Defs::QRMask)) continue;
+			if ((r.qr == 1) && !(flags & DNS::Defs::QRMask)) continue;
+			if ((r.type != 0) && (r.type != type)) continue;
+
+			if (!r.prefix.empty()) {
+				auto n = r.prefix.size();
+				if (first+1+n > len) continue;
+
+				uint8_t c = buf[first];
+				if ((c & 0xC0) || (c < n)) continue;
+				if (strncasecmp(&buf[first+1], r.prefix.c_str(), n) != 0) continue;
+			}
+
+			return true;
+		}
+
+		return false;
+	}
+
+	// Attach/detach compiled program; false if unsupported or failed.
+	static bool Attach(int sd, const std::vector<sock_filter>& prog)
+	{
+		#if __linux__
+			if (prog.empty()) return false;
+
+			struct sock_fprog fp;
+			fp.len = (unsigned short)prog.size();
+			fp.filter = const_cast<sock_filter *>(prog.data());
+
+			if (setsockopt(sd, SOL_SOCKET, SO_ATTACH_FILTER, &fp, sizeof(fp)) < 0) {
+				WARN("setsockopt(SO_ATTACH_FILTER)");
+				return false;
+			}
+			return true;
+		#else
+			(void)sd; (void)prog;
+			return false;
+		#endif
+	}
+
+	static bool Detach(int sd)
+	{
+		#if __linux__
+			int dummy = 0;
+			return (setsockopt(sd, SOL_SOCKET, SO_DETACH_FILTER, &dummy, sizeof(dummy)) == 0);
+		#else
+			(void)sd;
+			return false;
+		#endif
+	}
+
+	// Parse rule from string: [q|r][:TYPE][:prefix], e.g. "r:PTR:_ipp"
+	static bool ParseRule(const char *str, Rule& r)
+	{
+		auto field = FilterRules::Split(str);
+		field.resize(3);
+
+		r = Rule();
+
+		if (!FilterRules::ParseQR(field[0], r.qr)) return false;
+
+		if (!field[1].empty() && field[1] != "*") {
+			r.type = FilterRules::ParseType(field[1]);
+			if (r.type == 0) return false;
+		}
+
+		r.prefix = field[2];
+		return true;
+	}
+};
+
+}
+
+#endif
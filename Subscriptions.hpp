@@ -0,0 +1,231 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SUBSCRIPTIONS)
+
+#define MDNS_SUBSCRIPTIONS
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <functional>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "DNS.hpp"
+#include "DatagramSocket.hpp"
+
+namespace mDNS
+{
+
+//
+// Subscription registry: dispatch decoded records to every consumer whose
+// name pattern matches, in time proportional to the length of the name rather
+// than the number of subscribers.
+//
+// Patterns are dotted names, matched case-insensitively. A leading "*" label
+// matches one or more labels, e.g.:
+//
+//   "_airplay._tcp.local" : exactly that name
+//   "*._ipp._tcp.local"   : any name ending in "._ipp._tcp.local"
+//
+// Patterns are stored in a trie of labels in reverse order (i.e. "local" at
+// the root), so walking a name from its last label visits every pattern that
+// could match it. Names are read from the wire format in place (following
+// compression pointers), and are never converted to strings here.
+//
+struct Subscriptions
+{
+	// What a subscriber sees: the record (rr.name is empty; use rr.name_ofs
+	// with bytes if the name is needed), its source message and section.
+	struct Record {
+		const char *bytes;
+		size_t len;
+		int section; // DNS::Builder::Section
+		const DNS::ResourceRecord& rr;
+		const DatagramSocket::Meta *meta;
+	};
+
+	using Callback = std::function<void(const Record&)>;
+
+	struct Subscriber {
+		int id;
+		uint16_t type; // 0 => any type
+		Callback fn;
+	};
+
+	struct Node {
+		std::string label; // lower case
+		std::unordered_map< uint64_t, std::vector<std::unique_ptr<Node>> > children;
+		std::vector<Subscriber> exact, wildcard;
+	};
+
+	static constexpr size_t MaxLabels = 128; // max possible in a 255-byte name
+
+	Node root;
+	int next_id = 1;
+
+	std::shared_mutex mutex;
+
+	static std::vector<std::string> split_(const std::string& pattern)
+	{
+		std::vector<std::string> labels;
+		size_t start = 0;
+
+		while (start < pattern.size()) {
+			auto end = pattern.find('.', start);
+			if (end == std::string::npos) end = pattern.size();
+			if (end > start) {
+				auto lbl = pattern.substr(start, end-start);
+				for (auto& c : lbl) c = tolower((unsigned char)c);
+				labels.push_back(lbl);
+			}
+			start = end + 1;
+		}
+
+		return labels;
+	}
+
+	static Node* child_(const Node& n, const char *lbl, size_t len)
+	{
+		auto it = n.children.find( Hash::fnv1a_nocase(lbl,len) );
+		if (it == n.children.end()) return nullptr;
+
+		for (auto& c : it->second) {
+			if ((c->label.size() == len) && (strncasecmp(c->label.c_str(),lbl,len) == 0)) {
+				return c.get();
+			}
+		}
+
+		return nullptr;
+	}
+
+	// Returns subscription id (for Unsubscribe()), or 0 on bad pattern.
+	int Subscribe(const std::string& pattern, uint16_t type, Callback fn)
+	{
+		auto labels = split_(pattern);
+		bool wildcard = false;
+
+		if (!labels.empty() && labels[0] == "*") {
+			wildcard = true;
+			labels.erase(labels.begin());
+		}
+
+		if (labels.empty()) {
+			WARN("Bad subscription pattern '%s'", pattern.c_str());
+			return 0;
+		}
+
+		std::unique_lock<std::shared_mutex> lock(mutex);
+
+		Node* n = &root;
+		for (auto it = labels.rbegin(); it != labels.rend(); ++it) {
+			auto c = child_(*n, it->c_str(), it->size());
+			if (!c) {
+				auto& bucket = n->children[ Hash::fnv1a_nocase(it->c_str(),it->size()) ];
+				bucket.push_back( std::make_unique<Node>() );
+				c = bucket.back().get();
+				c->label = *it;
+			}
+			n = c;
+		}
+
+		int id = next_id++;
+		(wildcard ? n->wildcard : n->exact).push_back( {id, type, fn} );
+
+		return id;
+	}
+
+	bool Unsubscribe(int id)
+	{
+		std::unique_lock<std::shared_mutex> lock(mutex);
+		return unsubscribe_(root, id);
+	}
+
+	static bool unsubscribe_(Node& n, int id)
+	{
+		for (auto v : { &n.exact, &n.wildcard }) {
+			for (auto it = v->begin(); it != v->end(); ++it) {
+				if (it->id == id) {
+					v->erase(it);
+					return true;
+				}
+			}
+		}
+
+		for (auto& bucket : n.children) {
+			for (auto& c : bucket.second) {
+				if (unsubscribe_(*c, id)) return true;
+			}
+		}
+
+		return false;
+	}
+
+	static void notify_(const std::vector<Subscriber>& subs, const Record& rec)
+	{
+		for (const auto& s : subs) {
+			if ((s.type == 0) || (s.type == rec.rr.type) || (rec.rr.type == DNS::Defs::ANY)) {
+				s.fn(rec);
+			}
+		}
+	}
+
+	// Dispatch a single record to matching subscribers; returns false if the
+	// record's name could not be read.
+	bool Dispatch(const Record& rec)
+	{
+		DNS::Parse::Span spans[MaxLabels];
+		size_t n_spans;
+
+		if (DNS::Parse::spans(rec.bytes, rec.rr.name_ofs, rec.len, spans, MaxLabels, n_spans) == 0) {
+			return false;
+		}
+
+		std::shared_lock<std::shared_mutex> lock(mutex);
+
+		const Node* n = &root;
+		for (size_t k = n_spans; k-- > 0; ) {
+			n = child_(*n, &rec.bytes[spans[k].ofs], spans[k].len);
+			if (!n) return true;
+
+			if (k > 0) notify_(n->wildcard, rec); // at least one label remains
+		}
+		notify_(n->exact, rec);
+
+		return true;
+	}
+
+	// Walk all records of a message (questions included), dispatching each.
+	// Returns number of records dispatched.
+	int DispatchMessage(const char *bytes, size_t len, const DatagramSocket::Meta *meta = nullptr)
+	{
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+
+		size_t i = msg.read_header(bytes, 0, len);
+		if (i == 0) return 0;
+
+		int counts[] = { msg.n_question, msg.n_answer, msg.n_authority, msg.n_additional };
+		int n = 0;
+
+		for (int sec=0; sec<4; sec++) {
+			for (int j=0; j<counts[sec]; j++) {
+				i = (sec == 0) ? rr.read_header(bytes, i, len) : rr.read_header_and_body(bytes, i, len);
+				if (i == 0) return n;
+
+				Record rec = { bytes, len, sec, rr, meta };
+				Dispatch(rec);
+				n++;
+			}
+		}
+
+		return n;
+	}
+};
+
+}
+
+#endif
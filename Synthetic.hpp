@@ -0,0 +1,120 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_SYNTHETIC)
+
+#define MDNS_SYNTHETIC
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <string>
+#include <vector>
+
+#include "DNS.hpp"
+
+namespace mDNS
+{
+
+//
+// Synthetic DNS-SD traffic for load generation and benchmarks: queries,
+// announcements and goodbyes for service type t / instance i, plus a few
+// kinds of malformed packet. Not used by the listener itself.
+//
+// Service type 0 is "_ipp._tcp.local"; others are "_svcNN._tcp.local".
+//
+struct Synthetic
+{
+	static std::string service_type(int t)
+	{
+		char buf[64];
+		if (t == 0) return "_ipp._tcp.local";
+		snprintf(buf, sizeof(buf), "_svc%02d._tcp.local", t % 100);
+		return buf;
+	}
+
+	static std::string instance(int t, int i)
+	{
+		return "Device " + std::to_string(i) + "." + service_type(t);
+	}
+
+	static std::string host(int i)
+	{
+		return "device-" + std::to_string(i) + ".local";
+	}
+
+	// 10.x.y.z from instance number
+	static void address(int i, char addr[4])
+	{
+		addr[0] = 10;
+		addr[1] = (i >> 16) & 0xff;
+		addr[2] = (i >> 8) & 0xff;
+		addr[3] = i & 0xff;
+	}
+
+	static void query(std::vector<char>& buf, int t)
+	{
+		DNS::Builder b(buf);
+		b.question(service_type(t), DNS::Defs::PTR);
+	}
+
+	// PTR answer, with SRV/TXT/A additionals; ttl == 0 => goodbye
+	static void announcement(std::vector<char>& buf, int t, int i, uint32_t ttl = 4500)
+	{
+		const uint16_t flags = DNS::Defs::QRMask | DNS::Defs::AAMask;
+		const uint16_t in_flush = DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT;
+
+		auto inst = instance(t, i);
+		auto hst = host(i);
+		char addr[4];
+
+		address(i, addr);
+
+		DNS::Builder b(buf, 0, flags);
+		b.record(b.Answer, service_type(t), DNS::Defs::PTR, DNS::Defs::IN, ttl, DNS::Builder::rdata_name(inst));
+		if (ttl == 0) return;
+
+		b.record(b.Additional, inst, DNS::Defs::SRV, in_flush, 120, DNS::Builder::rdata_srv(0, 0, 631, hst));
+		b.record(b.Additional, inst, DNS::Defs::TXT, in_flush, ttl,
+			DNS::Builder::rdata_txt({"txtvers=1", "ty=Device " + std::to_string(i), "rp=ipp/print"}));
+		b.record(b.Additional, hst, DNS::Defs::A, in_flush, 120, addr, sizeof(addr));
+	}
+
+	static void goodbye(std::vector<char>& buf, int t, int i)
+	{
+		announcement(buf, t, i, 0);
+	}
+
+	// Variations on an announcement that a parser must reject cleanly.
+	static void malformed(std::vector<char>& buf, int t, int i, int kind)
+	{
+		announcement(buf, t, i);
+
+		switch (kind % 4) {
+			case 0: // truncated mid-record
+				buf.resize(buf.size() / 2);
+			break;
+
+			case 1: // counts claim more records than present
+			{
+				uint16_t n = 200;
+				DNS::Parse::write(buf.data(), 6, buf.size(), n);
+			}
+			break;
+
+			case 2: // name is a compression pointer to itself
+				buf[12] = (char)0xc0;
+				buf[13] = 12;
+			break;
+
+			case 3: // label length runs past end of packet
+				buf[12] = (char)0x3f;
+				buf.resize(30);
+			break;
+		}
+	}
+};
+
+}
+
+#endif
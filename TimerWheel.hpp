@@ -0,0 +1,123 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_TIMERWHEEL)
+
+#define MDNS_TIMERWHEEL
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <vector>
+
+namespace mDNS
+{
+
+//
+// Hierarchical timer wheel (after Varghese & Lauck): Levels wheels of Slots
+// slots each, where a slot on level l spans Slots^l ticks. A timer goes on
+// the lowest level whose range covers its deadline, and moves down a level
+// each time the wheel above it turns over, so it is handled O(Levels) times
+// however far away its deadline is. Advancing by one tick looks at a single
+// slot (plus, every Slots ticks, one slot of the level above), whatever the
+// number of timers.
+//
+// With 4 levels of 64 slots the range is 2^24 ticks; later deadlines are
+// parked in the top level and re-placed when it comes round.
+//
+// Timers can't be cancelled; values should carry enough to recognise stale
+// ones when they fire (e.g. a generation count). Ticks are whatever unit the
+// caller uses, and must only increase.
+//
+template <typename T>
+struct TimerWheel
+{
+	static constexpr int Bits = 6;
+	static constexpr int Levels = 4;
+	static constexpr uint64_t Slots = 1 << Bits;
+	static constexpr uint64_t Mask = Slots - 1;
+
+	struct Timer {
+		uint64_t deadline;
+		T value;
+	};
+
+	std::vector<Timer> slots[Levels][Slots];
+	uint64_t now = 0; // last tick processed
+	size_t size = 0;
+
+	TimerWheel(uint64_t start = 0) : now(start) {}
+
+	void place_(Timer&& t)
+	{
+		uint64_t when = (t.deadline > now) ? t.deadline : now;
+		uint64_t delta = when - now;
+
+		for (int l=0; l<Levels; l++) {
+			if (delta < (1ULL << (Bits*(l+1)))) {
+				slots[l][(when >> (Bits*l)) & Mask].push_back(std::move(t));
+				return;
+			}
+		}
+
+		// Out of range: the top level slot that will be visited last
+		auto top = Bits*(Levels-1);
+		slots[Levels-1][((now >> top) - 1) & Mask].push_back(std::move(t));
+	}
+
+	// Timers due now (or in the past) fire on the next Advance().
+	void Add(uint64_t deadline, const T& value)
+	{
+		if (deadline <= now) deadline = now + 1;
+		place_( {deadline, value} );
+		size++;
+	}
+
+	// Move to tick "to", calling fn(T&) for each timer whose deadline has
+	// passed, in deadline order (to within a tick). fn may Add() timers.
+	// Returns number fired.
+	template <typename F>
+	size_t Advance(uint64_t to, F fn)
+	{
+		size_t n = 0;
+		std::vector<Timer> due;
+
+		while (now < to) {
+			now++;
+
+			// Cascade: each level that turned over hands a slot down
+			for (int l=1; l<Levels; l++) {
+				if (now & ((1ULL << (Bits*l)) - 1)) break;
+
+				auto& slot = slots[l][(now >> (Bits*l)) & Mask];
+				if (slot.empty()) continue;
+
+				std::vector<Timer> tmp;
+				tmp.swap(slot);
+				for (auto& t : tmp) place_(std::move(t));
+			}
+
+			auto& slot = slots[0][now & Mask];
+			if (slot.empty()) continue;
+
+			due.clear();
+			due.swap(slot);
+
+			for (auto& t : due) {
+				if (t.deadline > now) {
+					place_(std::move(t)); // parked out-of-range timer
+					continue;
+				}
+				size--;
+				n++;
+				fn(t.value);
+			}
+		}
+
+		return n;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_TRANSPORT)
+
+#define MDNS_TRANSPORT
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <chrono>
+
+#include "SockUtil.hpp"
+#include "DatagramSocket.hpp"
+
+namespace mDNS
+{
+
+//
+// What protocol logic needs from the network, so it can run over real
+// sockets or a simulated network (see SimNetwork.hpp) unchanged: the
+// DatagramSocket calls, waiting for data, and a clock.
+//
+// Descriptors are whatever the transport says they are; only pass them back
+// to the transport that returned them. Times are microseconds from the
+// transport's own clock: steady_clock for sockets, virtual time when
+// simulated, so a timeout waited out in a simulation costs no real time.
+//
+struct Transport
+{
+	virtual ~Transport() {}
+
+	// As DatagramSocket::CreateAndBind(): port 0 => ephemeral; device, if
+	// given, restricts the socket to that interface. Returns -1 on failure.
+	virtual int Open(int family, int port, const char *device = nullptr) = 0;
+
+	// Join multicast group on interface ifc_idx; 0 => any/default.
+	virtual bool Join(int sd, const char *group, int ifc_idx = 0) = 0;
+
+	// > 0 if sd has data to Read() within timeout_ms; 0 => don't wait.
+	virtual int Wait(int sd, int timeout_ms) = 0;
+
+	// Next datagram waiting on sd, as DatagramSocket::Read(); doesn't block,
+	// returns -1 if there is none.
+	virtual int Read(int sd, void *buf, size_t len, DatagramSocket::Meta& meta) = 0;
+
+	// As DatagramSocket::Send(): to dst, out of interface ifc_idx only
+	// (0 => default).
+	virtual int Send(int sd, const void *buf, size_t len, const sockaddr_storage& dst, int ifc_idx = 0) = 0;
+
+	virtual void Close(int sd) = 0;
+
+	virtual int64_t Now_us() = 0;
+};
+
+//
+// Real sockets, via DatagramSocket.
+//
+struct SocketTransport : public Transport
+{
+	int Open(int family, int port, const char *device = nullptr) override
+	{
+		return DatagramSocket::CreateAndBind(family, port, nullptr, device);
+	}
+
+	bool Join(int sd, const char *group, int ifc_idx = 0) override
+	{
+		DatagramSocket::JoinMulticastIndex(sd, group, ifc_idx);
+		return true;
+	}
+
+	int Wait(int sd, int timeout_ms) override
+	{
+		struct pollfd pfd = { sd, POLLIN, 0 };
+		return poll(&pfd, 1, timeout_ms);
+	}
+
+	int Read(int sd, void *buf, size_t len, DatagramSocket::Meta& meta) override
+	{
+		return DatagramSocket::Read(sd, buf, len, meta, MSG_DONTWAIT);
+	}
+
+	int Send(int sd, const void *buf, size_t len, const sockaddr_storage& dst, int ifc_idx = 0) override
+	{
+		return DatagramSocket::Send(sd, buf, len, dst, ifc_idx);
+	}
+
+	void Close(int sd) override
+	{
+		close(sd);
+	}
+
+	int64_t Now_us() override
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	// Shared instance, for anything not given a transport
+	static SocketTransport& Default()
+	{
+		static SocketTransport t;
+		return t;
+	}
+};
+
+}
+
+#endif
@@ -0,0 +1,145 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_TXTRECORD)
+
+#define MDNS_TXTRECORD
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <strings.h> // strncasecmp()
+
+#include <string_view>
+#include <vector>
+
+namespace mDNS
+{
+
+namespace DNS
+{
+
+//
+// DNS-SD TXT record RDATA: a sequence of [N][b1,b2,...bN] strings, each of
+// the form "key=value", "key=" (empty value) or "key" (boolean attribute,
+// no value); RFC6763:6.3-6.5.
+//
+// TxtIndex records where each key and value lives as offsets relative to the
+// start of the RDATA, so it stays valid for any copy of the same RDATA (e.g.
+// one held in a cache) and need only be built once. TxtView pairs an index
+// with a particular copy of the RDATA and answers lookups with non-owning
+// string_views, without allocating.
+//
+struct TxtIndex
+{
+	struct Entry {
+		uint16_t key_ofs, val_ofs;
+		uint8_t key_len, val_len;
+		bool has_value;
+	};
+
+	std::vector<Entry> entries;
+
+	TxtIndex() {}
+	TxtIndex(const char *rdata, size_t len) { build(rdata, len); }
+
+	// Returns false on malformed RDATA; entries up to that point are kept.
+	bool build(const char *rdata, size_t len)
+	{
+		entries.clear();
+
+		if (!rdata) return false;
+
+		size_t i = 0;
+		while (i < len) {
+			uint8_t n = rdata[i++];
+
+			if (i+n > len) {
+				WARN("TXT string length exceeds RDATA: %d+%d, %d", (int)i, (int)n, (int)len);
+				return false;
+			}
+
+			// Empty strings and those starting with '=' are ignored; RFC6763:6.4
+			if ((n > 0) && (rdata[i] != '=')) {
+				Entry e = { (uint16_t)i, (uint16_t)i, n, 0, false };
+
+				auto eq = (const char *)memchr(&rdata[i], '=', n);
+				if (eq) {
+					e.key_len = (uint8_t)(eq - &rdata[i]);
+					e.val_ofs = (uint16_t)(i + e.key_len + 1);
+					e.val_len = (uint8_t)(n - e.key_len - 1);
+					e.has_value = true;
+				}
+
+				entries.push_back(e);
+			}
+
+			i += n;
+		}
+
+		return true;
+	}
+};
+
+struct TxtView
+{
+	const char *rdata = nullptr;
+	size_t len = 0;
+	const TxtIndex *index = nullptr;
+
+	TxtView() {}
+	TxtView(const char *rdata_, size_t len_, const TxtIndex& index_) :
+		rdata(rdata_), len(len_), index(&index_) {}
+
+	size_t size() const { return index ? index->entries.size() : 0; }
+
+	std::string_view key(size_t i) const
+	{
+		const auto& e = index->entries[i];
+		return std::string_view(&rdata[e.key_ofs], e.key_len);
+	}
+
+	std::string_view value(size_t i) const
+	{
+		const auto& e = index->entries[i];
+		return std::string_view(&rdata[e.val_ofs], e.val_len);
+	}
+
+	// Whole "key=value" string
+	std::string_view entry(size_t i) const
+	{
+		const auto& e = index->entries[i];
+		size_t n = e.has_value ? e.key_len + 1 + e.val_len : e.key_len;
+		return std::string_view(&rdata[e.key_ofs], n);
+	}
+
+	// Case-insensitive key search; first occurrence wins (RFC6763:6.4).
+	// Returns entry index, or -1 if not present.
+	int find(std::string_view k) const
+	{
+		for (size_t i=0, N=size(); i<N; i++) {
+			const auto& e = index->entries[i];
+			if ((e.key_len == k.size()) && (strncasecmp(&rdata[e.key_ofs], k.data(), k.size()) == 0)) {
+				return (int)i;
+			}
+		}
+		return -1;
+	}
+
+	bool has(std::string_view k) const { return find(k) >= 0; }
+
+	// False if key absent; boolean attributes yield an empty value.
+	bool get(std::string_view k, std::string_view& v) const
+	{
+		int i = find(k);
+		if (i < 0) return false;
+		v = value(i);
+		return true;
+	}
+};
+
+}
+
+}
+
+#endif
@@ -0,0 +1,376 @@
+/*
+	Author: John Grime
+*/
+
+#if !defined(MDNS_URINGRECEIVER)
+
+#define MDNS_URINGRECEIVER
+
+#include "defs.hpp" // should come before any inet headers etc
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if __linux__
+	#include <linux/io_uring.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "DNS.hpp"
+#include "DatagramSocket.hpp"
+
+namespace mDNS
+{
+
+//
+// Receive datagrams through io_uring rather than a recvmsg() call per packet.
+// A single multishot IORING_OP_RECVMSG stays armed on the socket, and the
+// kernel writes each datagram it receives into a buffer it picks from a ring
+// of buffers we provide (IORING_REGISTER_PBUF_RING), posting a completion
+// for it. Reading is then a look at shared memory, with a system call only
+// to wait when nothing is there. Needs Linux 6.0 or later.
+//
+// Each buffer holds an io_uring_recvmsg_out header, then the source address,
+// then the ancillary data (PKTINFO etc, decoded by ParseControl() as usual),
+// then the payload; a buffer goes back on the ring once its datagram has
+// been copied out by Read().
+//
+// Read() has the same contract as DatagramSocket::Read(). If io_uring can't
+// be set up (old kernel, disabled by sysctl or seccomp, non-Linux), a warning
+// is printed and Read() and Wait() fall back to recvmsg() and select() on
+// the socket; Active() says which is in use. As the multishot receive drains
+// the socket, callers must Wait() here rather than select() on it.
+//
+// Uses the raw system calls, so there's no dependency on liburing. One
+// thread per receiver.
+//
+struct UringReceiver
+{
+	using Meta = DatagramSocket::Meta;
+
+	static constexpr unsigned DefaultBuffers = 128;   // power of 2
+	static constexpr size_t NameSpace = sizeof(sockaddr_storage);
+	static constexpr size_t ControlSpace = 256;
+
+	int sd = -1;
+	int ring_fd = -1;
+	size_t max_payload = 0;
+
+	#if __linux__
+
+		// Submission and completion queues, shared with the kernel
+		void *sq_ptr = nullptr, *cq_ptr = nullptr;
+		size_t sq_size = 0, cq_size = 0;
+		io_uring_sqe *sqes = nullptr;
+		size_t sqes_size = 0;
+
+		unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_mask = nullptr, *sq_array = nullptr;
+		unsigned *cq_head = nullptr, *cq_tail = nullptr, *cq_mask = nullptr;
+		io_uring_cqe *cqes = nullptr;
+
+		// Provided buffers, and the ring through which they're handed over.
+		// Not io_uring_buf_ring: its flexible array member comes out 8 bytes
+		// late in C++, so the entries are addressed directly, with the tail
+		// (as the kernel has it) overlaying the first entry's resv field.
+		io_uring_buf *buf_ring = nullptr;
+		size_t buf_ring_size = 0;
+		unsigned n_bufs = 0;
+		uint16_t buf_tail = 0;
+		size_t buf_size = 0;
+		std::vector<char> bufs;
+
+		struct msghdr mh; // template for the multishot receive
+		bool armed = false;
+
+	#endif
+
+	static int enter_(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_sz)
+	{
+		#if __linux__
+			return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_sz);
+		#else
+			(void)fd; (void)to_submit; (void)min_complete; (void)flags; (void)arg; (void)arg_sz;
+			return -1;
+		#endif
+	}
+
+	// max_payload: largest datagram expected; longer ones are truncated.
+	UringReceiver(int sd_, size_t max_payload_ = DNS::EDNS::MaxPayload, unsigned n_bufs_ = DefaultBuffers) :
+		sd(sd_), max_payload(max_payload_)
+	{
+		#if __linux__
+			if (!setup_(n_bufs_)) {
+				WARN("io_uring unavailable; using recvmsg()");
+				errno = 0;
+				teardown_();
+			}
+		#else
+			(void)n_bufs_;
+			WARN("io_uring unavailable; using recvmsg()");
+		#endif
+	}
+
+	~UringReceiver()
+	{
+		#if __linux__
+			teardown_();
+		#endif
+	}
+
+	UringReceiver(const UringReceiver&) = delete;
+	UringReceiver& operator=(const UringReceiver&) = delete;
+
+	bool Active() const { return ring_fd >= 0; }
+
+	#if __linux__
+
+	bool setup_(unsigned n)
+	{
+		if ((n == 0) || (n & (n-1)) || (n > 32768)) return false;
+
+		// Room on the CQ for a completion per buffer, so none overflow (which
+		// ends the multishot receive)
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = 2*n;
+
+		ring_fd = (int)syscall(__NR_io_uring_setup, 4, &p);
+		if (ring_fd < 0) return false;
+
+		if (!(p.features & IORING_FEAT_SINGLE_MMAP)) return false;
+
+		// SQ and CQ rings share a mapping; SQEs have their own
+		sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+		cq_size = p.cq_off.cqes + p.cq_entries*sizeof(io_uring_cqe);
+		if (cq_size > sq_size) sq_size = cq_size;
+
+		sq_ptr = mmap(nullptr, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED) { sq_ptr = nullptr; return false; }
+		cq_ptr = sq_ptr;
+
+		sqes_size = p.sq_entries*sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe *)mmap(nullptr, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) { sqes = nullptr; return false; }
+
+		auto sq = (char *)sq_ptr, cq = (char *)cq_ptr;
+		sq_head = (unsigned *)(sq + p.sq_off.head);
+		sq_tail = (unsigned *)(sq + p.sq_off.tail);
+		sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+		sq_array = (unsigned *)(sq + p.sq_off.array);
+		cq_head = (unsigned *)(cq + p.cq_off.head);
+		cq_tail = (unsigned *)(cq + p.cq_off.tail);
+		cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+		cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+
+		// Buffer ring: page aligned, as mmap() gives us
+		n_bufs = n;
+		buf_ring_size = n_bufs*sizeof(io_uring_buf);
+		buf_ring = (io_uring_buf *)mmap(nullptr, buf_ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (buf_ring == MAP_FAILED) { buf_ring = nullptr; return false; }
+
+		io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+		reg.ring_entries = n_bufs;
+		reg.bgid = 0;
+		if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+		buf_size = sizeof(io_uring_recvmsg_out) + NameSpace + ControlSpace + max_payload;
+		bufs.resize(n_bufs*buf_size);
+		buf_tail = 0;
+		for (unsigned i=0; i<n_bufs; i++) recycle_(i);
+
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_namelen = NameSpace;
+		mh.msg_controllen = ControlSpace;
+
+		return arm_();
+	}
+
+	void teardown_()
+	{
+		if (sqes) munmap(sqes, sqes_size);
+		if (sq_ptr) munmap(sq_ptr, sq_size);
+		if (ring_fd >= 0) close(ring_fd);
+		if (buf_ring) munmap(buf_ring, buf_ring_size);
+
+		sqes = nullptr;
+		sq_ptr = cq_ptr = nullptr;
+		buf_ring = nullptr;
+		ring_fd = -1;
+		armed = false;
+	}
+
+	// Hand buffer back to the kernel
+	void recycle_(unsigned bid)
+	{
+		auto& b = buf_ring[buf_tail & (n_bufs-1)];
+		b.addr = (uint64_t)(uintptr_t)&bufs[bid*buf_size];
+		b.len = (uint32_t)buf_size;
+		b.bid = (uint16_t)bid;
+		buf_tail++;
+		__atomic_store_n(&buf_ring[0].resv, buf_tail, __ATOMIC_RELEASE);
+	}
+
+	// (Re)submit the multishot receive
+	bool arm_()
+	{
+		unsigned tail = *sq_tail;
+		unsigned idx = tail & *sq_mask;
+
+		auto sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = sd;
+		sqe->addr = (uint64_t)(uintptr_t)&mh;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->user_data = 1;
+
+		sq_array[idx] = idx;
+		__atomic_store_n(sq_tail, tail+1, __ATOMIC_RELEASE);
+
+		if (enter_(ring_fd, 1, 0, 0, nullptr, 0) != 1) {
+			WARN("io_uring_enter(submit) failed");
+			return false;
+		}
+
+		armed = true;
+		return true;
+	}
+
+	io_uring_cqe* peek_()
+	{
+		unsigned head = *cq_head;
+		if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return nullptr;
+		return &cqes[head & *cq_mask];
+	}
+
+	void pop_()
+	{
+		__atomic_store_n(cq_head, *cq_head + 1, __ATOMIC_RELEASE);
+	}
+
+	#endif
+
+	// Wait up to timeout_ms for a datagram; returns > 0 if Read() won't block,
+	// 0 on timeout (or signal), < 0 on error. As select() for the fallback.
+	int Wait(int timeout_ms)
+	{
+		#if __linux__
+			if (Active()) {
+				if (peek_()) return 1;
+				if (!armed && !arm_()) return -1;
+
+				struct __kernel_timespec ts;
+				ts.tv_sec = timeout_ms / 1000;
+				ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+				io_uring_getevents_arg arg;
+				memset(&arg, 0, sizeof(arg));
+				arg.sigmask_sz = _NSIG/8;
+				arg.ts = (uint64_t)(uintptr_t)&ts;
+
+				auto r = enter_(ring_fd, 0, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+				if ((r < 0) && (errno != ETIME) && (errno != EINTR)) return -1;
+				errno = 0;
+				return peek_() ? 1 : 0;
+			}
+		#endif
+
+		struct pollfd pfd = { sd, POLLIN, 0 };
+		return poll(&pfd, 1, timeout_ms);
+	}
+
+	//
+	// As DatagramSocket::Read(): copies the next datagram into buf, with its
+	// source, destination and interface in meta. Blocks if there's nothing
+	// to read.
+	//
+	int Read(void *buf, size_t len, Meta& meta)
+	{
+		if (!buf || (len<1)) return -1;
+
+		#if __linux__
+			if (!Active()) return DatagramSocket::Read(sd, buf, len, meta);
+
+			while (true) {
+				if (!armed && !arm_()) return -1;
+
+				auto cqe = peek_();
+				if (!cqe) {
+					if ((enter_(ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0) && (errno != EINTR)) {
+						WARN("io_uring_enter(wait) failed");
+						return -1;
+					}
+					continue;
+				}
+
+				auto res = cqe->res;
+				auto flags = cqe->flags;
+				pop_();
+
+				if (!(flags & IORING_CQE_F_MORE)) armed = false;
+
+				// Out of buffers (we re-arm above), or socket error
+				if (res < 0) {
+					if (res == -ENOBUFS) continue;
+					errno = -res;
+					WARN("multishot recvmsg() returned %d", res);
+					return -1;
+				}
+
+				if (!(flags & IORING_CQE_F_BUFFER)) continue;
+				unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+				int result = copy_(&bufs[bid*buf_size], (size_t)res, buf, len, meta);
+				recycle_(bid);
+				return result;
+			}
+		#else
+			return DatagramSocket::Read(sd, buf, len, meta);
+		#endif
+	}
+
+	#if __linux__
+
+	// Unpack name, control data and payload from a provided buffer
+	int copy_(char *p, size_t n, void *buf, size_t len, Meta& meta)
+	{
+		io_uring_recvmsg_out out;
+		if (n < sizeof(out)) return -1;
+		memcpy(&out, p, sizeof(out));
+
+		memset(&meta.src, 0, sizeof(meta.src));
+		memcpy(&meta.src, p + sizeof(out), std::min((size_t)out.namelen, sizeof(meta.src)));
+
+		// ParseControl() wants a msghdr; point it at the control data in place
+		struct msghdr ctl;
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.msg_control = p + sizeof(out) + NameSpace;
+		ctl.msg_controllen = out.controllen;
+		if (out.flags & MSG_CTRUNC) WARN("metadata is potentially truncated");
+		DatagramSocket::ParseControl(ctl, meta);
+
+		if (out.flags & MSG_TRUNC) WARN("datagram truncated to %d bytes", (int)max_payload);
+
+		size_t payload = sizeof(out) + NameSpace + ControlSpace;
+		size_t N = std::min((size_t)out.payloadlen, n - std::min(n, payload));
+		if (N > len) N = len;
+		memcpy(buf, p + payload, N);
+
+		return (int)N;
+	}
+
+	#endif
+};
+
+}
+
+#endif
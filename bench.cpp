@@ -0,0 +1,2212 @@
+/*
+	Author: John Grime
+*/
+
+#include "mDNS.hpp" // should come before any inet headers etc
+#include "Synthetic.hpp"
+#include "Responder.hpp"
+
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace mDNS;
+
+//
+// Micro-benchmarks; run as "./bench <name> [--option=value ...]".
+//
+// Traffic is generated over loopback, so no other hosts are needed. Note that
+// on loopback the kernel receive path (including any socket filter) runs in
+// the SENDING thread's context, so receiver CPU time excludes it.
+//
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Options as --key=value pairs, with defaults.
+
+struct Options
+{
+	std::map<std::string,std::string> kv;
+
+	Options(int argc, char **argv)
+	{
+		for (int i=2; i<argc; i++) {
+			std::string s(argv[i]);
+			if (s.compare(0,2,"--") != 0) ERROR("Bad option '%s'", argv[i]);
+			auto eq = s.find('=');
+			if (eq == std::string::npos) kv[s.substr(2)] = "1";
+			else kv[s.substr(2,eq-2)] = s.substr(eq+1);
+		}
+	}
+
+	long get(const char *key, long def) const
+	{
+		auto it = kv.find(key);
+		return (it == kv.end()) ? def : atol(it->second.c_str());
+	}
+
+	std::string get(const char *key, const char *def) const
+	{
+		auto it = kv.find(key);
+		return (it == kv.end()) ? def : it->second;
+	}
+};
+
+int64_t thread_cpu_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+// Full decode of all records in a message (no printing); returns record count.
+
+int decode_all(const char *buf, size_t len)
+{
+	DNS::Message msg;
+	DNS::ResourceRecord rr;
+	std::vector<std::string> tmp;
+
+	size_t i = msg.read_header(buf, 0, len);
+	if (i == 0) return 0;
+
+	int n = 0;
+	for (int q=0; q<msg.n_question; q++, n++) {
+		if ((i = rr.read_header(buf, i, len, tmp)) == 0) return n;
+	}
+
+	int total = msg.n_answer + msg.n_authority + msg.n_additional;
+	for (int r=0; r<total; r++, n++) {
+		if ((i = rr.read_header_and_body(buf, i, len, tmp)) == 0) return n;
+	}
+
+	return n;
+}
+
+// Synthetic service-discovery traffic: a query and an announcement for each
+// of a set of service types.
+
+std::vector< std::vector<char> > make_traffic(int n_types)
+{
+	std::vector< std::vector<char> > pkts;
+	std::vector<char> buf;
+
+	for (int t=0; t<n_types; t++) {
+		Synthetic::query(buf, t);
+		pkts.push_back(buf);
+
+		Synthetic::announcement(buf, t, t);
+		pkts.push_back(buf);
+	}
+
+	return pkts;
+}
+
+// Send packets round-robin to 127.0.0.1:port at (approximately) rate pps.
+
+void send_loop(int port, const std::vector< std::vector<char> >& pkts, long n, long rate)
+{
+	sockaddr_storage ss;
+	SockUtil::pack(&ss, AF_INET, "127.0.0.1", port);
+
+	int sd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sd < 0) ERROR("socket()");
+
+	auto t0 = Clock::now();
+	for (long i=0; i<n; i++) {
+		const auto& p = pkts[i % pkts.size()];
+		sendto(sd, p.data(), p.size(), 0, (sockaddr *)&ss, sizeof(sockaddr_in));
+
+		if ((rate > 0) && (i % 64 == 0)) {
+			auto due = t0 + std::chrono::nanoseconds((int64_t)(1e9 * i / rate));
+			while (Clock::now() < due) {}
+		}
+	}
+
+	close(sd);
+}
+
+//
+// In-kernel (BPF) vs userspace filtering of uninteresting traffic.
+//
+
+int bench_filter(const Options& opt)
+{
+	auto n = opt.get("n", 200000);
+	auto rate = opt.get("rate", 200000);
+	auto port = (int)opt.get("port", 53531);
+	auto n_types = (int)opt.get("types", 16);
+
+	auto pkts = make_traffic(n_types);
+
+	// Interesting: responses whose first answer is a PTR for "_ipp..."
+	SocketFilter filter;
+	SocketFilter::Rule r;
+	SocketFilter::ParseRule(opt.get("rule", "r:PTR:_ipp").c_str(), r);
+	filter.rules.push_back(r);
+
+	printf("filter: %ld packets at %ld pps, %d service types, rule qr=%d type=%d prefix='%s'\n",
+		n, rate, n_types, r.qr, r.type, r.prefix.c_str());
+	printf("%-10s %10s %10s %10s %12s %12s\n",
+		"mode", "received", "matched", "records", "rx_cpu_ms", "ns/sent");
+
+	for (int kernel=0; kernel<2; kernel++) {
+		std::atomic<bool> done(false);
+		long received = 0, matched = 0, records = 0;
+		int64_t cpu_ns = 0;
+
+		int sd = DatagramSocket::CreateAndBind(AF_INET, port);
+		int rcvbuf = 8*1024*1024;
+		setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+		if (kernel && !SocketFilter::Attach(sd, filter.Compile())) {
+			printf("%-10s (socket filters unavailable)\n", "kernel");
+			close(sd);
+			continue;
+		}
+
+		std::thread rx([&] {
+			DatagramSocket::Meta meta;
+			std::vector<char> buf(66000);
+			fd_set fds;
+
+			auto t0 = thread_cpu_ns();
+			while (true) {
+				struct timeval tv = { 0, 200000 };
+				FD_ZERO(&fds);
+				FD_SET(sd, &fds);
+				if (select(sd+1, &fds, nullptr, nullptr, &tv) < 1) {
+					if (done) break;
+					continue;
+				}
+
+				auto N = DatagramSocket::Read(sd, buf.data(), buf.size(), meta);
+				if (N < 0) continue;
+				received++;
+
+				if (!kernel && !filter.Match(buf.data(), N)) continue;
+				matched++;
+				records += decode_all(buf.data(), N);
+			}
+			cpu_ns = thread_cpu_ns() - t0;
+		});
+
+		send_loop(port, pkts, n, rate);
+		done = true;
+		rx.join();
+		close(sd);
+
+		printf("%-10s %10ld %10ld %10ld %12.2f %12.1f\n",
+			kernel ? "kernel" : "userspace", received, matched, records,
+			cpu_ns/1e6, (double)cpu_ns/n);
+	}
+
+	return 0;
+}
+
+// Decode cost under a flood, with and without the header prefilter: a mix
+// of queries, announcements and malformed packets, of which only responses
+// matching the policy are wanted. Everything else is decoded in full (as the
+// quiet listener would) or rejected from the header.
+
+int bench_prefilter(const Options& opt)
+{
+	auto n = opt.get("n", 1000000);
+	auto n_types = (int)opt.get("types", 16);
+	auto queries = (int)opt.get("queries", 8); // per announcement
+	auto spec = opt.get("policy", "r:PTR");
+
+	Prefilter prefilter;
+	if (!Prefilter::ParsePolicy(spec.c_str(), prefilter.policy)) ERROR("Bad policy '%s'", spec.c_str());
+
+	std::vector< std::vector<char> > pkts;
+	std::vector<char> buf;
+
+	for (int t=0; t<n_types; t++) {
+		Synthetic::announcement(buf, t, t);
+		pkts.push_back(buf);
+		for (int k=0; k<queries; k++) {
+			Synthetic::query(buf, (t+k) % n_types);
+			pkts.push_back(buf);
+		}
+		Synthetic::malformed(buf, t, t, t);
+		pkts.push_back(buf);
+	}
+
+	Subscriptions subs;
+	long records = 0;
+	subs.Subscribe("*.local", 0, [&records](const Subscriptions::Record&) { records++; });
+
+	printf("prefilter: %ld packets, %d queries per announcement, policy '%s'\n", n, queries, spec.c_str());
+	printf("  %-12s %10s %10s %12s %10s\n", "mode", "decoded", "records", "ns/packet", "total ms");
+
+	// Parse::labels() etc. warn about the malformed packets; not of interest here
+	int stderr_fd = dup(2), null_fd = open("/dev/null", O_WRONLY);
+
+	for (int pre=0; pre<2; pre++) {
+		long decoded = 0;
+		records = 0;
+
+		dup2(null_fd, 2);
+		auto t0 = Clock::now();
+
+		for (long i=0; i<n; i++) {
+			const auto& p = pkts[i % pkts.size()];
+			if (pre && !prefilter.Accept(p.data(), p.size())) continue;
+			subs.DispatchMessage(p.data(), p.size());
+			decoded++;
+		}
+
+		double elapsed = std::chrono::duration<double,std::milli>(Clock::now() - t0).count();
+		dup2(stderr_fd, 2);
+
+		printf("  %-12s %10ld %10ld %12.1f %10.1f\n", pre ? "prefilter" : "full decode",
+			decoded, records, 1e6*elapsed/n, elapsed);
+	}
+
+	close(null_fd);
+	close(stderr_fd);
+
+	auto st = prefilter.GetStats();
+	printf("  skipped %llu of %llu (%.1f%%) :", (unsigned long long)st.skipped,
+		(unsigned long long)st.seen, 100.0*st.skipped/st.seen);
+	for (int r=0; r<Prefilter::NReasons; r++) {
+		printf(" %s %llu", Prefilter::ReasonNames[r], (unsigned long long)st.reasons[r]);
+	}
+	printf("\n");
+
+	return 0;
+}
+
+//
+// Receive backends: recvmsg() per datagram vs io_uring multishot recvmsg into
+// provided buffers, each waited on as the listener does (select() or Wait()).
+// One thread sends a batch over loopback and then reads it back, so the cost
+// of sending (and the kernel receive path that runs with it) is included,
+// and is the same for both.
+//
+
+int bench_recv(const Options& opt)
+{
+	auto n = opt.get("n", 1000000);
+	auto batch = opt.get("batch", 64);
+	auto port = (int)opt.get("port", 53532);
+	auto n_types = (int)opt.get("types", 16);
+
+	auto pkts = make_traffic(n_types);
+
+	sockaddr_storage ss;
+	SockUtil::pack(&ss, AF_INET, "127.0.0.1", port);
+
+	printf("recv: %ld packets in batches of %ld, %d service types\n", n, batch, n_types);
+	printf("  %-10s %10s %10s %12s %12s\n", "backend", "received", "pktinfo", "cpu ns/pkt", "wall ns/pkt");
+
+	for (int uring=0; uring<2; uring++) {
+		int rx = DatagramSocket::CreateAndBind(AF_INET, port);
+		int rcvbuf = 8*1024*1024;
+		setsockopt(rx, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+		int tx = socket(PF_INET, SOCK_DGRAM, 0);
+		if (tx < 0) ERROR("socket()");
+
+		std::unique_ptr<UringReceiver> ring;
+		if (uring) {
+			ring.reset(new UringReceiver(rx));
+			if (!ring->Active()) {
+				printf("  %-10s (unavailable)\n", "io_uring");
+				close(tx);
+				ring.reset();
+				close(rx);
+				continue;
+			}
+		}
+
+		DatagramSocket::Meta meta;
+		std::vector<char> buf(66000);
+		fd_set fds;
+		long received = 0, pktinfo = 0;
+
+		auto c0 = thread_cpu_ns();
+		auto t0 = Clock::now();
+
+		for (long i=0; i<n; i+=batch) {
+			long m = std::min(batch, n-i);
+
+			for (long k=0; k<m; k++) {
+				const auto& p = pkts[(i+k) % pkts.size()];
+				sendto(tx, p.data(), p.size(), 0, (sockaddr *)&ss, sizeof(sockaddr_in));
+			}
+
+			for (long k=0; k<m; k++) {
+				int w;
+				if (ring) w = ring->Wait(200);
+				else {
+					struct timeval tv = { 0, 200000 };
+					FD_ZERO(&fds);
+					FD_SET(rx, &fds);
+					w = select(rx+1, &fds, nullptr, nullptr, &tv);
+				}
+				if (w < 1) break; // lost
+
+				auto N = ring ? ring->Read(buf.data(), buf.size(), meta) :
+					DatagramSocket::Read(rx, buf.data(), buf.size(), meta);
+				if (N < 0) continue;
+
+				received++;
+				if (meta.ifc_idx > 0) pktinfo++;
+			}
+		}
+
+		double cpu_ns = thread_cpu_ns() - c0;
+		double wall_ns = std::chrono::duration<double,std::nano>(Clock::now() - t0).count();
+
+		close(tx);
+		ring.reset();
+		close(rx);
+
+		printf("  %-10s %10ld %10ld %12.1f %12.1f\n", uring ? "io_uring" : "recvmsg",
+			received, pktinfo, cpu_ns/n, wall_ns/n);
+	}
+
+	return 0;
+}
+
+//
+// End-to-end query/answer latency, with responder and querier in-process and
+// talking over loopback multicast.
+//
+
+int64_t realtime_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+int64_t ns_(const struct timespec& ts)
+{
+	return (int64_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+// Print p50/p99/p999 of a sample (in ns) as microseconds
+void percentiles(const char *label, std::vector<int64_t>& v)
+{
+	if (v.empty()) {
+		printf("  %-28s (no samples)\n", label);
+		return;
+	}
+
+	std::sort(v.begin(), v.end());
+	auto p = [&v](double q) { return v[std::min(v.size()-1, (size_t)(q*v.size()))] / 1e3; };
+
+	printf("  %-28s %9.2f %9.2f %9.2f %9.2f\n", label, p(0.5), p(0.99), p(0.999), v.back()/1e3);
+}
+
+// Join group on the named interface (by its first IPv4 address)
+bool join_on_(int sd, const char *group, Interfaces& ifcs, const char *ifc_name)
+{
+	auto ifc = ifcs.LookupByName(ifc_name);
+	if (!ifc) return false;
+
+	for (const auto ifa : ifc->addresses) {
+		if (ifa->ifa_addr && (ifa->ifa_addr->sa_family == AF_INET)) {
+			DatagramSocket::JoinMulticastGroup(sd, group, ifa);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int bench_latency(const Options& opt)
+{
+	auto n = opt.get("n", 100000);
+	auto port = (int)opt.get("port", 53533);
+	auto n_hosts = (int)opt.get("hosts", 1000);
+	auto ifc_name = opt.get("ifc", "lo");
+	const char *group = "224.0.0.251";
+
+	Interfaces ifcs;
+	unsigned int ifc_idx = Interfaces::GetIndex(ifc_name.c_str());
+	if (ifc_idx == 0) ERROR("Unknown interface '%s'", ifc_name.c_str());
+
+	// Per-query timestamps (CLOCK_REALTIME ns, to compare with kernel stamps)
+	struct Sample {
+		int64_t send0, send1;          // querier: around sendto()
+		int64_t r_krx, r_user, r_send; // responder: kernel rx, user rx, reply built
+		int64_t q_krx, q_user, q_done; // querier: kernel rx, user rx, decoded
+	};
+	std::vector<Sample> samples(n);
+
+	// Queries go one at a time; the DNS id is only 16 bits, so the responder
+	// finds the sample via the query in flight rather than samples[id].
+	std::atomic<long> in_flight(-1);
+
+	// Responder: authoritative A records for host-<i>.local
+
+	Responder responder;
+	for (int i=0; i<n_hosts; i++) {
+		char addr[4];
+		Synthetic::address(i, addr);
+		responder.Add("host-" + std::to_string(i) + ".local", DNS::Defs::A,
+			DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT, 120, std::vector<char>(addr, addr+4));
+	}
+
+	int rsd = DatagramSocket::CreateAndBind(AF_INET, port);
+	if (!join_on_(rsd, group, ifcs, ifc_name.c_str())) {
+		ERROR("No IPv4 address on '%s' to join %s", ifc_name.c_str(), group);
+	}
+	DatagramSocket::EnableTimestamps(rsd);
+
+	std::atomic<bool> done(false);
+
+	std::thread rx([&] {
+		DatagramSocket::Meta meta;
+		std::vector<char> buf(66000), out;
+		fd_set fds;
+
+		while (!done) {
+			struct timeval tv = { 0, 100000 };
+			FD_ZERO(&fds);
+			FD_SET(rsd, &fds);
+			if (select(rsd+1, &fds, nullptr, nullptr, &tv) < 1) continue;
+
+			auto N = DatagramSocket::Read(rsd, buf.data(), buf.size(), meta);
+			auto t_user = realtime_ns();
+			if (N < 12) continue;
+
+			int src_port = 0;
+			SockUtil::unpack(&meta.src, nullptr, 0, &src_port);
+
+			if (!responder.Respond(buf.data(), N, src_port != 5353, out)) continue;
+
+			uint16_t id = 0;
+			DNS::Parse::read(buf.data(), 0, N, id);
+			long seq = in_flight;
+			if ((seq >= 0) && (id == (uint16_t)seq)) {
+				auto& s = samples[seq];
+				s.r_krx = ns_(meta.rx_time);
+				s.r_user = t_user;
+				s.r_send = realtime_ns();
+			}
+
+			// Reply direct to (legacy unicast) querier
+			sendto(rsd, out.data(), out.size(), 0, (sockaddr *)&meta.src, sizeof(sockaddr_in));
+		}
+	});
+
+	// Querier: ephemeral port, multicast out via ifc, timestamps on replies
+
+	int qsd = socket(PF_INET, SOCK_DGRAM, 0);
+	{
+		int on = 1;
+		struct ip_mreqn m;
+		memset(&m, 0, sizeof(m));
+		m.imr_ifindex = ifc_idx;
+		if (setsockopt(qsd, IPPROTO_IP, IP_MULTICAST_IF, &m, sizeof(m)) < 0) ERROR("IP_MULTICAST_IF");
+		setsockopt(qsd, IPPROTO_IP, IP_PKTINFO, &on, sizeof(on));
+		DatagramSocket::SetMulticastLoop(qsd, AF_INET, true);
+		DatagramSocket::EnableTimestamps(qsd);
+	}
+
+	sockaddr_storage dst;
+	SockUtil::pack(&dst, AF_INET, group, port);
+
+	// Decoded answers go through the subscription dispatcher, as they would
+	// in a real consumer.
+	Subscriptions subs;
+	long answers = 0;
+	subs.Subscribe("*.local", DNS::Defs::A, [&answers](const Subscriptions::Record& r) {
+		if (r.section == DNS::Builder::Answer) answers++;
+	});
+
+	DatagramSocket::Meta meta;
+	std::vector<char> buf(66000), q;
+	long lost = 0;
+	fd_set fds;
+
+	auto t0 = Clock::now();
+
+	for (long i=0; i<n; i++) {
+		auto& s = samples[i];
+		std::string name = "host-" + std::to_string(i % n_hosts) + ".local";
+
+		DNS::Builder b(q, (uint16_t)i);
+		b.question(name, DNS::Defs::A);
+
+		in_flight = i;
+		s.send0 = realtime_ns();
+		if (sendto(qsd, q.data(), q.size(), 0, (sockaddr *)&dst, sizeof(sockaddr_in)) < 0) {
+			ERROR("sendto() failed; is multicast enabled on '%s'?", ifc_name.c_str());
+		}
+		s.send1 = realtime_ns();
+
+		// Wait for the matching reply (discarding any stale ones)
+		while (true) {
+			struct timeval tv = { 0, 100000 };
+			FD_ZERO(&fds);
+			FD_SET(qsd, &fds);
+			if (select(qsd+1, &fds, nullptr, nullptr, &tv) < 1) {
+				lost++;
+				s.q_done = 0;
+				break;
+			}
+
+			auto N = DatagramSocket::Read(qsd, buf.data(), buf.size(), meta);
+			auto t_user = realtime_ns();
+			if (N < 12) continue;
+
+			uint16_t id = 0;
+			DNS::Parse::read(buf.data(), 0, N, id);
+			if (id != (uint16_t)i) continue;
+
+			subs.DispatchMessage(buf.data(), N, &meta);
+
+			s.q_krx = ns_(meta.rx_time);
+			s.q_user = t_user;
+			s.q_done = realtime_ns();
+			break;
+		}
+	}
+
+	double elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+
+	done = true;
+	rx.join();
+	close(rsd);
+	close(qsd);
+
+	// Stage breakdown
+
+	std::vector<int64_t> rtt, send, krx_r, wake_r, handle_r, krx_q, wake_q, decode_q;
+
+	for (const auto& s : samples) {
+		if (s.q_done == 0) continue;
+		rtt.push_back(s.q_done - s.send0);
+		send.push_back(s.send1 - s.send0);
+		handle_r.push_back(s.r_send - s.r_user);
+		decode_q.push_back(s.q_done - s.q_user);
+
+		// Kernel timestamps, where available
+		if (s.r_krx) {
+			krx_r.push_back(s.r_krx - s.send0);
+			wake_r.push_back(s.r_user - s.r_krx);
+		}
+		if (s.q_krx) {
+			krx_q.push_back(s.q_krx - s.r_send);
+			wake_q.push_back(s.q_user - s.q_krx);
+		}
+	}
+
+	printf("latency: %ld queries over %s, %d hosts : %.0f queries/s, %ld lost, %ld answers\n",
+		n, ifc_name.c_str(), n_hosts, (n-lost)/elapsed, lost, answers);
+	printf("  %-28s %9s %9s %9s %9s   (microseconds)\n", "stage", "p50", "p99", "p999", "max");
+	percentiles("round trip", rtt);
+	percentiles("query sendto()", send);
+	percentiles("query kernel delivery", krx_r);
+	percentiles("responder wakeup", wake_r);
+	percentiles("responder parse+build", handle_r);
+	percentiles("reply kernel delivery", krx_q);
+	percentiles("querier wakeup", wake_q);
+	percentiles("querier parse+dispatch", decode_q);
+
+	return 0;
+}
+
+// Repeated AAAA lookups for IPv4-only hosts, with and without NSEC in the
+// responder. Without it, every lookup waits out the timeout and asks again;
+// with it, the first query per host is answered "no" and the rest are
+// answered from the querier's cache.
+
+int bench_negative(const Options& opt)
+{
+	auto n = opt.get("n", 200);
+	auto port = (int)opt.get("port", 53533);
+	auto n_hosts = (int)opt.get("hosts", 20);
+	auto timeout_ms = (int)opt.get("timeout-ms", 20);
+	auto ifc_name = opt.get("ifc", "lo");
+	const char *group = "224.0.0.251";
+
+	Interfaces ifcs;
+	unsigned int ifc_idx = Interfaces::GetIndex(ifc_name.c_str());
+	if (ifc_idx == 0) ERROR("Unknown interface '%s'", ifc_name.c_str());
+
+	Responder responder;
+	for (int i=0; i<n_hosts; i++) {
+		char addr[4];
+		Synthetic::address(i, addr);
+		responder.Add("host-" + std::to_string(i) + ".local", DNS::Defs::A,
+			DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT, 120, std::vector<char>(addr, addr+4));
+	}
+
+	int rsd = DatagramSocket::CreateAndBind(AF_INET, port);
+	if (!join_on_(rsd, group, ifcs, ifc_name.c_str())) {
+		ERROR("No IPv4 address on '%s' to join %s", ifc_name.c_str(), group);
+	}
+
+	std::atomic<bool> done(false);
+	std::atomic<long> replies(0);
+
+	std::thread rx([&] {
+		DatagramSocket::Meta meta;
+		std::vector<char> buf(66000), out;
+		fd_set fds;
+
+		while (!done) {
+			struct timeval tv = { 0, 100000 };
+			FD_ZERO(&fds);
+			FD_SET(rsd, &fds);
+			if (select(rsd+1, &fds, nullptr, nullptr, &tv) < 1) continue;
+
+			auto N = DatagramSocket::Read(rsd, buf.data(), buf.size(), meta);
+			if (N < 12) continue;
+
+			int src_port = 0;
+			SockUtil::unpack(&meta.src, nullptr, 0, &src_port);
+
+			if (!responder.Respond(buf.data(), N, src_port != 5353, out)) continue;
+
+			sendto(rsd, out.data(), out.size(), 0, (sockaddr *)&meta.src, sizeof(sockaddr_in));
+			replies++;
+		}
+	});
+
+	int qsd = socket(PF_INET, SOCK_DGRAM, 0);
+	{
+		struct ip_mreqn m;
+		memset(&m, 0, sizeof(m));
+		m.imr_ifindex = ifc_idx;
+		if (setsockopt(qsd, IPPROTO_IP, IP_MULTICAST_IF, &m, sizeof(m)) < 0) ERROR("IP_MULTICAST_IF");
+		DatagramSocket::SetMulticastLoop(qsd, AF_INET, true);
+	}
+
+	sockaddr_storage dst;
+	SockUtil::pack(&dst, AF_INET, group, port);
+
+	printf("negative: %ld AAAA lookups for %d IPv4-only hosts, %d ms timeout\n", n, n_hosts, timeout_ms);
+	printf("  %-8s %9s %9s %9s %9s %12s\n", "NSEC", "queries", "replies", "timeouts", "cached", "total ms");
+
+	for (bool negative : { false, true }) {
+		responder.negative = negative;
+		replies = 0;
+
+		Cache cache;
+		Cache::Reader reader(cache);
+		DatagramSocket::Meta meta;
+		std::vector<char> buf(66000), q;
+		long queries = 0, timeouts = 0, cached = 0;
+		fd_set fds;
+
+		auto t0 = Clock::now();
+
+		for (long i=0; i<n; i++) {
+			std::string name = "host-" + std::to_string(i % n_hosts) + ".local";
+			auto now_ms = Cache::Now();
+
+			if (reader.Absent(name, DNS::Defs::AAAA, now_ms) ||
+				reader.Lookup(name, DNS::Defs::AAAA, now_ms, [](const Cache::Entry&) {}) > 0) {
+				cached++;
+				continue;
+			}
+
+			DNS::Builder b(q, (uint16_t)i);
+			b.question(name, DNS::Defs::AAAA);
+
+			if (sendto(qsd, q.data(), q.size(), 0, (sockaddr *)&dst, sizeof(sockaddr_in)) < 0) {
+				ERROR("sendto() failed; is multicast enabled on '%s'?", ifc_name.c_str());
+			}
+			queries++;
+
+			while (true) {
+				struct timeval tv = { 0, timeout_ms*1000 };
+				FD_ZERO(&fds);
+				FD_SET(qsd, &fds);
+				if (select(qsd+1, &fds, nullptr, nullptr, &tv) < 1) {
+					timeouts++;
+					break;
+				}
+
+				auto N = DatagramSocket::Read(qsd, buf.data(), buf.size(), meta);
+				if (N < 12) continue;
+
+				uint16_t id = 0;
+				DNS::Parse::read(buf.data(), 0, N, id);
+				if (id != (uint16_t)i) continue;
+
+				cache.Update(buf.data(), N, Cache::Now());
+				break;
+			}
+		}
+
+		double elapsed = std::chrono::duration<double,std::milli>(Clock::now() - t0).count();
+
+		printf("  %-8s %9ld %9ld %9ld %9ld %12.1f\n", negative ? "yes" : "no",
+			queries, (long)replies, timeouts, cached, elapsed);
+	}
+
+	done = true;
+	rx.join();
+	close(rsd);
+	close(qsd);
+
+	return 0;
+}
+
+// Response packing: a browse for a service type with many instances, each
+// answer bringing SRV, TXT, A and AAAA additionals. Packets and bytes per
+// record with and without name compression, what a single packet would have
+// dropped, and responses/s; every packet is decoded back into a cache to
+// check nothing was lost or mangled.
+
+int bench_pack(const Options& opt)
+{
+	auto n_instances = (int)opt.get("instances", 500);
+	auto max_size = (size_t)opt.get("size", 1472);
+	auto n = opt.get("n", 2000);
+
+	const uint16_t in_flush = DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT;
+	const auto service = Synthetic::service_type(0);
+
+	Responder responder;
+	for (int i=0; i<n_instances; i++) {
+		auto inst = Synthetic::instance(0, i);
+		auto hst = Synthetic::host(i);
+		char addr[4], addr6[16] = { (char)0xfe, (char)0x80 };
+
+		Synthetic::address(i, addr);
+		memcpy(addr6+12, addr, 4);
+
+		responder.Add(service, DNS::Defs::PTR, DNS::Defs::IN, 4500, DNS::Builder::rdata_name(inst));
+		responder.Add(inst, DNS::Defs::SRV, in_flush, 120, DNS::Builder::rdata_srv(0, 0, 631, hst));
+		responder.Add(inst, DNS::Defs::TXT, in_flush, 4500,
+			DNS::Builder::rdata_txt({"txtvers=1", "ty=Device " + std::to_string(i), "rp=ipp/print"}));
+		responder.Add(hst, DNS::Defs::A, in_flush, 120, std::vector<char>(addr, addr+4));
+		responder.Add(hst, DNS::Defs::AAAA, in_flush, 120, std::vector<char>(addr6, addr6+16));
+	}
+
+	std::vector<char> query, single;
+	{
+		DNS::Builder b(query);
+		b.question(service, DNS::Defs::PTR);
+	}
+
+	// Decode packets into a fresh cache; returns number of records cached.
+	auto check = [](const std::vector< std::vector<char> >& pkts, size_t max_size, size_t& oversize) {
+		Cache cache;
+		auto now_ms = Cache::Now();
+		oversize = 0;
+		for (const auto& p : pkts) {
+			if (p.size() > max_size) oversize++;
+			cache.Update(p.data(), p.size(), now_ms);
+		}
+		Cache::Reader r(cache);
+		return r.ForEach(now_ms, [](const Cache::Entry&) {});
+	};
+
+	size_t expected = 5*n_instances;
+
+	printf("pack: browse answered with %d PTRs plus SRV/TXT/A/AAAA (%d records), packets <= %d bytes\n",
+		n_instances, (int)expected, (int)max_size);
+
+	// Single packet, as Respond() did before: everything past max_size dropped
+	responder.Respond(query.data(), query.size(), false, single, max_size);
+	{
+		DNS::Message msg;
+		msg.read_header(single.data(), 0, single.size());
+		int n_rr = msg.n_answer + msg.n_additional;
+		printf("  %-24s %4d packet  %8d bytes %8.1f bytes/record %6d records (%d dropped)\n",
+			"single packet", 1, (int)single.size(), (double)single.size()/n_rr, n_rr, (int)expected - n_rr);
+	}
+
+	int bad = 0;
+
+	for (bool compress : { false, true }) {
+		// As Responder::Respond() (multi-packet), with compression selectable
+		std::vector<DNS::Packer::Record> answers, additionals;
+		for (const auto& r : responder.records) {
+			DNS::Packer::Record x = { &r.name, r.type, r.clss, r.TTL, r.rdata.data(), (uint16_t)r.rdata.size() };
+			((r.type == DNS::Defs::PTR) ? answers : additionals).push_back(x);
+		}
+
+		std::vector< std::vector<char> > pkts;
+		auto res = DNS::Packer::Pack(pkts, 0, DNS::Defs::QRMask | DNS::Defs::AAMask, max_size, answers, additionals, compress);
+
+		size_t oversize;
+		size_t cached = check(pkts, max_size, oversize);
+		size_t n_rr = res.answers + res.additionals;
+
+		printf("  %-24s %4d packets %8d bytes %8.1f bytes/record %6d records, %d decoded, %d oversize, %.1f%% full\n",
+			compress ? "split, compressed" : "split, uncompressed", (int)res.packets, (int)res.bytes,
+			(double)res.bytes/n_rr, (int)n_rr, (int)cached, (int)oversize, 100.0*res.bytes/(res.packets*max_size));
+
+		if ((cached != expected) || (oversize > 0) || (res.skipped > 0)) bad++;
+	}
+
+	// Throughput of the whole path: parse query, plan, pack
+	std::vector< std::vector<char> > pkts;
+	size_t n_pkts = 0, n_bytes = 0;
+
+	auto t0 = Clock::now();
+	for (long i=0; i<n; i++) {
+		n_pkts += responder.Respond(query.data(), query.size(), false, pkts, max_size);
+		for (const auto& p : pkts) n_bytes += p.size();
+	}
+	double dt = std::chrono::duration<double>(Clock::now() - t0).count();
+
+	size_t oversize;
+	if (check(pkts, max_size, oversize) != expected) bad++;
+
+	printf("  Responder::Respond()     %10.0f responses/s, %10.0f records/s, %8.1f MB/s (%d packets each)\n",
+		n/dt, n*expected/dt, 1e-6*n_bytes/dt, (int)(n_pkts/n));
+
+	return bad;
+}
+
+// Multi-homed responder: one host with an address on each of several links
+// (e.g. VLANs on a gateway) and a few services, browsed from every link.
+// Answering from every record and multicasting on every link, as before,
+// vs answering from the receiving link's view on that link only; bytes on
+// the wire (with IPv4/UDP headers) per query, and responses/s. Every scoped
+// response must carry exactly the addresses of its own link.
+
+int bench_links(const Options& opt)
+{
+	auto n_links = (int)opt.get("links", 8);
+	auto n_services = (int)opt.get("services", 4);
+	auto max_size = (size_t)opt.get("size", 1472);
+	auto n = opt.get("n", 50000);
+
+	const uint16_t in_flush = DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT;
+	const auto hst = Synthetic::host(0);
+	const size_t headers = 20 + 8;
+
+	// Link k (interface index k) has addresses A/AAAA[k]
+	std::vector< std::vector<char> > A(n_links+1), AAAA(n_links+1);
+
+	Responder flat, scoped;
+	for (int s=0; s<n_services; s++) {
+		auto inst = Synthetic::instance(s, 0);
+		for (auto r : { &flat, &scoped }) {
+			r->Add(Synthetic::service_type(s), DNS::Defs::PTR, DNS::Defs::IN, 4500, DNS::Builder::rdata_name(inst));
+			r->Add(inst, DNS::Defs::SRV, in_flush, 120, DNS::Builder::rdata_srv(0, 0, 631+s, hst));
+			r->Add(inst, DNS::Defs::TXT, in_flush, 4500, DNS::Builder::rdata_txt({"txtvers=1"}));
+		}
+	}
+	for (int k=1; k<=n_links; k++) {
+		char addr[4], addr6[16] = { (char)0xfe, (char)0x80 };
+		Synthetic::address(k, addr);
+		memcpy(addr6+12, addr, 4);
+		A[k].assign(addr, addr+4);
+		AAAA[k].assign(addr6, addr6+16);
+
+		flat.Add(hst, DNS::Defs::A, in_flush, 120, A[k]);
+		flat.Add(hst, DNS::Defs::AAAA, in_flush, 120, AAAA[k]);
+		scoped.Add(hst, DNS::Defs::A, in_flush, 120, A[k], k);
+		scoped.Add(hst, DNS::Defs::AAAA, in_flush, 120, AAAA[k], k);
+	}
+
+	std::vector< std::vector<char> > queries(n_services);
+	for (int s=0; s<n_services; s++) Synthetic::query(queries[s], s);
+
+	// Addresses in a response: returns false unless exactly link k's
+	auto own_addresses = [&](const std::vector<char>& p, int k) {
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+		std::vector<char> rdata;
+		int n_A = 0, n_AAAA = 0;
+
+		size_t i = msg.read_header(p.data(), 0, p.size());
+		int n_rr = msg.n_answer + msg.n_authority + msg.n_additional;
+		for (int j=0; (i > 0) && (j<n_rr); j++) {
+			i = rr.read_header_and_body(p.data(), i, p.size(), tmp);
+			if ((i == 0) || !Cache::rdata_(p.data(), p.size(), rr, rdata)) return false;
+			if (rr.type == DNS::Defs::A) {
+				if (rdata != A[k]) return false;
+				n_A++;
+			}
+			if (rr.type == DNS::Defs::AAAA) {
+				if (rdata != AAAA[k]) return false;
+				n_AAAA++;
+			}
+		}
+		return (n_A == 1) && (n_AAAA == 1);
+	};
+
+	printf("links: host on %d links with %d services, each browsed from every link, packets <= %d bytes\n",
+		n_links, n_services, (int)max_size);
+
+	int bad = 0;
+
+	for (bool per_link : { false, true }) {
+		const auto& responder = per_link ? scoped : flat;
+		std::vector< std::vector<char> > pkts;
+		size_t n_queries = 0, n_pkts = 0, n_records = 0, n_bytes = 0, n_wrong = 0;
+
+		// What goes on the wire, and is it right?
+		for (int k=1; k<=n_links; k++) {
+			for (const auto& q : queries) {
+				responder.Respond(q.data(), q.size(), false, pkts, max_size, per_link ? k : 0);
+
+				size_t n_sent = per_link ? 1 : n_links; // flat: multicast on every link
+				for (const auto& p : pkts) {
+					DNS::Message msg;
+					msg.read_header(p.data(), 0, p.size());
+					n_records += msg.n_answer + msg.n_additional;
+					n_bytes += n_sent * (p.size() + headers);
+					if (per_link && !own_addresses(p, k)) n_wrong++;
+				}
+				n_pkts += n_sent * pkts.size();
+				n_queries++;
+			}
+		}
+		if (n_wrong > 0) bad++;
+
+		// Cost of building them
+		size_t n_total = 0;
+		auto t0 = Clock::now();
+		for (long i=0; i<n; i++) {
+			int k = 1 + (int)(i % n_links);
+			const auto& q = queries[(i / n_links) % n_services];
+			n_total += responder.Respond(q.data(), q.size(), false, pkts, max_size, per_link ? k : 0);
+		}
+		double dt = std::chrono::duration<double>(Clock::now() - t0).count();
+
+		printf("  %-24s %6.1f records/response %6.1f packets %8.0f bytes on the wire per query %10.0f responses/s",
+			per_link ? "per link, that link only" : "all records, all links",
+			(double)n_records/n_queries, (double)n_pkts/n_queries, (double)n_bytes/n_queries, n/dt);
+		if (per_link) printf(" (%d with other links' addresses)", (int)n_wrong);
+		printf("\n");
+
+		if (n_total == 0) bad++;
+	}
+
+	return bad;
+}
+
+// Bulk resolution: A records for thousands of hosts from an in-process
+// responder, packed into multi-question queries, vs one name at a time.
+
+int bench_resolve(const Options& opt)
+{
+	auto port = (int)opt.get("port", 53534);
+	auto n_hosts = (int)opt.get("hosts", 5000);
+	auto n_single = (int)opt.get("single", 1000);
+	auto rate = (int)opt.get("rate", 0L);
+	auto max_size = (size_t)opt.get("size", 1472);
+	auto missing = (int)opt.get("missing", 0L); // percent of names nobody has
+	const char *group = "224.0.0.251";
+
+	Responder responder;
+	for (int i=0; i<n_hosts; i++) {
+		char addr[4];
+		Synthetic::address(i, addr);
+		responder.Add("host-" + std::to_string(i) + ".local", DNS::Defs::A,
+			DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT, 120, std::vector<char>(addr, addr+4));
+	}
+
+	Interfaces ifcs;
+	int rsd = DatagramSocket::CreateAndBind(AF_INET, port);
+	if (!join_on_(rsd, group, ifcs, "lo")) ERROR("No IPv4 address on 'lo' to join %s", group);
+
+	std::atomic<bool> done(false);
+	std::atomic<long> n_queries(0);
+
+	std::thread rx([&] {
+		DatagramSocket::Meta meta;
+		std::vector<char> buf(66000), out;
+		fd_set fds;
+
+		while (!done) {
+			struct timeval tv = { 0, 100000 };
+			FD_ZERO(&fds);
+			FD_SET(rsd, &fds);
+			if (select(rsd+1, &fds, nullptr, nullptr, &tv) < 1) continue;
+
+			auto N = DatagramSocket::Read(rsd, buf.data(), buf.size(), meta);
+			if (N < 12) continue;
+			n_queries++;
+
+			if (!responder.Respond(buf.data(), N, true, out)) continue;
+			sendto(rsd, out.data(), out.size(), 0, (sockaddr *)&meta.src, sizeof(sockaddr_in));
+		}
+	});
+
+	// Names to resolve; some percentage for hosts nobody has, which cost
+	// the full timeout and retries.
+	std::vector<Resolver::Question> questions;
+	for (int i=0; i<n_hosts; i++) {
+		bool absent = (missing > 0) && (i % 100 < missing);
+		questions.push_back( { (absent ? "nobody-" : "host-") + std::to_string(i) + ".local", DNS::Defs::A } );
+	}
+
+	auto run = [&](const char *label, Resolver& r, const std::vector<Resolver::Question>& qs, bool one_by_one) {
+		std::vector<Resolver::Result> results;
+		long q0 = n_queries;
+
+		auto t0 = Clock::now();
+		if (one_by_one) {
+			for (const auto& q : qs) results.push_back( r.Resolve({q})[0] );
+		}
+		else {
+			results = r.Resolve(qs);
+		}
+		double dt = std::chrono::duration<double>(Clock::now() - t0).count();
+
+		std::vector<int64_t> latency;
+		size_t n_answered = 0, n_wrong = 0;
+
+		for (size_t i=0; i<results.size(); i++) {
+			const auto& x = results[i];
+			if (!x.Answered()) continue;
+			n_answered++;
+			latency.push_back(1000*x.Latency_us());
+
+			char addr[4];
+			Synthetic::address(atoi(x.name.c_str() + x.name.find('-') + 1), addr);
+			if ((x.rdata.size() != 1) || (memcmp(x.rdata[0].data(), addr, 4) != 0)) n_wrong++;
+		}
+
+		printf("  %-14s %6d names %8.3f s %10.0f names/s %6ld queries, %6d answered, %d wrong\n",
+			label, (int)qs.size(), dt, qs.size()/dt, (long)(n_queries - q0), (int)n_answered, (int)n_wrong);
+		percentiles("  latency", latency);
+
+		return (int)n_wrong;
+	};
+
+	printf("resolve: %d hosts (%d%% missing), queries <= %d bytes, rate %d/s\n",
+		n_hosts, missing, (int)max_size, rate);
+	printf("  %-30s %9s %9s %9s %9s   (microseconds)\n", "", "p50", "p99", "p999", "max");
+
+	int n_wrong = 0;
+	{
+		Resolver r;
+		r.max_size = max_size;
+		r.rate = rate;
+		r.timeout_ms = 200;
+		if (!r.Open("127.0.0.1", group, port)) return 1;
+
+		n_wrong += run("bulk", r, questions, false);
+
+		auto st = r.GetStats();
+		printf("  %llu questions in %llu queries (%llu retries), %llu replies, %llu truncated, %llu unanswered\n",
+			(unsigned long long)st.questions, (unsigned long long)st.queries, (unsigned long long)st.retries,
+			(unsigned long long)st.replies, (unsigned long long)st.truncated, (unsigned long long)st.unanswered);
+	}
+	{
+		Resolver r;
+		r.max_questions = 1;
+		r.timeout_ms = 200;
+		if (!r.Open("127.0.0.1", group, port)) return 1;
+
+		std::vector<Resolver::Question> some(questions.begin(), questions.begin() + std::min(n_single, n_hosts));
+		n_wrong += run("one at a time", r, some, true);
+	}
+
+	done = true;
+	rx.join();
+	close(rsd);
+
+	return (n_wrong == 0) ? 0 : 1;
+}
+
+// Unicast DNS gateway: a stub client asks for A records of hosts the cache
+// already holds (UDP, then pipelined over one TCP connection), then for hosts
+// only an in-process responder on the link knows, which go out as multicast
+// queries and come back before the deadline.
+
+int bench_gateway(const Options& opt)
+{
+	auto n = opt.get("n", 100000);
+	auto port = (int)opt.get("port", 53530);
+	auto n_instances = (int)opt.get("instances", 1000);
+	auto window = (int)opt.get("window", 16);
+	auto n_misses = opt.get("misses", 200);
+	const char *group = "224.0.0.251";
+
+	Cache cache;
+	std::vector<char> buf;
+	for (int i=0; i<n_instances; i++) {
+		Synthetic::announcement(buf, i % 16, i);
+		cache.Update(buf.data(), buf.size(), Cache::Now());
+	}
+
+	Gateway gateway(cache);
+	if (!gateway.Open("127.0.0.1", port, "127.0.0.1")) ERROR("Unable to open gateway on port %d", port);
+
+	// Link responder for the misses, answering legacy unicast queries
+	Responder responder;
+	for (int i=0; i<n_misses; i++) {
+		char addr[4];
+		Synthetic::address(i, addr);
+		responder.Add("host-" + std::to_string(i) + ".local", DNS::Defs::A,
+			DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT, 120, std::vector<char>(addr, addr+4));
+	}
+
+	Interfaces ifcs;
+	int rsd = DatagramSocket::CreateAndBind(AF_INET, 5353);
+	if (!join_on_(rsd, group, ifcs, "lo")) ERROR("No IPv4 address on 'lo' to join %s", group);
+
+	volatile std::sig_atomic_t status = 0;
+	std::thread gw([&] { gateway.Run(status, 10); });
+
+	std::thread link([&] {
+		DatagramSocket::Meta meta;
+		std::vector<char> in(9000), out;
+		fd_set fds;
+
+		while (status == 0) {
+			struct timeval tv = { 0, 10000 };
+			FD_ZERO(&fds);
+			FD_SET(rsd, &fds);
+			if (select(rsd+1, &fds, nullptr, nullptr, &tv) < 1) continue;
+
+			auto N = DatagramSocket::Read(rsd, in.data(), in.size(), meta);
+			int src_port = 0;
+			SockUtil::unpack(&meta.src, nullptr, 0, &src_port);
+			if ((N < 12) || (src_port == 5353)) continue;
+			if (responder.Respond(in.data(), N, true, out)) {
+				sendto(rsd, out.data(), out.size(), 0, (sockaddr *)&meta.src, sizeof(sockaddr_in));
+			}
+		}
+	});
+
+	sockaddr_storage gw_addr;
+	SockUtil::pack(&gw_addr, AF_INET, "127.0.0.1", port);
+
+	auto query = [](std::vector<char>& q, long i, const std::string& name) {
+		DNS::Builder b(q, (uint16_t)i, DNS::Defs::RDMask);
+		b.question(name, DNS::Defs::A);
+	};
+
+	// True if r is the response to query i; counts it if it has answers
+	auto check = [](const char* r, size_t len, long i, long& answered) {
+		DNS::Message msg;
+		if (msg.read_header(r, 0, len) == 0 || msg.id != (uint16_t)i) return false;
+		if (msg.n_answer > 0) answered++;
+		return true;
+	};
+
+	printf("gateway: %d cached instances, window %d\n", n_instances, window);
+	printf("  %-18s %9s %9s %12s %9s %9s\n", "mode", "queries", "answered", "queries/s", "p50 us", "p99 us");
+
+	auto report = [](const char* mode, long n, long answered, double secs, std::vector<int64_t>& lat) {
+		std::sort(lat.begin(), lat.end());
+		auto p = [&lat](double q) { return lat.empty() ? 0.0 : lat[std::min(lat.size()-1, (size_t)(q*lat.size()))]/1e3; };
+		printf("  %-18s %9ld %9ld %12.0f %9.1f %9.1f\n", mode, n, answered, n/secs, p(0.5), p(0.99));
+	};
+
+	// Cached, over UDP; up to window queries outstanding
+	{
+		int sd = socket(PF_INET, SOCK_DGRAM, 0);
+		std::vector<char> q, r(4096);
+		std::vector<int64_t> sent(n), lat;
+		long answered = 0, n_sent = 0, n_recv = 0;
+		fd_set fds;
+
+		auto t0 = Clock::now();
+		while (n_recv < n) {
+			while ((n_sent < n) && (n_sent - n_recv < window)) {
+				query(q, n_sent, Synthetic::host(n_sent % n_instances));
+				sent[n_sent] = realtime_ns();
+				sendto(sd, q.data(), q.size(), 0, (sockaddr *)&gw_addr, sizeof(sockaddr_in));
+				n_sent++;
+			}
+
+			struct timeval tv = { 1, 0 };
+			FD_ZERO(&fds);
+			FD_SET(sd, &fds);
+			if (select(sd+1, &fds, nullptr, nullptr, &tv) < 1) break; // lost
+
+			// One gateway thread, so responses come back in order
+			auto N = recv(sd, r.data(), r.size(), 0);
+			if (check(r.data(), N, n_recv, answered)) lat.push_back(realtime_ns() - sent[n_recv]);
+			n_recv++;
+		}
+		double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+		report("cached, UDP", n_recv, answered, secs, lat);
+		close(sd);
+	}
+
+	// Cached, over one TCP connection, pipelined
+	{
+		int sd = socket(PF_INET, SOCK_STREAM, 0);
+		if (connect(sd, (sockaddr *)&gw_addr, sizeof(sockaddr_in)) != 0) ERROR("connect()");
+
+		const int on = 1;
+		setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		std::vector<char> q, framed, r(65536);
+		std::vector<int64_t> sent(n), lat;
+		long answered = 0, n_sent = 0, n_recv = 0;
+
+		auto read_n = [sd](char* p, size_t len) {
+			size_t done = 0;
+			while (done < len) {
+				auto k = read(sd, p+done, len-done);
+				if (k <= 0) return false;
+				done += k;
+			}
+			return true;
+		};
+
+		auto t0 = Clock::now();
+		while (n_recv < n) {
+			framed.clear();
+			while ((n_sent < n) && (n_sent - n_recv < window)) {
+				query(q, n_sent, Synthetic::host(n_sent % n_instances));
+				DNS::Parse::append(framed, (uint16_t)q.size());
+				framed.insert(framed.end(), q.begin(), q.end());
+				sent[n_sent++] = realtime_ns();
+			}
+			if (framed.size() > 0 && write(sd, framed.data(), framed.size()) != (ssize_t)framed.size()) break;
+
+			char len_buf[2];
+			if (!read_n(len_buf, 2)) break;
+			uint16_t len = ((uint8_t)len_buf[0] << 8) | (uint8_t)len_buf[1];
+			if (!read_n(r.data(), len)) break;
+
+			if (check(r.data(), len, n_recv, answered)) lat.push_back(realtime_ns() - sent[n_recv]);
+			n_recv++;
+		}
+		double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+		report("cached, TCP", n_recv, answered, secs, lat);
+		close(sd);
+	}
+
+	// Not cached: forwarded to the link, one at a time
+	{
+		int sd = socket(PF_INET, SOCK_DGRAM, 0);
+		struct timeval tv = { 1, 0 };
+		setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+		std::vector<char> q, r(4096);
+		std::vector<int64_t> lat;
+		long answered = 0;
+
+		auto t0 = Clock::now();
+		for (long i=0; i<n_misses; i++) {
+			query(q, i, "host-" + std::to_string(i) + ".local");
+			auto t = realtime_ns();
+			sendto(sd, q.data(), q.size(), 0, (sockaddr *)&gw_addr, sizeof(sockaddr_in));
+			auto N = recv(sd, r.data(), r.size(), 0);
+			if ((N > 0) && check(r.data(), N, i, answered)) lat.push_back(realtime_ns() - t);
+		}
+		double secs = std::chrono::duration<double>(Clock::now() - t0).count();
+		report("miss => multicast", n_misses, answered, secs, lat);
+		close(sd);
+	}
+
+	status = 1;
+	gw.join();
+	link.join();
+	close(rsd);
+
+	auto st = gateway.GetStats();
+	printf("  gateway: %llu queries, %llu from cache, %llu forwarded, %llu replies, %llu timeouts\n",
+		(unsigned long long)st.queries, (unsigned long long)st.cached, (unsigned long long)st.forwarded,
+		(unsigned long long)st.replies, (unsigned long long)st.timeouts);
+
+	return 0;
+}
+
+// Lookup throughput against reader thread count, for the sharded snapshot
+// cache and for the same records in a single mutex-protected map, while a
+// writer thread keeps re-announcing them.
+
+int bench_cache(const Options& opt)
+{
+	long seconds_x10 = opt.get("ms", 500) / 100;
+	int max_threads = opt.get("threads", (long)std::thread::hardware_concurrency());
+	int n_types = opt.get("types", 16);
+	int n_instances = opt.get("instances", 1000);
+	long write_rate = opt.get("write-rate", 10000);
+
+	if (max_threads < 1) max_threads = 1;
+	if (seconds_x10 < 1) seconds_x10 = 1;
+
+	// Announcements to cache, and the names to look up (SRV by instance)
+
+	std::vector< std::vector<char> > pkts;
+	std::vector<std::string> names;
+
+	for (int i=0; i<n_instances; i++) {
+		std::vector<char> buf;
+		Synthetic::announcement(buf, i % n_types, i);
+		pkts.push_back(buf);
+		names.push_back(Synthetic::instance(i % n_types, i));
+	}
+
+	// Baseline: one map, one lock, updated in place
+
+	struct Locked {
+		std::mutex mutex;
+		std::unordered_map< uint64_t, std::vector<Cache::Entry> > table;
+	} locked;
+
+	auto locked_update = [&locked](const char *buf, size_t len, int64_t now_ms) {
+		Cache tmp;
+		tmp.Update(buf, len, now_ms);
+		Cache::Reader r(tmp);
+		std::vector<Cache::Entry> entries;
+		r.ForEach(now_ms, [&entries](const Cache::Entry& e) { entries.push_back(e); });
+
+		std::lock_guard<std::mutex> lock(locked.mutex);
+		for (auto& e : entries) {
+			auto& v = locked.table[e.hash];
+			bool found = false;
+			for (auto& x : v) {
+				if ((x.type == e.type) && (x.name == e.name) && (x.rdata == e.rdata)) {
+					x.expires_ms = e.expires_ms;
+					found = true;
+				}
+			}
+			if (!found) v.push_back(e);
+		}
+	};
+
+	Cache cache;
+	auto now0 = Cache::Now();
+
+	for (const auto& p : pkts) {
+		cache.Update(p.data(), p.size(), now0);
+		locked_update(p.data(), p.size(), now0);
+	}
+
+	// Writer: re-announce at the given rate (0 => not at all)
+
+	auto run = [&](bool use_cache, int n_threads, uint64_t& lookups, uint64_t& writes) {
+		std::atomic<bool> stop{false};
+		std::atomic<uint64_t> total{0};
+		std::vector<std::thread> readers;
+
+		for (int t=0; t<n_threads; t++) {
+			readers.emplace_back([&, t]() {
+				uint64_t x = 0x9e3779b97f4a7c15ULL * (t+1), n = 0, sum = 0;
+				int64_t now_ms = Cache::Now();
+				Cache::Reader r(cache);
+
+				while (!stop.load(std::memory_order_relaxed)) {
+					for (int k=0; k<256; k++) {
+						x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+						const auto& name = names[x % names.size()];
+
+						if (use_cache) {
+							r.Lookup(name, DNS::Defs::SRV, now_ms, [&sum](const Cache::Entry& e) {
+								sum += e.rdata.size();
+							});
+						}
+						else {
+							auto h = Hash::fnv1a_nocase(name.data(), name.size());
+							std::lock_guard<std::mutex> lock(locked.mutex);
+							auto it = locked.table.find(h);
+							if (it == locked.table.end()) continue;
+							for (const auto& e : it->second) {
+								if ((e.type != DNS::Defs::SRV) || (e.expires_ms <= now_ms)) continue;
+								if (strcasecmp(e.name.c_str(), name.c_str()) != 0) continue;
+								sum += e.rdata.size();
+							}
+						}
+					}
+					n += 256;
+				}
+
+				if (sum == 0) WARN("No lookups succeeded");
+				total += n;
+			});
+		}
+
+		writes = 0;
+		auto t0 = Clock::now();
+		auto t_end = t0 + std::chrono::milliseconds(100*seconds_x10);
+
+		while (Clock::now() < t_end) {
+			if (write_rate > 0) {
+				double elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+				if ((double)writes < elapsed*write_rate) {
+					const auto& p = pkts[writes % pkts.size()];
+					if (use_cache) cache.Update(p.data(), p.size(), Cache::Now());
+					else locked_update(p.data(), p.size(), Cache::Now());
+					writes++;
+					continue;
+				}
+			}
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+
+		stop = true;
+		for (auto& t : readers) t.join();
+
+		lookups = total;
+	};
+
+	printf("cache: %d records (%d instances), writer %ld announcements/s, %.1f s per run\n",
+		n_instances*4, n_instances, write_rate, 0.1*seconds_x10);
+	printf("  %8s %16s %16s %16s %16s\n", "threads", "sharded/s", "per thread", "locked/s", "per thread");
+
+	for (int n=1; ; n = (n*2 > max_threads && n < max_threads) ? max_threads : n*2) {
+		uint64_t lk[2], wr[2];
+		run(true, n, lk[0], wr[0]);
+		run(false, n, lk[1], wr[1]);
+
+		double dt = 0.1*seconds_x10;
+		printf("  %8d %16.0f %16.0f %16.0f %16.0f\n", n,
+			lk[0]/dt, lk[0]/dt/n, lk[1]/dt, lk[1]/dt/n);
+
+		if (n >= max_threads) break;
+	}
+
+	auto st = cache.GetStats();
+	printf("  sharded cache: %llu messages, %llu tables published, %llu reclaimed\n",
+		(unsigned long long)st.messages, (unsigned long long)st.published, (unsigned long long)st.reclaimed);
+
+	return 0;
+}
+
+// Refresh scheduling for many watched records over simulated time: the timer
+// wheel against scanning every record each tick. Each refresh question is
+// "answered" straight into the cache, as a responder on the link would.
+
+int bench_refresh(const Options& opt)
+{
+	auto n_records = (int)opt.get("records", 100000);
+	auto minutes = (int)opt.get("minutes", 30);
+	auto payload = (size_t)opt.get("payload", 1472);
+
+	auto ttl_of = [](int i) { return (i % 4 == 0) ? 120u : 4500u; };
+	auto name_of = [](int i) { return Synthetic::host(i); };
+
+	Cache cache;
+	int64_t start_ms = 0, end_ms = 60000LL*minutes;
+
+	{
+		std::vector<Cache::Entry> entries(n_records);
+		for (int i=0; i<n_records; i++) {
+			auto& e = entries[i];
+			char addr[4];
+			Synthetic::address(i, addr);
+			e.name = name_of(i);
+			e.type = DNS::Defs::A;
+			e.clss = DNS::Defs::IN;
+			e.TTL = ttl_of(i);
+			e.received_ms = start_ms - (i % 97)*10*(int64_t)e.TTL; // 0-96% of TTL old
+			e.expires_ms = e.received_ms + 1000*(int64_t)e.TTL;
+			e.rdata.assign(addr, addr+4);
+		}
+		cache.Insert(std::move(entries), start_ms);
+	}
+
+	Refresher refresher(cache, start_ms, payload);
+	for (int i=0; i<n_records; i++) refresher.Watch(name_of(i), DNS::Defs::A, start_ms);
+
+	// "Answers" to the questions in a query
+	auto answer = [&](const std::vector<char>& q, int64_t now_ms) {
+		DNS::Message msg;
+		DNS::ResourceRecord rr;
+		std::vector<std::string> tmp;
+		std::vector<Cache::Entry> entries;
+
+		size_t i = msg.read_header(q.data(), 0, q.size());
+		for (int k=0; k<msg.n_question; k++) {
+			i = rr.read_header(q.data(), i, q.size(), tmp);
+			int n = atoi(rr.name.c_str() + 7); // "device-<n>.local."
+			Cache::Entry e;
+			char addr[4];
+			Synthetic::address(n, addr);
+			e.name = rr.name;
+			e.type = rr.type;
+			e.clss = DNS::Defs::IN;
+			e.TTL = ttl_of(n);
+			e.received_ms = now_ms;
+			e.expires_ms = now_ms + 1000*(int64_t)e.TTL;
+			e.rdata.assign(addr, addr+4);
+			entries.push_back(std::move(e));
+		}
+		cache.Insert(std::move(entries), now_ms);
+	};
+
+	int64_t wheel_ns = 0, answer_ns = 0, busy_ticks = 0, ticks = 0;
+	size_t max_questions = 0;
+
+	for (int64_t now_ms = start_ms; now_ms <= end_ms; now_ms += Refresher::Tick_ms) {
+		auto t0 = thread_cpu_ns();
+		auto packets = refresher.Advance(now_ms);
+		auto t1 = thread_cpu_ns();
+
+		size_t n_q = 0;
+		for (const auto& q : packets) {
+			uint16_t n = 0;
+			DNS::Parse::read(q.data(), 4, q.size(), n);
+			n_q += n;
+			answer(q, now_ms + 1);
+		}
+		answer_ns += thread_cpu_ns() - t1;
+
+		wheel_ns += t1 - t0;
+		ticks++;
+		if (!packets.empty()) busy_ticks++;
+		max_questions = std::max(max_questions, n_q);
+	}
+
+	// Records that lapsed anyway
+	long lapsed = 0;
+	{
+		Cache::Reader reader(cache);
+		for (int i=0; i<n_records; i++) {
+			if (reader.Lookup(name_of(i), DNS::Defs::A, end_ms, [](const Cache::Entry&) {}) == 0) lapsed++;
+		}
+	}
+
+	// The alternative: check every record's deadline on every tick
+	std::vector<int64_t> deadlines(n_records);
+	for (int i=0; i<n_records; i++) deadlines[i] = start_ms + i;
+
+	long scan_ticks = std::min(ticks, 1000L), due = 0;
+	auto t0 = thread_cpu_ns();
+	for (long t=0; t<scan_ticks; t++) {
+		int64_t now_ms = start_ms + t*Refresher::Tick_ms;
+		for (int i=0; i<n_records; i++) {
+			if (deadlines[i] <= now_ms) {
+				due++;
+				deadlines[i] += 1000*(int64_t)ttl_of(i);
+			}
+		}
+	}
+	double scan_ns = (double)(thread_cpu_ns() - t0) / scan_ticks;
+
+	const auto& st = refresher.stats;
+
+	printf("refresh: %d records over %d simulated minutes, %ld ticks of %d ms, %zu byte queries\n",
+		n_records, minutes, ticks, (int)Refresher::Tick_ms, payload);
+	printf("  questions %llu in %llu packets (%.1f per packet, at most %zu per tick), %ld busy ticks\n",
+		(unsigned long long)st.questions, (unsigned long long)st.packets,
+		st.packets ? (double)st.questions/st.packets : 0.0, max_questions, busy_ticks);
+	printf("  timers fired %llu, rescheduled by answers %llu, idle %llu, lapsed at end %ld\n",
+		(unsigned long long)st.fired, (unsigned long long)st.refreshed, (unsigned long long)st.idle, lapsed);
+	printf("  timer wheel       %10.1f ns/tick (%.1f ms total)\n", (double)wheel_ns/ticks, wheel_ns/1e6);
+	printf("  scan all records  %10.1f ns/tick (%ld due)\n", scan_ns, due);
+	printf("  simulated answers %10.1f ms total\n", answer_ns/1e6);
+
+	return 0;
+}
+
+// Shared memory export: cost of publishing, and lookups through the C reader
+// (its own mapping, as another process would have) against Cache::Reader.
+
+int bench_shm(const Options& opt)
+{
+	int n_types = opt.get("types", 16);
+	int n_instances = opt.get("instances", 1000);
+	long n_lookups = opt.get("n", 2000000);
+	long publish_ms = opt.get("publish-ms", 10);
+	std::string name = "/mdns-bench-" + std::to_string(getpid());
+
+	std::vector< std::vector<char> > pkts;
+	std::vector<std::string> names;
+
+	for (int i=0; i<n_instances; i++) {
+		std::vector<char> buf;
+		Synthetic::announcement(buf, i % n_types, i);
+		pkts.push_back(buf);
+		names.push_back(Synthetic::instance(i % n_types, i));
+	}
+
+	Cache cache;
+	ShmExport shm;
+
+	if (!shm.Open(name, 2*4*n_instances)) return 1;
+
+	auto now_ms = Cache::Now();
+	for (const auto& p : pkts) cache.Update(p.data(), p.size(), now_ms);
+
+	// Publishing: initial, unchanged, and after re-announcing 10%
+
+	auto t0 = Clock::now();
+	auto n_full = shm.Publish(cache, now_ms);
+	auto t1 = Clock::now();
+	auto n_none = shm.Publish(cache, now_ms);
+	auto t2 = Clock::now();
+	for (size_t i=0; i<pkts.size(); i += 10) cache.Update(pkts[i].data(), pkts[i].size(), now_ms+1);
+	auto t3 = Clock::now();
+	auto n_some = shm.Publish(cache, now_ms+1);
+	auto t4 = Clock::now();
+
+	auto us = [](Clock::time_point a, Clock::time_point b) {
+		return std::chrono::duration<double,std::micro>(b-a).count();
+	};
+
+	printf("shm: %d records in %d slots (%.1f MiB)\n",
+		(int)shm.n_used, (int)shm.hdr->n_slots, shm.size/(1024.0*1024.0));
+	printf("  publish, initial    %10.1f us (%d slots written)\n", us(t0,t1), (int)n_full);
+	printf("  publish, unchanged  %10.1f us (%d slots written)\n", us(t1,t2), (int)n_none);
+	printf("  publish, 10%% new    %10.1f us (%d slots written)\n", us(t3,t4), (int)n_some);
+
+	// Lookups of SRV by instance name, with and without a concurrent publisher
+
+	mdns_shm reader;
+	if (mdns_shm_open(&reader, name.c_str()) != 0) ERROR("mdns_shm_open(%s)", name.c_str());
+
+	auto lookups = [&](bool use_shm, bool publisher) {
+		std::atomic<bool> stop{false};
+		std::thread writer;
+
+		if (publisher) {
+			writer = std::thread([&]() {
+				int64_t t = now_ms + 2;
+				size_t k = 0;
+				while (!stop) {
+					for (int j=0; j<n_instances/10; j++, k++) {
+						const auto& p = pkts[k % pkts.size()];
+						cache.Update(p.data(), p.size(), t);
+					}
+					shm.Publish(cache, t++);
+					std::this_thread::sleep_for(std::chrono::milliseconds(publish_ms));
+				}
+			});
+		}
+
+		mdns_shm_slot out[4];
+		Cache::Reader r(cache);
+		uint64_t x = 0x9e3779b97f4a7c15ULL, found = 0;
+		int64_t t = now_ms;
+
+		auto start = Clock::now();
+		for (long i=0; i<n_lookups; i++) {
+			x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+			const auto& nm = names[x % names.size()];
+			if (use_shm) {
+				found += mdns_shm_lookup(&reader, nm.c_str(), DNS::Defs::SRV, t, out, 4);
+			}
+			else {
+				found += r.Lookup(nm, DNS::Defs::SRV, t, [](const Cache::Entry&) {});
+			}
+		}
+		double dt = std::chrono::duration<double>(Clock::now() - start).count();
+
+		stop = true;
+		if (writer.joinable()) writer.join();
+
+		if ((long)found != n_lookups) WARN("%d of %ld lookups found a record", (int)found, n_lookups);
+		return n_lookups / dt;
+	};
+
+	printf("  %-28s %14s %14s\n", "lookups/s", "idle", "publishing");
+	printf("  %-28s %14.0f %14.0f\n", "mdns_shm_lookup()", lookups(true, false), lookups(true, true));
+	printf("  %-28s %14.0f %14.0f\n", "Cache::Reader::Lookup()", lookups(false, false), lookups(false, true));
+
+	mdns_shm_close(&reader);
+
+	return 0;
+}
+
+// Recording: cost of Record() per datagram from several threads, segment
+// rolls included, then reading the log back and converting it to pcap.
+
+int bench_record(const Options& opt)
+{
+	long n = opt.get("n", 1000000);
+	int n_threads = opt.get("threads", 2);
+	int segment_mb = opt.get("segment-mb", 16);
+	int n_types = opt.get("types", 16);
+	std::string dir = opt.get("dir", "/tmp/mdns-bench-record");
+
+	auto pkts = make_traffic(n_types);
+
+	DatagramSocket::Meta meta;
+	memset(&meta, 0, sizeof(meta));
+	SockUtil::pack(&meta.src, AF_INET, "192.168.1.10", 5353);
+	SockUtil::pack(&meta.dst, AF_INET, "224.0.0.251", 5353);
+	meta.ifc_idx = 2;
+
+	mkdir(dir.c_str(), 0755);
+	for (auto seq : Recorder::Segments(dir)) unlink(Recorder::segment_path_(dir, seq).c_str());
+
+	Recorder recorder;
+	if (!recorder.Open(dir, (size_t)segment_mb << 20, 1000)) return 1;
+
+	std::vector<std::thread> threads;
+	std::vector<int64_t> cpu_ns(n_threads);
+
+	auto t0 = Clock::now();
+	for (int t=0; t<n_threads; t++) {
+		threads.emplace_back( [&,t] {
+			auto c0 = thread_cpu_ns();
+			for (long i=t; i<n; i+=n_threads) {
+				const auto& p = pkts[i % pkts.size()];
+				recorder.Record(p.data(), p.size(), meta);
+			}
+			cpu_ns[t] = thread_cpu_ns() - c0;
+		});
+	}
+	for (auto& t : threads) t.join();
+	double wall_ms = std::chrono::duration<double,std::milli>(Clock::now() - t0).count();
+
+	recorder.Close();
+	auto st = recorder.GetStats();
+
+	int64_t total_cpu = 0;
+	for (auto c : cpu_ns) total_cpu += c;
+
+	printf("record: %ld datagrams from %d threads, %d MB segments\n", n, n_threads, segment_mb);
+	printf("  recorded %llu, dropped %llu, %.1f MB in %llu segments\n",
+		(unsigned long long)st.frames, (unsigned long long)st.dropped,
+		st.bytes/1048576.0, (unsigned long long)st.segments);
+	printf("  Record()      %8.1f ns/datagram (cpu), %.1f ms wall\n", (double)total_cpu/n, wall_ms);
+
+	// Read back, and convert
+	long frames = 0, bytes = 0;
+	auto t1 = Clock::now();
+	Recorder::ReadAll(dir, [&](const Recorder::Frame& f, const char *) { frames++; bytes += f.payload_len; });
+	auto t2 = Clock::now();
+
+	Pcap pcap;
+	std::string pcap_path = dir + "/bench.pcap";
+	pcap.Open(pcap_path);
+	Recorder::ReadAll(dir, [&](const Recorder::Frame& f, const char *payload) {
+		DatagramSocket::Meta m;
+		Recorder::ToMeta(f, m);
+		pcap.Write(f.time_ns, m, payload, f.payload_len);
+	});
+	pcap.Close();
+	auto t3 = Clock::now();
+
+	struct stat sb;
+	stat(pcap_path.c_str(), &sb);
+
+	printf("  read back     %8.1f ns/datagram (%ld frames, %ld payload bytes)\n",
+		std::chrono::duration<double,std::nano>(t2-t1).count()/std::max(frames,1L), frames, bytes);
+	printf("  to pcap       %8.1f ns/datagram (%.1f MB)\n",
+		std::chrono::duration<double,std::nano>(t3-t2).count()/std::max(frames,1L), sb.st_size/1048576.0);
+
+	for (auto seq : Recorder::Segments(dir)) unlink(Recorder::segment_path_(dir, seq).c_str());
+	unlink(pcap_path.c_str());
+	rmdir(dir.c_str());
+
+	return (frames == (long)st.frames) ? 0 : 1;
+}
+
+// Snapshot write and (warm start) load times, against rebuilding the same
+// cache by decoding every announcement again.
+
+int bench_snapshot(const Options& opt)
+{
+	int n_types = opt.get("types", 16);
+	int n_instances = opt.get("instances", 10000);
+	std::string path = opt.get("path", "/tmp/mdns-bench.snapshot");
+
+	std::vector< std::vector<char> > pkts;
+	for (int i=0; i<n_instances; i++) {
+		std::vector<char> buf;
+		Synthetic::announcement(buf, i % n_types, i);
+		pkts.push_back(buf);
+	}
+
+	auto ms = [](Clock::time_point a, Clock::time_point b) {
+		return std::chrono::duration<double,std::milli>(b-a).count();
+	};
+
+	Cache cache;
+	auto now_ms = Cache::Now();
+
+	auto t0 = Clock::now();
+	for (const auto& p : pkts) cache.Update(p.data(), p.size(), now_ms);
+	auto t1 = Clock::now();
+	int n_written = Snapshot::Write(cache, path, now_ms);
+	auto t2 = Clock::now();
+
+	Cache warm;
+	std::vector<Snapshot::Question> stale;
+	auto t3 = Clock::now();
+	int n_loaded = Snapshot::Load(warm, path, Cache::Now(), &stale);
+	auto t4 = Clock::now();
+
+	struct stat st;
+	stat(path.c_str(), &st);
+
+	printf("snapshot: %d instances, %d records, %.1f KiB on disk\n",
+		n_instances, n_written, st.st_size/1024.0);
+	printf("  decode all announcements  %10.2f ms\n", ms(t0,t1));
+	printf("  write snapshot            %10.2f ms\n", ms(t1,t2));
+	printf("  load snapshot             %10.2f ms (%d records, %d stale)\n", ms(t3,t4), n_loaded, (int)stale.size());
+
+	unlink(path.c_str());
+
+	return (n_loaded == n_written) ? 0 : 1;
+}
+
+// Event feed: a steady stream of re-announcements with the odd TXT change,
+// polled once per (simulated) second; events and their encoded size vs the
+// packets that produced them, and the cost of a poll.
+
+int bench_events(const Options& opt)
+{
+	int n_types = opt.get("types", 16);
+	int n_instances = opt.get("instances", 1000);
+	int pps = opt.get("pps", 100);
+	int seconds = opt.get("seconds", 60);
+	int n_changes = opt.get("changes", 5);
+
+	const uint16_t flags = DNS::Defs::QRMask | DNS::Defs::AAMask;
+	const uint16_t in_flush = DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT;
+
+	std::vector<int> revs(n_instances, 0);
+
+	// As Synthetic::announcement(), plus a revision in the TXT record; the
+	// empty string first checks that it's skipped, and nothing after it lost.
+	auto announce = [&](std::vector<char>& buf, int i) {
+		int t = i % n_types;
+		auto inst = Synthetic::instance(t, i);
+		auto hst = Synthetic::host(i);
+		char addr[4];
+
+		Synthetic::address(i, addr);
+
+		DNS::Builder b(buf, 0, flags);
+		b.record(b.Answer, Synthetic::service_type(t), DNS::Defs::PTR, DNS::Defs::IN, 4500, DNS::Builder::rdata_name(inst));
+		b.record(b.Additional, inst, DNS::Defs::SRV, in_flush, 120, DNS::Builder::rdata_srv(0, 0, 631, hst));
+		b.record(b.Additional, inst, DNS::Defs::TXT, in_flush, 4500,
+			DNS::Builder::rdata_txt({"", "txtvers=1", "rev=" + std::to_string(revs[i])}));
+		b.record(b.Additional, hst, DNS::Defs::A, in_flush, 120, addr, sizeof(addr));
+	};
+
+	Cache cache;
+	EventFeed feed;
+	uint64_t n_json = 0, n_bin = 0, bad_txt = 0;
+
+	feed.Subscribe([&](const EventFeed::Batch& batch) {
+		for (const auto& ev : batch) {
+			std::string text;
+			std::vector<char> bin;
+			EventFeed::Json(ev, text);
+			if (!ev.txt.empty() && (text.find("\"txt\":[\"txtvers=1\",\"rev=") == std::string::npos)) bad_txt++;
+			EventFeed::Binary(ev, bin);
+			n_json += text.size();
+			n_bin += bin.size();
+		}
+	});
+
+	std::vector<char> buf;
+	int64_t now_ms = Cache::Now();
+
+	for (int i=0; i<n_instances; i++) {
+		announce(buf, i);
+		cache.Update(buf.data(), buf.size(), now_ms);
+	}
+	feed.Poll(cache, now_ms);
+	auto initial = feed.GetStats().events;
+	n_json = n_bin = 0;
+
+	// Each instance re-announced every n_instances/pps seconds, so the flush
+	// grace period has passed when a changed TXT replaces the old one.
+
+	long n_pkts = (long)seconds * pps, n_bytes = 0, k = 0;
+	long change_every = (n_changes > 0) ? std::max(n_pkts / n_changes, 1L) : n_pkts+1;
+	double poll_us = 0, max_us = 0;
+
+	for (int s=0; s<seconds; s++) {
+		for (int j=0; j<pps; j++, k++) {
+			int i = k % n_instances;
+			if ((k+1) % change_every == 0) revs[i]++;
+			announce(buf, i);
+			cache.Update(buf.data(), buf.size(), now_ms + 1000 + (int64_t)j*1000/pps);
+			n_bytes += buf.size();
+		}
+		now_ms += 1000;
+
+		auto t0 = Clock::now();
+		feed.Poll(cache, now_ms + 1000);
+		double us = std::chrono::duration<double,std::micro>(Clock::now() - t0).count();
+		poll_us += us;
+		max_us = std::max(max_us, us);
+	}
+
+	auto t0 = Clock::now();
+	for (int j=0; j<1000; j++) feed.Poll(cache, now_ms + 1000);
+	double idle_us = std::chrono::duration<double,std::micro>(Clock::now() - t0).count() / 1000;
+
+	auto st = feed.GetStats();
+
+	printf("events: %d instances, %d s at %d packets/s, %d TXT changes\n", n_instances, seconds, pps, n_changes);
+	printf("  initial poll           %10llu events\n", (unsigned long long)initial);
+	printf("  packets decoded        %10ld (%.1f KiB)\n", n_pkts, n_bytes/1024.0);
+	printf("  events after that      %10llu (JSON %.1f KiB, binary %.1f KiB)\n",
+		(unsigned long long)(st.events - initial), n_json/1024.0, n_bin/1024.0);
+	printf("  poll, cache changed    %10.1f us mean, %.1f us max\n", poll_us/seconds, max_us);
+	printf("  poll, nothing changed  %10.3f us\n", idle_us);
+	if (bad_txt > 0) printf("  %llu events with TXT strings missing from JSON\n", (unsigned long long)bad_txt);
+
+	return (((int)st.kinds[EventFeed::Txt] == n_changes) && (bad_txt == 0)) ? 0 : 1;
+}
+
+// Thousands of devices on a simulated network (SimNetwork.hpp), under a
+// virtual clock: each device is a Responder on its own host, on one of
+// several links, and a gateway attached to every link keeps a Cache of what
+// it hears. Devices announce twice, 1 s apart (RFC6762:8.3), starting at a
+// random time in the first second; the gateway then browses every service
+// type on every link, devices answering after 20-120 ms (RFC6762:6); and
+// finally resolves the address of every device on the first link in bulk
+// (Resolver, via the gateway's host). Reports traffic, what the gateway
+// learned, and virtual vs real and CPU time. Each run with the same seed
+// must produce the same digest.
+
+int bench_sim(const Options& opt)
+{
+	auto n_devices = (int)opt.get("devices", 5000);
+	auto n_links = (int)opt.get("links", 10);
+	auto n_types = (int)opt.get("types", 8);
+	auto loss_pct = opt.get("loss", 0L);
+	auto latency_us = opt.get("latency-us", 500);
+	auto jitter_us = opt.get("jitter-us", 200);
+	auto seed = opt.get("seed", 1);
+	auto n_runs = (int)opt.get("runs", 2);
+	const char *group = "224.0.0.251";
+	const size_t max_size = 1472;
+
+	if ((n_links < 1) || (n_links > 256) || (n_devices < n_links) || (n_types < 1)) ERROR("Bad options");
+
+	printf("sim: %d devices on %d links, %d service types, latency %ld+%ld us, loss %ld%%\n",
+		n_devices, n_links, n_types, latency_us, jitter_us, loss_pct);
+	printf("  %-30s %9s %9s %9s %9s   (microseconds)\n", "", "p50", "p99", "p999", "max");
+
+	struct Device {
+		SimNetwork::Host* host;
+		int sd;
+		Responder responder;
+		std::vector< std::vector<char> > announcement;
+	};
+
+	uint64_t first_digest = 0;
+	int bad = 0;
+
+	for (int run=1; run<=n_runs; run++) {
+		auto t0 = Clock::now();
+		auto cpu0 = thread_cpu_ns();
+
+		SimNetwork net(seed);
+		net.latency_us = latency_us;
+		net.jitter_us = jitter_us;
+		net.loss = loss_pct / 100.0;
+
+		for (int l=0; l<n_links; l++) net.AddLink();
+
+		sockaddr_storage mcast;
+		SockUtil::pack(&mcast, AF_INET, group, 5353);
+
+		// Shared by every callback; it all runs in this thread
+		std::vector<char> rx(66000);
+		DatagramSocket::Meta meta;
+
+		// Gateway: every link, caching every response
+		std::vector<int> all_links;
+		for (int l=0; l<n_links; l++) all_links.push_back(l);
+
+		auto& gw = net.AddHost(all_links);
+		Cache cache;
+		uint64_t gw_responses = 0;
+
+		int gw_sd = gw.Open(AF_INET, 5353);
+		for (int k=1; k<=n_links; k++) gw.Join(gw_sd, group, k);
+
+		gw.OnReadable(gw_sd, [&](int sd) {
+			int N;
+			while ((N = gw.Read(sd, rx.data(), rx.size(), meta)) >= 0) {
+				if ((N < 12) || !(rx[2] & 0x80)) continue;
+				cache.Update(rx.data(), N, net.now_us/1000);
+				gw_responses++;
+			}
+		});
+
+		// Devices: device i is on link i % n_links
+		std::deque<Device> devices;
+		uint64_t n_answers = 0;
+
+		for (int i=0; i<n_devices; i++) {
+			auto& host = net.AddHost( {i % n_links} );
+			devices.push_back( {&host, -1, Responder(), {}} );
+			auto& dev = devices.back();
+
+			auto t = i % n_types;
+			auto inst = Synthetic::instance(t, i);
+			auto hst = Synthetic::host(i);
+			auto addr = host.Address(1);
+			auto a = (const char *)SockUtil::inet4(&addr);
+			const uint16_t in_flush = DNS::Defs::IN | DNS::Defs::CACHE_FLUSH_BIT;
+
+			dev.responder.Add(Synthetic::service_type(t), DNS::Defs::PTR, DNS::Defs::IN, 4500, DNS::Builder::rdata_name(inst));
+			dev.responder.Add(inst, DNS::Defs::SRV, in_flush, 120, DNS::Builder::rdata_srv(0, 0, 631, hst));
+			dev.responder.Add(inst, DNS::Defs::TXT, in_flush, 4500, DNS::Builder::rdata_txt({"txtvers=1"}));
+			dev.responder.Add(hst, DNS::Defs::A, in_flush, 120, std::vector<char>(a, a+4));
+
+			std::vector<DNS::Packer::Record> answers, none;
+			for (const auto& r : dev.responder.records) {
+				answers.push_back( {&r.name, r.type, r.clss, r.TTL, r.rdata.data(), (uint16_t)r.rdata.size()} );
+			}
+			DNS::Packer::Pack(dev.announcement, 0, DNS::Defs::QRMask | DNS::Defs::AAMask, max_size, answers, none);
+
+			dev.sd = host.Open(AF_INET, 5353);
+			host.Join(dev.sd, group);
+
+			// Queries answered from the receiving interface's view; multicast
+			// answers spread over 20-120 ms, legacy unicast answered at once.
+			// Legacy answers repeat the questions, so can be larger than the
+			// query; they're limited only by the querier's EDNS payload size,
+			// as IP would fragment them.
+			host.OnReadable(dev.sd, [&, dp = &dev](int sd) {
+				int N;
+				while ((N = dp->host->Read(sd, rx.data(), rx.size(), meta)) >= 0) {
+					if ((N < 12) || (rx[2] & 0x80)) continue;
+
+					bool legacy = (ntohs(((sockaddr_in *)&meta.src)->sin_port) != 5353);
+					std::vector< std::vector<char> > pkts;
+					size_t limit = legacy ? 0 : max_size;
+					if (dp->responder.Respond(rx.data(), N, legacy, pkts, limit, meta.ifc_idx) == 0) continue;
+
+					auto dst = legacy ? meta.src : mcast;
+					auto ifc = meta.ifc_idx;
+					auto send = [dp, sd, dst, ifc, pkts]() {
+						for (const auto& p : pkts) dp->host->Send(sd, p.data(), p.size(), dst, ifc);
+					};
+					n_answers++;
+
+					if (legacy) send();
+					else net.After(net.Uniform(20000, 120000), send);
+				}
+			});
+
+			auto start = net.Uniform(0, 1000000);
+			for (int k=0; k<2; k++) {
+				net.At(start + k*1000000, [dp = &dev, &mcast]() {
+					for (const auto& p : dp->announcement) dp->host->Send(dp->sd, p.data(), p.size(), mcast, 1);
+				});
+			}
+		}
+
+		// Announcements
+		auto count = [&]() {
+			Cache::Reader r(cache);
+			return r.ForEach(net.now_us/1000, [](const Cache::Entry&) {});
+		};
+
+		net.RunUntil(3000000);
+		auto announced = count();
+
+		// Browse every type on every link
+		std::vector<char> query;
+		{
+			DNS::Builder b(query, 0, 0, max_size);
+			for (int t=0; t<n_types; t++) b.question(Synthetic::service_type(t), DNS::Defs::PTR);
+		}
+		for (int k=1; k<=n_links; k++) gw.Send(gw_sd, query.data(), query.size(), mcast, k);
+
+		auto browse_answers = n_answers;
+		net.RunUntil(4000000);
+		browse_answers = n_answers - browse_answers;
+
+		// Records the gateway should know: PTR, SRV, TXT and A per device
+		size_t expected = 4*n_devices;
+		size_t cached = count();
+
+		// Bulk resolution of the first link's devices, from the gateway
+		std::vector<Resolver::Question> questions;
+		for (int i=0; i<n_devices; i+=n_links) questions.push_back( {Synthetic::host(i), DNS::Defs::A} );
+
+		Resolver resolver;
+		if (!resolver.Open(gw, 1, group, 5353)) ERROR("Resolver::Open()");
+
+		auto r0 = net.now_us;
+		auto results = resolver.Resolve(questions);
+		auto r_dt = net.now_us - r0;
+
+		std::vector<int64_t> latency;
+		size_t n_resolved = 0;
+		for (const auto& x : results) {
+			if (!x.Answered()) continue;
+			n_resolved++;
+			latency.push_back(1000*x.Latency_us());
+		}
+		auto rst = resolver.GetStats();
+
+		auto cpu = (thread_cpu_ns() - cpu0) / 1e9;
+		auto wall = std::chrono::duration<double>(Clock::now() - t0).count();
+		auto st = net.GetStats();
+
+		printf("  run %d: %.2f s simulated in %.2f s (%.2f s CPU), %llu events\n",
+			run, net.now_us/1e6, wall, cpu, (unsigned long long)st.events);
+		printf("    traffic : %llu packets (%.1f MB), %llu deliveries, %llu lost, %llu overflows\n",
+			(unsigned long long)st.packets, st.bytes/1048576.0, (unsigned long long)st.deliveries,
+			(unsigned long long)st.lost, (unsigned long long)st.overflows);
+		printf("    gateway : %d of %d records after announcements, %d after browse (%llu answers); %llu responses heard\n",
+			(int)announced, (int)expected, (int)cached, (unsigned long long)browse_answers, (unsigned long long)gw_responses);
+		printf("    resolve : %d of %d names in %llu queries (%llu retries), %.3f s virtual\n",
+			(int)n_resolved, (int)questions.size(), (unsigned long long)rst.queries,
+			(unsigned long long)rst.retries, r_dt/1e6);
+		percentiles("  virtual latency", latency);
+		printf("    digest  : %016llx\n", (unsigned long long)st.digest);
+
+		if (run == 1) first_digest = st.digest;
+		else if (st.digest != first_digest) bad++;
+
+		if ((loss_pct == 0) && ((cached != expected) || (n_resolved != questions.size()))) bad++;
+
+		resolver.Close();
+	}
+
+	if (n_runs > 1) printf("  %s\n", bad ? "MISMATCH or missing records" : "runs identical");
+
+	return bad;
+}
+
+struct Bench {
+	const char *name;
+	const char *desc;
+	std::function<int(const Options&)> fn;
+};
+
+const std::vector<Bench> benchmarks = {
+	{ "filter", "In-kernel BPF vs userspace filtering [--n --rate --port --types --rule]", bench_filter },
+	{ "prefilter", "Decode cost of a flood with/without header prefilter [--n --types --queries --policy]", bench_prefilter },
+	{ "recv", "Receive backends: recvmsg vs io_uring multishot with provided buffers [--n --batch --port --types]", bench_recv },
+	{ "latency", "Query/answer round trip via in-process responder [--n --port --hosts --ifc]", bench_latency },
+	{ "negative", "Repeated lookups of missing records, with/without NSEC [--n --port --hosts --timeout-ms --ifc]", bench_negative },
+	{ "pack", "Large responses split over packets: bytes/record with/without compression, responses/s [--instances --size --n]", bench_pack },
+	{ "links", "Multi-homed answers: per-link view on that link vs every address on every link [--links --services --size --n]", bench_links },
+	{ "resolve", "Bulk resolution in multi-question queries vs one at a time [--hosts --single --rate --size --missing --port]", bench_resolve },
+	{ "gateway", "Unicast DNS gateway: queries/s from cache (UDP/TCP), multicast misses [--n --port --instances --window --misses]", bench_gateway },
+	{ "cache", "Cache lookups/s vs reader threads, sharded vs locked [--ms --threads --instances --types --write-rate]", bench_cache },
+	{ "refresh", "Refresh scheduling over simulated time, timer wheel vs scan [--records --minutes --payload]", bench_refresh },
+	{ "shm", "Shared memory export: publish cost, C reader lookups/s [--n --instances --types --publish-ms]", bench_shm },
+	{ "record", "Recording to memory-mapped segments: Record() cost, read back, pcap [--n --threads --segment-mb --types --dir]", bench_record },
+	{ "events", "Service change events vs packets, poll cost [--instances --types --pps --seconds --changes]", bench_events },
+	{ "snapshot", "Cache snapshot write/load vs decoding announcements [--instances --types --path]", bench_snapshot },
+	{ "sim", "Simulated network: thousands of devices under a virtual clock, traffic and CPU [--devices --links --types --loss --latency-us --jitter-us --seed --runs]", bench_sim },
+};
+
+}
+
+int main(int argc, char **argv)
+{
+	setbuf(stdout, nullptr);
+
+	if (argc >= 2) {
+		Options opt(argc, argv);
+		for (const auto& b : benchmarks) {
+			if (strcmp(argv[1], b.name) == 0) return b.fn(opt);
+		}
+	}
+
+	printf("Usage: %s <benchmark> [--option=value ...]\n", argv[0]);
+	for (const auto& b : benchmarks) printf("  %-10s %s\n", b.name, b.desc);
+
+	return 1;
+}
@@ -20,6 +20,7 @@
 #include <cstdlib>
 #include <cerrno>
 #include <cstring>
+#include <cstdint>
 
 #include <map>
 #include <string>
@@ -34,6 +35,34 @@ namespace mDNS
 // Map something of type T to a string name
 template <typename T> using NameMap = std::map<T,std::string>;
 
+// Fast non-cryptographic hashing (FNV-1a) for packet and name keys
+struct Hash
+{
+	static constexpr uint64_t Basis = 0xcbf29ce484222325ULL;
+	static constexpr uint64_t Prime = 0x100000001b3ULL;
+
+	static uint64_t fnv1a(const void *data, size_t len, uint64_t h = Basis)
+	{
+		auto p = (const unsigned char *)data;
+		for (size_t i=0; i<len; i++) {
+			h = (h ^ p[i]) * Prime;
+		}
+		return h;
+	}
+
+	// As above, but ASCII case-insensitive (DNS names; RFC4343)
+	static uint64_t fnv1a_nocase(const void *data, size_t len, uint64_t h = Basis)
+	{
+		auto p = (const unsigned char *)data;
+		for (size_t i=0; i<len; i++) {
+			auto c = p[i];
+			if ((c >= 'A') && (c <= 'Z')) c += 'a' - 'A';
+			h = (h ^ c) * Prime;
+		}
+		return h;
+	}
+};
+
 // Warning/error logging (possibly to multiple output streams)
 struct Log
 {
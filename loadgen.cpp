@@ -0,0 +1,254 @@
+/*
+	Author: John Grime
+*/
+
+#include "mDNS.hpp" // should come before any inet headers etc
+#include "Synthetic.hpp"
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <csignal>
+#include <thread>
+
+using namespace mDNS;
+
+//
+// Synthetic mDNS load generator: sends a configurable mix of queries,
+// announcements, goodbyes and malformed packets to a multicast group on a
+// given interface, at a target rate (0 = as fast as possible), and reports
+// the achieved rate once per second.
+//
+// For single-machine tests use "lo" (after "ip link set lo multicast on") or
+// one end of a veth pair, and run the listener on the same interface with
+// --quiet so that printing doesn't dominate.
+//
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+volatile std::sig_atomic_t gSignalStatus = 0;
+
+void signal_handler(int signal)
+{
+	gSignalStatus = signal;
+}
+
+void usage(const char *prog)
+{
+	printf("Usage: %s <interface> [options]\n", prog);
+	printf("  --group=<ip>      multicast group (224.0.0.251; ff02::fb => IPv6)\n");
+	printf("  --port=<n>        destination port (5353)\n");
+	printf("  --rate=<pps>      target packets/sec, 0 => unlimited (10000)\n");
+	printf("  --seconds=<n>     run time, 0 => until SIGINT (10)\n");
+	printf("  --mix=<q:a:g:m>   relative weights of queries, announcements,\n");
+	printf("                    goodbyes and malformed packets (4:4:1:1)\n");
+	printf("  --types=<n>       number of service types (16)\n");
+	printf("  --instances=<n>   number of service instances (256)\n");
+	printf("  --batch=<n>       packets per sendmmsg() call (32)\n");
+	exit(1);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::string group = "224.0.0.251";
+	int port = 5353;
+	long rate = 10000, seconds = 10;
+	int mix[4] = { 4, 4, 1, 1 };
+	int n_types = 16, n_instances = 256, batch = 32;
+
+	setbuf(stdout, nullptr);
+
+	if (argc < 2) usage(argv[0]);
+
+	const char *ifc_name = argv[1];
+	unsigned int ifc_idx = Interfaces::GetIndex(ifc_name);
+	if (ifc_idx == 0) ERROR("Unknown interface '%s'", ifc_name);
+
+	for (int i=2; i<argc; i++) {
+		const char *a = argv[i];
+
+		if (strncmp(a, "--group=", 8) == 0) group = a+8;
+		else if (strncmp(a, "--port=", 7) == 0) port = atoi(a+7);
+		else if (strncmp(a, "--rate=", 7) == 0) rate = atol(a+7);
+		else if (strncmp(a, "--seconds=", 10) == 0) seconds = atol(a+10);
+		else if (strncmp(a, "--types=", 8) == 0) n_types = atoi(a+8);
+		else if (strncmp(a, "--instances=", 12) == 0) n_instances = atoi(a+12);
+		else if (strncmp(a, "--batch=", 8) == 0) batch = atoi(a+8);
+		else if (strncmp(a, "--mix=", 6) == 0) {
+			if (sscanf(a+6, "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2], &mix[3]) != 4) usage(argv[0]);
+		}
+		else usage(argv[0]);
+	}
+
+	if ((n_types < 1) || (n_instances < 1) || (batch < 1)) usage(argv[0]);
+	if (batch > 256) batch = 256;
+
+	// Destination and sending socket
+
+	int family = (group.find(':') == std::string::npos) ? AF_INET : AF_INET6;
+	sockaddr_storage dst;
+	socklen_t dst_len = (family == AF_INET) ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+
+	if (!SockUtil::pack(&dst, family, group.c_str(), port)) {
+		ERROR("Bad group/port %s : %d", group.c_str(), port);
+	}
+
+	int sd = socket((family == AF_INET) ? PF_INET : PF_INET6, SOCK_DGRAM, 0);
+	if (sd < 0) ERROR("socket()");
+
+	if (family == AF_INET) {
+		struct ip_mreqn m;
+		memset(&m, 0, sizeof(m));
+		m.imr_ifindex = ifc_idx;
+		if (setsockopt(sd, IPPROTO_IP, IP_MULTICAST_IF, &m, sizeof(m)) < 0) {
+			ERROR("setsockopt(IP_MULTICAST_IF,%s)", ifc_name);
+		}
+		unsigned char ttl = 255;
+		setsockopt(sd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+	}
+	else {
+		int idx = ifc_idx, hops = 255;
+		if (setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &idx, sizeof(idx)) < 0) {
+			ERROR("setsockopt(IPV6_MULTICAST_IF,%s)", ifc_name);
+		}
+		setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+	}
+
+	DatagramSocket::SetMulticastLoop(sd, family, true);
+
+	// Pre-built packet pools, so generation costs nothing while sending
+
+	const char *kinds[] = { "query", "announce", "goodbye", "malformed" };
+	std::vector< std::vector<char> > pools[4];
+	std::vector<int> schedule; // kind per slot, in proportion to mix
+	const int pool_size = 256;
+
+	for (int k=0; k<4; k++) {
+		for (int j=0; j<pool_size; j++) {
+			std::vector<char> buf;
+			int t = j % n_types, inst = (j * 7919) % n_instances;
+
+			if (k == 0) Synthetic::query(buf, t);
+			if (k == 1) Synthetic::announcement(buf, t, inst);
+			if (k == 2) Synthetic::goodbye(buf, t, inst);
+			if (k == 3) Synthetic::malformed(buf, t, inst, j);
+
+			pools[k].push_back(buf);
+		}
+		for (int w=0; w<mix[k]; w++) schedule.push_back(k);
+	}
+
+	if (schedule.empty()) ERROR("Empty mix");
+
+	// Signal handler, as for main.cpp
+
+	{
+		struct sigaction new_action;
+		sigemptyset(&new_action.sa_mask);
+		new_action.sa_handler = signal_handler;
+		new_action.sa_flags = 0;
+		if (sigaction(SIGINT, &new_action, nullptr) != 0) ERROR("sigaction()");
+	}
+
+	printf("Sending to %s port %d via %s (%d) : rate %ld pps, mix %d:%d:%d:%d\n",
+		group.c_str(), port, ifc_name, ifc_idx, rate, mix[0], mix[1], mix[2], mix[3]);
+
+	// Send loop: batches via sendmmsg() where available, paced against the
+	// start time so short stalls are caught up.
+
+	std::vector<struct iovec> iov(batch);
+	#if __linux__
+		std::vector<struct mmsghdr> mm(batch);
+	#endif
+
+	uint64_t sent = 0, bytes = 0, errors = 0, last_sent = 0, last_bytes = 0;
+	uint64_t by_kind[4] = { 0, 0, 0, 0 };
+	size_t slot = 0;
+
+	auto t0 = Clock::now(), t_report = t0;
+
+	while (gSignalStatus == 0) {
+		auto now = Clock::now();
+		double elapsed = std::chrono::duration<double>(now - t0).count();
+
+		if ((seconds > 0) && (elapsed >= seconds)) break;
+
+		// Periodic report
+		if (now - t_report >= std::chrono::seconds(1)) {
+			double dt = std::chrono::duration<double>(now - t_report).count();
+			printf("%8.1f s : %10.0f pps %8.2f Mbit/s (total %llu, errors %llu)\n",
+				elapsed, (sent-last_sent)/dt, 8e-6*(bytes-last_bytes)/dt,
+				(unsigned long long)sent, (unsigned long long)errors);
+			last_sent = sent;
+			last_bytes = bytes;
+			t_report = now;
+		}
+
+		// Rate limiting: how many packets are due by now?
+		int n = batch;
+		if (rate > 0) {
+			uint64_t due = (uint64_t)(elapsed * rate);
+			if (due <= sent) {
+				// Sleep until the next one is due, or the next report
+				auto t_next = t0 + std::chrono::duration_cast<Clock::duration>(
+					std::chrono::duration<double>((double)(sent+1) / rate));
+				std::this_thread::sleep_until(std::min(t_next, t_report + std::chrono::seconds(1)));
+				continue;
+			}
+			n = (due-sent < (uint64_t)batch) ? (int)(due-sent) : batch;
+		}
+
+		int kind_of[256];
+		for (int j=0; j<n; j++) {
+			int k = schedule[slot % schedule.size()];
+			const auto& p = pools[k][(slot / schedule.size()) % pool_size];
+			iov[j].iov_base = (void *)p.data();
+			iov[j].iov_len = p.size();
+			kind_of[j % 256] = k;
+			slot++;
+		}
+
+		int done = 0;
+		#if __linux__
+			for (int j=0; j<n; j++) {
+				memset(&mm[j], 0, sizeof(mm[j]));
+				mm[j].msg_hdr.msg_name = &dst;
+				mm[j].msg_hdr.msg_namelen = dst_len;
+				mm[j].msg_hdr.msg_iov = &iov[j];
+				mm[j].msg_hdr.msg_iovlen = 1;
+			}
+			done = sendmmsg(sd, mm.data(), n, 0);
+			if (done < 0) done = 0;
+		#else
+			for (int j=0; j<n; j++) {
+				if (sendto(sd, iov[j].iov_base, iov[j].iov_len, 0, (sockaddr *)&dst, dst_len) < 0) break;
+				done++;
+			}
+		#endif
+
+		errors += n - done;
+		errno = 0;
+
+		for (int j=0; j<done; j++) {
+			bytes += iov[j].iov_len;
+			by_kind[kind_of[j % 256]]++;
+		}
+		sent += done;
+	}
+
+	double elapsed = std::chrono::duration<double>(Clock::now() - t0).count();
+
+	printf("\nSent %llu packets in %.2f s : %.0f pps, %.2f Mbit/s, %llu errors\n",
+		(unsigned long long)sent, elapsed, sent/elapsed, 8e-6*bytes/elapsed,
+		(unsigned long long)errors);
+	for (int k=0; k<4; k++) {
+		printf("  %-10s %llu\n", kinds[k], (unsigned long long)by_kind[k]);
+	}
+
+	close(sd);
+}
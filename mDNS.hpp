@@ -12,6 +12,29 @@
 #include "Interfaces.hpp"
 
 #include "DNS.hpp"
+#include "RRTypes.hpp"
+#include "TxtRecord.hpp"
 #include "DatagramSocket.hpp"
+#include "Transport.hpp"
+#include "SimNetwork.hpp"
+#include "UringReceiver.hpp"
+#include "PacketCapture.hpp"
+#include "Recorder.hpp"
+#include "Pcap.hpp"
+#include "Dedupe.hpp"
+#include "SelfEcho.hpp"
+#include "FilterRules.hpp"
+#include "SocketFilter.hpp"
+#include "Prefilter.hpp"
+#include "Subscriptions.hpp"
+#include "Responder.hpp"
+#include "Cache.hpp"
+#include "ShmExport.hpp"
+#include "Snapshot.hpp"
+#include "Gateway.hpp"
+#include "TimerWheel.hpp"
+#include "Refresher.hpp"
+#include "Resolver.hpp"
+#include "EventFeed.hpp"
 
 #endif
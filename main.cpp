@@ -4,10 +4,14 @@
 
 #include "mDNS.hpp" // should come before any inet headers etc
 
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <csignal>
+#include <memory>
+#include <condition_variable>
 #include <mutex>
 #include <thread>
 
@@ -55,16 +59,25 @@ void signal_handler(int signal)
 
 // Debug print routines
 
-void print_dns_rr(const DNS::ResourceRecord& rr, const char* msg_buf, bool is_question)
+void print_dns_rr(const DNS::ResourceRecord& rr, const char* msg_buf, size_t msg_len, bool is_question)
 {
 	using Defs = DNS::Defs;
 
-	char b[INET6_ADDRSTRLEN];
-	std::vector<std::string> tmp;
+	const auto& info = DNS::RRTypes::info(rr.type);
+	std::string text;
+
+	// EDNS pseudo-record: class and TTL fields are reused; RFC6891:6.1.3
+	DNS::EDNS edns;
+	if (!is_question && edns.from_record(rr)) {
+		printf("  {OPT udp_size=%d version=%d flags=%s(%d) ext_rcode=%d rd_len=%d}\n",
+			rr.clss, edns.version, (edns.flags & DNS::EDNS::DOMask) ? "DO " : "", edns.flags,
+			edns.ext_rcode, rr.rd_len);
+		return;
+	}
 
 	printf("  {name=%s, type=%s (%d), class=%s %s(%d)} {TTL=%d rd_len=%d}",
 		rr.name.c_str(),
-		Defs::RRType(rr.type),
+		DNS::RRTypes::name(rr.type) ? DNS::RRTypes::name(rr.type) : "?",
 		rr.type,
 		Defs::Class(rr.clss & ~Defs::CACHE_FLUSH_BIT),
 		(rr.clss&Defs::CACHE_FLUSH_BIT) ? "[FLUSH_CACHE] " : "",
@@ -76,49 +89,13 @@ void print_dns_rr(const DNS::ResourceRecord& rr, const char* msg_buf, bool is_qu
 		return;
 	}
 
-	size_t i = rr.rd_ofs;
-	size_t max_i = i + rr.rd_len;
-
-	tmp.clear();
-
-	printf( " { " );
-	switch (rr.type) {
-		case Defs::A:
-			printf("%s ", inet_ntop(AF_INET, &msg_buf[i], b, sizeof(b)) );
-		break;
-
-		case Defs::AAAA:
-			printf("%s ", inet_ntop(AF_INET6, &msg_buf[i], b, sizeof(b)) );
-		break;
-
-		case Defs::PTR:
-			DNS::Parse::labels(msg_buf, i, max_i, true, true, tmp);
-
-			for (const auto& str: tmp) printf("%s.", str.c_str());
-				printf(" ");
-		break;
-
-		case Defs::SRV:
-		{
-			uint16_t priority, weight, port;
-
-			i = DNS::Parse::read(msg_buf, i, max_i, priority);
-			i = DNS::Parse::read(msg_buf, i, max_i, weight);
-			i = DNS::Parse::read(msg_buf, i, max_i, port);
-
-			DNS::Parse::labels(msg_buf, i, max_i, true, true, tmp);
-
-			for (const auto& str: tmp) printf("%s.", str.c_str());
-			printf(" priority=%d weight=%d port=%d ", priority, weight, port);
-		}
-		break;
-
-		case Defs::TXT:
-			DNS::Parse::labels(msg_buf, i, max_i, true, false, tmp);
-			for (const auto& str: tmp) printf("'%s' ", str.c_str());
-		break;
+	// Presentation format, per the type's RDATA layout
+	if (info.format(msg_buf, msg_len, rr.rd_ofs, rr.rd_len, text)) {
+		printf(" { %s }\n", text.c_str());
+	}
+	else {
+		printf(" { malformed: %s }\n", text.c_str());
 	}
-	printf( "}\n" );
 }
 
 void print_dns_msg(
@@ -158,7 +135,7 @@ void print_dns_msg(
 			printf("Problem parsing record.\n");
 			return;
 		}
-		print_dns_rr(rr, msg_buf, true);
+		print_dns_rr(rr, msg_buf, msg_buflen, true);
 	}
 
 	const char* sections[] = { "Answers", "Authority", "Additional" };
@@ -172,7 +149,7 @@ void print_dns_msg(
 				printf("Problem parsing record.\n");
 				return;
 			}
-			print_dns_rr(rr, msg_buf, false);
+			print_dns_rr(rr, msg_buf, msg_buflen, false);
 		}
 	}
 
@@ -181,29 +158,233 @@ void print_dns_msg(
 
 }
 
-// IPv4/6 threads call this to collect and print messages
+// Listening sockets, so that our queries can go out on them too, from port
+// 5353 (see post() in main()).
+
+struct Listeners
+{
+	struct Entry {
+		int family, sd;
+		unsigned int ifc_idx; // 0 => any interface
+	};
+
+	std::vector<Entry> entries;
+	std::mutex mutex;
+	std::condition_variable added;
+
+	void Add(int family, int sd, unsigned int ifc_idx)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		entries.push_back( {family, sd, ifc_idx} );
+		added.notify_all();
+	}
+
+	// Wait until at least n sockets are listening; false on timeout.
+	bool WaitFor(size_t n, int timeout_ms)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		return added.wait_for(lock, std::chrono::milliseconds(timeout_ms), [&] { return entries.size() >= n; });
+	}
+
+	void Remove(int sd)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i=0; i<entries.size(); i++) {
+			if (entries[i].sd != sd) continue;
+			entries.erase(entries.begin() + i);
+			return;
+		}
+	}
+
+	// Multicast buf to the mDNS group out of interface ifc_idx; false if no
+	// socket of that family listens there, or the send failed.
+	bool Send(int family, unsigned int ifc_idx, const void *buf, size_t len)
+	{
+		sockaddr_storage dst;
+		auto IP = (family == AF_INET6) ? "ff02::fb" : "224.0.0.251";
+
+		if (!SockUtil::pack(&dst, family, IP, 5353)) return false;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& e : entries) {
+			if ((e.family != family) || ((e.ifc_idx != 0) && (e.ifc_idx != ifc_idx))) continue;
+			return DatagramSocket::Send(e.sd, buf, len, dst, ifc_idx) >= 0;
+		}
+		return false;
+	}
+};
+
+// State shared by all listener threads
+
+struct Shared
+{
+	int timeout_ms = 100;
+	bool quiet = false; // no per-packet output; see counters below
+	bool use_cache = false;
+	bool use_prefilter = false;
+	bool use_uring = false; // receive via io_uring, where available
+	bool recording = false; // everything received goes to recorder
+	bool responding = false; // queries answered from responder; see answer_message()
+	bool mcast_loop = true; // local delivery of what we send from listening sockets
+
+	Dedupe dedupe;
+	SelfEcho self_echo;
+	SocketFilter filter;
+	Prefilter prefilter;
+	Subscriptions subscriptions;
+	Cache cache;
+	Recorder recorder;
+	Responder responder;
+	Listeners listeners;
+	std::map<int,size_t> link_payload; // interface index => largest response (IPv6 headers)
+
+	std::mutex print_mutex;
+
+	std::atomic<uint64_t> n_datagrams{0}, n_bytes{0}, n_records{0};
+	std::atomic<uint64_t> n_answered{0}, n_answer_packets{0}, n_answer_bytes{0};
+
+	Shared(const Interfaces& ifcs) : self_echo(ifcs) {}
+};
+
+// Everything after the read: counting, filtering, caching and decoding.
+// Returns false if the datagram was skipped (prefilter, echo, duplicate).
+
+bool process_message(const char *buf, int N, DatagramSocket::Meta& meta, Shared& shared)
+{
+	auto& dedupe = shared.dedupe;
+	auto& self_echo = shared.self_echo;
+	auto& print_mutex = shared.print_mutex;
+
+	char ip_buf[INET6_ADDRSTRLEN];
+
+	if (shared.recording) shared.recorder.Record(buf, N, meta);
+
+	shared.n_datagrams++;
+	shared.n_bytes += N;
+
+	// Header-only checks, before anything is decoded
+	if (shared.use_prefilter && !shared.prefilter.Accept(buf, N)) return false;
+
+	// Our own transmission, looped back? Don't parse (or answer) it.
+	if (self_echo.IsEcho(buf, N, meta)) {
+		if (shared.quiet) return false;
+		std::lock_guard<std::mutex> lock(print_mutex);
+		printf("\n[self] %d bytes from %s on %d; skipped\n",
+			(int)N, SockUtil::unpack(&meta.src, ip_buf, sizeof(ip_buf)), meta.ifc_idx);
+		return false;
+	}
+
+	// Same datagram via another family/interface? Skip before parsing.
+	if (dedupe.IsDuplicate(buf, N, meta)) {
+		if (shared.quiet) return false;
+		std::lock_guard<std::mutex> lock(print_mutex);
+		printf("\n[duplicate] %d bytes from %s on %d; skipped\n",
+			(int)N, SockUtil::unpack(&meta.src, ip_buf, sizeof(ip_buf)), meta.ifc_idx);
+		return false;
+	}
+
+	dedupe.Learn(buf, N, meta);
+
+	if (shared.use_cache) shared.cache.Update(buf, N, Cache::Now());
+
+	// Decode only, e.g. under synthetic load
+	if (shared.quiet) {
+		shared.n_records += shared.subscriptions.DispatchMessage(buf, N, &meta);
+		return true;
+	}
+
+	// Avoid intermingled output
+	{
+		std::lock_guard<std::mutex> lock(print_mutex);
+
+		printf("\n***********************\n");
+		printf("Read %d bytes\n", (int)N);
+		printf("%s => ", SockUtil::unpack(&meta.src, ip_buf, sizeof(ip_buf)));
+		printf("%s : ", SockUtil::unpack(&meta.dst, ip_buf, sizeof(ip_buf)));
+		printf("delivered_on=%d\n", meta.ifc_idx);
+
+		SockUtil::print(&meta.src);
+		SockUtil::print(&meta.dst);
+
+		print_dns_msg(buf, N);
+
+		// Subscribers see the records straight from the receive buffer
+		shared.subscriptions.DispatchMessage(buf, N, &meta);
+	}
+
+	return true;
+}
+
+// Answer a query from the view of the interface it arrived on, and send the
+// answer out of that interface only: straight back to a legacy querier
+// (RFC6762:6.7), else multicast to the group on that link. sd is the socket
+// the query was read from, so answers come from port 5353.
+
+void answer_message(int sd, int family, const char *buf, int N, const DatagramSocket::Meta& meta, Shared& shared)
+{
+	std::vector< std::vector<char> > packets;
+	char ip_buf[INET6_ADDRSTRLEN];
+	int port = 0;
+
+	SockUtil::unpack(&meta.src, ip_buf, sizeof(ip_buf), &port);
+	bool legacy = (port != 5353);
+
+	auto it = shared.link_payload.find(meta.ifc_idx);
+	size_t max_size = (it != shared.link_payload.end()) ? it->second : DNS::EDNS::MinPayload;
+
+	if (shared.responder.Respond(buf, N, legacy, packets, max_size, meta.ifc_idx) == 0) return;
+
+	sockaddr_storage dst = meta.src;
+	if (!legacy && !SockUtil::pack(&dst, family, (family == AF_INET6) ? "ff02::fb" : "224.0.0.251", 5353)) return;
+
+	for (const auto& p : packets) {
+		shared.self_echo.Record(&p[0], p.size(), 5353, meta.ifc_idx);
+		if (DatagramSocket::Send(sd, &p[0], p.size(), dst, meta.ifc_idx) < 0) continue;
+		shared.n_answer_packets++;
+		shared.n_answer_bytes += p.size();
+	}
+	shared.n_answered++;
+}
+
+// IPv4/6 threads call this to collect and print messages. If device is
+// specified, the socket only receives datagrams arriving on that interface.
 
 void read_messages(
 	int family, int port, const char *IP,
 	const std::vector<ifaddrs *>* ifa_vec,
-	int timeout_ms,
-	volatile std::sig_atomic_t& status,
-	std::mutex& print_mutex)
+	const char *device,
+	Shared& shared,
+	volatile std::sig_atomic_t& status)
 {
+	auto timeout_ms = shared.timeout_ms;
+
 	TimeoutSelect ts;
 	DatagramSocket::Meta meta;
 
 	std::vector<char> msg_buf(66000);
-	char ip_buf[INET6_ADDRSTRLEN];
 
 	if (!IP) return;
 	if (ifa_vec && ifa_vec->size()<1) return;
 
-	int sd = DatagramSocket::CreateAndBind(family, port);
+	bool device_bound = false;
+	unsigned int filter_idx = 0;
+
+	int sd = DatagramSocket::CreateAndBind(family, port, nullptr, device, &device_bound);
 	if (sd < 0) {
 		ERROR("Creation/bind failed (%s : %d).\n", IP, port);
 	}
 
+	// Kernel wouldn't restrict socket to device? Filter in userspace instead.
+	if (device && !device_bound) {
+		filter_idx = Interfaces::GetIndex(device);
+	}
+
+	// Likewise for the content filter, if any rules were specified.
+	bool user_filter = false;
+	if (!shared.filter.rules.empty()) {
+		user_filter = !SocketFilter::Attach(sd, shared.filter.Compile());
+	}
+
 	// See note in DatagramSocket::JoinMulticastInterface()
 	if (ifa_vec) {
 		for (const auto& ifa : *ifa_vec) {
@@ -214,44 +395,126 @@ void read_messages(
 		DatagramSocket::JoinMulticastGroup(sd, IP);
 	}
 
+	// Our queries go out on this socket too
+	if (!shared.mcast_loop) DatagramSocket::SetMulticastLoop(sd, family, false);
+	shared.listeners.Add(family, sd, device ? Interfaces::GetIndex(device) : 0);
+
+	// The ring drains the socket itself, so must also do the waiting
+	std::unique_ptr<UringReceiver> ring;
+	if (shared.use_uring) ring.reset(new UringReceiver(sd));
+
 	while (status == 0) {
 		// Don't block - only proceed to Read() when data available
-		if ((timeout_ms>0) && (ts.Select(timeout_ms,{sd})<1) ) continue;
+		if (timeout_ms>0) {
+			auto n = ring ? ring->Wait(timeout_ms) : ts.Select(timeout_ms,{sd});
+			if (n<1) continue;
+		}
 
-		auto N = DatagramSocket::Read(sd, &msg_buf[0], msg_buf.size(), meta);
+		auto N = ring ? ring->Read(&msg_buf[0], msg_buf.size(), meta) :
+			DatagramSocket::Read(sd, &msg_buf[0], msg_buf.size(), meta);
 		if (N<0) {
 			WARN("DatagramSocket::Read() returned %d", N);
 			continue;
 		}
 
-		// Avoid intermingled output
-		{
-			std::lock_guard<std::mutex> lock(print_mutex);
+		if ((filter_idx != 0) && ((unsigned int)meta.ifc_idx != filter_idx)) continue;
+		if (user_filter && !shared.filter.Match(&msg_buf[0], N)) continue;
+
+		if (process_message(&msg_buf[0], N, meta, shared) && shared.responding) {
+			answer_message(sd, family, &msg_buf[0], N, meta, shared);
+		}
+	}
 
-			printf("\n***********************\n");
-			printf("Read %d bytes\n", (int)N);
-			printf("%s => ", SockUtil::unpack(&meta.src, ip_buf, sizeof(ip_buf)));
-			printf("%s : ", SockUtil::unpack(&meta.dst, ip_buf, sizeof(ip_buf)));
-			printf("delivered_on=%d\n", meta.ifc_idx);
+	shared.listeners.Remove(sd);
+	ring.reset();
+	close(sd);
+}
 
-			SockUtil::print(&meta.src);
-			SockUtil::print(&meta.dst);
+// Passive alternative to read_messages(): every UDP/5353 frame the device
+// sees, decoded where it lies in the capture ring.
 
-			print_dns_msg(&msg_buf[0], N);
+void capture_messages(
+	PacketCapture& capture,
+	Shared& shared,
+	volatile std::sig_atomic_t& status)
+{
+	auto timeout_ms = (shared.timeout_ms > 0) ? shared.timeout_ms : 100;
+	bool user_filter = !shared.filter.rules.empty(); // can't attach; offsets differ
+
+	DatagramSocket::Meta meta;
+	const char *data;
+
+	while (status == 0) {
+		if (capture.Wait(timeout_ms) < 1) continue;
+
+		int N;
+		while ((N = capture.Next(data, meta)) >= 0) {
+			if (user_filter && !shared.filter.Match(data, N)) continue;
+			process_message(data, N, meta, shared);
 		}
 	}
+}
 
-	close(sd);
+// Feed a recording (directory of segments) or a pcap file through the same
+// path, as fast as it can be read, optionally writing it out again as pcap.
+// Returns number of frames read, or -1 on error.
+
+long replay_messages(const std::string& path, Pcap *out, Shared& shared)
+{
+	DatagramSocket::Meta meta;
+	struct stat st;
+
+	if ((stat(path.c_str(), &st) == 0) && S_ISDIR(st.st_mode)) {
+		return Recorder::ReadAll(path, [&](const Recorder::Frame& f, const char *payload) {
+			Recorder::ToMeta(f, meta);
+			if (out) out->Write(f.time_ns, meta, payload, f.payload_len);
+			process_message(payload, f.payload_len, meta, shared);
+		});
+	}
+
+	PacketCapture parser; // just for its frame parsing
+	return Pcap::ReadFile(path, [&](int64_t time_ns, const char *frame, size_t len) {
+		const char *payload;
+		int N = parser.parse_(frame, len, 0, payload, meta);
+		if (N < 0) return;
+		meta.rx_time.tv_sec = time_ns / 1000000000LL;
+		meta.rx_time.tv_nsec = time_ns % 1000000000LL;
+		if (out) out->Write(time_ns, meta, payload, N);
+		process_message(payload, N, meta, shared);
+	});
 }
 
 int main(int argc, char **argv)
 {
 	Interfaces ifcs;
 
-	int timeout_ms = 100;
+	Shared shared(ifcs);
+
+	std::string shm_name;
+	int shm_slots = 4096;
+	ShmExport shm;
+	std::string snapshot_path;
+	int snapshot_secs = 30;
+	std::vector<Snapshot::Question> stale;
+	std::string gateway_IP = "127.0.0.1";
+	int gateway_port = 0;
+	Gateway gateway(shared.cache);
+	std::thread gateway_thread;
+	std::vector< std::pair<std::string,uint16_t> > refresh_list;
+	Refresher refresher(shared.cache, Cache::Now());
+	EventFeed events;
+	std::string events_path;
+	bool events_binary = false;
+	FILE *events_file = nullptr;
+	bool per_interface = false;
+	std::vector< std::pair<std::string,bool> > capture_devices; // name, promisc
+	std::vector< std::unique_ptr<PacketCapture> > captures;
+	std::string record_dir, replay_path, pcap_path;
+	int record_mb = 64, record_segments = 16;
+	Pcap pcap_out;
 	std::vector<ifaddrs *> ifaddrs4, ifaddrs6;
 
-	std::mutex print_mutex;
+	auto& print_mutex = shared.print_mutex;
 
 	// Avoid warnings/errors appearing out-of-order relative to normal output
 
@@ -265,12 +528,239 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
-	// Args may be interface names or IP addresses; test in that order.
+	// Args may be options, interface names or IP addresses; test in that order.
 
 	for (int i=1; i<argc; i++ )
 	{
 		ifaddrs* ifa = nullptr;
 
+		// Options: --dedupe=<ms> (0 disables duplicate suppression)
+		if (strncmp(argv[i], "--dedupe=", 9) == 0) {
+			shared.dedupe.window = std::chrono::milliseconds(atoi(argv[i]+9));
+			continue;
+		}
+
+		// Options: --filter=[q|r][:TYPE][:prefix] (repeatable; any rule may match)
+		if (strncmp(argv[i], "--filter=", 9) == 0) {
+			SocketFilter::Rule r;
+			if (!SocketFilter::ParseRule(argv[i]+9, r)) ERROR("Bad filter rule '%s'", argv[i]+9);
+			shared.filter.rules.push_back(r);
+			continue;
+		}
+
+		// Options: --prefilter[=[q|r][:TYPE,...][:any-opcode][:any-rcode]] (skip by header)
+		if ((strcmp(argv[i], "--prefilter") == 0) || (strncmp(argv[i], "--prefilter=", 12) == 0)) {
+			auto spec = (argv[i][11] == '=') ? argv[i]+12 : "";
+			if (!Prefilter::ParsePolicy(spec, shared.prefilter.policy)) ERROR("Bad prefilter policy '%s'", spec);
+			shared.use_prefilter = true;
+			continue;
+		}
+
+		// Options: --quiet (decode without printing; report rates every second)
+		if (strcmp(argv[i], "--quiet") == 0) {
+			shared.quiet = true;
+			continue;
+		}
+
+		// Options: --watch=<pattern>[:TYPE] (repeatable; e.g. "*._ipp._tcp.local:SRV")
+		if (strncmp(argv[i], "--watch=", 8) == 0) {
+			std::string pattern(argv[i]+8);
+			uint16_t type = 0;
+
+			auto colon = pattern.find(':');
+			if (colon != std::string::npos) {
+				auto x = pattern.substr(colon+1);
+				if (!x.empty() && (x != "*")) {
+					type = FilterRules::ParseType(x);
+					if (type == 0) ERROR("Bad type in '%s'", argv[i]);
+				}
+				pattern.resize(colon);
+			}
+
+			shared.subscriptions.Subscribe(pattern, type, [pattern](const Subscriptions::Record& rec) {
+				const char* sections[] = { "question", "answer", "authority", "additional" };
+				std::vector<std::string> tmp;
+
+				DNS::Parse::labels(rec.bytes, rec.rr.name_ofs, rec.len, true, true, tmp);
+
+				printf("[watch %s] %s ", pattern.c_str(), sections[rec.section]);
+				for (const auto& str: tmp) printf("%s.", str.c_str());
+				printf(" type %d\n", rec.rr.type);
+			});
+			continue;
+		}
+
+		// Options: --cache (cache received records; contents printed on exit)
+		if (strcmp(argv[i], "--cache") == 0) {
+			shared.use_cache = true;
+			continue;
+		}
+
+		// Options: --shm=<name>[:slots] (implies --cache; publish it for other processes)
+		if (strncmp(argv[i], "--shm=", 6) == 0) {
+			shm_name = argv[i]+6;
+			auto colon = shm_name.find(':');
+			if (colon != std::string::npos) {
+				shm_slots = atoi(shm_name.c_str()+colon+1);
+				shm_name.resize(colon);
+			}
+			if (shm_name.empty() || (shm_slots < 1)) ERROR("Bad shared memory option '%s'", argv[i]);
+			if (shm_name[0] != '/') shm_name = "/" + shm_name;
+			shared.use_cache = true;
+			continue;
+		}
+
+		// Options: --snapshot=<path>[:seconds] (implies --cache; load at start, save periodically)
+		if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+			snapshot_path = argv[i]+11;
+			auto colon = snapshot_path.rfind(':');
+			if (colon != std::string::npos) {
+				snapshot_secs = atoi(snapshot_path.c_str()+colon+1);
+				snapshot_path.resize(colon);
+			}
+			if (snapshot_path.empty() || (snapshot_secs < 1)) ERROR("Bad snapshot option '%s'", argv[i]);
+			shared.use_cache = true;
+			continue;
+		}
+
+		// Options: --respond=<host> (answer A/AAAA for host[.local] with the addresses of the receiving interface, on that interface)
+		if (strncmp(argv[i], "--respond=", 10) == 0) {
+			std::string host(argv[i]+10);
+			if (host.empty()) ERROR("Bad respond option '%s'", argv[i]);
+			if (host.find('.') == std::string::npos) host += ".local";
+			shared.responder.AddHost(host, 120, ifcs); // RFC6762:10 host record TTL
+			shared.responding = true;
+			printf("Responding for '%s' (%d addresses)\n", host.c_str(), (int)shared.responder.records.size());
+			continue;
+		}
+
+		// Options: --publish=<name>:<TYPE>:<rdata> (repeatable; answer with this record, RDATA in zone file text, e.g. "0 0 631 host.local.")
+		if (strncmp(argv[i], "--publish=", 10) == 0) {
+			auto field = FilterRules::Split(argv[i]+10);
+			if (field.size() < 3) ERROR("Bad publish option '%s'", argv[i]);
+
+			// RDATA text may contain ':' itself, e.g. AAAA
+			std::string name = field[0], text = field[2];
+			for (size_t k=3; k<field.size(); k++) text += ":" + field[k];
+
+			uint16_t type = FilterRules::ParseType(field[1]);
+			std::vector<char> rdata;
+			if (name.empty() || (type == 0) || !DNS::RRTypes::info(type).encode(text, rdata)) {
+				ERROR("Bad publish option '%s'", argv[i]);
+			}
+
+			// Shared records (PTR) can't claim the name; RFC6762:10 TTLs
+			bool shared_rr = (type == DNS::Defs::PTR);
+			bool host_rr = (type == DNS::Defs::A) || (type == DNS::Defs::AAAA) || (type == DNS::Defs::SRV);
+			shared.responder.Add(name, type, DNS::Defs::IN | (shared_rr ? 0 : DNS::Defs::CACHE_FLUSH_BIT),
+				host_rr ? 120 : 4500, rdata);
+			shared.responding = true;
+			continue;
+		}
+
+		// Options: --gateway=[IP:]port (implies --cache; unicast DNS for .local names)
+		if (strncmp(argv[i], "--gateway=", 10) == 0) {
+			std::string x(argv[i]+10);
+			auto colon = x.rfind(':');
+			if (colon != std::string::npos) {
+				gateway_IP = x.substr(0, colon);
+				x = x.substr(colon+1);
+			}
+			gateway_port = atoi(x.c_str());
+			if (gateway_port < 1) ERROR("Bad gateway option '%s'", argv[i]);
+			shared.use_cache = true;
+			continue;
+		}
+
+		// Options: --refresh=<name>[:TYPE] (repeatable; implies --cache; query before records expire)
+		if (strncmp(argv[i], "--refresh=", 10) == 0) {
+			std::string name(argv[i]+10);
+			uint16_t type = DNS::Defs::A;
+			auto colon = name.rfind(':');
+			if (colon != std::string::npos) {
+				type = FilterRules::ParseType(name.substr(colon+1));
+				name.resize(colon);
+			}
+			if (name.empty() || (type == 0)) ERROR("Bad refresh option '%s'", argv[i]);
+			refresh_list.push_back( {name, type} );
+			shared.use_cache = true;
+			continue;
+		}
+
+		// Options: --events=<file|->[:json|bin] (implies --cache; service changes each second)
+		if (strncmp(argv[i], "--events=", 9) == 0) {
+			events_path = argv[i]+9;
+			auto colon = events_path.rfind(':');
+			if (colon != std::string::npos) {
+				auto fmt = events_path.substr(colon+1);
+				if ((fmt != "json") && (fmt != "bin")) ERROR("Bad events format in '%s'", argv[i]);
+				events_binary = (fmt == "bin");
+				events_path.resize(colon);
+			}
+			if (events_path.empty()) ERROR("Bad events option '%s'", argv[i]);
+			shared.use_cache = true;
+			continue;
+		}
+
+		// Options: --no-loop (disable local delivery of the multicasts we send)
+		if (strcmp(argv[i], "--no-loop") == 0) {
+			shared.mcast_loop = false;
+			continue;
+		}
+
+		// Options: --uring (receive via io_uring multishot recvmsg; falls back to recvmsg)
+		if (strcmp(argv[i], "--uring") == 0) {
+			shared.use_uring = true;
+			continue;
+		}
+
+		// Options: --capture=<interface>[:promisc] (repeatable; passive link layer capture instead of sockets)
+		if (strncmp(argv[i], "--capture=", 10) == 0) {
+			std::string name(argv[i]+10);
+			bool promisc = false;
+			auto colon = name.find(':');
+			if (colon != std::string::npos) {
+				if (name.substr(colon+1) != "promisc") ERROR("Bad capture option '%s'", argv[i]);
+				promisc = true;
+				name.resize(colon);
+			}
+			if (name.empty()) ERROR("Bad capture option '%s'", argv[i]);
+			capture_devices.push_back( {name, promisc} );
+			continue;
+		}
+
+		// Options: --record=<dir>[:MB[:segments]] (append everything received to memory-mapped log segments)
+		if (strncmp(argv[i], "--record=", 9) == 0) {
+			record_dir = argv[i]+9;
+			auto colon = record_dir.find(':');
+			if (colon != std::string::npos) {
+				sscanf(record_dir.c_str()+colon+1, "%d:%d", &record_mb, &record_segments);
+				record_dir.resize(colon);
+			}
+			if (record_dir.empty() || (record_mb < 1) || (record_segments < 2)) ERROR("Bad record option '%s'", argv[i]);
+			continue;
+		}
+
+		// Options: --replay=<dir|file.pcap> (decode a recording or pcap instead of listening, then exit)
+		if (strncmp(argv[i], "--replay=", 9) == 0) {
+			replay_path = argv[i]+9;
+			if (replay_path.empty()) ERROR("Bad replay option '%s'", argv[i]);
+			continue;
+		}
+
+		// Options: --to-pcap=<file> (with --replay; write what is replayed as pcap)
+		if (strncmp(argv[i], "--to-pcap=", 10) == 0) {
+			pcap_path = argv[i]+10;
+			if (pcap_path.empty()) ERROR("Bad pcap option '%s'", argv[i]);
+			continue;
+		}
+
+		// Options: --per-interface (one socket & thread per interface/family)
+		if (strcmp(argv[i], "--per-interface") == 0) {
+			per_interface = true;
+			continue;
+		}
+
 		// Is this a valid interface name?
 		if (auto ifc = ifcs.LookupByName(argv[i])) {
 			printf("'%s' => interface (%d)\n", argv[i], ifc->index);
@@ -313,10 +803,35 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if ((ifaddrs4.size()==0) && (ifaddrs6.size()==0)) {
+	bool passive = (capture_devices.size() > 0) || (replay_path.size() > 0);
+
+	if ((pcap_path.size() > 0) && (replay_path.empty())) ERROR("--to-pcap needs --replay");
+
+	if ((ifaddrs4.size()==0) && (ifaddrs6.size()==0) && !passive) {
 		ERROR("No valid interfaces or addresses specified.\n");
 	}
 
+	for (const auto& x : capture_devices) {
+		captures.emplace_back(new PacketCapture);
+		if (!captures.back()->Open(x.first.c_str(), x.second)) {
+			ERROR("Unable to capture on '%s'", x.first.c_str());
+		}
+		printf("Capturing mDNS frames on %s%s\n", x.first.c_str(), x.second ? " (promiscuous)" : "");
+	}
+
+	// Warm start from snapshot, if there is one
+
+	if (snapshot_path.size() > 0) {
+		auto t0 = std::chrono::steady_clock::now();
+		int n = Snapshot::Load(shared.cache, snapshot_path, Cache::Now(), &stale);
+		auto dt = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - t0).count();
+
+		if (n >= 0) {
+			printf("Loaded %d records from snapshot '%s' in %.2f ms; %d stale names/types to query\n",
+				n, snapshot_path.c_str(), dt, (int)stale.size());
+		}
+	}
+
 	// Signal handler; signal() deprecated, use sigaction() if possible.
 
 	{
@@ -340,138 +855,261 @@ int main(int argc, char **argv)
 		}
 	}
 
+	// Largest answer each link takes in one packet, looked up per query
+	if (shared.responding) {
+		for (const auto& ifc : ifcs.interfaces) {
+			shared.link_payload[ifc.index] = Interfaces::MaxPayload(ifc.name.c_str(), AF_INET6);
+		}
+	}
+
+	// Recording starts before any listener thread, so they only ever read the
+	// flag and every datagram received is recorded.
+
+	if (record_dir.size() > 0) {
+		if (!shared.recorder.Open(record_dir, (size_t)record_mb << 20, record_segments)) {
+			ERROR("Unable to record to '%s'", record_dir.c_str());
+		}
+		shared.recording = true;
+		printf("Recording to '%s' (%d MB segments, keeping %d)\n", record_dir.c_str(), record_mb, record_segments);
+	}
+
+	// Per-interface sockets rely on the kernel restricting each to its device.
+	// Without that they'd all share ANY:5353 via SO_REUSEPORT, and the kernel
+	// would spread unicast (legacy, QU) replies across them, each dropped by
+	// any socket for the wrong interface. So keep one socket per family then;
+	// answers still go out on the receiving interface (meta.ifc_idx).
+
+	if (per_interface && !passive) {
+		const char *probe_ifc = (ifaddrs4.size() > 0) ? ifaddrs4[0]->ifa_name :
+			(ifaddrs6.size() > 0) ? ifaddrs6[0]->ifa_name : nullptr;
+		int sd = socket(PF_INET, SOCK_DGRAM, 0);
+		bool ok = (sd >= 0) && probe_ifc && DatagramSocket::BindToDevice(sd, AF_INET, probe_ifc);
+		if (sd >= 0) close(sd);
+
+		if (!ok) {
+			WARN("--per-interface needs sockets bound to devices; using one socket per family instead");
+			per_interface = false;
+		}
+	}
+
 	// IPv4 mDNS listener thread
 
-	std::thread thread4( [&ifaddrs4,timeout_ms,&print_mutex] {
+	std::thread thread4( [&ifaddrs4,per_interface,passive,&shared] {
 		auto port = 5353;
 		auto IP = "224.0.0.251";
 
-		if (ifaddrs4.size()<1) return;
-		read_messages(AF_INET, port, IP, &ifaddrs4, timeout_ms, gSignalStatus, print_mutex);
+		if (passive || per_interface || ifaddrs4.size()<1) return;
+		read_messages(AF_INET, port, IP, &ifaddrs4, nullptr, shared, gSignalStatus);
 	});
 
 	// IPv6 mDNS listener thread
 
-	std::thread thread6( [&ifaddrs6,timeout_ms,&print_mutex] {
+	std::thread thread6( [&ifaddrs6,per_interface,passive,&shared] {
 		auto port = 5353;
 		auto IP = "ff02::fb";
 
-		if (ifaddrs6.size()<1) return;
-		read_messages(AF_INET6, port, IP, &ifaddrs6, timeout_ms, gSignalStatus, print_mutex);
+		if (passive || per_interface || ifaddrs6.size()<1) return;
+		read_messages(AF_INET6, port, IP, &ifaddrs6, nullptr, shared, gSignalStatus);
 	});
 
-	sleep(1);
+	// Alternatively, one listener thread per interface and family; the kernel
+	// discards traffic from other interfaces, and each socket has its own core.
 
-	// Post ping packets?
-	{
-		std::vector<char> msg_buf;
-		struct sockaddr_storage mcast_ss, local_ss;
+	std::map< std::string, std::vector<ifaddrs *> > by_ifc4, by_ifc6;
+	std::vector<std::thread> ifc_threads;
 
-		DNS::Message::make_request(msg_buf, {
-//			{"blah.x.y", DNS::Defs::PTR},
-//			{"wibble.blerp", DNS::Defs::TXT},
-			{"_services._dns-sd._udp.local", DNS::Defs::PTR},
-		});
+	if (per_interface && !passive) {
+		for (const auto x : ifaddrs4) by_ifc4[x->ifa_name].push_back(x);
+		for (const auto x : ifaddrs6) by_ifc6[x->ifa_name].push_back(x);
 
-		//print_dns_msg(&msg_buf[0], msg_buf.size());
+		for (const auto& it : by_ifc4) {
+			ifc_threads.emplace_back( [&it,&shared] {
+				read_messages(AF_INET, 5353, "224.0.0.251", &it.second, it.first.c_str(),
+					shared, gSignalStatus);
+			});
+		}
 
-		// IPv4
-		for (const auto x: ifaddrs4) {
-			auto port = 5353;
-			auto IP = "224.0.0.251";
-			auto sa = (SockUtil::sa4 *) &local_ss;
+		for (const auto& it : by_ifc6) {
+			ifc_threads.emplace_back( [&it,&shared] {
+				read_messages(AF_INET6, 5353, "ff02::fb", &it.second, it.first.c_str(),
+					shared, gSignalStatus);
+			});
+		}
+	}
 
-			if (!SockUtil::pack(&mcast_ss, AF_INET, IP, port)) {
-				ERROR("init() : ipv4 addr %s port %d invalid", IP, port);
-			}
+	// Or, passively, one thread per capture
 
-			{
-				std::lock_guard<std::mutex> lock(print_mutex);
-				SockUtil::print(&mcast_ss);
-				SockUtil::print(x->ifa_addr);
-			}
+	for (auto& c : captures) {
+		auto capture = c.get();
+		ifc_threads.emplace_back( [capture,&shared] {
+			capture_messages(*capture, shared, gSignalStatus);
+		});
+	}
 
-			int sd = socket(PF_INET, SOCK_DGRAM, 0);
-			if (sd < 0) {
-				ERROR("Socket creation failed");
-			}
+	// ... or a replay, after which we're done
 
-			memcpy(sa, x->ifa_addr, sizeof(*sa));
-			sa->sin_port = htons(0);
+	if (replay_path.size() > 0) {
+		if ((pcap_path.size() > 0) && !pcap_out.Open(pcap_path)) ERROR("Unable to write '%s'", pcap_path.c_str());
 
-			if (bind(sd, (sockaddr *)sa, sizeof(*sa)) != 0) {
-				ERROR("bind(%s,%d)", IP, port);
-			}
+		ifc_threads.emplace_back( [&replay_path,&pcap_path,&pcap_out,&shared] {
+			auto n = replay_messages(replay_path, (pcap_path.size() > 0) ? &pcap_out : nullptr, shared);
+			printf("Replayed %ld frames from '%s'\n", n, replay_path.c_str());
+			gSignalStatus = SIGINT;
+		});
+	}
 
-			{
-				std::lock_guard<std::mutex> lock(print_mutex);
-				SockUtil::print(sa);
-			}
+	// Unicast DNS gateway onto the cache, with multicast queries for misses
+	// sent via the first IPv4 address we're listening on.
 
-			// Note - size of sockaddr can't be sizeof(sockaddr_storage) or call fails.
-        	auto result = sendto(
-				sd,
-				&msg_buf[0], msg_buf.size(),
-				0,
-				(sockaddr *)&mcast_ss, sizeof(sockaddr_in));
-			
-			if (result<0) {
-				ERROR("Failed sendto() call", result);
-			}
+	if (gateway_port > 0) {
+		char buf[INET6_ADDRSTRLEN];
+		const char *mcast_IP = nullptr;
+
+		if (ifaddrs4.size() > 0) mcast_IP = SockUtil::unpack(ifaddrs4[0]->ifa_addr, buf, sizeof(buf));
 
-			close(sd);
+		if (!gateway.Open(gateway_IP.c_str(), gateway_port, mcast_IP)) {
+			ERROR("Unable to start gateway on %s:%d", gateway_IP.c_str(), gateway_port);
 		}
+		printf("DNS gateway on %s port %d (UDP/TCP)\n", gateway_IP.c_str(), gateway_port);
 
-		// IPv6
-		for (const auto x: ifaddrs6) {
-			auto port = 5353;
-			auto IP = "ff02::fb";
-			auto sa = (SockUtil::sa6 *) &local_ss;
+		gateway_thread = std::thread( [&gateway] { gateway.Run(gSignalStatus); } );
+	}
+
+	sleep(1);
+
+	// Largest query that fits every link we send on
+	size_t max_payload = DNS::EDNS::MaxPayload;
+	for (const auto x : ifaddrs4) max_payload = std::min(max_payload, Interfaces::MaxPayload(x->ifa_name, AF_INET));
+	for (const auto x : ifaddrs6) max_payload = std::min(max_payload, Interfaces::MaxPayload(x->ifa_name, AF_INET6));
+
+	// Send messages as multicasts out of each interface we listen on, via the
+	// listening sockets. Queries then come from port 5353, so responders
+	// multicast their answers (RFC6762:6.7) and the listeners cache them; from
+	// any other port, answers come back by unicast to that port. Each send is
+	// recorded first, so that our own copies are recognised when they loop back.
+	auto post = [&](const std::vector< std::vector<char> >& msg_bufs, bool verbose) {
+		auto send = [&](int family, const std::vector<ifaddrs *>& ifas) {
+			std::vector<unsigned int> done; // one send per interface, however many addresses
+
+			for (const auto x : ifas) {
+				auto idx = Interfaces::GetIndex(x->ifa_name);
+				if (std::find(done.begin(), done.end(), idx) != done.end()) continue;
+				done.push_back(idx);
+
+				if (verbose) {
+					std::lock_guard<std::mutex> lock(print_mutex);
+					printf("Sending %d message(s) on %s (%u), %s\n", (int)msg_bufs.size(), x->ifa_name, idx,
+						(family == AF_INET6) ? "IPv6" : "IPv4");
+				}
 
-			int sd = socket(PF_INET6, SOCK_DGRAM, 0);
-			if (sd < 0) {
-				ERROR("Socket creation failed");
+				for (const auto& msg_buf : msg_bufs) {
+					shared.self_echo.Record(&msg_buf[0], msg_buf.size(), 5353, (int)idx);
+					if (!shared.listeners.Send(family, idx, &msg_buf[0], msg_buf.size())) {
+						WARN("No listening socket to send from on %s", x->ifa_name);
+						break;
+					}
+				}
 			}
+		};
 
-			// https://docs.oracle.com/cd/E19455-01/806-1017/auto1/index.html
-			// https://stackoverflow.com/questions/1264948/link-scope-ipv6-multicast-packets-suddenly-not-routable-on-a-macbook-pro
-			int idx = Interfaces::GetIndex(x->ifa_name);
-			setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &idx, sizeof(idx));
+		send(AF_INET, ifaddrs4);
+		send(AF_INET6, ifaddrs6);
+	};
 
-			memcpy(sa, x->ifa_addr, sizeof(*sa));
-			sa->sin6_port = htons(0);
+	// Post ping packets? Not when capturing; that's only listening.
+	if (!passive) {
+		std::vector< std::vector<char> > msg_bufs(1);
 
-			if (bind(sd, (sockaddr *)sa, sizeof(*sa)) != 0) {
-				ERROR("bind(%s,%d)", IP, port);
-			}
+		// Sent via the listening sockets, so those must be open first; else
+		// e.g. the snapshot's stale records would go unrefreshed.
+		size_t n_listeners = per_interface ? (by_ifc4.size() + by_ifc6.size()) :
+			((ifaddrs4.size() > 0) + (ifaddrs6.size() > 0));
+		if (!shared.listeners.WaitFor(n_listeners, 5000)) WARN("Not every listening socket is open yet");
 
-			{
-				std::lock_guard<std::mutex> lock(print_mutex);
-				SockUtil::print(sa);
-			}
+		DNS::Message::make_request(msg_bufs[0], {
+//			{"blah.x.y", DNS::Defs::PTR},
+//			{"wibble.blerp", DNS::Defs::TXT},
+			{"_services._dns-sd._udp.local", DNS::Defs::PTR},
+		});
 
-			if (!SockUtil::pack(&mcast_ss, AF_INET6, IP, port)) {
-				ERROR("init() : ipv6 addr %s port %d invalid", IP, port);
-			}
+		// Refresh whatever the snapshot had stale, packing as many questions
+		// into each query as the smallest link MTU allows
+		if (stale.size() > 0) {
+			size_t k = 0;
+
+			msg_bufs.clear();
+			while (k < stale.size()) {
+				msg_bufs.emplace_back();
+				DNS::Builder b(msg_bufs.back(), 0, 0, max_payload);
 
-			{
-				std::lock_guard<std::mutex> lock(print_mutex);
-				SockUtil::print(&mcast_ss);
-				SockUtil::print(x->ifa_addr);
+				if (msg_bufs.size() == 1) b.question("_services._dns-sd._udp.local", DNS::Defs::PTR);
+
+				auto k0 = k;
+				while ((k < stale.size()) && b.question(stale[k].name, stale[k].type)) k++;
+				if (k == k0) k++; // can't ever fit
 			}
+		}
+
+		//print_dns_msg(&msg_bufs[0][0], msg_bufs[0].size());
+
+		post(msg_bufs, true);
+	}
+
+	// Report receive rates until interrupted, if not printing every packet,
+	// and/or keep the shared memory copy of the cache up to date. Anything
+	// using the cache also ticks here, to drop records nothing refreshes.
 
-			// Note - size of sockaddr can't be sizeof(sockaddr_storage) or call fails.
-        	auto result = sendto(
-				sd,
-				&msg_buf[0], msg_buf.size(),
-				0,
-				(sockaddr *)&mcast_ss, sizeof(sockaddr_in6));
-			
-			if (result<0) {
-				ERROR("Failed sendto() call", result);
+	if (shm_name.size() > 0) {
+		if (!shm.Open(shm_name, shm_slots)) ERROR("Unable to create shared memory '%s'", shm_name.c_str());
+		printf("Publishing cache to shared memory '%s' (%d slots)\n", shm_name.c_str(), (int)shm.hdr->n_slots);
+	}
+
+	if (refresh_list.size() > 0) {
+		refresher.max_size = max_payload;
+		for (const auto& x : refresh_list) refresher.Watch(x.first, x.second, Cache::Now());
+		printf("Refreshing %d name(s) before expiry\n", (int)refresher.Watched());
+	}
+
+	if (events_path.size() > 0) {
+		events_file = (events_path == "-") ? stdout : fopen(events_path.c_str(), "wb");
+		if (!events_file) ERROR("Unable to open events file '%s'", events_path.c_str());
+
+		events.Subscribe([events_file, events_binary](const EventFeed::Batch& batch) {
+			std::string text;
+			std::vector<char> bin;
+			for (const auto& ev : batch) {
+				if (events_binary) EventFeed::Binary(ev, bin);
+				else EventFeed::Json(ev, text);
 			}
+			if (events_binary) fwrite(bin.data(), 1, bin.size(), events_file);
+			else fwrite(text.data(), 1, text.size(), events_file);
+			fflush(events_file);
+		});
+	}
 
-			close(sd);
+	if (shared.quiet || shared.use_cache || shm.hdr || (snapshot_path.size() > 0) || (refresh_list.size() > 0) || events_file) {
+		uint64_t last[4] = { 0, 0, 0, 0 };
+		int tick = 0;
+		while (gSignalStatus == 0) {
+			usleep(100*1000);
+			if (refresh_list.size() > 0) post(refresher.Advance(Cache::Now()), false);
+			if (shm.hdr) shm.Publish(shared.cache, Cache::Now());
+			if ((snapshot_path.size() > 0) && ((tick+1) % (10*snapshot_secs) == 0)) {
+				Snapshot::Write(shared.cache, snapshot_path, Cache::Now());
+			}
+			if (++tick % 10 != 0) continue;
+			if (shared.use_cache) shared.cache.Expire(Cache::Now());
+			if (events_file) events.Poll(shared.cache, Cache::Now());
+			if (!shared.quiet) continue;
+
+			uint64_t now[4] = { shared.n_datagrams, shared.n_bytes, shared.n_records,
+				shared.prefilter.GetStats().skipped };
+			printf("%10llu datagrams/s %8.2f Mbit/s %10llu records/s (total %llu)",
+				(unsigned long long)(now[0]-last[0]), 8e-6*(now[1]-last[1]),
+				(unsigned long long)(now[2]-last[2]), (unsigned long long)now[0]);
+			if (shared.use_prefilter) printf(" %10llu skipped/s", (unsigned long long)(now[3]-last[3]));
+			printf("\n");
+			for (int j=0; j<4; j++) last[j] = now[j];
 		}
 	}
 
@@ -483,6 +1121,116 @@ int main(int argc, char **argv)
 	thread6.join();
 	printf("Joined thread6\n");
 
+	for (auto& t : ifc_threads) t.join();
+	if (ifc_threads.size()>0) printf("Joined %d interface threads\n", (int)ifc_threads.size());
+
+	if (shared.recording) {
+		shared.recorder.Close();
+
+		auto st = shared.recorder.GetStats();
+		printf("Recorder: %llu frames, %llu bytes in %llu segments, %llu dropped\n",
+			(unsigned long long)st.frames, (unsigned long long)st.bytes,
+			(unsigned long long)st.segments, (unsigned long long)st.dropped);
+	}
+
+	if (pcap_out.f) {
+		pcap_out.Close();
+		printf("Wrote pcap '%s'\n", pcap_path.c_str());
+	}
+
+	for (size_t i=0; i<captures.size(); i++) {
+		auto st = captures[i]->GetStats();
+		printf("Capture %s: %llu frames, %llu mDNS, %llu skipped, %llu fragments, %llu dropped\n",
+			capture_devices[i].first.c_str(), (unsigned long long)st.frames, (unsigned long long)st.datagrams,
+			(unsigned long long)st.skipped, (unsigned long long)st.fragments, (unsigned long long)st.drops);
+	}
+
+	if (gateway_thread.joinable()) {
+		gateway_thread.join();
+
+		auto st = gateway.GetStats();
+		printf("Gateway: %llu queries (%llu TCP), %llu from cache, %llu forwarded, %llu replies, %llu timeouts, %llu refused\n",
+			(unsigned long long)st.queries, (unsigned long long)st.tcp, (unsigned long long)st.cached,
+			(unsigned long long)st.forwarded, (unsigned long long)st.replies,
+			(unsigned long long)st.timeouts, (unsigned long long)st.refused);
+	}
+
+	if (shared.responding) {
+		printf("Responder: %llu queries answered in %llu packets (%llu bytes), each on its own interface\n",
+			(unsigned long long)shared.n_answered, (unsigned long long)shared.n_answer_packets,
+			(unsigned long long)shared.n_answer_bytes);
+	}
+
+	if (events_file) {
+		events.Poll(shared.cache, Cache::Now()); // anything since the last tick
+		if (events_file != stdout) fclose(events_file);
+
+		auto st = events.GetStats();
+		printf("Events: %llu in %llu batches (%llu polls, %llu skipped)",
+			(unsigned long long)st.events, (unsigned long long)st.batches,
+			(unsigned long long)st.polls, (unsigned long long)st.skipped);
+		for (int k=0; k<EventFeed::NKinds; k++) {
+			printf("%s %s %llu", (k == 0) ? " :" : ",", EventFeed::KindNames[k], (unsigned long long)st.kinds[k]);
+		}
+		printf("\n");
+	}
+
+	if (refresh_list.size() > 0) {
+		const auto& st = refresher.stats;
+		printf("Refresher: %llu timers, %llu questions in %llu queries, %llu rescheduled by answers, %llu idle\n",
+			(unsigned long long)st.fired, (unsigned long long)st.questions, (unsigned long long)st.packets,
+			(unsigned long long)st.refreshed, (unsigned long long)st.idle);
+	}
+
+	{
+		auto st = shared.dedupe.GetStats();
+		printf("Self echoes: %llu\n", (unsigned long long)shared.self_echo.GetEchoes());
+		printf("Dedupe: seen %llu duplicates %llu (cross-family %llu, cross-interface %llu); %llu IPv4/IPv6 hosts learned\n",
+			(unsigned long long)st.seen, (unsigned long long)st.duplicates,
+			(unsigned long long)st.cross_family, (unsigned long long)st.cross_interface,
+			(unsigned long long)st.pairs);
+	}
+
+	if (shared.use_prefilter) {
+		auto st = shared.prefilter.GetStats();
+		printf("Prefilter: seen %llu skipped %llu (%.1f%%)",
+			(unsigned long long)st.seen, (unsigned long long)st.skipped,
+			(st.seen > 0) ? 100.0*st.skipped/st.seen : 0.0);
+		for (int r=0; r<Prefilter::NReasons; r++) {
+			printf("%s %s %llu", (r == 0) ? " :" : ",", Prefilter::ReasonNames[r],
+				(unsigned long long)st.reasons[r]);
+		}
+		printf("\n");
+	}
+
+	if (snapshot_path.size() > 0) {
+		int n = Snapshot::Write(shared.cache, snapshot_path, Cache::Now());
+		if (n >= 0) printf("Wrote %d records to snapshot '%s'\n", n, snapshot_path.c_str());
+	}
+
+	if (shared.use_cache) {
+		auto now_ms = Cache::Now();
+		auto st = shared.cache.GetStats();
+		Cache::Reader reader(shared.cache);
+
+		printf("Cache: %llu messages, %llu records cached/refreshed, %llu flushed, %llu expired\n",
+			(unsigned long long)st.messages, (unsigned long long)st.records,
+			(unsigned long long)st.flushed, (unsigned long long)st.expired);
+
+		if (shm.hdr) {
+			auto& x = shm.stats;
+			printf("Shared memory: %llu publishes, %llu slots written, %llu deleted, %llu rebuilds, %llu skipped\n",
+				(unsigned long long)x.publishes, (unsigned long long)x.written, (unsigned long long)x.deleted,
+				(unsigned long long)x.rebuilds, (unsigned long long)x.skipped);
+		}
+
+		reader.ForEach(now_ms, [now_ms](const Cache::Entry& e) {
+			printf("  %s %s (%d) TTL %d/%d, %d bytes\n",
+				e.name.c_str(), DNS::RRTypes::text(e.type).c_str(), e.type,
+				(int)((e.expires_ms-now_ms)/1000), (int)e.TTL, (int)e.rdata.size());
+		});
+	}
+
 	printf("done\n");
 
 }
@@ -0,0 +1,282 @@
+/*
+	Author: John Grime
+*/
+
+/*
+	Shared-memory view of the mDNS record cache: layout and reader, in C.
+
+	A writer (see ShmExport.hpp) maps a POSIX shared memory object and keeps
+	it in step with its record cache; any number of readers in other processes
+	map the same object read-only and look records up directly, with no
+	system calls and no locks.
+
+	Layout, version 1 (native byte order and alignment of the writer's host):
+
+	  offset 0              mdns_shm_header (128 bytes)
+	  offset header_size    n_slots x mdns_shm_slot (slot_size bytes each)
+
+	The slots form an open-addressed hash table, probed linearly from
+	(hash & (n_slots-1)). A lookup scans from there until it reaches an EMPTY
+	slot; DELETED slots are skipped but don't end the scan. All records with
+	the same name (any type) share a hash, so they are found by one scan.
+
+	hash is 64-bit FNV-1a over the name, ASCII lower case, with no trailing
+	dot: see mdns_shm_hash(). Names are stored as received (dotted, no trailing
+	dot). RDATA is in wire format, with any names (e.g. PTR, SRV, NSEC)
+	uncompressed. Records whose RDATA exceeds MDNS_SHM_MAX_RDATA are not
+	exported.
+
+	expires_ms is CLOCK_MONOTONIC in milliseconds; see mdns_shm_now_ms().
+
+	Consistency is by seqlocks. Each slot has a sequence number that is odd
+	while the writer is changing it; a reader copies the slot and retries if
+	the sequence was odd or changed meanwhile. The header also has a sequence
+	number, odd while the writer rebuilds the whole table; a lookup that
+	overlaps a rebuild is repeated.
+
+	Needs POSIX (shm_open, clock_gettime); with strict ISO C compilers, define
+	e.g. _POSIX_C_SOURCE=200809L. GCC or Clang atomic builtins are assumed. On
+	older glibc, link with -lrt.
+
+	Compatibility: readers must check magic and version (mdns_shm_open() does).
+	Fields may be added to the reserved areas without a version change; any
+	other change to the layout increments the version.
+*/
+
+#if !defined(MDNS_SHM_H)
+
+#define MDNS_SHM_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define MDNS_SHM_MAGIC     0x314d4853534e444dULL /* "MDNSSHM1" */
+#define MDNS_SHM_VERSION   1u
+#define MDNS_SHM_SLOT_SIZE 1024u
+#define MDNS_SHM_MAX_NAME  255u
+#define MDNS_SHM_MAX_RDATA (MDNS_SHM_SLOT_SIZE - 288u)
+
+#define MDNS_SHM_SLOT_EMPTY   0u
+#define MDNS_SHM_SLOT_USED    1u
+#define MDNS_SHM_SLOT_DELETED 2u
+
+#define MDNS_SHM_TYPE_ANY 255u
+
+typedef struct mdns_shm_header {
+	uint64_t magic;        /* MDNS_SHM_MAGIC; written last on creation */
+	uint32_t version;      /* MDNS_SHM_VERSION */
+	uint32_t header_size;  /* offset of first slot */
+	uint32_t slot_size;    /* MDNS_SHM_SLOT_SIZE */
+	uint32_t n_slots;      /* power of 2 */
+	uint32_t seq;          /* table seqlock: odd => rebuild in progress */
+	uint32_t writer_pid;
+	uint64_t generation;   /* incremented by each publish */
+	int64_t  published_ms; /* CLOCK_MONOTONIC ms of last publish */
+	uint32_t n_used;       /* slots in use (approximate while publishing) */
+	uint32_t n_skipped;    /* records not exported at last publish (too big, or table full) */
+	uint8_t  reserved[72];
+} mdns_shm_header;
+
+typedef struct mdns_shm_slot {
+	uint32_t seq;          /* slot seqlock: odd => being written */
+	uint8_t  state;        /* MDNS_SHM_SLOT_xxx */
+	uint8_t  name_len;
+	uint16_t rdata_len;
+	uint64_t hash;         /* mdns_shm_hash(name) */
+	uint16_t type;
+	uint16_t clss;         /* without cache-flush bit */
+	uint32_t ttl;          /* as received */
+	int64_t  expires_ms;   /* CLOCK_MONOTONIC ms */
+	char     name[MDNS_SHM_MAX_NAME+1]; /* NUL terminated */
+	uint8_t  rdata[MDNS_SHM_MAX_RDATA];
+} mdns_shm_slot;
+
+#if defined(__cplusplus)
+	static_assert(sizeof(mdns_shm_header) == 128, "mdns_shm_header size");
+	static_assert(sizeof(mdns_shm_slot) == MDNS_SHM_SLOT_SIZE, "mdns_shm_slot size");
+#else
+	_Static_assert(sizeof(mdns_shm_header) == 128, "mdns_shm_header size");
+	_Static_assert(sizeof(mdns_shm_slot) == MDNS_SHM_SLOT_SIZE, "mdns_shm_slot size");
+#endif
+
+/* Reader handle */
+typedef struct mdns_shm {
+	int fd;
+	size_t size;
+	const mdns_shm_header *hdr;
+	const mdns_shm_slot *slots;
+} mdns_shm;
+
+static inline uint32_t mdns_shm_seq_begin_(const uint32_t *seq)
+{
+	return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int mdns_shm_seq_retry_(const uint32_t *seq, uint32_t s)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (s & 1u) || (__atomic_load_n(seq, __ATOMIC_RELAXED) != s);
+}
+
+static inline char mdns_shm_lower_(char c)
+{
+	return ((c >= 'A') && (c <= 'Z')) ? (char)(c + ('a' - 'A')) : c;
+}
+
+/* Name hash as used for slot placement; len excludes any trailing dot. */
+static inline uint64_t mdns_shm_hash(const char *name, size_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h = (h ^ (uint8_t)mdns_shm_lower_(name[i])) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static inline int64_t mdns_shm_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* Returns 0 on success, -1 on system error (see errno), -2 on bad layout. */
+static inline int mdns_shm_open(mdns_shm *shm, const char *name)
+{
+	struct stat st;
+	void *p;
+	const mdns_shm_header *hdr;
+
+	memset(shm, 0, sizeof(*shm));
+	shm->fd = -1;
+
+	shm->fd = shm_open(name, O_RDONLY, 0);
+	if (shm->fd < 0) return -1;
+
+	if ((fstat(shm->fd, &st) != 0) || ((size_t)st.st_size < sizeof(mdns_shm_header))) {
+		close(shm->fd);
+		shm->fd = -1;
+		return -1;
+	}
+
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, shm->fd, 0);
+	if (p == MAP_FAILED) {
+		close(shm->fd);
+		shm->fd = -1;
+		return -1;
+	}
+
+	hdr = (const mdns_shm_header *)p;
+	if ((__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MDNS_SHM_MAGIC) ||
+		(hdr->version != MDNS_SHM_VERSION) ||
+		(hdr->slot_size != MDNS_SHM_SLOT_SIZE) ||
+		(hdr->n_slots == 0) || (hdr->n_slots & (hdr->n_slots-1)) ||
+		((size_t)hdr->header_size + (size_t)hdr->n_slots*hdr->slot_size > (size_t)st.st_size)) {
+		munmap(p, (size_t)st.st_size);
+		close(shm->fd);
+		shm->fd = -1;
+		return -2;
+	}
+
+	shm->size = (size_t)st.st_size;
+	shm->hdr = hdr;
+	shm->slots = (const mdns_shm_slot *)((const char *)p + hdr->header_size);
+
+	return 0;
+}
+
+static inline void mdns_shm_close(mdns_shm *shm)
+{
+	if (shm->hdr) munmap((void *)shm->hdr, shm->size);
+	if (shm->fd >= 0) close(shm->fd);
+	memset(shm, 0, sizeof(*shm));
+	shm->fd = -1;
+}
+
+/*
+	Copy up to max unexpired records with the given name and type (or
+	MDNS_SHM_TYPE_ANY) into out. The name may have a trailing dot, and is
+	matched case-insensitively. Returns the number of records found, which
+	may exceed max (only max are copied).
+*/
+static inline int mdns_shm_lookup(const mdns_shm *shm, const char *name, uint16_t type,
+	int64_t now_ms, mdns_shm_slot *out, int max)
+{
+	const mdns_shm_header *hdr = shm->hdr;
+	mdns_shm_slot tmp; /* records beyond max are read here, to be counted */
+	size_t len = strlen(name);
+	uint64_t h;
+	uint32_t mask, i, n_probe, s_tbl;
+	int n;
+
+	if (len > 0 && name[len-1] == '.') len--;
+	if (len > MDNS_SHM_MAX_NAME) return 0;
+
+	h = mdns_shm_hash(name, len);
+	mask = hdr->n_slots - 1;
+
+	for (;;) {
+		s_tbl = mdns_shm_seq_begin_(&hdr->seq);
+		if (s_tbl & 1u) continue;
+
+		n = 0;
+		for (i = (uint32_t)h & mask, n_probe = 0; n_probe < hdr->n_slots; i = (i+1) & mask, n_probe++) {
+			const mdns_shm_slot *slot = &shm->slots[i];
+			mdns_shm_slot *r = (n < max) ? &out[n] : &tmp;
+			uint32_t s;
+			uint8_t state;
+			int match;
+			size_t k;
+
+			s = mdns_shm_seq_begin_(&slot->seq);
+			state = slot->state;
+			match = (state == MDNS_SHM_SLOT_USED) && (slot->hash == h);
+			if (match) {
+				/* Only the parts in use; lengths are checked, as they may be torn */
+				size_t name_len = slot->name_len, rdata_len = slot->rdata_len;
+				if (rdata_len > MDNS_SHM_MAX_RDATA) rdata_len = MDNS_SHM_MAX_RDATA;
+				memcpy(r, slot, offsetof(mdns_shm_slot, name));
+				memcpy(r->name, slot->name, name_len+1);
+				memcpy(r->rdata, slot->rdata, rdata_len);
+			}
+
+			if (mdns_shm_seq_retry_(&slot->seq, s)) {
+				/* Being written; read this slot again */
+				i = (i-1) & mask;
+				n_probe--;
+				continue;
+			}
+
+			if (state == MDNS_SHM_SLOT_EMPTY) break;
+			if (!match) continue;
+
+			/* Check the consistent copy */
+			if (r->name_len != len) continue;
+			if ((type != MDNS_SHM_TYPE_ANY) && (r->type != type)) continue;
+			if (r->expires_ms <= now_ms) continue;
+			for (k = 0; k < len; k++) {
+				if (mdns_shm_lower_(r->name[k]) != mdns_shm_lower_(name[k])) break;
+			}
+			if (k == len) n++;
+		}
+
+		if (!mdns_shm_seq_retry_(&hdr->seq, s_tbl)) return n;
+	}
+}
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif